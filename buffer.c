@@ -0,0 +1,100 @@
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include "buffer.h"
+
+/* ---------------- */
+/* buffer procedure */
+/* ---------------- */
+
+/* creates & returns an empty buffer */
+buffer_t *bufferCreate() {
+	buffer_t *buffer = malloc(sizeof(*buffer));
+	assert(buffer);
+	buffer->cap = BUFFER_INIT_SIZE;
+	buffer->data = malloc(buffer->cap);
+	assert(buffer->data);
+	buffer->start = 0;
+	buffer->end = 0;
+	return buffer;
+}
+
+/* number of unread bytes */
+size_t bufferLen(buffer_t *buffer) {
+	return buffer->end - buffer->start;
+}
+
+/* pointer to the first unread byte */
+char *bufferHead(buffer_t *buffer) {
+	return buffer->data + buffer->start;
+}
+
+/* make sure there are at least len free bytes after the tail,
+ * consumed bytes are reclaimed before growing
+ */
+char *bufferReserve(buffer_t *buffer, size_t len) {
+	if (buffer->cap - buffer->end >= len) {
+		return buffer->data + buffer->end;
+	}
+
+	// reclaim consumed bytes
+	if (buffer->start > 0) {
+		memmove(buffer->data, buffer->data + buffer->start, buffer->end - buffer->start);
+		buffer->end -= buffer->start;
+		buffer->start = 0;
+	}
+
+	// grow (doubling) when there is still not enough room
+	if (buffer->cap - buffer->end < len) {
+		size_t cap = buffer->cap;
+		while (cap - buffer->end < len) {
+			cap *= 2;
+		}
+		buffer->data = realloc(buffer->data, cap);
+		assert(buffer->data);
+		buffer->cap = cap;
+	}
+	return buffer->data + buffer->end;
+}
+
+/* mark len bytes written at the tail (after bufferReserve) as readable */
+void bufferCommit(buffer_t *buffer, size_t len) {
+	buffer->end += len;
+}
+
+/* append len bytes at the tail */
+void bufferAppend(buffer_t *buffer, const void *data, size_t len) {
+	memcpy(bufferReserve(buffer, len), data, len);
+	buffer->end += len;
+}
+
+/* drop len bytes from the head */
+void bufferConsume(buffer_t *buffer, size_t len) {
+	buffer->start += len;
+	if (buffer->start == buffer->end) {
+		// empty: restart from the beginning for free
+		buffer->start = 0;
+		buffer->end = 0;
+	}
+}
+
+/* read whatever is available from fd into the tail, at least min_free bytes of room are made first */
+ssize_t bufferReadFrom(buffer_t *buffer, int fd, size_t min_free, int flags) {
+	bufferReserve(buffer, min_free);
+	ssize_t n;
+	do {
+		n = recv(fd, buffer->data + buffer->end, buffer->cap - buffer->end, flags);
+	} while (n < 0 && errno == EINTR);
+	if (n > 0) {
+		buffer->end += n;
+	}
+	return n;
+}
+
+/* free buffer */
+void bufferFree(buffer_t *buffer) {
+	free(buffer->data);
+	free(buffer);
+}
@@ -0,0 +1,54 @@
+#ifndef BUFFER_H
+#define BUFFER_H
+#include <stddef.h>
+#include <sys/types.h>
+
+#define BUFFER_INIT_SIZE 4096
+
+/* growable byte queue: bytes are appended at the tail & consumed from the head
+ * unread bytes are data[start .. end)
+ */
+typedef struct buffer {
+    char *data;
+    size_t start;
+    size_t end;
+    size_t cap;
+} buffer_t;
+
+/* ---------------- */
+/* buffer procedure */
+/* ---------------- */
+
+/* creates & returns an empty buffer */
+buffer_t *bufferCreate();
+
+/* number of unread bytes */
+size_t bufferLen(buffer_t *buffer);
+
+/* pointer to the first unread byte */
+char *bufferHead(buffer_t *buffer);
+
+/* make sure there are at least len free bytes after the tail,
+ * consumed bytes are reclaimed before growing
+ * returns pointer to the tail
+ */
+char *bufferReserve(buffer_t *buffer, size_t len);
+
+/* mark len bytes written at the tail (after bufferReserve) as readable */
+void bufferCommit(buffer_t *buffer, size_t len);
+
+/* append len bytes at the tail */
+void bufferAppend(buffer_t *buffer, const void *data, size_t len);
+
+/* drop len bytes from the head */
+void bufferConsume(buffer_t *buffer, size_t len);
+
+/* read whatever is available from fd into the tail, at least min_free bytes of room are made first
+ * returns bytes read, 0 on end of file, -1 on error (errno set, EAGAIN included)
+ */
+ssize_t bufferReadFrom(buffer_t *buffer, int fd, size_t min_free, int flags);
+
+/* free buffer */
+void bufferFree(buffer_t *buffer);
+
+#endif
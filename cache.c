@@ -0,0 +1,275 @@
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <pthread.h>
+#include "cache.h"
+#include "rpc_ext.h"
+
+#define CACHE_LINE 64
+// multipliers of the payload hash (splitmix64 / golden ratio constants)
+#define HASH_PRIME_1 0x9E3779B97F4A7C15ull
+#define HASH_PRIME_2 0xBF58476D1CE4E5B9ull
+#define HASH_PRIME_3 0x94D049BB133111EBull
+
+typedef struct cacheEntry {
+    struct cacheEntry *next;       // bucket chain
+    struct cacheEntry *clock_next; // circular list the clock hand sweeps
+    struct cacheEntry *clock_prev;
+    uint64_t hash;
+    uint64_t tag;
+    int referenced;                // hit since the hand last passed
+    int key_data1;
+    size_t key_len;
+    int data1;
+    size_t data2_len;
+    size_t size;                   // bytes charged to the shard
+    char bytes[];                  // key data2, then result data2
+} cacheEntry_t;
+
+typedef struct cacheShard {
+    _Alignas(CACHE_LINE) pthread_mutex_t lock;
+    cacheEntry_t **buckets;
+    size_t n_buckets; // power of two
+    size_t n;
+    size_t bytes;
+    size_t max_bytes;
+    cacheEntry_t *hand; // next entry the clock looks at, NULL when empty
+} cacheShard_t;
+
+struct resultCache {
+    cacheShard_t shards[CACHE_SHARDS];
+};
+
+/* mix the bits of x so that every input bit affects every output bit */
+static uint64_t cacheMix(uint64_t x) {
+	x ^= x >> 30;
+	x *= HASH_PRIME_2;
+	x ^= x >> 27;
+	x *= HASH_PRIME_3;
+	x ^= x >> 31;
+	return x;
+}
+
+/* the shard of a hash, its low bits pick the bucket */
+static cacheShard_t *cacheShard(resultCache_t *cache, uint64_t hash) {
+	return &cache->shards[hash >> 58 & (CACHE_SHARDS - 1)];
+}
+
+/* check whether entry is the key (hash, tag, payload) */
+static int cacheEntryMatches(cacheEntry_t *entry, uint64_t hash, uint64_t tag, rpc_data *payload) {
+	return entry->hash == hash && entry->tag == tag && entry->key_data1 == payload->data1 &&
+	entry->key_len == payload->data2_len && (payload->data2_len == 0 ||
+	memcmp(entry->bytes, payload->data2, payload->data2_len) == 0);
+}
+
+/* double the buckets of shard & rehash every entry (lock held) */
+static void cacheShardGrow(cacheShard_t *shard) {
+	size_t n_buckets = shard->n_buckets * 2;
+	cacheEntry_t **buckets = calloc(n_buckets, sizeof(*buckets));
+	if (buckets == NULL) {
+		return;
+	}
+	for (size_t i = 0; i < shard->n_buckets; i++) {
+		cacheEntry_t *entry = shard->buckets[i];
+		while (entry != NULL) {
+			cacheEntry_t *next = entry->next;
+			cacheEntry_t **bucket = &buckets[entry->hash & (n_buckets - 1)];
+			entry->next = *bucket;
+			*bucket = entry;
+			entry = next;
+		}
+	}
+	free(shard->buckets);
+	shard->buckets = buckets;
+	shard->n_buckets = n_buckets;
+}
+
+/* unlink entry from its bucket & the clock, then free it (lock held) */
+static void cacheShardRemove(cacheShard_t *shard, cacheEntry_t *entry) {
+	cacheEntry_t **link = &shard->buckets[entry->hash & (shard->n_buckets - 1)];
+	while (*link != entry) {
+		link = &(*link)->next;
+	}
+	*link = entry->next;
+
+	if (entry->clock_next == entry) {
+		shard->hand = NULL;
+	} else {
+		entry->clock_prev->clock_next = entry->clock_next;
+		entry->clock_next->clock_prev = entry->clock_prev;
+		if (shard->hand == entry) {
+			shard->hand = entry->clock_next;
+		}
+	}
+	shard->n--;
+	shard->bytes -= entry->size;
+	free(entry);
+}
+
+/* evict entries until extra more bytes fit in the budget of shard (lock held) */
+static void cacheShardEvict(cacheShard_t *shard, size_t extra) {
+	while (shard->hand != NULL && shard->bytes + extra > shard->max_bytes) {
+		cacheEntry_t *entry = shard->hand;
+		if (entry->referenced) {
+			// recently used: a second chance, until the hand comes round again
+			entry->referenced = 0;
+			shard->hand = entry->clock_next;
+		} else {
+			cacheShardRemove(shard, entry);
+		}
+	}
+}
+
+/* ---------------------- */
+/* resultCache procedure  */
+/* ---------------------- */
+
+/* creates & returns a cache that may use up to max_bytes (0 keeps it empty) */
+resultCache_t *resultCacheCreate(size_t max_bytes) {
+	resultCache_t *cache = aligned_alloc(CACHE_LINE, sizeof(*cache));
+	assert(cache);
+	for (int i = 0; i < CACHE_SHARDS; i++) {
+		cacheShard_t *shard = &cache->shards[i];
+		pthread_mutex_init(&shard->lock, NULL);
+		shard->buckets = calloc(CACHE_INIT_BUCKETS, sizeof(*shard->buckets));
+		assert(shard->buckets);
+		shard->n_buckets = CACHE_INIT_BUCKETS;
+		shard->n = 0;
+		shard->bytes = 0;
+		shard->max_bytes = max_bytes / CACHE_SHARDS;
+		shard->hand = NULL;
+	}
+	return cache;
+}
+
+/* change the memory budget, evicting entries until every shard is within it */
+void resultCacheSetLimit(resultCache_t *cache, size_t max_bytes) {
+	for (int i = 0; i < CACHE_SHARDS; i++) {
+		cacheShard_t *shard = &cache->shards[i];
+		pthread_mutex_lock(&shard->lock);
+		__atomic_store_n(&shard->max_bytes, max_bytes / CACHE_SHARDS, __ATOMIC_RELAXED);
+		cacheShardEvict(shard, 0);
+		pthread_mutex_unlock(&shard->lock);
+	}
+}
+
+/* hash of the key (tag, payload), eight bytes of data2 at a time */
+uint64_t resultCacheHash(uint64_t tag, rpc_data *payload) {
+	uint64_t hash = cacheMix(tag ^ ((uint64_t)(unsigned)payload->data1 << 32) ^ payload->data2_len);
+	const unsigned char *bytes = payload->data2;
+	size_t len = payload->data2_len, i = 0;
+	for (; i + sizeof(uint64_t) <= len; i += sizeof(uint64_t)) {
+		uint64_t word;
+		memcpy(&word, bytes + i, sizeof(word));
+		hash = (hash ^ word * HASH_PRIME_1) * HASH_PRIME_2;
+		hash ^= hash >> 29;
+	}
+	if (i < len) {
+		uint64_t word = 0;
+		memcpy(&word, bytes + i, len - i);
+		hash = (hash ^ word * HASH_PRIME_1) * HASH_PRIME_2;
+	}
+	return cacheMix(hash);
+}
+
+/* look up the result cached for (tag, payload), see cache.h */
+rpc_data *resultCacheGet(resultCache_t *cache, uint64_t hash, uint64_t tag, rpc_data *payload) {
+	cacheShard_t *shard = cacheShard(cache, hash);
+	rpc_data *result = NULL;
+	pthread_mutex_lock(&shard->lock);
+	cacheEntry_t *entry = shard->buckets[hash & (shard->n_buckets - 1)];
+	while (entry != NULL && !cacheEntryMatches(entry, hash, tag, payload)) {
+		entry = entry->next;
+	}
+	if (entry != NULL) {
+		entry->referenced = 1;
+		result = rpc_data_alloc(entry->data2_len);
+		result->data1 = entry->data1;
+		if (entry->data2_len > 0) {
+			memcpy(result->data2, entry->bytes + entry->key_len, entry->data2_len);
+		}
+	}
+	pthread_mutex_unlock(&shard->lock);
+	return result;
+}
+
+/* remember result as the answer to (tag, payload), see cache.h */
+void resultCachePut(resultCache_t *cache, uint64_t hash, uint64_t tag, rpc_data *payload, rpc_data *result) {
+	cacheShard_t *shard = cacheShard(cache, hash);
+	size_t size = sizeof(cacheEntry_t) + payload->data2_len + result->data2_len;
+	if (size > __atomic_load_n(&shard->max_bytes, __ATOMIC_RELAXED) / CACHE_MAX_ENTRY_SHARE) {
+		return;
+	}
+
+	// built outside the lock, dropped if another thread cached the same key meanwhile
+	cacheEntry_t *entry = malloc(size);
+	if (entry == NULL) {
+		return;
+	}
+	entry->hash = hash;
+	entry->tag = tag;
+	entry->referenced = 0;
+	entry->key_data1 = payload->data1;
+	entry->key_len = payload->data2_len;
+	entry->data1 = result->data1;
+	entry->data2_len = result->data2_len;
+	entry->size = size;
+	if (payload->data2_len > 0) {
+		memcpy(entry->bytes, payload->data2, payload->data2_len);
+	}
+	if (result->data2_len > 0) {
+		memcpy(entry->bytes + entry->key_len, result->data2, result->data2_len);
+	}
+
+	pthread_mutex_lock(&shard->lock);
+	cacheEntry_t *existing = shard->buckets[hash & (shard->n_buckets - 1)];
+	while (existing != NULL && !cacheEntryMatches(existing, hash, tag, payload)) {
+		existing = existing->next;
+	}
+	if (existing != NULL || size > shard->max_bytes / CACHE_MAX_ENTRY_SHARE) {
+		pthread_mutex_unlock(&shard->lock);
+		free(entry);
+		return;
+	}
+	cacheShardEvict(shard, size);
+	if (shard->n >= shard->n_buckets) {
+		cacheShardGrow(shard);
+	}
+	cacheEntry_t **bucket = &shard->buckets[hash & (shard->n_buckets - 1)];
+	entry->next = *bucket;
+	*bucket = entry;
+	// a new entry goes just behind the hand, so it is looked at last
+	if (shard->hand == NULL) {
+		entry->clock_next = entry->clock_prev = entry;
+		shard->hand = entry;
+	} else {
+		entry->clock_next = shard->hand;
+		entry->clock_prev = shard->hand->clock_prev;
+		entry->clock_prev->clock_next = entry;
+		shard->hand->clock_prev = entry;
+	}
+	shard->n++;
+	shard->bytes += size;
+	pthread_mutex_unlock(&shard->lock);
+}
+
+/* free cache & every entry */
+void resultCacheFree(resultCache_t *cache) {
+	if (cache == NULL) {
+		return;
+	}
+	for (int i = 0; i < CACHE_SHARDS; i++) {
+		cacheShard_t *shard = &cache->shards[i];
+		for (size_t b = 0; b < shard->n_buckets; b++) {
+			cacheEntry_t *entry = shard->buckets[b];
+			while (entry != NULL) {
+				cacheEntry_t *next = entry->next;
+				free(entry);
+				entry = next;
+			}
+		}
+		free(shard->buckets);
+		pthread_mutex_destroy(&shard->lock);
+	}
+	free(cache);
+}
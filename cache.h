@@ -0,0 +1,51 @@
+#ifndef CACHE_H
+#define CACHE_H
+#include <stddef.h>
+#include <stdint.h>
+#include "rpc.h"
+
+// independently locked parts of a cache, a power of two
+#define CACHE_SHARDS 64
+// hash buckets of a shard at first, doubled whenever it holds more entries than buckets
+#define CACHE_INIT_BUCKETS 64
+// an entry may take at most this fraction of its shard's budget
+#define CACHE_MAX_ENTRY_SHARE 4
+
+// data definitions
+typedef struct resultCache resultCache_t;
+
+/* ---------------------- */
+/* resultCache procedure  */
+/* ---------------------- */
+
+/* results of pure functions keyed on (tag, data1, data2) of their payload, where the tag
+ * names the function; the cache is split into CACHE_SHARDS shards, each with its own
+ * lock, hash table & share of the memory budget, & a shard over budget evicts with the
+ * CLOCK algorithm: a hit only sets a flag, & the hand sweeping the entries evicts the
+ * first one whose flag is clear (clearing the flags it passes)
+ * every function is thread-safe
+ */
+
+/* creates & returns a cache that may use up to max_bytes (0 keeps it empty) */
+resultCache_t *resultCacheCreate(size_t max_bytes);
+
+/* change the memory budget, evicting entries until every shard is within it */
+void resultCacheSetLimit(resultCache_t *cache, size_t max_bytes);
+
+/* hash of the key (tag, payload), to pass to resultCacheGet & resultCachePut */
+uint64_t resultCacheHash(uint64_t tag, rpc_data *payload);
+
+/* look up the result cached for (tag, payload)
+ * returns a copy the caller owns (rpc_data_free), NULL on a miss
+ */
+rpc_data *resultCacheGet(resultCache_t *cache, uint64_t hash, uint64_t tag, rpc_data *payload);
+
+/* remember result (valid, not taken over) as the answer to (tag, payload), the key &
+ * result are copied; an entry too large for its shard is not cached
+ */
+void resultCachePut(resultCache_t *cache, uint64_t hash, uint64_t tag, rpc_data *payload, rpc_data *result);
+
+/* free cache & every entry */
+void resultCacheFree(resultCache_t *cache);
+
+#endif
@@ -0,0 +1,513 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include "connection.h"
+#include "pool.h"
+#include "trace.h"
+
+// free room requested before each recv, large enough to take a burst of small requests at once
+#define CONNECTION_READ_SIZE 16384
+// queued reply pieces smaller than this are copied, larger ones are kept by reference
+#define CONNECTION_COPY_LIMIT 4096
+// pieces handed to a single sendmsg when flushing the queue
+#define CONNECTION_FLUSH_IOV 64
+
+/* piece of a reply waiting for the socket */
+struct outSegment {
+    char *data;
+    size_t len;
+    size_t sent;
+    int copied;       // data is a private copy, freed with the segment
+    rpc_data *result; // released once this segment is sent
+    outSegment_t *next;
+};
+
+/* in-order reply that finished before an earlier one */
+struct heldReply {
+    uint32_t seq;
+    outSegment_t *head;
+    outSegment_t *tail;
+    heldReply_t *next;
+};
+
+/* -------------------- */
+/* connection procedure */
+/* -------------------- */
+
+/* creates & returns a connection owning sockfd (switched to non-blocking mode) & shm, refcount 1 */
+connection_t *connectionCreate(int sockfd, shmChannel_t *shm, void *owner) {
+	fcntl(sockfd, F_SETFL, fcntl(sockfd, F_GETFL, 0) | O_NONBLOCK);
+
+	connection_t *conn = malloc(sizeof(*conn));
+	assert(conn);
+	conn->sockfd = sockfd;
+	conn->shm = shm;
+	conn->awaiting_shm = 0;
+	conn->owner = owner;
+	conn->active = 0;
+	pthread_mutex_init(&conn->lock, NULL);
+	conn->refcount = 1;
+	conn->closed = 0;
+	conn->compress = 0;
+	conn->streams = NULL;
+	conn->version = 1;
+	conn->rbuf = bufferCreate();
+	conn->have_header = 0;
+	conn->direct_data2 = NULL;
+	conn->direct_len = 0;
+	conn->direct_filled = 0;
+	conn->out_head = NULL;
+	conn->out_tail = NULL;
+	conn->ordered_next = 0;
+	conn->ordered_sent = 0;
+	conn->held = NULL;
+	conn->corked = 0;
+	conn->send_inflight = 0;
+	memset(&conn->send_msg, 0, sizeof(conn->send_msg));
+	return conn;
+}
+
+/* free a chain of segments, releasing the results they point into */
+static void outSegmentFreeAll(outSegment_t *segment) {
+	while (segment != NULL) {
+		outSegment_t *next = segment->next;
+		if (segment->copied) {
+			poolFree(segment->data);
+		}
+		rpc_data_free(segment->result);
+		poolFree(segment);
+		segment = next;
+	}
+}
+
+/* take an extra reference, e.g. for a job handed to a worker */
+void connectionRetain(connection_t *conn) {
+	pthread_mutex_lock(&conn->lock);
+	conn->refcount++;
+	pthread_mutex_unlock(&conn->lock);
+}
+
+/* drop a reference, the last one closes the socket & frees the connection */
+void connectionRelease(connection_t *conn) {
+	pthread_mutex_lock(&conn->lock);
+	int refcount = --conn->refcount;
+	pthread_mutex_unlock(&conn->lock);
+	if (refcount > 0) {
+		return;
+	}
+
+	shmChannelFree(conn->shm);
+	close(conn->sockfd);
+	while (conn->held != NULL) {
+		heldReply_t *reply = conn->held;
+		conn->held = reply->next;
+		outSegmentFreeAll(reply->head);
+		poolFree(reply);
+	}
+	outSegmentFreeAll(conn->out_head);
+	poolFree(conn->send_msg.msg_iov);
+	free(conn->direct_data2);
+	bufferFree(conn->rbuf);
+	pthread_mutex_destroy(&conn->lock);
+	free(conn);
+}
+
+/* stop sending on conn, replies still being computed are dropped */
+void connectionMarkClosed(connection_t *conn) {
+	pthread_mutex_lock(&conn->lock);
+	conn->closed = 1;
+	pthread_mutex_unlock(&conn->lock);
+}
+
+/* recv(2) on the socket, or on the rings when the connection has them */
+static ssize_t connectionRecv(connection_t *conn, char *buf, size_t len) {
+	if (conn->shm != NULL) {
+		return shmChannelRecv(conn->shm, buf, len, MSG_DONTWAIT);
+	}
+	ssize_t n;
+	do {
+		n = recv(conn->sockfd, buf, len, 0);
+	} while (n < 0 && errno == EINTR);
+	return n;
+}
+
+/* read everything the socket has into the receive buffer (or the large body being received) */
+int connectionReceive(connection_t *conn) {
+	ssize_t n;
+	if (conn->direct_data2 != NULL && conn->direct_filled < conn->direct_len) {
+		// large body: receive straight into its final buffer, never past its end
+		n = connectionRecv(conn, conn->direct_data2 + conn->direct_filled, conn->direct_len - conn->direct_filled);
+		if (n > 0) {
+			conn->direct_filled += n;
+		}
+	} else {
+		// a known body size is reserved at once instead of growing the buffer step by step
+		size_t min_free = CONNECTION_READ_SIZE;
+		if (conn->have_header && conn->header.body_len < LARGE_PAYLOAD_SIZE &&
+		conn->header.body_len > bufferLen(conn->rbuf)) {
+			size_t missing = conn->header.body_len - bufferLen(conn->rbuf);
+			if (missing > min_free) {
+				min_free = missing;
+			}
+		}
+		if (conn->shm != NULL) {
+			n = connectionRecv(conn, bufferReserve(conn->rbuf, min_free), min_free);
+			if (n > 0) {
+				bufferCommit(conn->rbuf, n);
+			}
+		} else {
+			n = bufferReadFrom(conn->rbuf, conn->sockfd, min_free, 0);
+		}
+	}
+
+	if (n > 0) {
+		TRACE(RPC_TRACE_DEBUG, TRACE_READ, conn->sockfd, n);
+		return 1;
+	}
+	if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+		return 0;
+	}
+	if (n < 0) {
+		perror("read");
+	}
+	return -1;
+}
+
+/* take bytes the owner received for conn some other way */
+size_t connectionReceiveBytes(connection_t *conn, const char *data, size_t len) {
+	if (conn->direct_data2 != NULL && conn->direct_filled < conn->direct_len) {
+		// large body: never past its end, the rest belongs to the next request
+		size_t missing = conn->direct_len - conn->direct_filled;
+		if (len > missing) {
+			len = missing;
+		}
+		memcpy(conn->direct_data2 + conn->direct_filled, data, len);
+		conn->direct_filled += len;
+		return len;
+	}
+	memcpy(bufferReserve(conn->rbuf, len), data, len);
+	bufferCommit(conn->rbuf, len);
+	return len;
+}
+
+/* large rpc_call() body: once data1 & data2_len are buffered (v1, a v2 header holds them),
+ * move data2 into its own buffer
+ * returns 1 when data2 is complete, 0 if more bytes are needed, -1 if malformed
+ */
+static int connectionDirectBody(connection_t *conn) {
+	if (conn->direct_data2 == NULL) {
+		conn->direct_len = conn->header.body_len;
+		if (conn->header.version == 1) {
+			if (bufferLen(conn->rbuf) < RPC_DATA_HEADER_SIZE) {
+				return 0;
+			}
+			if (checkRPCDataBuffer(bufferHead(conn->rbuf), conn->header.body_len) < 0) {
+				return -1;
+			}
+			memcpy(conn->direct_header, bufferHead(conn->rbuf), RPC_DATA_HEADER_SIZE);
+			bufferConsume(conn->rbuf, RPC_DATA_HEADER_SIZE);
+			conn->direct_len -= RPC_DATA_HEADER_SIZE;
+		} else if (conn->header.body_len != conn->header.data2_len) {
+			return -1;
+		}
+		conn->direct_data2 = malloc(conn->direct_len);
+		if (conn->direct_data2 == NULL) {
+			perror("Memory allocation failed");
+			return -1;
+		}
+
+		// the recv that brought the header may already hold the start of data2
+		size_t buffered = bufferLen(conn->rbuf);
+		conn->direct_filled = buffered < conn->direct_len ? buffered : conn->direct_len;
+		memcpy(conn->direct_data2, bufferHead(conn->rbuf), conn->direct_filled);
+		bufferConsume(conn->rbuf, conn->direct_filled);
+	}
+	return conn->direct_filled == conn->direct_len;
+}
+
+/* look for the next complete request */
+int connectionNextFrame(connection_t *conn, frameHeader_t **header, char **body, char **data2) {
+	// state 1: waiting for the fixed-size header
+	if (!conn->have_header) {
+		int header_len = parseRequestHeader(bufferHead(conn->rbuf), bufferLen(conn->rbuf), &conn->header);
+		if (header_len <= 0) {
+			return header_len;
+		}
+		// a client speaks one version of the protocol, settled by its hello: check it
+		// before a large body gets a buffer of its own
+		if (conn->header.version != conn->version && conn->header.flag != RPC_HELLO_FLAG) {
+			return -1;
+		}
+		bufferConsume(conn->rbuf, header_len);
+		conn->have_header = 1;
+	}
+	*header = &conn->header;
+
+	// state 2a: waiting for a large body received in place
+	int is_call = conn->header.flag == RPC_CALL_FLAG || conn->header.flag == RPC_CALL_ID_FLAG ||
+	conn->header.flag == RPC_CALL_DEADLINE_FLAG || conn->header.flag == RPC_CALL_STREAM_FLAG;
+	int direct = conn->direct_data2 != NULL;
+	if (!direct && is_call && conn->header.body_len >= LARGE_PAYLOAD_SIZE) {
+		// a compressed data2 is inflated out of the receive buffer instead
+		if (conn->header.version == 2) {
+			direct = !(conn->header.flags & RPC_V2_FLAG_COMPRESSED);
+		} else if (bufferLen(conn->rbuf) < RPC_DATA_HEADER_SIZE) {
+			return 0;
+		} else {
+			direct = !isRPCDataCompressed(bufferHead(conn->rbuf));
+		}
+	}
+	if (direct) {
+		int ready = connectionDirectBody(conn);
+		if (ready <= 0) {
+			return ready;
+		}
+		*body = conn->direct_header;
+		*data2 = conn->direct_data2;
+		return 1;
+	}
+
+	// state 2b: waiting for the body in the receive buffer
+	if (bufferLen(conn->rbuf) < conn->header.body_len) {
+		return 0;
+	}
+	*body = bufferHead(conn->rbuf);
+	*data2 = NULL;
+	return 1;
+}
+
+/* drop the request returned by connectionNextFrame */
+void connectionConsumeFrame(connection_t *conn) {
+	if (conn->direct_data2 != NULL) {
+		// data2 now belongs to the caller
+		conn->direct_data2 = NULL;
+		conn->direct_len = 0;
+		conn->direct_filled = 0;
+	} else {
+		bufferConsume(conn->rbuf, conn->header.body_len);
+	}
+	conn->have_header = 0;
+}
+
+/* reserve the sequence number of a request that must be answered in order (owner only) */
+uint32_t connectionNextOrdered(connection_t *conn) {
+	return conn->ordered_next++;
+}
+
+/* turn the unsent part of a reply into segments appended to *head / *tail
+ * small pieces are copied, large ones keep pointing into result, which the last
+ * segment releases (result is released right away when nothing points into it)
+ */
+static void outSegmentAppend(outSegment_t **head, outSegment_t **tail, struct iovec *iov, int iovcnt,
+size_t skip, rpc_data *result) {
+	outSegment_t *last_reference = NULL;
+	for (int i = 0; i < iovcnt; i++) {
+		if (skip >= iov[i].iov_len) {
+			skip -= iov[i].iov_len;
+			continue;
+		}
+		outSegment_t *segment = poolAlloc(sizeof(*segment));
+		assert(segment);
+		segment->len = iov[i].iov_len - skip;
+		segment->sent = 0;
+		segment->result = NULL;
+		segment->next = NULL;
+		if (result != NULL && segment->len >= CONNECTION_COPY_LIMIT) {
+			segment->data = (char *)iov[i].iov_base + skip;
+			segment->copied = 0;
+			last_reference = segment;
+		} else {
+			segment->data = poolAlloc(segment->len);
+			memcpy(segment->data, (char *)iov[i].iov_base + skip, segment->len);
+			segment->copied = 1;
+		}
+		skip = 0;
+
+		if (*tail == NULL) {
+			*head = segment;
+		} else {
+			(*tail)->next = segment;
+		}
+		*tail = segment;
+	}
+
+	if (last_reference != NULL) {
+		last_reference->result = result;
+	} else {
+		rpc_data_free(result);
+	}
+}
+
+/* write a whole reply, queueing what the socket does not take (lock held) */
+static int connectionWrite(connection_t *conn, struct iovec *iov, int iovcnt, rpc_data *result) {
+	// queued bytes go first, new bytes line up behind them
+	size_t sent = 0;
+	if (conn->out_head == NULL && !conn->corked) {
+		ssize_t n = sendFrameNonBlocking(conn->sockfd, conn->shm, iov, iovcnt);
+		if (n < 0) {
+			rpc_data_free(result);
+			return -1;
+		}
+		sent = n;
+	}
+	outSegmentAppend(&conn->out_head, &conn->out_tail, iov, iovcnt, sent, result);
+	return 0;
+}
+
+/* send a reply without blocking, whatever the socket does not accept is queued */
+int connectionSend(connection_t *conn, int ordered, uint32_t seq, struct iovec *iov, int iovcnt, rpc_data *result) {
+	int status = 0;
+	pthread_mutex_lock(&conn->lock);
+	if (conn->closed) {
+		pthread_mutex_unlock(&conn->lock);
+		rpc_data_free(result);
+		return 0;
+	}
+
+	// an earlier in-order reply is still being computed: hold this one back
+	if (ordered && seq != conn->ordered_sent) {
+		heldReply_t *reply = poolAlloc(sizeof(*reply));
+		reply->seq = seq;
+		reply->head = NULL;
+		reply->tail = NULL;
+		outSegmentAppend(&reply->head, &reply->tail, iov, iovcnt, 0, result);
+		heldReply_t **pos = &conn->held;
+		while (*pos != NULL && (*pos)->seq < seq) {
+			pos = &(*pos)->next;
+		}
+		reply->next = *pos;
+		*pos = reply;
+		pthread_mutex_unlock(&conn->lock);
+		return 0;
+	}
+
+	status = connectionWrite(conn, iov, iovcnt, result);
+	if (ordered) {
+		conn->ordered_sent++;
+		// release held replies that are now next in line, their segments move to the queue as is
+		while (conn->held != NULL && conn->held->seq == conn->ordered_sent) {
+			heldReply_t *reply = conn->held;
+			conn->held = reply->next;
+			if (reply->head != NULL) {
+				if (conn->out_tail == NULL) {
+					conn->out_head = reply->head;
+				} else {
+					conn->out_tail->next = reply->head;
+				}
+				conn->out_tail = reply->tail;
+			}
+			poolFree(reply);
+			conn->ordered_sent++;
+		}
+	}
+	pthread_mutex_unlock(&conn->lock);
+
+	// replies released from the held list may be writable right away
+	if (status == 0) {
+		status = connectionFlush(conn);
+	}
+	return status;
+}
+
+/* point iov at the queued segments, up to max of them (lock held) */
+/* RETURNS: number of iov entries filled */
+static int connectionGather(connection_t *conn, struct iovec *iov, int max) {
+	int iovcnt = 0;
+	for (outSegment_t *segment = conn->out_head; segment != NULL && iovcnt < max; segment = segment->next) {
+		iov[iovcnt].iov_base = segment->data + segment->sent;
+		iov[iovcnt].iov_len = segment->len - segment->sent;
+		iovcnt++;
+	}
+	return iovcnt;
+}
+
+/* drop the first n queued bytes, freeing the segments that are fully sent (lock held) */
+static void connectionConsumeSent(connection_t *conn, size_t n) {
+	while (conn->out_head != NULL && n > 0) {
+		outSegment_t *segment = conn->out_head;
+		size_t left = segment->len - segment->sent;
+		if (n < left) {
+			segment->sent += n;
+			break;
+		}
+		n -= left;
+		conn->out_head = segment->next;
+		segment->next = NULL;
+		outSegmentFreeAll(segment);
+	}
+	if (conn->out_head == NULL) {
+		conn->out_tail = NULL;
+	}
+}
+
+/* push queued bytes to the socket once it is writable again */
+int connectionFlush(connection_t *conn) {
+	int status = 0;
+	pthread_mutex_lock(&conn->lock);
+	while (!conn->closed && !conn->corked && !conn->send_inflight && conn->out_head != NULL) {
+		// gather the queued segments into one sendmsg
+		struct iovec iov[CONNECTION_FLUSH_IOV];
+		int iovcnt = connectionGather(conn, iov, CONNECTION_FLUSH_IOV);
+
+		ssize_t n = sendFrameNonBlocking(conn->sockfd, conn->shm, iov, iovcnt);
+		if (n < 0) {
+			status = -1;
+			break;
+		}
+		if (n == 0) {
+			break;
+		}
+		connectionConsumeSent(conn, n);
+	}
+	pthread_mutex_unlock(&conn->lock);
+	return status;
+}
+
+/* queue every reply from now on instead of writing it, until connectionUncork (owner only) */
+void connectionCork(connection_t *conn) {
+	pthread_mutex_lock(&conn->lock);
+	conn->corked = 1;
+	pthread_mutex_unlock(&conn->lock);
+}
+
+/* stop queueing replies, the ones already queued wait for connectionStartSend (owner only) */
+void connectionUncork(connection_t *conn) {
+	pthread_mutex_lock(&conn->lock);
+	conn->corked = 0;
+	pthread_mutex_unlock(&conn->lock);
+}
+
+/* hand the head of the queue to the owner for an asynchronous sendmsg (owner only) */
+struct msghdr *connectionStartSend(connection_t *conn) {
+	struct msghdr *msg = NULL;
+	pthread_mutex_lock(&conn->lock);
+	if (!conn->closed && !conn->corked && !conn->send_inflight && conn->out_head != NULL) {
+		// the segments stay queued (& new replies line up behind them) until connectionSendDone
+		if (conn->send_msg.msg_iov == NULL) {
+			conn->send_msg.msg_iov = poolAlloc(CONNECTION_FLUSH_IOV * sizeof(struct iovec));
+		}
+		conn->send_msg.msg_iovlen = connectionGather(conn, conn->send_msg.msg_iov, CONNECTION_FLUSH_IOV);
+		conn->send_inflight = 1;
+		msg = &conn->send_msg;
+	}
+	pthread_mutex_unlock(&conn->lock);
+	return msg;
+}
+
+/* the sendmsg started by connectionStartSend wrote n bytes (or failed if n < 0) */
+int connectionSendDone(connection_t *conn, ssize_t n) {
+	pthread_mutex_lock(&conn->lock);
+	conn->send_inflight = 0;
+	if (n > 0) {
+		TRACE(RPC_TRACE_DEBUG, TRACE_WRITE, conn->sockfd, n);
+		connectionConsumeSent(conn, n);
+	}
+	pthread_mutex_unlock(&conn->lock);
+	return n < 0 ? -1 : 0;
+}
@@ -0,0 +1,136 @@
+#ifndef CONNECTION_H
+#define CONNECTION_H
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/uio.h>
+#include <sys/socket.h>
+#include "rpc.h"
+#include "buffer.h"
+#include "frame.h"
+#include "shm.h"
+
+// rpc_call() bodies at least this large skip the receive buffer: data2 is received
+// straight into its own heap buffer, which is then handed to the rpc_handler as is
+// (unless it was sent compressed)
+#define LARGE_PAYLOAD_SIZE (64 * 1024)
+
+// data definitions
+typedef struct outSegment outSegment_t;
+typedef struct heldReply heldReply_t;
+
+/* server side of a client connection
+ * the receive side is only touched by the reactor that owns the connection,
+ * the send side is shared with every worker still answering one of its calls
+ */
+typedef struct connection {
+    int sockfd;
+    shmChannel_t *shm;    // requests & replies travel through shared-memory rings, NULL for a plain socket
+    int awaiting_shm;     // accepted on a shared-memory listener, the rings have not arrived yet (owner only)
+    void *owner;          // reactor serving this connection
+    unsigned active;      // calls admitted & not answered yet, updated atomically
+    pthread_mutex_t lock; // guards everything below refcount, including the send side
+    int refcount;         // owner + in-flight jobs, the socket is closed when it drops to 0
+    int closed;
+    int compress;         // the client agreed on RPC_FEATURE_COMPRESS, set by the owner before any call
+    void *streams;        // streaming calls in progress on the connection, see rpc_register_stream
+    int version;          // wire protocol of the replies: 1, or 2 once the client sent RPC_OP_HELLO,
+                          // set by the owner before any call
+
+    // receive side: incremental parser state
+    buffer_t *rbuf;
+    int have_header;      // header is decoded & the parser waits for header.body_len bytes
+    frameHeader_t header;
+    char direct_header[RPC_DATA_HEADER_SIZE]; // data1 & data2_len of a large v1 body
+    char *direct_data2;   // large body being received in place, NULL otherwise
+    uint32_t direct_len;
+    uint32_t direct_filled;
+
+    // send side: bytes the socket did not accept yet & in-order replies finished too early
+    outSegment_t *out_head;
+    outSegment_t *out_tail;
+    uint32_t ordered_next; // sequence number of the next request that must be answered in order
+    uint32_t ordered_sent; // sequence number of the next in-order reply allowed on the wire
+    heldReply_t *held;     // sorted by sequence number
+    int corked;            // replies only queue up, the owner submits them later (connectionStartSend)
+    int send_inflight;     // send_msg, pointing at the head of the queue, is being sent by the owner
+    struct msghdr send_msg;
+} connection_t;
+
+/* -------------------- */
+/* connection procedure */
+/* -------------------- */
+
+/* creates & returns a connection owning sockfd (switched to non-blocking mode) & shm (may be NULL),
+ * refcount 1
+ */
+connection_t *connectionCreate(int sockfd, shmChannel_t *shm, void *owner);
+
+/* take an extra reference, e.g. for a job handed to a worker */
+void connectionRetain(connection_t *conn);
+
+/* drop a reference, the last one closes the socket & frees the connection */
+void connectionRelease(connection_t *conn);
+
+/* stop sending on conn, replies still being computed are dropped */
+void connectionMarkClosed(connection_t *conn);
+
+/* read everything the socket has into the receive buffer (or the large body being received)
+ * returns 1 if bytes were read, 0 if the socket is drained, -1 on end of file or error
+ */
+int connectionReceive(connection_t *conn);
+
+/* take bytes the owner received for conn some other way (e.g. into an io_uring
+ * provided buffer): they go to the large body being received, up to its end, or to
+ * the receive buffer
+ * returns the number of bytes taken, connectionNextFrame must run before the rest
+ */
+size_t connectionReceiveBytes(connection_t *conn, const char *data, size_t len);
+
+/* look for the next complete request
+ * returns 1 & sets *header / *body when a whole request has arrived, 0 if more bytes
+ * are needed, -1 if the stream is malformed or switches wire protocol versions
+ * for a large rpc_call() body, *body only holds data1 & data2_len (v1, a v2 header holds
+ * them already) and *data2 is the payload received in place (the caller takes ownership),
+ * otherwise *data2 is NULL
+ * the request stays valid until connectionConsumeFrame
+ */
+int connectionNextFrame(connection_t *conn, frameHeader_t **header, char **body, char **data2);
+
+/* drop the request returned by connectionNextFrame */
+void connectionConsumeFrame(connection_t *conn);
+
+/* reserve the sequence number of a request that must be answered in order (owner only) */
+uint32_t connectionNextOrdered(connection_t *conn);
+
+/* send a reply without blocking, whatever the socket does not accept is queued
+ * in-order replies (ordered != 0) wait until every earlier in-order reply is sent
+ * the connection takes ownership of result (may be NULL): large pieces of the reply that
+ * point into it are queued by reference instead of being copied, & it is freed once sent
+ * returns 0 on success, -1 if the connection is broken
+ */
+int connectionSend(connection_t *conn, int ordered, uint32_t seq, struct iovec *iov, int iovcnt, rpc_data *result);
+
+/* push queued bytes to the socket once it is writable again
+ * (nothing to do while the connection is corked or the owner is sending)
+ * returns 0 on success, -1 if the connection is broken
+ */
+int connectionFlush(connection_t *conn);
+
+/* queue every reply from now on instead of writing it, until connectionUncork (owner only) */
+void connectionCork(connection_t *conn);
+
+/* stop queueing replies, the ones already queued wait for connectionStartSend (owner only) */
+void connectionUncork(connection_t *conn);
+
+/* hand the head of the queue to the owner for an asynchronous sendmsg (owner only)
+ * returns the message to send (valid until connectionSendDone), NULL if there is nothing
+ * to send, the connection is corked or a send is already in flight
+ */
+struct msghdr *connectionStartSend(connection_t *conn);
+
+/* the sendmsg started by connectionStartSend wrote n bytes (or failed if n < 0)
+ * returns 0 on success, -1 if the connection is broken
+ */
+int connectionSendDone(connection_t *conn, ssize_t n);
+
+#endif
@@ -0,0 +1,814 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <string.h>
+#include <errno.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include "frame.h"
+#include "trace.h"
+#include "pool.h"
+#include "lz.h"
+
+/* ------- */
+/* parsing */
+/* ------- */
+
+static int parseRequestHeaderV2(const char *buffer, size_t len, frameHeader_t *header);
+
+/* decode the header of the request at the head of buffer (len bytes available) */
+int parseRequestHeader(const char *buffer, size_t len, frameHeader_t *header) {
+	if (len < HEADER_BUFFER_SIZE) {
+		return 0;
+	}
+	header->version = 1;
+	header->flags = 0;
+	header->data1 = 0;
+	header->data2_len = 0;
+	if (((uint8_t)buffer[0] & RPC_V2_MAGIC_MASK) == RPC_V2_MAGIC) {
+		return parseRequestHeaderV2(buffer, len, header);
+	}
+
+	// every request starts with (uint16_t) function_flag & a uint16_t argument
+	uint16_t flag_network, arg_network;
+	memcpy(&flag_network, buffer, sizeof(flag_network));
+	memcpy(&arg_network, buffer + UINT16_SIZE, sizeof(arg_network));
+	header->flag = ntohs(flag_network);
+	header->arg = ntohs(arg_network);
+	header->request_id = 0;
+	header->timeout_us = 0;
+	header->credit = 0;
+	header->body_len = 0;
+
+	size_t header_len = HEADER_BUFFER_SIZE;
+	uint32_t field_network;
+	switch (header->flag) {
+	case RPC_CLOSE_CLIENT_FLAG:
+	case RPC_HELLO_FLAG:
+		return header_len;
+	case RPC_FIND_FLAG:
+		header->body_len = header->arg;
+		return header_len;
+	case RPC_FIND_MANY_FLAG:
+		// (uint32_t) body_len, then every name as (uint16_t) fname_len & fname
+		if (len < header_len + UINT32_SIZE) {
+			return 0;
+		}
+		memcpy(&field_network, buffer + header_len, sizeof(field_network));
+		header->body_len = ntohl(field_network);
+		header_len += UINT32_SIZE;
+		if (header->body_len < (uint32_t)header->arg * UINT16_SIZE) {
+			return -1;
+		}
+		return header_len;
+	case RPC_STREAM_CREDIT_FLAG:
+	case RPC_CALL_ID_FLAG:
+	case RPC_CALL_DEADLINE_FLAG:
+	case RPC_CALL_STREAM_FLAG:
+	case RPC_CALL_BATCH_FLAG:
+		if (len < header_len + UINT32_SIZE) {
+			return 0;
+		}
+		memcpy(&field_network, buffer + header_len, sizeof(field_network));
+		header->request_id = ntohl(field_network);
+		header_len += UINT32_SIZE;
+		if (header->flag == RPC_CALL_DEADLINE_FLAG || header->flag == RPC_CALL_STREAM_FLAG ||
+		header->flag == RPC_STREAM_CREDIT_FLAG) {
+			if (len < header_len + UINT32_SIZE) {
+				return 0;
+			}
+			memcpy(&field_network, buffer + header_len, sizeof(field_network));
+			if (header->flag == RPC_CALL_DEADLINE_FLAG) {
+				header->timeout_us = ntohl(field_network);
+			} else {
+				header->credit = ntohl(field_network);
+			}
+			header_len += UINT32_SIZE;
+		}
+		if (header->flag == RPC_STREAM_CREDIT_FLAG) {
+			return header_len;
+		}
+		// fall through: the rest is laid out like RPC_CALL_FLAG
+	case RPC_CALL_FLAG:
+		if (len < header_len + UINT32_SIZE) {
+			return 0;
+		}
+		memcpy(&field_network, buffer + header_len, sizeof(field_network));
+		header->body_len = ntohl(field_network);
+		header_len += UINT32_SIZE;
+		if (header->body_len < RPC_DATA_NULL_DATA2_SIZE) {
+			return -1;
+		}
+		return header_len;
+	default:
+		return -1;
+	}
+}
+
+/* decode a v2 request: its fixed header, then the varint fields leading its body, */
+/* into the fields of the v1 request it stands for */
+static int parseRequestHeaderV2(const char *buffer, size_t len, frameHeader_t *header) {
+	if (len < RPC_V2_HEADER_SIZE) {
+		return 0;
+	}
+	uint8_t opcode, flags, status;
+	uint32_t body_len;
+	int version = parseFrameHeaderV2(buffer, &opcode, &flags, &status, &header->request_id, &body_len);
+	// a hello may offer a later version, which the server answers with the one it speaks
+	if (version < 2 || (version != 2 && opcode != RPC_OP_HELLO) || status != RPC_STATUS_OK) {
+		return -1;
+	}
+	header->version = 2;
+	header->flags = flags;
+	header->arg = 0;
+	header->timeout_us = 0;
+	header->credit = 0;
+
+	// the varint fields must be complete before the rest of the body is waited for
+	const char *ptr = buffer + RPC_V2_HEADER_SIZE;
+	size_t available = len - RPC_V2_HEADER_SIZE < body_len ? len - RPC_V2_HEADER_SIZE : body_len;
+	uint32_t fields[3] = {0, 0, 0};
+	int n_fields;
+	switch (opcode) {
+	case RPC_OP_CLOSE:
+		header->flag = RPC_CLOSE_CLIENT_FLAG;
+		n_fields = 0;
+		break;
+	case RPC_OP_HELLO:
+		header->flag = RPC_HELLO_FLAG;
+		n_fields = 1;
+		break;
+	case RPC_OP_FIND:
+		header->flag = RPC_FIND_MANY_FLAG;
+		n_fields = 1;
+		break;
+	case RPC_OP_STREAM_CREDIT:
+		header->flag = RPC_STREAM_CREDIT_FLAG;
+		n_fields = 1;
+		break;
+	case RPC_OP_CALL_BATCH:
+		header->flag = RPC_CALL_BATCH_FLAG;
+		n_fields = 1;
+		break;
+	case RPC_OP_CALL:
+		header->flag = (flags & RPC_V2_FLAG_DEADLINE) ? RPC_CALL_DEADLINE_FLAG : RPC_CALL_ID_FLAG;
+		n_fields = (flags & RPC_V2_FLAG_DEADLINE) ? 2 : 1;
+		break;
+	case RPC_OP_CALL_STREAM:
+		header->flag = RPC_CALL_STREAM_FLAG;
+		n_fields = 2;
+		break;
+	default:
+		return -1;
+	}
+	for (int i = 0; i < n_fields; i++) {
+		int n = getVarint(ptr, available, &fields[i]);
+		if (n <= 0) {
+			return n == 0 && available < body_len ? 0 : -1;
+		}
+		ptr += n;
+		available -= n;
+		body_len -= n;
+	}
+
+	switch (header->flag) {
+	case RPC_HELLO_FLAG:
+		header->arg = fields[0];
+		break;
+	case RPC_FIND_MANY_FLAG:
+		// the count must fit, & so must a varint fname_len per name
+		if (fields[0] > UINT16_MAX || body_len < fields[0]) {
+			return -1;
+		}
+		header->arg = fields[0];
+		break;
+	case RPC_STREAM_CREDIT_FLAG:
+		header->credit = fields[0];
+		break;
+	case RPC_CALL_BATCH_FLAG:
+	case RPC_CALL_ID_FLAG:
+	case RPC_CALL_DEADLINE_FLAG:
+	case RPC_CALL_STREAM_FLAG:
+		if (fields[0] > UINT16_MAX) {
+			return -1;
+		}
+		header->arg = fields[0];
+		if (header->flag == RPC_CALL_DEADLINE_FLAG) {
+			header->timeout_us = fields[1];
+		} else if (header->flag == RPC_CALL_STREAM_FLAG) {
+			header->credit = fields[1];
+		}
+		if (header->flag != RPC_CALL_BATCH_FLAG) {
+			// the body is left with data2 alone, which a large call receives in place
+			int n = parseRPCDataHeaderV2(ptr, available, &header->data1, &header->data2_len);
+			if (n <= 0) {
+				return n == 0 && available < body_len ? 0 : -1;
+			}
+			ptr += n;
+			body_len -= n;
+		}
+		break;
+	}
+	header->body_len = body_len;
+	return ptr - buffer;
+}
+
+/* check that a data2 of wire_len bytes (compressed or not) agrees with its raw data2_len */
+static int checkData2V2(const char *data2, uint32_t wire_len, uint32_t data2_len, int compressed) {
+	if (compressed) {
+		return data2_len > 0 && lzDecompress(data2, wire_len, NULL, data2_len) == 0 ? 0 : -1;
+	}
+	return wire_len == data2_len ? 0 : -1;
+}
+
+/* check that the data2 bytes of a v2 call agree with its data2_len */
+int checkRPCDataV2(frameHeader_t *header, const char *data2) {
+	return checkData2V2(data2, header->body_len, header->data2_len, (header->flags & RPC_V2_FLAG_COMPRESSED) != 0);
+}
+
+/* copy (or inflate) the wire_len bytes of a checked data2 into a pooled buffer of payload */
+static void extractData2V2(rpc_data *payload, const char *data2, uint32_t wire_len, int compressed) {
+	if (payload->data2_len == 0) {
+		payload->data2 = NULL;
+		return;
+	}
+	payload->data2 = poolAlloc(payload->data2_len);
+	if (compressed) {
+		lzDecompress(data2, wire_len, payload->data2, payload->data2_len);
+	} else {
+		memcpy(payload->data2, data2, payload->data2_len);
+	}
+}
+
+/* extract the rpc_data of a v2 call from its header & the data2 bytes */
+void extractRPCDataV2(rpc_data *payload, frameHeader_t *header, char *data2, int in_place) {
+	payload->data1 = header->data1;
+	payload->data2_len = header->data2_len;
+	if (in_place) {
+		payload->data2 = data2;
+		return;
+	}
+	extractData2V2(payload, data2, header->body_len, (header->flags & RPC_V2_FLAG_COMPRESSED) != 0);
+}
+
+/* check that a serialized rpc_data of payload_len bytes is consistent with its data2_len */
+int checkRPCDataBuffer(const char *buffer_pointer, uint32_t payload_len) {
+	if (payload_len == RPC_DATA_NULL_DATA2_SIZE) {
+		return 0;
+	}
+	if (payload_len <= RPC_DATA_HEADER_SIZE) {
+		return -1;
+	}
+	uint32_t data2_len_network;
+	memcpy(&data2_len_network, buffer_pointer + UINT64_SIZE, sizeof(data2_len_network));
+	uint32_t data2_len = ntohl(data2_len_network);
+	if (data2_len & RPC_DATA_COMPRESSED_BIT) {
+		data2_len &= ~RPC_DATA_COMPRESSED_BIT;
+		return data2_len > 0 && lzDecompress(buffer_pointer + RPC_DATA_HEADER_SIZE,
+		payload_len - RPC_DATA_HEADER_SIZE, NULL, data2_len) == 0 ? 0 : -1;
+	}
+	return data2_len == payload_len - RPC_DATA_HEADER_SIZE ? 0 : -1;
+}
+
+/* tell from the header of a serialized rpc_data whether data2 follows compressed */
+int isRPCDataCompressed(const char *buffer_pointer) {
+	uint32_t data2_len_network;
+	memcpy(&data2_len_network, buffer_pointer + UINT64_SIZE, sizeof(data2_len_network));
+	return (ntohl(data2_len_network) & RPC_DATA_COMPRESSED_BIT) != 0;
+}
+
+/* ------------------------ */
+/* rpc_data (de)serializing */
+/* ------------------------ */
+
+/* check that data2_len & data2 agree with each other */
+int isRPCDataValid(rpc_data *payload) {
+	return !(payload == NULL || ((payload->data2_len > 0) & (payload->data2 == NULL)) ||
+	((payload->data2_len == 0) & (payload->data2 != NULL)) || (payload->data2_len & RPC_DATA_COMPRESSED_BIT));
+}
+
+/* size of payload once serialized */
+uint32_t getRPCDataLen(rpc_data *payload) {
+	if (payload->data2_len == 0) {
+		return UINT64_SIZE;
+	}
+	return RPC_DATA_HEADER_SIZE + payload->data2_len;
+}
+
+/* serialize data1 (& data2_len when there is data2) into buffer,
+ * data2 itself is sent straight from payload->data2
+ */
+size_t loadRPCDataHeaderToBuffer(rpc_data *payload, char *buffer_pointer) {
+	uint64_t data1_network = hton64bit(payload->data1);
+	memcpy(buffer_pointer, &data1_network, sizeof(data1_network));
+	buffer_pointer += sizeof(data1_network);
+
+	if (payload->data2_len == 0) {
+		return UINT64_SIZE;
+	}
+	uint32_t data2_len_network = htonl(payload->data2_len);
+	memcpy(buffer_pointer, &data2_len_network, sizeof(data2_len_network));
+	return RPC_DATA_HEADER_SIZE;
+}
+
+/* compress the data2 of payload for sending when it is large enough & the result is worth it */
+char *compressRPCData2(rpc_data *payload, size_t min_size, uint32_t *compressed_len) {
+	size_t len = payload->data2_len;
+	if (min_size == 0 || len < min_size || len > ~RPC_DATA_COMPRESSED_BIT) {
+		return NULL;
+	}
+	char *compressed = poolAlloc(len);
+	// a cheap look at the start saves compressing a whole payload that does not shrink
+	size_t probe = RPC_DATA_COMPRESS_PROBE_SIZE;
+	if (len >= 2 * probe && lzCompress(payload->data2, probe, compressed,
+	probe - (probe >> RPC_DATA_COMPRESS_GAIN_SHIFT)) == 0) {
+		poolFree(compressed);
+		return NULL;
+	}
+	size_t n = lzCompress(payload->data2, len, compressed, len - (len >> RPC_DATA_COMPRESS_GAIN_SHIFT));
+	if (n == 0) {
+		poolFree(compressed);
+		return NULL;
+	}
+	*compressed_len = n;
+	return compressed;
+}
+
+/* serialize data1 & data2_len of a payload whose data2 is sent compressed */
+size_t loadCompressedRPCDataHeaderToBuffer(rpc_data *payload, char *buffer_pointer) {
+	uint64_t data1_network = hton64bit(payload->data1);
+	memcpy(buffer_pointer, &data1_network, sizeof(data1_network));
+	uint32_t data2_len_network = htonl(payload->data2_len | RPC_DATA_COMPRESSED_BIT);
+	memcpy(buffer_pointer + sizeof(data1_network), &data2_len_network, sizeof(data2_len_network));
+	return RPC_DATA_HEADER_SIZE;
+}
+
+/* extract a checked buffer to rpc_data, decompressing data2 if needed */
+void extractRPCDataFromBuffer(rpc_data *payload, char *buffer_pointer, uint32_t payload_len) {
+	uint64_t data1_network, data1;
+	memcpy(&data1_network, buffer_pointer, sizeof(data1_network));
+	data1 = n64bittoh(data1_network);
+	payload->data1 = data1;
+	buffer_pointer += sizeof(data1_network);
+
+	if (payload_len == RPC_DATA_NULL_DATA2_SIZE) {
+		// implement NULL data2 incase no data2 in return_buffer
+		payload->data2_len = 0;
+		payload->data2 = NULL;
+	} else {
+		// extract data2_len & data2 if available in return_buffer
+		uint32_t data2_len_network, data2_len;
+		memcpy(&data2_len_network, buffer_pointer, sizeof(data2_len_network));
+		data2_len = ntohl(data2_len_network);
+		buffer_pointer += sizeof(data2_len_network);
+
+		if (data2_len & RPC_DATA_COMPRESSED_BIT) {
+			// checkRPCDataBuffer made sure it decompresses to exactly data2_len bytes
+			payload->data2_len = data2_len & ~RPC_DATA_COMPRESSED_BIT;
+			payload->data2 = poolAlloc(payload->data2_len);
+			lzDecompress(buffer_pointer, payload_len - RPC_DATA_HEADER_SIZE, payload->data2, payload->data2_len);
+			return;
+		}
+		payload->data2_len = data2_len;
+		payload->data2 = poolAlloc(payload->data2_len);
+		memcpy(payload->data2, buffer_pointer, payload->data2_len);
+	}
+}
+
+/* extract data1 & data2_len of a large rpc_data whose data2 was received in place,
+ * payload takes ownership of data2 without copying it
+ */
+void extractRPCDataWithData2(rpc_data *payload, char *buffer_pointer, void *data2) {
+	uint64_t data1_network;
+	memcpy(&data1_network, buffer_pointer, sizeof(data1_network));
+	payload->data1 = n64bittoh(data1_network);
+	buffer_pointer += sizeof(data1_network);
+
+	uint32_t data2_len_network;
+	memcpy(&data2_len_network, buffer_pointer, sizeof(data2_len_network));
+	payload->data2_len = ntohl(data2_len_network);
+	payload->data2 = data2;
+}
+
+/* size of a batch of n rpc_data once serialized, NULL or invalid ones count as errors */
+uint64_t getRPCDataBatchLen(rpc_data *payload[], size_t n) {
+	uint64_t len = UINT32_SIZE;
+	for (size_t i = 0; i < n; i++) {
+		len += UINT32_SIZE;
+		if (isRPCDataValid(payload[i])) {
+			len += getRPCDataLen(payload[i]);
+		}
+	}
+	return len;
+}
+
+/* serialize a batch: (uint32_t) count, then every rpc_data as (uint32_t) rpc_data_len & rpc_data */
+size_t loadRPCDataBatchToBuffer(rpc_data *payload[], size_t n, char *buffer_pointer) {
+	char *ptr = buffer_pointer;
+	uint32_t count_network = htonl(n);
+	memcpy(ptr, &count_network, sizeof(count_network));
+	ptr += sizeof(count_network);
+
+	for (size_t i = 0; i < n; i++) {
+		// rpc_data_len == 0 marks an invalid rpc_data
+		uint32_t rpc_data_len = isRPCDataValid(payload[i]) ? getRPCDataLen(payload[i]) : 0;
+		uint32_t rpc_data_len_network = htonl(rpc_data_len);
+		memcpy(ptr, &rpc_data_len_network, sizeof(rpc_data_len_network));
+		ptr += sizeof(rpc_data_len_network);
+		if (rpc_data_len > 0) {
+			ptr += loadRPCDataHeaderToBuffer(payload[i], ptr);
+			if (payload[i]->data2_len > 0) {
+				memcpy(ptr, payload[i]->data2, payload[i]->data2_len);
+				ptr += payload[i]->data2_len;
+			}
+		}
+	}
+	return ptr - buffer_pointer;
+}
+
+/* check a serialized batch of payload_len bytes & read its count */
+int checkRPCDataBatch(const char *buffer_pointer, uint32_t payload_len, int allow_invalid, uint32_t *count) {
+	if (payload_len < UINT32_SIZE) {
+		return -1;
+	}
+	uint32_t count_network;
+	memcpy(&count_network, buffer_pointer, sizeof(count_network));
+	*count = ntohl(count_network);
+
+	const char *ptr = buffer_pointer + UINT32_SIZE, *end = buffer_pointer + payload_len;
+	for (uint32_t i = 0; i < *count; i++) {
+		uint32_t rpc_data_len_network;
+		if (end - ptr < UINT32_SIZE) {
+			return -1;
+		}
+		memcpy(&rpc_data_len_network, ptr, sizeof(rpc_data_len_network));
+		uint32_t rpc_data_len = ntohl(rpc_data_len_network);
+		ptr += UINT32_SIZE;
+		if (rpc_data_len == 0 && allow_invalid) {
+			continue;
+		}
+		if (end - ptr < rpc_data_len || checkRPCDataBuffer(ptr, rpc_data_len) < 0) {
+			return -1;
+		}
+		ptr += rpc_data_len;
+	}
+	return ptr == end ? 0 : -1;
+}
+
+/* extract a batch checked by checkRPCDataBatch, invalid rpc_data come out as NULL */
+void extractRPCDataBatch(char *buffer_pointer, uint32_t count, rpc_data *payload[]) {
+	char *ptr = buffer_pointer + UINT32_SIZE;
+	for (uint32_t i = 0; i < count; i++) {
+		uint32_t rpc_data_len_network;
+		memcpy(&rpc_data_len_network, ptr, sizeof(rpc_data_len_network));
+		uint32_t rpc_data_len = ntohl(rpc_data_len_network);
+		ptr += UINT32_SIZE;
+		payload[i] = NULL;
+		if (rpc_data_len > 0) {
+			payload[i] = poolAlloc(sizeof(*(payload[i])));
+			extractRPCDataFromBuffer(payload[i], ptr, rpc_data_len);
+			ptr += rpc_data_len;
+		}
+	}
+}
+
+/* convert 64-bit data to network byte order format */
+/* inspired from https://codereview.stackexchange.com/questions/151049/endianness-conversion-in-c */
+uint64_t hton64bit(uint64_t data) {
+    // Check the host's byte order
+    static const int32_t num = 1;
+    static const uint8_t* const is_little_endian_pointer = (const uint8_t*)&num;
+    if (*is_little_endian_pointer == 1) {
+        return ((data & 0x00000000000000FFULL) << 56) |
+               ((data & 0x000000000000FF00ULL) << 40) |
+               ((data & 0x0000000000FF0000ULL) << 24) |
+               ((data & 0x00000000FF000000ULL) << 8) |
+               ((data & 0x000000FF00000000ULL) >> 8) |
+               ((data & 0x0000FF0000000000ULL) >> 24) |
+               ((data & 0x00FF000000000000ULL) >> 40) |
+               ((data & 0xFF00000000000000ULL) >> 56);
+    } else {
+        return data;
+    }
+}
+
+/* convert 64-bit data from network byte order format to host format*/
+/* inspired from https://codereview.stackexchange.com/questions/151049/endianness-conversion-in-c */
+uint64_t n64bittoh(uint64_t data) {
+    // Check the format of this host
+	int num = 1;
+	if (*(char*)&num == 0) {
+		// if it's a big endian system
+		return data;
+	} else {
+		// if it's a little endian system
+		return ((data & 0xFFULL) << 56) |
+               ((data & 0xFF00ULL) << 40) |
+               ((data & 0xFF0000ULL) << 24) |
+               ((data & 0xFF000000ULL) << 8) |
+               ((data & 0xFF00000000ULL) >> 8) |
+               ((data & 0xFF0000000000ULL) >> 24) |
+               ((data & 0xFF000000000000ULL) >> 40) |
+               ((data & 0xFF00000000000000ULL) >> 56);
+	}
+}
+
+/* ---------------- */
+/* wire protocol v2 */
+/* ---------------- */
+
+/* append v as a LEB128 varint */
+size_t putVarint(char *buffer_pointer, uint32_t v) {
+	size_t n = 0;
+	while (v >= 0x80) {
+		buffer_pointer[n++] = (char)(v | 0x80);
+		v >>= 7;
+	}
+	buffer_pointer[n++] = (char)v;
+	return n;
+}
+
+/* read a varint from the len bytes available at buffer_pointer */
+int getVarint(const char *buffer_pointer, size_t len, uint32_t *v) {
+	const uint8_t *bytes = (const uint8_t *)buffer_pointer;
+	// a single byte is by far the most common case: small fids, lengths & counts
+	if (len > 0 && bytes[0] < 0x80) {
+		*v = bytes[0];
+		return 1;
+	}
+	uint32_t value = 0;
+	for (size_t i = 0; i < VARINT_MAX_SIZE; i++) {
+		if (i == len) {
+			return 0;
+		}
+		value |= (uint32_t)(bytes[i] & 0x7F) << (7 * i);
+		if (bytes[i] < 0x80) {
+			// the last byte holds the top 4 bits of a 32-bit value
+			if (i == VARINT_MAX_SIZE - 1 && bytes[i] > 0x0F) {
+				return -1;
+			}
+			*v = value;
+			return i + 1;
+		}
+	}
+	return -1;
+}
+
+/* serialize the fixed header of a v2 frame into buffer */
+size_t loadFrameHeaderV2(char *buffer_pointer, uint8_t opcode, uint8_t flags, uint8_t status,
+uint32_t request_id, uint32_t body_len) {
+	buffer_pointer[0] = (char)(RPC_V2_MAGIC | 2);
+	buffer_pointer[1] = (char)opcode;
+	buffer_pointer[2] = (char)flags;
+	buffer_pointer[3] = (char)status;
+	uint32_t request_id_network = htonl(request_id);
+	memcpy(buffer_pointer + 4, &request_id_network, sizeof(request_id_network));
+	uint32_t body_len_network = htonl(body_len);
+	memcpy(buffer_pointer + 8, &body_len_network, sizeof(body_len_network));
+	return RPC_V2_HEADER_SIZE;
+}
+
+/* decode the fixed header of a v2 frame into its fields */
+int parseFrameHeaderV2(const char *buffer_pointer, uint8_t *opcode, uint8_t *flags, uint8_t *status,
+uint32_t *request_id, uint32_t *body_len) {
+	uint8_t magic_version = buffer_pointer[0];
+	if ((magic_version & RPC_V2_MAGIC_MASK) != RPC_V2_MAGIC) {
+		return -1;
+	}
+	*opcode = buffer_pointer[1];
+	*flags = buffer_pointer[2];
+	*status = buffer_pointer[3];
+	uint32_t request_id_network, body_len_network;
+	memcpy(&request_id_network, buffer_pointer + 4, sizeof(request_id_network));
+	memcpy(&body_len_network, buffer_pointer + 8, sizeof(body_len_network));
+	*request_id = ntohl(request_id_network);
+	*body_len = ntohl(body_len_network);
+	return magic_version & RPC_V2_VERSION_MASK;
+}
+
+/* data1 as a varint: zigzag keeps small negative values as short as small positive ones */
+static uint32_t zigzagEncode(int data1) {
+	uint32_t v = (uint32_t)data1;
+	return v << 1 ^ (uint32_t)-(v >> 31);
+}
+
+static int zigzagDecode(uint32_t v) {
+	return (int)(v >> 1 ^ (uint32_t)-(v & 1));
+}
+
+/* serialize data1 & data2_len of a v2 rpc_data */
+size_t loadRPCDataHeaderV2ToBuffer(rpc_data *payload, char *buffer_pointer) {
+	size_t n = putVarint(buffer_pointer, zigzagEncode(payload->data1));
+	return n + putVarint(buffer_pointer + n, payload->data2_len);
+}
+
+/* decode data1 & data2_len of a v2 rpc_data from the len bytes available */
+int parseRPCDataHeaderV2(const char *buffer_pointer, size_t len, int *data1, uint32_t *data2_len) {
+	uint32_t zigzag;
+	int n = getVarint(buffer_pointer, len, &zigzag);
+	if (n <= 0) {
+		return n;
+	}
+	int m = getVarint(buffer_pointer + n, len - n, data2_len);
+	if (m <= 0 || *data2_len & RPC_DATA_COMPRESSED_BIT) {
+		return m == 0 ? 0 : -1;
+	}
+	*data1 = zigzagDecode(zigzag);
+	return n + m;
+}
+
+/* check that a v2 rpc_data of payload_len bytes is consistent with its data2_len */
+int checkRPCDataBufferV2(const char *buffer_pointer, uint32_t payload_len, uint8_t flags) {
+	int data1;
+	uint32_t data2_len;
+	int n = parseRPCDataHeaderV2(buffer_pointer, payload_len, &data1, &data2_len);
+	if (n <= 0) {
+		return -1;
+	}
+	return checkData2V2(buffer_pointer + n, payload_len - n, data2_len, (flags & RPC_V2_FLAG_COMPRESSED) != 0);
+}
+
+/* extract a v2 rpc_data checked by checkRPCDataBufferV2, decompressing data2 if needed */
+void extractRPCDataFromBufferV2(rpc_data *payload, char *buffer_pointer, uint32_t payload_len, uint8_t flags) {
+	uint32_t data2_len;
+	int n = parseRPCDataHeaderV2(buffer_pointer, payload_len, &payload->data1, &data2_len);
+	payload->data2_len = data2_len;
+	extractData2V2(payload, buffer_pointer + n, payload_len - n, (flags & RPC_V2_FLAG_COMPRESSED) != 0);
+}
+
+/* size of a varint */
+static size_t varintLen(uint32_t v) {
+	size_t n = 1;
+	while (v >= 0x80) {
+		v >>= 7;
+		n++;
+	}
+	return n;
+}
+
+/* size of a v2 batch of n rpc_data once serialized, NULL or invalid ones count as errors */
+uint64_t getRPCDataBatchLenV2(rpc_data *payload[], size_t n) {
+	uint64_t len = varintLen(n);
+	for (size_t i = 0; i < n; i++) {
+		if (!isRPCDataValid(payload[i])) {
+			len++;
+			continue;
+		}
+		len += varintLen(payload[i]->data2_len + 1) + varintLen(zigzagEncode(payload[i]->data1)) +
+		payload[i]->data2_len;
+	}
+	return len;
+}
+
+/* serialize a v2 batch: (varint) count, then every rpc_data as a batch entry */
+size_t loadRPCDataBatchV2ToBuffer(rpc_data *payload[], size_t n, char *buffer_pointer) {
+	char *ptr = buffer_pointer;
+	ptr += putVarint(ptr, n);
+	for (size_t i = 0; i < n; i++) {
+		// data2_len + 1 == 0 marks an invalid rpc_data
+		if (!isRPCDataValid(payload[i])) {
+			ptr += putVarint(ptr, 0);
+			continue;
+		}
+		ptr += putVarint(ptr, payload[i]->data2_len + 1);
+		ptr += putVarint(ptr, zigzagEncode(payload[i]->data1));
+		if (payload[i]->data2_len > 0) {
+			memcpy(ptr, payload[i]->data2, payload[i]->data2_len);
+			ptr += payload[i]->data2_len;
+		}
+	}
+	return ptr - buffer_pointer;
+}
+
+/* decode the batch entry at ptr (at most end), RETURNS: bytes it takes, -1 if malformed */
+/* (*tag is data2_len + 1, 0 for an invalid rpc_data) */
+static int parseBatchEntryV2(const char *ptr, const char *end, uint32_t *tag, int *data1) {
+	int n = getVarint(ptr, end - ptr, tag);
+	if (n <= 0) {
+		return -1;
+	}
+	if (*tag == 0) {
+		return n;
+	}
+	uint32_t zigzag;
+	int m = getVarint(ptr + n, end - ptr - n, &zigzag);
+	if (m <= 0 || (uint64_t)(end - ptr - n - m) < *tag - 1) {
+		return -1;
+	}
+	*data1 = zigzagDecode(zigzag);
+	return n + m + (*tag - 1);
+}
+
+/* check a serialized v2 batch of payload_len bytes & read its count */
+int checkRPCDataBatchV2(const char *buffer_pointer, uint32_t payload_len, int allow_invalid, uint32_t *count) {
+	const char *ptr = buffer_pointer, *end = buffer_pointer + payload_len;
+	int n = getVarint(ptr, payload_len, count);
+	if (n <= 0 || *count > payload_len) {
+		// every entry takes at least one byte
+		return -1;
+	}
+	ptr += n;
+	for (uint32_t i = 0; i < *count; i++) {
+		uint32_t tag;
+		int data1;
+		int len = parseBatchEntryV2(ptr, end, &tag, &data1);
+		if (len < 0 || (tag == 0 && !allow_invalid) || (tag > 0 && tag - 1 > ~RPC_DATA_COMPRESSED_BIT)) {
+			return -1;
+		}
+		ptr += len;
+	}
+	return ptr == end ? 0 : -1;
+}
+
+/* extract a v2 batch checked by checkRPCDataBatchV2, invalid entries come out as NULL */
+void extractRPCDataBatchV2(char *buffer_pointer, uint32_t payload_len, uint32_t count, rpc_data *payload[]) {
+	char *ptr = buffer_pointer, *end = buffer_pointer + payload_len;
+	uint32_t checked_count;
+	ptr += getVarint(ptr, payload_len, &checked_count);
+	for (uint32_t i = 0; i < count; i++) {
+		uint32_t tag;
+		int data1 = 0;
+		int len = parseBatchEntryV2(ptr, end, &tag, &data1);
+		payload[i] = NULL;
+		if (tag > 0) {
+			payload[i] = poolAlloc(sizeof(*(payload[i])));
+			payload[i]->data1 = data1;
+			payload[i]->data2_len = tag - 1;
+			extractData2V2(payload[i], ptr + len - (tag - 1), tag - 1, 0);
+		}
+		ptr += len;
+	}
+}
+
+/* ------- */
+/* sending */
+/* ------- */
+
+/* send a whole frame made of iovcnt pieces with as few syscalls as possible
+ * (a single sendmsg unless the socket buffer is full)
+ */
+int sendFrame(int sockfd, shmChannel_t *shm, struct iovec *iov, int iovcnt) {
+	if (shm != NULL) {
+		ssize_t n = shmChannelSend(shm, iov, iovcnt, 0);
+		if (n < 0) {
+			perror("shmChannelSend");
+			return -1;
+		}
+		TRACE(RPC_TRACE_DEBUG, TRACE_WRITE, sockfd, n);
+		return 0;
+	}
+
+	struct msghdr msg;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = iov;
+	msg.msg_iovlen = iovcnt;
+
+	while (msg.msg_iovlen > 0) {
+		ssize_t n = sendmsg(sockfd, &msg, MSG_NOSIGNAL);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("sendmsg");
+			return -1;
+		}
+		TRACE(RPC_TRACE_DEBUG, TRACE_WRITE, sockfd, n);
+
+		// partial write: skip the pieces already sent
+		while (msg.msg_iovlen > 0 && (size_t)n >= msg.msg_iov->iov_len) {
+			n -= msg.msg_iov->iov_len;
+			msg.msg_iov++;
+			msg.msg_iovlen--;
+		}
+		if (msg.msg_iovlen > 0) {
+			msg.msg_iov->iov_base = (char *)msg.msg_iov->iov_base + n;
+			msg.msg_iov->iov_len -= n;
+		}
+	}
+	return 0;
+}
+
+/* send as much of a frame as the socket accepts right now, without blocking */
+ssize_t sendFrameNonBlocking(int sockfd, shmChannel_t *shm, struct iovec *iov, int iovcnt) {
+	struct msghdr msg;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = iov;
+	msg.msg_iovlen = iovcnt;
+
+	ssize_t n;
+	if (shm != NULL) {
+		n = shmChannelSend(shm, iov, iovcnt, MSG_DONTWAIT);
+	} else {
+		do {
+			n = sendmsg(sockfd, &msg, MSG_NOSIGNAL | MSG_DONTWAIT);
+		} while (n < 0 && errno == EINTR);
+	}
+	if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+		return 0;
+	}
+	if (n < 0) {
+		perror("sendmsg");
+	} else {
+		TRACE(RPC_TRACE_DEBUG, TRACE_WRITE, sockfd, n);
+	}
+	return n;
+}
@@ -0,0 +1,291 @@
+#ifndef FRAME_H
+#define FRAME_H
+#include <stdint.h>
+#include <sys/uio.h>
+#include "rpc.h"
+#include "shm.h"
+
+/* ------------- */
+/* wire protocol */
+/* ------------- */
+
+// request flags (first uint16_t of every request)
+#define RPC_CLOSE_CLIENT_FLAG 0
+#define RPC_FIND_FLAG 1
+#define RPC_CALL_FLAG 2
+#define RPC_CALL_ID_FLAG 3
+#define RPC_FIND_MANY_FLAG 4
+#define RPC_CALL_BATCH_FLAG 5
+#define RPC_HELLO_FLAG 6
+// RPC_CALL_ID_FLAG with a (uint32_t) timeout_us after the request id
+#define RPC_CALL_DEADLINE_FLAG 7
+// RPC_CALL_ID_FLAG with a (uint32_t) window after the request id: the call is answered by a
+// stream of replies, at most window of them before the client grants more
+#define RPC_CALL_STREAM_FLAG 8
+// (uint32_t) request_id & (uint32_t) credit, no body: the client of a stream takes credit
+// more replies, a credit of 0 cancels the stream
+#define RPC_STREAM_CREDIT_FLAG 9
+
+// features a client offers in RPC_HELLO_FLAG (uint16_t arg) or RPC_OP_HELLO & the server
+// answers with the subset it agrees to use on the connection
+#define RPC_FEATURE_COMPRESS 0x0001
+
+// wire protocol v2: every frame, in both directions, is a fixed RPC_V2_HEADER_SIZE header,
+// (uint8_t) magic | version, (uint8_t) opcode, (uint8_t) flags, (uint8_t) status,
+// (uint32_t) request_id, (uint32_t) body_len, then body_len bytes of varint fields & data;
+// a v1 request starts with a uint16_t flag below 256, so its first byte is always 0
+#define RPC_V2_MAGIC 0xA0
+#define RPC_V2_MAGIC_MASK 0xF0
+#define RPC_V2_VERSION_MASK 0x0F
+#define RPC_V2_HEADER_SIZE 12
+// v2 opcodes of requests, the request_id of a reply names the request it answers
+#define RPC_OP_HELLO 1        // varint features; must be the first frame of a v2 connection
+#define RPC_OP_FIND 2         // varint count, then varint fname_len & fname per name
+#define RPC_OP_CALL 3         // varint fid, [varint timeout_us], rpc_data
+#define RPC_OP_CALL_BATCH 4   // varint fid, varint count, then every rpc_data as a batch entry
+#define RPC_OP_CALL_STREAM 5  // varint fid, varint window, rpc_data
+#define RPC_OP_STREAM_CREDIT 6 // varint credit (0 cancels the stream request_id)
+#define RPC_OP_CLOSE 7        // no body
+#define RPC_OP_REPLY 8        // every frame a v2 server sends
+// v2 flags
+#define RPC_V2_FLAG_DEADLINE 0x01   // RPC_OP_CALL: a timeout_us follows the fid
+#define RPC_V2_FLAG_COMPRESSED 0x02 // the data2 of the rpc_data follows compressed (lz.h)
+// v2 status of a reply, nothing but RPC_STATUS_OK carries a body
+#define RPC_STATUS_OK 0         // HELLO: varint features, FIND: varint generation & varint fids,
+                                // CALL & stream chunks: rpc_data, CALL_BATCH: varint count & entries
+#define RPC_STATUS_ERROR 1      // the handler failed (or a stream ended with an error)
+#define RPC_STATUS_OVERLOADED 2 // the call was turned away without being run
+#define RPC_STATUS_STREAM_END 3 // the stream ended after its last chunk
+#define RPC_STATUS_EXPIRED 4    // the call's deadline passed before it could be run
+// a v2 rpc_data is (varint) zigzag data1, (varint) data2_len, then data2, whose compressed
+// bytes fill the rest of the body under RPC_V2_FLAG_COMPRESSED; a batch entry is
+// (varint) data2_len + 1 (0 for an invalid rpc_data, nothing follows), zigzag data1 & data2
+#define VARINT_MAX_SIZE 5 // every varint field holds 32 bits
+#define RPC_V2_DATA_HEADER_MAX_SIZE (2 * VARINT_MAX_SIZE)
+
+#define UINT16_SIZE sizeof(uint16_t)
+#define UINT32_SIZE sizeof(uint32_t)
+#define UINT64_SIZE sizeof(uint64_t)
+#define HEADER_BUFFER_SIZE (2 * UINT16_SIZE)
+#define RPC_DATA_NULL_DATA2_SIZE UINT64_SIZE
+// serialized rpc_data without data2: (uint64_t) data1, (uint32_t) data2_len
+#define RPC_DATA_HEADER_SIZE (UINT64_SIZE + UINT32_SIZE)
+// rpc_data_len of a reply to a call the server turned away under overload, nothing follows
+#define RPC_OVERLOADED_LEN 0xFFFFFFFFU
+// rpc_data_len of the reply ending a stream that went well, nothing follows (an error ends
+// it with a rpc_data_len of 0 instead)
+#define RPC_STREAM_END_LEN 0xFFFFFFFEU
+// rpc_data_len of a reply to a deadline call dropped unrun once its deadline passed,
+// nothing follows
+#define RPC_EXPIRED_LEN 0xFFFFFFFDU
+// set in data2_len when data2 follows compressed (lz.h), the other bits give its raw length
+#define RPC_DATA_COMPRESSED_BIT 0x80000000U
+// a data2 must shrink by at least 1/2^RPC_DATA_COMPRESS_GAIN_SHIFT to be sent compressed
+#define RPC_DATA_COMPRESS_GAIN_SHIFT 3
+// larger data2 are only compressed if their first RPC_DATA_COMPRESS_PROBE_SIZE bytes are
+#define RPC_DATA_COMPRESS_PROBE_SIZE (16 * 1024)
+// largest fixed-size part of any frame: the v2 header, fid, timeout_us (or window) & the
+// rpc_data header, which outgrows v1's flag, fid, request_id, timeout_us, rpc_data_len &
+// rpc_data header
+#define FRAME_MAX_HEADER_SIZE (RPC_V2_HEADER_SIZE + 2 * VARINT_MAX_SIZE + RPC_V2_DATA_HEADER_MAX_SIZE)
+
+/* fixed-size part of a request, decoded before its body has arrived
+ * a v2 request is decoded into the v1 flag it stands for, along with its varint fields
+ */
+typedef struct frameHeader {
+    uint16_t flag;
+    uint16_t arg;        // fid for calls, fname_len for rpc_find, name count for rpc_find_many,
+                         // features for RPC_HELLO_FLAG
+    uint32_t request_id; // RPC_CALL_ID_FLAG, RPC_CALL_DEADLINE_FLAG, RPC_CALL_BATCH_FLAG & streams only
+    uint32_t timeout_us; // time the caller still waits for the reply, 0 for no deadline
+    uint32_t credit;     // window of RPC_CALL_STREAM_FLAG, credit of RPC_STREAM_CREDIT_FLAG
+    uint32_t body_len;   // bytes following the header: fname(s) or serialized rpc_data(s)
+    uint8_t version;     // 1, or 2 for a RPC_V2_MAGIC frame
+    uint8_t flags;       // v2 flags
+    // v2 calls & streams: the rpc_data header is decoded too, body_len then only counts data2
+    int data1;
+    uint32_t data2_len;
+} frameHeader_t;
+
+/* ------- */
+/* parsing */
+/* ------- */
+
+/* decode the header of the request at the head of buffer (len bytes available)
+ * returns the header size once complete, 0 if more bytes are needed,
+ * -1 if the bytes cannot be the start of a request
+ */
+int parseRequestHeader(const char *buffer, size_t len, frameHeader_t *header);
+
+/* check that a serialized rpc_data of payload_len bytes is consistent with its data2_len,
+ * a compressed data2 must decompress to exactly its raw length
+ * returns 0 if it is, -1 otherwise
+ */
+int checkRPCDataBuffer(const char *buffer_pointer, uint32_t payload_len);
+
+/* tell from the header of a serialized rpc_data (RPC_DATA_HEADER_SIZE bytes of a
+ * payload longer than RPC_DATA_NULL_DATA2_SIZE) whether data2 follows compressed
+ * returns 1 if it does, 0 otherwise
+ */
+int isRPCDataCompressed(const char *buffer_pointer);
+
+/* check that the body_len data2 bytes of a v2 call agree with its data2_len,
+ * a compressed data2 must decompress to exactly that length
+ * returns 0 if they do, -1 otherwise
+ */
+int checkRPCDataV2(frameHeader_t *header, const char *data2);
+
+/* extract the rpc_data of a v2 call checked by checkRPCDataV2 from its header & the
+ * data2 bytes, taking data2 over as is when it was received in place (in_place)
+ */
+void extractRPCDataV2(rpc_data *payload, frameHeader_t *header, char *data2, int in_place);
+
+/* ------------------------ */
+/* rpc_data (de)serializing */
+/* ------------------------ */
+
+/* check that data2_len & data2 agree with each other (& that data2_len leaves
+ * RPC_DATA_COMPRESSED_BIT clear) */
+int isRPCDataValid(rpc_data *payload);
+
+/* size of payload once serialized */
+uint32_t getRPCDataLen(rpc_data *payload);
+
+/* serialize data1 (& data2_len when there is data2) into buffer,
+ * data2 itself is sent straight from payload->data2
+ * returns the number of bytes written (at most RPC_DATA_HEADER_SIZE)
+ */
+size_t loadRPCDataHeaderToBuffer(rpc_data *payload, char *buffer_pointer);
+
+/* compress the data2 of payload for sending when it is at least min_size bytes (min_size 0
+ * never compresses) & the result is worth it (RPC_DATA_COMPRESS_GAIN_SHIFT)
+ * returns the compressed bytes (poolFree them once sent) with their size in compressed_len,
+ * NULL to send data2 as is
+ */
+char *compressRPCData2(rpc_data *payload, size_t min_size, uint32_t *compressed_len);
+
+/* serialize data1 & data2_len of a payload whose data2 is sent as compressed_len
+ * compressed bytes (compressRPCData2), the rpc_data then takes
+ * RPC_DATA_HEADER_SIZE + compressed_len bytes on the wire
+ * returns the number of bytes written (RPC_DATA_HEADER_SIZE)
+ */
+size_t loadCompressedRPCDataHeaderToBuffer(rpc_data *payload, char *buffer_pointer);
+
+/* extract a checked buffer to rpc_data, decompressing data2 if needed */
+void extractRPCDataFromBuffer(rpc_data *payload, char *buffer_pointer, uint32_t payload_len);
+
+/* extract data1 & data2_len of a large rpc_data whose data2 was received in place,
+ * payload takes ownership of data2 without copying it
+ */
+void extractRPCDataWithData2(rpc_data *payload, char *buffer_pointer, void *data2);
+
+/* size of a batch of n rpc_data once serialized, NULL or invalid ones count as errors
+ * (64 bits so that callers can tell a batch too large for one frame)
+ */
+uint64_t getRPCDataBatchLen(rpc_data *payload[], size_t n);
+
+/* serialize a batch: (uint32_t) count, then every rpc_data as (uint32_t) rpc_data_len
+ * & rpc_data, data2 included; an invalid rpc_data is sent as rpc_data_len 0
+ * returns the number of bytes written (getRPCDataBatchLen)
+ */
+size_t loadRPCDataBatchToBuffer(rpc_data *payload[], size_t n, char *buffer_pointer);
+
+/* check that a serialized batch of payload_len bytes is consistent & read its count,
+ * rpc_data_len 0 is only accepted when allow_invalid is set (responses)
+ * returns 0 if it is, -1 otherwise
+ */
+int checkRPCDataBatch(const char *buffer_pointer, uint32_t payload_len, int allow_invalid, uint32_t *count);
+
+/* extract the count rpc_data of a batch checked by checkRPCDataBatch into payload,
+ * an rpc_data sent with rpc_data_len 0 comes out as NULL
+ */
+void extractRPCDataBatch(char *buffer_pointer, uint32_t count, rpc_data *payload[]);
+
+/* convert 64-bit data to network byte order format */
+uint64_t hton64bit(uint64_t data);
+
+/* convert 64-bit data from network byte order format to host format */
+uint64_t n64bittoh(uint64_t data);
+
+/* ---------------- */
+/* wire protocol v2 */
+/* ---------------- */
+
+/* append v as a LEB128 varint (7 bits per byte, low bits first)
+ * returns the number of bytes written (at most VARINT_MAX_SIZE)
+ */
+size_t putVarint(char *buffer_pointer, uint32_t v);
+
+/* read a varint from the len bytes available at buffer_pointer
+ * returns the number of bytes read, 0 if it goes on past len, -1 if it overflows 32 bits
+ */
+int getVarint(const char *buffer_pointer, size_t len, uint32_t *v);
+
+/* serialize the fixed header of a v2 frame into buffer
+ * returns the number of bytes written (RPC_V2_HEADER_SIZE)
+ */
+size_t loadFrameHeaderV2(char *buffer_pointer, uint8_t opcode, uint8_t flags, uint8_t status,
+uint32_t request_id, uint32_t body_len);
+
+/* decode the fixed header of a v2 frame (RPC_V2_HEADER_SIZE bytes) into its fields
+ * returns the version it was sent with, -1 if it is not a v2 frame
+ */
+int parseFrameHeaderV2(const char *buffer_pointer, uint8_t *opcode, uint8_t *flags, uint8_t *status,
+uint32_t *request_id, uint32_t *body_len);
+
+/* serialize data1 & data2_len (the raw length if data2 goes out compressed) of a v2
+ * rpc_data, data2 itself is sent straight from payload->data2
+ * returns the number of bytes written (at most RPC_V2_DATA_HEADER_MAX_SIZE)
+ */
+size_t loadRPCDataHeaderV2ToBuffer(rpc_data *payload, char *buffer_pointer);
+
+/* decode data1 & data2_len of a v2 rpc_data from the len bytes available
+ * returns the number of bytes read, 0 if more are needed, -1 if malformed
+ */
+int parseRPCDataHeaderV2(const char *buffer_pointer, size_t len, int *data1, uint32_t *data2_len);
+
+/* check that a v2 rpc_data of payload_len bytes (flags: RPC_V2_FLAG_COMPRESSED) is
+ * consistent with its data2_len
+ * returns 0 if it is, -1 otherwise
+ */
+int checkRPCDataBufferV2(const char *buffer_pointer, uint32_t payload_len, uint8_t flags);
+
+/* extract a v2 rpc_data checked by checkRPCDataBufferV2, decompressing data2 if needed */
+void extractRPCDataFromBufferV2(rpc_data *payload, char *buffer_pointer, uint32_t payload_len, uint8_t flags);
+
+/* size of a v2 batch of n rpc_data once serialized, NULL or invalid ones count as errors */
+uint64_t getRPCDataBatchLenV2(rpc_data *payload[], size_t n);
+
+/* serialize a v2 batch: (varint) count, then every rpc_data as a batch entry
+ * returns the number of bytes written (getRPCDataBatchLenV2)
+ */
+size_t loadRPCDataBatchV2ToBuffer(rpc_data *payload[], size_t n, char *buffer_pointer);
+
+/* check a serialized v2 batch of payload_len bytes & read its count, invalid entries
+ * are only accepted when allow_invalid is set (responses)
+ * returns 0 if it is consistent, -1 otherwise
+ */
+int checkRPCDataBatchV2(const char *buffer_pointer, uint32_t payload_len, int allow_invalid, uint32_t *count);
+
+/* extract the count rpc_data of a v2 batch checked by checkRPCDataBatchV2 into payload,
+ * an invalid entry comes out as NULL
+ */
+void extractRPCDataBatchV2(char *buffer_pointer, uint32_t payload_len, uint32_t count, rpc_data *payload[]);
+
+/* ------- */
+/* sending */
+/* ------- */
+
+/* send a whole frame made of iovcnt pieces with as few syscalls as possible
+ * (a single sendmsg unless the socket buffer is full), through the rings of shm
+ * instead of the socket when it is not NULL
+ * returns 0 on success, -1 on error
+ */
+int sendFrame(int sockfd, shmChannel_t *shm, struct iovec *iov, int iovcnt);
+
+/* send as much of a frame as the socket (or the rings of shm) accepts right now, without blocking
+ * returns the number of bytes sent (0 if the socket buffer is full), -1 on error
+ */
+ssize_t sendFrameNonBlocking(int sockfd, shmChannel_t *shm, struct iovec *iov, int iovcnt);
+
+#endif
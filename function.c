@@ -1,24 +1,61 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdint.h>
 #include <assert.h>
 #include <float.h>
 #include <math.h>
 #include "function.h"
 #include "rpc.h"
 
+#define FNV_OFFSET_BASIS 2166136261u
+#define FNV_PRIME 16777619u
+#define INDEX_EMPTY 0
+
 struct function {
     int id;
     char *name;
+    uint32_t hash;
     rpc_handler obj;
+    rpc_batch_handler batch; // NULL unless registered with rpc_register_batch
+    rpc_async_handler async; // NULL unless registered with rpc_register_async
+    rpc_stream_handler stream; // NULL unless registered with rpc_register_stream
+    int pure;                // registered with rpc_register_pure, results may be cached
+    unsigned max_active;     // admission cap set by rpc_set_concurrency, 0 for none
+    unsigned active;         // calls admitted & not answered yet (only counted under a cap)
+    functionStats_t stats;   // kept across re-registrations of the same name
 };
 
+/* perfect hash built by functionListFreeze (hash & displace)
+ * every registered name has its own slot: slot = functionNameHash(displacement[bucket], name) % n
+ * a negative displacement -k-1 sends the single name of its bucket straight to slot k
+ */
+typedef struct frozenIndex {
+    int n;
+    int *displacement; // one per bucket (n buckets)
+    int *fid;          // fid of the name stored in each slot
+} frozenIndex_t;
+
 struct functionList {
-    function_t **function;
+    function_t **function; // indexed by fid - 1
     int size;
     int n;
+    int *index;            // open addressing: fid of each slot, INDEX_EMPTY if free
+    int index_size;        // power of two, kept at most half full
+    frozenIndex_t *frozen; // NULL unless frozen & unchanged since
+    uint32_t generation;   // bumped by every functionRegister
 };
 
+/* FNV-1a hash of name, seeded so the perfect hash can try several functions */
+uint32_t functionNameHash(uint32_t seed, const char *name) {
+	uint32_t hash = FNV_OFFSET_BASIS ^ (seed * FNV_PRIME);
+	for (const unsigned char *c = (const unsigned char *)name; *c != '\0'; c++) {
+		hash ^= *c;
+		hash *= FNV_PRIME;
+	}
+	return hash;
+}
+
 /* ------------------ */
 /* function procedure */
 /* ------------------ */
@@ -27,16 +64,25 @@ struct functionList {
 function_t *functionCreate(int name_len) {
 	function_t *function = malloc(sizeof(*function));
 	assert(function);
-    function->name = malloc(sizeof(name_len));
+    function->name = malloc(name_len + 1);
     assert(function->name);
-	function->obj = malloc(sizeof(*(function->obj)));
-	assert(function->obj);
+	function->id = 0;
+	function->hash = 0;
+	function->obj = NULL;
+	function->batch = NULL;
+	function->async = NULL;
+	function->stream = NULL;
+	function->pure = 0;
+	function->max_active = 0;
+	function->active = 0;
+	memset(&function->stats, 0, sizeof(function->stats));
 	return function;
 }
 
 /* assign name to function object */
 void assignNameToFunction(function_t *function, char *name) {
     strcpy(function->name, name);
+    function->hash = functionNameHash(0, name);
 }
 
 /* assign rpc_handler to function object */
@@ -44,6 +90,26 @@ void assignRPCHandlerToFunction(function_t *function, rpc_handler handler) {
 	function->obj = handler;
 }
 
+/* assign rpc_batch_handler to function object */
+void assignBatchHandlerToFunction(function_t *function, rpc_batch_handler batch) {
+	function->batch = batch;
+}
+
+/* assign rpc_async_handler to function object */
+void assignAsyncHandlerToFunction(function_t *function, rpc_async_handler async) {
+	function->async = async;
+}
+
+/* assign rpc_stream_handler to function object */
+void assignStreamHandlerToFunction(function_t *function, rpc_stream_handler stream) {
+	function->stream = stream;
+}
+
+/* mark function as pure (its results may be cached) or not */
+void assignPureToFunction(function_t *function, int pure) {
+	function->pure = pure;
+}
+
 /* get function_id from function object */
 int getFidFunction(function_t *function) {
 	return function->id;
@@ -62,6 +128,11 @@ functionList_t *functionListCreate() {
 	functionList->function = malloc(size * sizeof(*(functionList->function)));
 	assert(functionList->function);
 	functionList->n = 0;
+	functionList->index_size = 2 * INIT_SIZE;
+	functionList->index = calloc(functionList->index_size, sizeof(*(functionList->index)));
+	assert(functionList->index);
+	functionList->frozen = NULL;
+	functionList->generation = 0;
 	return functionList;
 }
 
@@ -75,52 +146,326 @@ void functionListEnsureSize(functionList_t *functionList) {
 	}
 }
 
+/* find the index slot holding name, or the free slot where it belongs */
+static int indexProbe(functionList_t *functionList, char *name, uint32_t hash) {
+	int mask = functionList->index_size - 1;
+	int slot = hash & mask;
+	while (functionList->index[slot] != INDEX_EMPTY) {
+		function_t *function = functionList->function[functionList->index[slot] - 1];
+		if (function->hash == hash && strcmp(function->name, name) == 0) {
+			break;
+		}
+		slot = (slot + 1) & mask; // linear probing
+	}
+	return slot;
+}
+
+/* double the index once it is half full & re-insert every fid */
+static void indexEnsureSize(functionList_t *functionList) {
+	if (2 * (functionList->n + 1) <= functionList->index_size) {
+		return;
+	}
+	free(functionList->index);
+	functionList->index_size *= 2;
+	functionList->index = calloc(functionList->index_size, sizeof(*(functionList->index)));
+	assert(functionList->index);
+	for (int i = 0; i < functionList->n; i++) {
+		function_t *function = functionList->function[i];
+		functionList->index[indexProbe(functionList, function->name, function->hash)] = function->id;
+	}
+}
+
+/* drop the perfect hash, lookups go back to the open addressing index */
+static void frozenIndexFree(functionList_t *functionList) {
+	if (functionList->frozen != NULL) {
+		free(functionList->frozen->displacement);
+		free(functionList->frozen->fid);
+		free(functionList->frozen);
+		functionList->frozen = NULL;
+	}
+}
+
 /* check whether this function name is already exist in functionList or not
  * if YES, overwrite the existing function name with new function object (handler)
  * otherwise register this new function with new function name into functionList 
  */
 /* (inspired from sortedArrayInsert(...) COMP20003 W3.8 skeleton code) */
-void functionRegister(functionList_t *functionList, function_t *function) {
-    functionListEnsureSize(functionList);
-    int i;
-    // loop to check whether this function name is already registered or not
-    for (i = 0; i < functionList->n; i++) {
-        if (strcmp(function->name, functionList->function[i]->name) == 0) {
-            break;
-        } 
-    }
-    if (i == functionList->n) {
-        // add new function
-        function->id = i+1;
-        functionList->function[i] = function;
-        (functionList->n)++;
-    } else {
+int functionRegister(functionList_t *functionList, function_t *function) {
+    int slot = indexProbe(functionList, function->name, function->hash);
+    functionList->generation++;
+    if (functionList->index[slot] != INDEX_EMPTY) {
         // overwrite existing function_name with new function_obj (handler)
-        functionList->function[i]->obj = function->obj;
+        function_t *existing = functionList->function[functionList->index[slot] - 1];
+        existing->obj = function->obj;
+        existing->batch = function->batch;
+        existing->async = function->async;
+        existing->stream = function->stream;
+        existing->pure = function->pure;
+        functionFree(function);
+        return existing->id;
     }
+
+    // add new function, a new name invalidates the perfect hash
+    frozenIndexFree(functionList);
+    functionListEnsureSize(functionList);
+    indexEnsureSize(functionList);
+    function->id = functionList->n + 1;
+    functionList->function[functionList->n] = function;
+    (functionList->n)++;
+    functionList->index[indexProbe(functionList, function->name, function->hash)] = function->id;
+    return function->id;
+}
+
+/* try to place every bucket with displacements, buckets are tried largest first
+ * returns 0 on success, -1 if some bucket found no displacement
+ */
+static int frozenIndexBuild(functionList_t *functionList, frozenIndex_t *frozen, int *bucket_of, int *order) {
+	int n = frozen->n;
+	int *count = calloc(n, sizeof(*count));
+	int *start = calloc(n + 1, sizeof(*start));
+	int *members = malloc(n * sizeof(*members));
+	int *taken = malloc(n * sizeof(*taken));
+	assert(count && start && members && taken);
+
+	// group names by bucket (counting sort)
+	for (int i = 0; i < n; i++) {
+		count[bucket_of[i]]++;
+	}
+	for (int b = 0; b < n; b++) {
+		start[b + 1] = start[b] + count[b];
+		order[b] = b;
+	}
+	int *fill = calloc(n, sizeof(*fill));
+	assert(fill);
+	for (int i = 0; i < n; i++) {
+		members[start[bucket_of[i]] + fill[bucket_of[i]]++] = i;
+	}
+	free(fill);
+
+	// largest buckets first (insertion sort by count is enough for a one-off build)
+	for (int i = 1; i < n; i++) {
+		int b = order[i], j = i;
+		while (j > 0 && count[order[j - 1]] < count[b]) {
+			order[j] = order[j - 1];
+			j--;
+		}
+		order[j] = b;
+	}
+
+	for (int i = 0; i < n; i++) {
+		frozen->fid[i] = INDEX_EMPTY;
+	}
+	int status = 0;
+	int next_free = 0;
+	for (int i = 0; i < n && status == 0; i++) {
+		int b = order[i];
+		if (count[b] == 0) {
+			break;
+		}
+
+		if (count[b] == 1) {
+			// single name: any free slot will do
+			while (frozen->fid[next_free] != INDEX_EMPTY) {
+				next_free++;
+			}
+			frozen->displacement[b] = -next_free - 1;
+			frozen->fid[next_free] = members[start[b]] + 1;
+			continue;
+		}
+
+		// several names: search a seed sending all of them to distinct free slots
+		int seed;
+		for (seed = 1; seed < FUNCTION_MAX_DISPLACEMENT; seed++) {
+			int k;
+			for (k = 0; k < count[b]; k++) {
+				function_t *function = functionList->function[members[start[b] + k]];
+				int slot = functionNameHash(seed, function->name) % n;
+				int clash = frozen->fid[slot] != INDEX_EMPTY;
+				for (int j = 0; j < k && !clash; j++) {
+					clash = taken[j] == slot;
+				}
+				if (clash) {
+					break;
+				}
+				taken[k] = slot;
+			}
+			if (k == count[b]) {
+				break;
+			}
+		}
+		if (seed == FUNCTION_MAX_DISPLACEMENT) {
+			status = -1;
+			break;
+		}
+		frozen->displacement[b] = seed;
+		for (int k = 0; k < count[b]; k++) {
+			frozen->fid[taken[k]] = members[start[b] + k] + 1;
+		}
+	}
+
+	free(count);
+	free(start);
+	free(members);
+	free(taken);
+	return status;
+}
+
+/* build a perfect hash over the registered names, so searchFunction does a single probe */
+int functionListFreeze(functionList_t *functionList) {
+	frozenIndexFree(functionList);
+	int n = functionList->n;
+	if (n == 0) {
+		return 0;
+	}
+
+	frozenIndex_t *frozen = malloc(sizeof(*frozen));
+	assert(frozen);
+	frozen->n = n;
+	frozen->displacement = calloc(n, sizeof(*(frozen->displacement)));
+	frozen->fid = malloc(n * sizeof(*(frozen->fid)));
+	int *bucket_of = malloc(n * sizeof(*bucket_of));
+	int *order = malloc(n * sizeof(*order));
+	assert(frozen->displacement && frozen->fid && bucket_of && order);
+	for (int i = 0; i < n; i++) {
+		bucket_of[i] = functionList->function[i]->hash % n;
+	}
+
+	int status = frozenIndexBuild(functionList, frozen, bucket_of, order);
+	free(bucket_of);
+	free(order);
+	functionList->frozen = frozen;
+	if (status < 0) {
+		frozenIndexFree(functionList);
+	}
+	return status;
 }
 
 /* search for matched function obj from functionList by function name
  * otherwise return 0 (not found)
  */
 int searchFunction(functionList_t *functionList, char *name) {
-    for (int i = 0; i < functionList->n; i++) {
-        if (strcmp(name, functionList->function[i]->name) == 0) {
-            return functionList->function[i]->id;
-        }
+    uint32_t hash = functionNameHash(0, name);
+    frozenIndex_t *frozen = functionList->frozen;
+    int fid;
+    if (frozen != NULL) {
+        int displacement = frozen->displacement[hash % frozen->n];
+        int slot = displacement < 0 ? -displacement - 1 : (int)(functionNameHash(displacement, name) % frozen->n);
+        fid = frozen->fid[slot];
+    } else {
+        fid = functionList->index[indexProbe(functionList, name, hash)];
     }
-    return 0;
+
+    // a perfect hash maps unknown names somewhere too, so always confirm the name
+    if (fid == INDEX_EMPTY || strcmp(functionList->function[fid - 1]->name, name) != 0) {
+        return 0;
+    }
+    return fid;
 }
 
-/* get function obj (rpc_handler) from functionList using fid */
+/* get function obj (rpc_handler) from functionList using fid
+ * returns NULL for an unknown fid
+ */
 rpc_handler getHandlerFunctionList(functionList_t *functionList, int fid) {
+    if (fid < 1 || fid > functionList->n) {
+        return NULL;
+    }
     return functionList->function[fid-1]->obj;
 }
 
+/* get the number of registered functions, fids run from 1 to this number */
+int functionListSize(functionList_t *functionList) {
+    return functionList->n;
+}
+
+/* get the name of fid from functionList, NULL for an unknown fid */
+char *getNameFunctionList(functionList_t *functionList, int fid) {
+    if (fid < 1 || fid > functionList->n) {
+        return NULL;
+    }
+    return functionList->function[fid-1]->name;
+}
+
+/* get the counters of fid from functionList, NULL for an unknown fid */
+functionStats_t *getStatsFunctionList(functionList_t *functionList, int fid) {
+    if (fid < 1 || fid > functionList->n) {
+        return NULL;
+    }
+    return &functionList->function[fid-1]->stats;
+}
+
+/* get the registry generation, it changes whenever a function is registered */
+uint32_t functionListGeneration(functionList_t *functionList) {
+    return functionList->generation;
+}
+
+/* get the rpc_batch_handler of fid from functionList
+ * returns NULL for an unknown fid or a function registered without one
+ */
+rpc_batch_handler getBatchHandlerFunctionList(functionList_t *functionList, int fid) {
+    if (fid < 1 || fid > functionList->n) {
+        return NULL;
+    }
+    return functionList->function[fid-1]->batch;
+}
+
+/* set the number of calls to fid that may be admitted at once, 0 for no limit */
+void setMaxActiveFunctionList(functionList_t *functionList, int fid, unsigned max_active) {
+    if (fid >= 1 && fid <= functionList->n) {
+        functionList->function[fid-1]->max_active = max_active;
+    }
+}
+
+/* admit a call to fid unless it already has max_active calls in progress */
+int admitFunctionList(functionList_t *functionList, int fid) {
+    if (fid < 1 || fid > functionList->n || functionList->function[fid-1]->max_active == 0) {
+        return 0;
+    }
+    function_t *function = functionList->function[fid-1];
+    if (__atomic_add_fetch(&function->active, 1, __ATOMIC_RELAXED) > function->max_active) {
+        __atomic_sub_fetch(&function->active, 1, __ATOMIC_RELAXED);
+        return -1;
+    }
+    return 0;
+}
+
+/* a call admitted by admitFunctionList has been answered */
+void releaseFunctionList(functionList_t *functionList, int fid) {
+    if (fid >= 1 && fid <= functionList->n && functionList->function[fid-1]->max_active > 0) {
+        __atomic_sub_fetch(&functionList->function[fid-1]->active, 1, __ATOMIC_RELAXED);
+    }
+}
+
+/* get the rpc_async_handler of fid from functionList
+ * returns NULL for an unknown fid or a function registered without one
+ */
+rpc_async_handler getAsyncHandlerFunctionList(functionList_t *functionList, int fid) {
+    if (fid < 1 || fid > functionList->n) {
+        return NULL;
+    }
+    return functionList->function[fid-1]->async;
+}
+
+/* get the rpc_stream_handler of fid from functionList
+ * returns NULL for an unknown fid or a function registered without one
+ */
+rpc_stream_handler getStreamHandlerFunctionList(functionList_t *functionList, int fid) {
+    if (fid < 1 || fid > functionList->n) {
+        return NULL;
+    }
+    return functionList->function[fid-1]->stream;
+}
+
+/* check whether fid was registered with rpc_register_pure, 0 for an unknown fid */
+int isPureFunctionList(functionList_t *functionList, int fid) {
+    if (fid < 1 || fid > functionList->n) {
+        return 0;
+    }
+    return functionList->function[fid-1]->pure;
+}
+
 /* free function */
 void functionFree(function_t *function) {
     free(function->name);
-    free(function->obj);
     free(function);
 }
 
@@ -129,5 +474,8 @@ void functionListFree(functionList_t *functionList) {
     for (int i = 0; i < functionList->n; i++) {
         functionFree(functionList->function[i]);
     }
+    frozenIndexFree(functionList);
+    free(functionList->index);
+    free(functionList->function);
     free(functionList);
 }
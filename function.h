@@ -1,19 +1,27 @@
 #ifndef FUNCTION_H
 #define FUNCTION_H
+#include <stdint.h>
 #include "rpc.h"
+#include "rpc_ext.h"
+#include "stats.h"
 
 #define INIT_SIZE 2
+// seeds tried per bucket before functionListFreeze gives up
+#define FUNCTION_MAX_DISPLACEMENT 100000
 
 // data definitions
 typedef struct function function_t;
 typedef struct functionList functionList_t;
 
+/* FNV-1a hash of a function name, seed 0 is the hash used by functionList */
+uint32_t functionNameHash(uint32_t seed, const char *name);
+
 /* ------------------ */
 /* function procedure */
 /* ------------------ */
 
 /* creates & returns an empty function node */
-function_t *functionCreate();
+function_t *functionCreate(int name_len);
 
 /* assign name to function object */
 void assignNameToFunction(function_t *function, char *name);
@@ -21,6 +29,18 @@ void assignNameToFunction(function_t *function, char *name);
 /* assign rpc_handler to function object */
 void assignRPCHandlerToFunction(function_t *function, rpc_handler handler);
 
+/* assign rpc_batch_handler to function object */
+void assignBatchHandlerToFunction(function_t *function, rpc_batch_handler batch);
+
+/* assign rpc_async_handler to function object */
+void assignAsyncHandlerToFunction(function_t *function, rpc_async_handler async);
+
+/* assign rpc_stream_handler to function object */
+void assignStreamHandlerToFunction(function_t *function, rpc_stream_handler stream);
+
+/* mark function as pure (its results may be cached) or not */
+void assignPureToFunction(function_t *function, int pure);
+
 /* get function_id from function object */
 int getFidFunction(function_t *function);
 
@@ -37,19 +57,75 @@ void functionListEnsureSize(functionList_t *functionList);
 
 /* check whether this function name is already exist in functionList or not
  * if YES, overwrite the existing function name with new function object (handler)
+ * & free the new function object
  * otherwise register this new function with new function name into functionList 
+ * names are indexed by a hash table, so registering is O(1) on average
+ * returns the fid of the name
  */
 /* (inspired from sortedArrayInsert(...) COMP20003 W3.8 skeleton code) */
-void functionRegister(functionList_t *functionList, function_t *function);
+int functionRegister(functionList_t *functionList, function_t *function);
+
+/* build a perfect hash over the names registered so far, later searchFunction
+ * calls cost a single probe; registering a new name drops it again
+ * returns 0 on success, -1 if no perfect hash was found (the hash table keeps serving)
+ */
+int functionListFreeze(functionList_t *functionList);
 
 /* search for matched function obj from functionList by function name
  * otherwise return 0 (not found)
  */
 int searchFunction(functionList_t *functionList, char *name);
 
-/* get function obj (rpc_handler) from functionList using fid */
+/* get function obj (rpc_handler) from functionList using fid
+ * returns NULL for an unknown fid
+ */
 rpc_handler getHandlerFunctionList(functionList_t *functionList, int fid);
 
+/* get the number of registered functions, fids run from 1 to this number */
+int functionListSize(functionList_t *functionList);
+
+/* get the name of fid from functionList, NULL for an unknown fid */
+char *getNameFunctionList(functionList_t *functionList, int fid);
+
+/* get the counters of fid from functionList, NULL for an unknown fid */
+functionStats_t *getStatsFunctionList(functionList_t *functionList, int fid);
+
+/* get the registry generation, it changes whenever a function is registered
+ * (clients compare it to know when their cached fids may be stale)
+ */
+uint32_t functionListGeneration(functionList_t *functionList);
+
+/* get the rpc_batch_handler of fid from functionList
+ * returns NULL for an unknown fid or a function registered without one
+ */
+rpc_batch_handler getBatchHandlerFunctionList(functionList_t *functionList, int fid);
+
+/* set the number of calls to fid that may be admitted at once, 0 for no limit
+ * (set before serving: calls admitted under one cap are released under the same one)
+ */
+void setMaxActiveFunctionList(functionList_t *functionList, int fid, unsigned max_active);
+
+/* admit a call to fid unless it already has max_active calls in progress
+ * returns 0 if admitted (release it with releaseFunctionList), -1 if at the cap
+ */
+int admitFunctionList(functionList_t *functionList, int fid);
+
+/* a call admitted by admitFunctionList has been answered */
+void releaseFunctionList(functionList_t *functionList, int fid);
+
+/* get the rpc_async_handler of fid from functionList
+ * returns NULL for an unknown fid or a function registered without one
+ */
+rpc_async_handler getAsyncHandlerFunctionList(functionList_t *functionList, int fid);
+
+/* get the rpc_stream_handler of fid from functionList
+ * returns NULL for an unknown fid or a function registered without one
+ */
+rpc_stream_handler getStreamHandlerFunctionList(functionList_t *functionList, int fid);
+
+/* check whether fid was registered with rpc_register_pure, 0 for an unknown fid */
+int isPureFunctionList(functionList_t *functionList, int fid);
+
 /* free function */
 void functionFree(function_t *function);
 
@@ -0,0 +1,178 @@
+#include <stdint.h>
+#include <string.h>
+#include "lz.h"
+
+// matches end at least this far from the end of the input, which is left as literals
+#define LZ_LAST_LITERALS 5
+// no match starts in the last LZ_MATCH_LIMIT bytes
+#define LZ_MATCH_LIMIT 12
+// the search step grows by one for every 2^LZ_SKIP_SHIFT bytes without a match
+#define LZ_SKIP_SHIFT 6
+
+static uint32_t lzRead32(const char *ptr) {
+	uint32_t value;
+	memcpy(&value, ptr, sizeof(value));
+	return value;
+}
+
+static uint64_t lzRead64(const char *ptr) {
+	uint64_t value;
+	memcpy(&value, ptr, sizeof(value));
+	return value;
+}
+
+static uint32_t lzHash(uint32_t sequence) {
+	return (sequence * 2654435761U) >> (32 - LZ_HASH_BITS);
+}
+
+/* bytes needed to write length (beyond the nibble of the token) */
+static size_t lzLengthSize(size_t length) {
+	return length < 15 ? 0 : (length - 15) / 255 + 1;
+}
+
+/* write the extra bytes of a length that did not fit its nibble */
+static char *lzWriteLength(char *op, size_t length) {
+	if (length < 15) {
+		return op;
+	}
+	length -= 15;
+	while (length >= 255) {
+		*op++ = (char)255;
+		length -= 255;
+	}
+	*op++ = (char)length;
+	return op;
+}
+
+/* append one sequence: literals, then a match unless match_len is 0 (last sequence) */
+/* RETURNS: new end of output, NULL if it would pass end */
+static char *lzWriteSequence(char *op, char *end, const char *literals, size_t literal_len, size_t offset,
+size_t match_len) {
+	size_t match_code = match_len > 0 ? match_len - LZ_MIN_MATCH : 0;
+	size_t needed = 1 + lzLengthSize(literal_len) + literal_len + (match_len > 0 ? 2 + lzLengthSize(match_code) : 0);
+	if (needed > (size_t)(end - op)) {
+		return NULL;
+	}
+	*op++ = (char)(((literal_len < 15 ? literal_len : 15) << 4) | (match_code < 15 ? match_code : 15));
+	op = lzWriteLength(op, literal_len);
+	memcpy(op, literals, literal_len);
+	op += literal_len;
+	if (match_len > 0) {
+		*op++ = (char)(offset & 0xFF);
+		*op++ = (char)(offset >> 8);
+		op = lzWriteLength(op, match_code);
+	}
+	return op;
+}
+
+/* compress src into dst, giving up as soon as the output would exceed cap */
+size_t lzCompress(const char *src, size_t len, char *dst, size_t cap) {
+	uint32_t table[1 << LZ_HASH_BITS];
+	memset(table, 0, sizeof(table));
+	char *op = dst, *end = dst + cap;
+	size_t anchor = 0, ip = 0;
+
+	if (len > LZ_MATCH_LIMIT) {
+		size_t limit = len - LZ_MATCH_LIMIT;
+		while (ip < limit) {
+			uint32_t sequence = lzRead32(src + ip);
+			uint32_t hash = lzHash(sequence);
+			size_t ref = table[hash];
+			table[hash] = ip;
+			if (ref >= ip || ip - ref > LZ_MAX_OFFSET || lzRead32(src + ref) != sequence) {
+				// accelerate through data that does not match
+				ip += 1 + ((ip - anchor) >> LZ_SKIP_SHIFT);
+				continue;
+			}
+
+			// extend the match a word at a time, then byte by byte
+			size_t match_len = LZ_MIN_MATCH;
+			size_t match_end = len - LZ_LAST_LITERALS;
+			while (ip + match_len + sizeof(uint64_t) <= match_end &&
+			lzRead64(src + ref + match_len) == lzRead64(src + ip + match_len)) {
+				match_len += sizeof(uint64_t);
+			}
+			while (ip + match_len < match_end && src[ref + match_len] == src[ip + match_len]) {
+				match_len++;
+			}
+			op = lzWriteSequence(op, end, src + anchor, ip - anchor, ip - ref, match_len);
+			if (op == NULL) {
+				return 0;
+			}
+			ip += match_len;
+			anchor = ip;
+		}
+	}
+
+	op = lzWriteSequence(op, end, src + anchor, len - anchor, 0, 0);
+	return op == NULL ? 0 : (size_t)(op - dst);
+}
+
+/* read the extra bytes of a length whose nibble was 15 */
+/* RETURNS: 0 on success, -1 if src ends first */
+static int lzReadLength(const unsigned char **ip, const unsigned char *end, size_t *length) {
+	if (*length < 15) {
+		return 0;
+	}
+	unsigned char byte;
+	do {
+		if (*ip >= end) {
+			return -1;
+		}
+		byte = *(*ip)++;
+		*length += byte;
+	} while (byte == 255);
+	return 0;
+}
+
+/* decompress src into dst (or only check it when dst is NULL) */
+int lzDecompress(const char *src, size_t len, char *dst, size_t dst_len) {
+	const unsigned char *ip = (const unsigned char *)src, *end = ip + len;
+	size_t out = 0;
+	while (ip < end) {
+		unsigned char token = *ip++;
+		size_t literal_len = token >> 4;
+		if (lzReadLength(&ip, end, &literal_len) < 0 || literal_len > (size_t)(end - ip) ||
+		literal_len > dst_len - out) {
+			return -1;
+		}
+		if (dst != NULL) {
+			memcpy(dst + out, ip, literal_len);
+		}
+		ip += literal_len;
+		out += literal_len;
+		if (ip == end) {
+			// the last sequence has no match
+			break;
+		}
+
+		if (end - ip < 2) {
+			return -1;
+		}
+		size_t offset = ip[0] | (size_t)ip[1] << 8;
+		ip += 2;
+		size_t match_len = token & 0x0F;
+		if (lzReadLength(&ip, end, &match_len) < 0) {
+			return -1;
+		}
+		match_len += LZ_MIN_MATCH;
+		if (offset == 0 || offset > out || match_len > dst_len - out) {
+			return -1;
+		}
+		if (dst != NULL) {
+			// the match may overlap the bytes it produces: everything from ref on repeats
+			// with period offset, so each copy can take twice as much as the one before
+			char *op = dst + out, *ref = op - offset;
+			for (size_t copied = 0; copied < match_len;) {
+				size_t chunk = offset + copied;
+				if (chunk > match_len - copied) {
+					chunk = match_len - copied;
+				}
+				memcpy(op + copied, ref, chunk);
+				copied += chunk;
+			}
+		}
+		out += match_len;
+	}
+	return out == dst_len ? 0 : -1;
+}
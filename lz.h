@@ -0,0 +1,31 @@
+#ifndef LZ_H
+#define LZ_H
+#include <stddef.h>
+
+/* LZ4-style block codec: a stream of sequences, each made of a token byte (literal
+ * length in the high nibble, match length - LZ_MIN_MATCH in the low one, 15 meaning
+ * more length bytes follow), the literals, then a 16-bit little-endian match offset
+ * the last sequence only has literals
+ */
+#define LZ_MIN_MATCH 4
+#define LZ_MAX_OFFSET 65535
+// hash table of the compressor, 4 bytes per entry
+#define LZ_HASH_BITS 14
+
+/* --------------- */
+/* lz procedure    */
+/* --------------- */
+
+/* compress src (len bytes) into dst, giving up as soon as the output would exceed cap,
+ * so asking for a smaller cap than len also bounds the time spent on incompressible data
+ * returns the compressed size, 0 if it does not fit in cap
+ */
+size_t lzCompress(const char *src, size_t len, char *dst, size_t cap);
+
+/* decompress src (len bytes) into dst, which must receive exactly dst_len bytes
+ * dst may be NULL to only check that src is well-formed
+ * returns 0 on success, -1 if src is malformed or does not produce dst_len bytes
+ */
+int lzDecompress(const char *src, size_t len, char *dst, size_t dst_len);
+
+#endif
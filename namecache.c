@@ -0,0 +1,113 @@
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include "namecache.h"
+#include "function.h"
+
+typedef struct nameEntry {
+    char *name; // NULL for a free slot
+    uint32_t hash;
+    int fid;
+} nameEntry_t;
+
+/* open addressing table, kept at most half full */
+struct nameCache {
+    nameEntry_t *entry;
+    int size; // power of two
+    int n;
+    int has_generation;
+    uint32_t generation;
+};
+
+/* creates & returns an empty name -> fid cache */
+nameCache_t *nameCacheCreate() {
+	nameCache_t *cache = malloc(sizeof(*cache));
+	assert(cache);
+	cache->size = NAMECACHE_INIT_SIZE;
+	cache->entry = calloc(cache->size, sizeof(*(cache->entry)));
+	assert(cache->entry);
+	cache->n = 0;
+	cache->has_generation = 0;
+	cache->generation = 0;
+	return cache;
+}
+
+/* find the slot holding name, or the free slot where it belongs */
+static nameEntry_t *nameCacheProbe(nameCache_t *cache, const char *name, uint32_t hash) {
+	int mask = cache->size - 1;
+	int slot = hash & mask;
+	while (cache->entry[slot].name != NULL) {
+		if (cache->entry[slot].hash == hash && strcmp(cache->entry[slot].name, name) == 0) {
+			break;
+		}
+		slot = (slot + 1) & mask; // linear probing
+	}
+	return &cache->entry[slot];
+}
+
+/* get the cached fid of name, 0 if it is not cached */
+int nameCacheLookup(nameCache_t *cache, const char *name) {
+	return nameCacheProbe(cache, name, functionNameHash(0, name))->fid;
+}
+
+/* double the table once it is half full & re-insert every entry */
+static void nameCacheEnsureSize(nameCache_t *cache) {
+	if (2 * (cache->n + 1) <= cache->size) {
+		return;
+	}
+	nameEntry_t *old = cache->entry;
+	int old_size = cache->size;
+	cache->size *= 2;
+	cache->entry = calloc(cache->size, sizeof(*(cache->entry)));
+	assert(cache->entry);
+	for (int i = 0; i < old_size; i++) {
+		if (old[i].name != NULL) {
+			*nameCacheProbe(cache, old[i].name, old[i].hash) = old[i];
+		}
+	}
+	free(old);
+}
+
+/* remember the fid of name, fid 0 (not found) is never cached */
+void nameCacheInsert(nameCache_t *cache, const char *name, int fid) {
+	if (fid == 0) {
+		return;
+	}
+	uint32_t hash = functionNameHash(0, name);
+	nameEntry_t *entry = nameCacheProbe(cache, name, hash);
+	if (entry->name == NULL) {
+		nameCacheEnsureSize(cache);
+		entry = nameCacheProbe(cache, name, hash);
+		entry->name = strdup(name);
+		assert(entry->name);
+		entry->hash = hash;
+		cache->n++;
+	}
+	entry->fid = fid;
+}
+
+/* record the registry generation reported by the server */
+void nameCacheSetGeneration(nameCache_t *cache, uint32_t generation) {
+	if (cache->has_generation && cache->generation != generation) {
+		nameCacheClear(cache);
+	}
+	cache->has_generation = 1;
+	cache->generation = generation;
+}
+
+/* drop every cached fid */
+void nameCacheClear(nameCache_t *cache) {
+	for (int i = 0; i < cache->size; i++) {
+		free(cache->entry[i].name);
+		cache->entry[i].name = NULL;
+		cache->entry[i].fid = 0;
+	}
+	cache->n = 0;
+}
+
+/* free nameCache */
+void nameCacheFree(nameCache_t *cache) {
+	nameCacheClear(cache);
+	free(cache->entry);
+	free(cache);
+}
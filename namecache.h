@@ -0,0 +1,34 @@
+#ifndef NAMECACHE_H
+#define NAMECACHE_H
+#include <stdint.h>
+
+#define NAMECACHE_INIT_SIZE 64
+
+// data definitions
+typedef struct nameCache nameCache_t;
+
+/* ------------------- */
+/* nameCache procedure */
+/* ------------------- */
+
+/* creates & returns an empty name -> fid cache (client side of rpc_find) */
+nameCache_t *nameCacheCreate();
+
+/* get the cached fid of name, 0 if it is not cached */
+int nameCacheLookup(nameCache_t *cache, const char *name);
+
+/* remember the fid of name, fid 0 (not found) is never cached */
+void nameCacheInsert(nameCache_t *cache, const char *name, int fid);
+
+/* record the registry generation reported by the server, every cached fid is
+ * dropped when it differs from the one the cache was filled under
+ */
+void nameCacheSetGeneration(nameCache_t *cache, uint32_t generation);
+
+/* drop every cached fid */
+void nameCacheClear(nameCache_t *cache);
+
+/* free nameCache */
+void nameCacheFree(nameCache_t *cache);
+
+#endif
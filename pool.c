@@ -0,0 +1,169 @@
+#include <stdlib.h>
+#include <stdint.h>
+#include <assert.h>
+#include <malloc.h>
+#include <pthread.h>
+#include "pool.h"
+
+/* a free block holds the next block of its list in its first word
+ * & the first block of a magazine links to the next magazine in its second word
+ */
+typedef struct freeBlock {
+    struct freeBlock *next;
+    struct freeBlock *next_magazine;
+} freeBlock_t;
+
+/* per-thread free list of one size class, at most two magazines long */
+typedef struct poolClass {
+    freeBlock_t *head;
+    int count;
+} poolClass_t;
+
+typedef struct poolCache {
+    poolClass_t classes[POOL_CLASSES];
+} poolCache_t;
+
+/* magazines given up by threads holding more blocks than they need */
+typedef struct poolDepot {
+    pthread_mutex_t lock;
+    freeBlock_t *magazines;
+    int count;
+} poolDepot_t;
+
+static poolDepot_t depot[POOL_CLASSES];
+static pthread_key_t cache_key;
+static pthread_once_t cache_once = PTHREAD_ONCE_INIT;
+static __thread poolCache_t *thread_cache;
+
+/* number of blocks in a magazine of size class c */
+static int poolMagazineSize(int c) {
+	int blocks = POOL_MAGAZINE_BYTES >> (c + POOL_MIN_SHIFT);
+	return blocks < 2 ? 2 : blocks > 64 ? 64 : blocks;
+}
+
+/* release every block cached by a thread that exits */
+static void poolCacheDestroy(void *arg) {
+	poolCache_t *cache = arg;
+	for (int c = 0; c < POOL_CLASSES; c++) {
+		freeBlock_t *block = cache->classes[c].head;
+		while (block != NULL) {
+			freeBlock_t *next = block->next;
+			free(block);
+			block = next;
+		}
+	}
+	free(cache);
+}
+
+static void poolCacheKeyCreate() {
+	pthread_key_create(&cache_key, poolCacheDestroy);
+	for (int c = 0; c < POOL_CLASSES; c++) {
+		pthread_mutex_init(&depot[c].lock, NULL);
+		depot[c].magazines = NULL;
+		depot[c].count = 0;
+	}
+}
+
+/* get the calling thread's cache, created on first use */
+static poolCache_t *poolThreadCache() {
+	if (thread_cache == NULL) {
+		pthread_once(&cache_once, poolCacheKeyCreate);
+		thread_cache = calloc(1, sizeof(*thread_cache));
+		assert(thread_cache);
+		pthread_setspecific(cache_key, thread_cache);
+	}
+	return thread_cache;
+}
+
+/* smallest class holding size bytes, -1 if none does */
+static int poolClassOf(size_t size) {
+	int c = 0;
+	while (c < POOL_CLASSES && ((size_t)1 << (c + POOL_MIN_SHIFT)) < size) {
+		c++;
+	}
+	return c < POOL_CLASSES ? c : -1;
+}
+
+/* allocate size bytes from the calling thread's cache of recycled blocks */
+void *poolAlloc(size_t size) {
+	int c = poolClassOf(size);
+	if (c < 0) {
+		void *ptr = malloc(size);
+		assert(ptr);
+		return ptr;
+	}
+
+	poolClass_t *class = &poolThreadCache()->classes[c];
+	if (class->head == NULL) {
+		// refill from the depot, one magazine at a time
+		pthread_mutex_lock(&depot[c].lock);
+		freeBlock_t *magazine = depot[c].magazines;
+		if (magazine != NULL) {
+			depot[c].magazines = magazine->next_magazine;
+			depot[c].count--;
+		}
+		pthread_mutex_unlock(&depot[c].lock);
+		if (magazine == NULL) {
+			void *ptr = malloc((size_t)1 << (c + POOL_MIN_SHIFT));
+			assert(ptr);
+			return ptr;
+		}
+		class->head = magazine;
+		class->count = poolMagazineSize(c);
+	}
+
+	freeBlock_t *block = class->head;
+	class->head = block->next;
+	class->count--;
+	return block;
+}
+
+/* hand ptr back to the calling thread's cache */
+void poolFree(void *ptr) {
+	if (ptr == NULL) {
+		return;
+	}
+
+	// the class is derived from the real block size, so blocks from plain malloc(3) fit too
+	size_t usable = malloc_usable_size(ptr);
+	if (usable < ((size_t)1 << POOL_MIN_SHIFT) || usable >= ((size_t)2 << POOL_MAX_SHIFT)) {
+		free(ptr);
+		return;
+	}
+	int c = POOL_CLASSES - 1;
+	while (((size_t)1 << (c + POOL_MIN_SHIFT)) > usable) {
+		c--;
+	}
+
+	poolClass_t *class = &poolThreadCache()->classes[c];
+	int magazine_size = poolMagazineSize(c);
+	if (class->count == 2 * magazine_size) {
+		// pass one magazine on to the depot, or back to free(3) if the depot is full too
+		freeBlock_t *magazine = class->head, *last = magazine;
+		for (int i = 1; i < magazine_size; i++) {
+			last = last->next;
+		}
+		class->head = last->next;
+		class->count -= magazine_size;
+		last->next = NULL;
+
+		pthread_mutex_lock(&depot[c].lock);
+		int keep = depot[c].count < POOL_DEPOT_MAGAZINES;
+		if (keep) {
+			magazine->next_magazine = depot[c].magazines;
+			depot[c].magazines = magazine;
+			depot[c].count++;
+		}
+		pthread_mutex_unlock(&depot[c].lock);
+		while (!keep && magazine != NULL) {
+			freeBlock_t *next = magazine->next;
+			free(magazine);
+			magazine = next;
+		}
+	}
+
+	freeBlock_t *block = ptr;
+	block->next = class->head;
+	class->head = block;
+	class->count++;
+}
@@ -0,0 +1,29 @@
+#ifndef POOL_H
+#define POOL_H
+#include <stddef.h>
+
+// size classes are powers of two from 16 bytes up to LARGE_PAYLOAD_SIZE
+#define POOL_MIN_SHIFT 4
+#define POOL_MAX_SHIFT 16
+#define POOL_CLASSES (POOL_MAX_SHIFT - POOL_MIN_SHIFT + 1)
+// blocks moved between a thread cache & the shared depot at once, in bytes
+#define POOL_MAGAZINE_BYTES (64 * 1024)
+// magazines the shared depot keeps per size class before handing blocks back to free(3)
+#define POOL_DEPOT_MAGAZINES 32
+
+/* -------------- */
+/* pool procedure */
+/* -------------- */
+
+/* allocate size bytes from the calling thread's cache of recycled blocks
+ * every block comes from malloc(3) in the first place, so it may still be released
+ * with free(3), & sizes beyond the largest class go straight to malloc(3)
+ */
+void *poolAlloc(size_t size);
+
+/* hand ptr (from poolAlloc or malloc(3), may be NULL) back to the calling thread's cache,
+ * a full cache passes a magazine of blocks to the depot shared by every thread
+ */
+void poolFree(void *ptr);
+
+#endif
@@ -1,4 +1,4 @@
-#define _POSIX_C_SOURCE 200112L
+#define _GNU_SOURCE
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -6,13 +6,33 @@
 #include <assert.h>
 #include <string.h>
 #include <arpa/inet.h>
-#include <sys/select.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/un.h>
+#include <sys/stat.h>
+#include <sys/eventfd.h>
+#include <fcntl.h>
+#include <errno.h>
 #include <netdb.h>
+#include <netinet/tcp.h>
 #include <unistd.h>
 #include <ctype.h>
 #include <inttypes.h>
+#include <pthread.h>
+#include <poll.h>
 #include "rpc.h"
+#include "rpc_ext.h"
 #include "function.h"
+#include "frame.h"
+#include "buffer.h"
+#include "connection.h"
+#include "workqueue.h"
+#include "namecache.h"
+#include "pool.h"
+#include "trace.h"
+#include "shm.h"
+#include "uring.h"
+#include "cache.h"
 
 #define MIN_PORT_VALUE 0
 #define MAX_PORT_VALUE 99999
@@ -20,36 +40,162 @@
 #define MAX_FNAME_LEN 1000
 #define MIN_FNAME_ASCII 32
 #define MAX_FNAME_ASCII 126
-#define RPC_FIND_FLAG 1
-#define RPC_CALL_FLAG 2
-#define RPC_CLOSE_CLIENT_FLAG 0
-#define HEADER_BUFFER_SIZE (2 * sizeof(uint16_t))
-#define UINT16_SIZE sizeof(uint16_t)
-#define UINT32_SIZE sizeof(uint32_t)
-#define UINT64_SIZE sizeof(uint64_t)
-#define RPC_DATA_NULL_DATA2_SIZE UINT64_SIZE
-
-void loadRPCDataToBuffer(rpc_data *payload, char *buffer_pointer);
-void extractRPCDataFromBuffer(rpc_data *payload, char *buffer_pointer, uint32_t payload_len);
-uint64_t hton64bit(uint64_t data);
-uint64_t n64bittoh(uint64_t data);
+// names starting with this prefix are kept for built-in functions such as RPC_STATS_FUNCTION
+#define RESERVED_FNAME_PREFIX "__"
+// longest line of the RPC_STATS_FUNCTION report: a name & 14 numbers
+#define STATS_LINE_MAX (MAX_FNAME_LEN + 14 * 21 + 1)
+#define MAX_EPOLL_EVENTS 1024
+// io_uring event loops: submission & completion slots, then the provided receive buffers
+#define URING_ENTRIES 256
+#define URING_CQ_ENTRIES 4096
+#define URING_BUFFERS 256
+#define URING_BUFFER_SIZE 16384
+// user_data of an io_uring request: the object it is for, tagged with its kind in the low bits
+#define URING_ACCEPT 0 // reactor_t (TCP port) or listener_t, NULL for a cancel request
+#define URING_RECV 1   // connection_t
+#define URING_POLL 2   // connection_t
+#define URING_SEND 3   // connection_t
+#define URING_KIND_MASK 3
+// rpc_call sends its request & starts receiving with a single io_uring_enter
+#define CLIENT_URING_ENTRIES 4
+#define CLIENT_READ_SIZE 16384
+#define CLIENT_PENDING_INIT_SIZE 16
+#define CLIENT_SLOT_MASK 0xFFFF
+// names resolved per rpc_find_many request (the count travels as a uint16_t)
+#define CLIENT_FIND_MANY_MAX 0xFFFF
+// endpoints a rpc_call_multi is sent to (hedges aside) before it gives up
+#define MULTI_MAX_ATTEMPTS 3
+// a rpc_client_multi endpoint that is down is reconnected at most once per second
+#define MULTI_RETRY_NS 1000000000ull
+// a new latency weighs 1/8 in the smoothed latency of an endpoint, which halves every
+// 100 ms it goes without one (so an endpoint that had a slow spell is tried again)
+#define MULTI_EWMA_SHIFT 3
+#define MULTI_DECAY_NS 100000000ull
+// an overload reply counts as a latency this many times the smoothed one
+#define MULTI_OVERLOAD_PENALTY 4
+// hedging delay: quantile of the latencies of the last window of calls, once enough are known
+#define HEDGE_QUANTILE 0.95
+#define HEDGE_WINDOW 1024
+#define HEDGE_MIN_SAMPLES 32
+// listening sockets rpc_listen may add next to the TCP port
+#define MAX_LISTENERS 16
+// address schemes of rpc_listen & rpc_init_client, any other address is a TCP host
+#define UNIX_SCHEME "unix:"
+#define SHM_SCHEME "shm:"
+
+// data2 size from which payloads are sent compressed, 0 while compression is off
+static size_t compress_min_size = 0;
+// I/O backend of the servers & clients initialised from now on, see rpc_set_io_backend
+static int io_backend = RPC_IO_EPOLL;
+// wire protocol the clients initialised from now on offer, see rpc_set_wire_version
+static int wire_version = RPC_WIRE_V2;
+
+/* listening socket added by rpc_listen */
+typedef struct listener {
+	int sockfd;
+	int shm; // accepted connections move their bytes through shared-memory rings
+} listener_t;
+
+/* threshold set by rpc_set_compression, read by every thread */
+static size_t compressionMinSize(void) {
+	return __atomic_load_n(&compress_min_size, __ATOMIC_RELAXED);
+}
+
+/* backend set by rpc_set_io_backend */
+static int ioBackend(void) {
+	return __atomic_load_n(&io_backend, __ATOMIC_RELAXED);
+}
+
+/* version set by rpc_set_wire_version */
+static int wireVersion(void) {
+	return __atomic_load_n(&wire_version, __ATOMIC_RELAXED);
+}
 
 struct rpc_server {
+    int port;
     int sockfd;
-    fd_set masterfds;
-    int maxfd;
+    int epollfd;
     functionList_t *functionList;
+    workQueue_t *jobs;
+    int stats_fid; // built-in RPC_STATS_FUNCTION
+    listener_t listeners[MAX_LISTENERS];
+    int n_listeners;
+    // admission limits set by rpc_set_admission, 0 for none
+    unsigned max_per_connection;
+    unsigned max_queued;
+    int uring; // reactors run on io_uring (when the kernel lets them), see rpc_set_io_backend
+    resultCache_t *cache; // results of rpc_register_pure functions, NULL until one is registered
+    size_t cache_size;    // memory budget of cache, see rpc_set_cache_size
 };
 
-/* Initialises server state */
-/* RETURNS: rpc_server* on success, NULL on error */
-/* code inspired from COMP30023 Workshop9 */
-rpc_server *rpc_init_server(int port) {
-	if (port < MIN_PORT_VALUE || port > MAX_PORT_VALUE) {
-		return NULL;
-	}
+/* event loop state, rpc_serve_all runs a single one, rpc_serve_all_threads one per thread */
+typedef struct reactor {
+	rpc_server *srv;
+	int sockfd;
+	int epollfd;
+	pthread_t thread;
+	uring_t *uring;        // NULL for an epoll event loop
+	connection_t **corked; // connections whose replies go out once the batch of completions is served
+	int n_corked;
+	int corked_cap;
+} reactor_t;
+
+/* rpc_call() request decoded by a reactor & waiting for a worker thread */
+typedef struct rpc_job {
+	connection_t *conn;
+	uint16_t fid;
+	int has_request_id; // RPC_CALL_ID_FLAG calls may be answered out of order
+	uint32_t request_id;
+	uint32_t seq;       // position among the replies that must go out in request order
+	uint64_t deadline_ns; // statsNow() after which the caller no longer waits, 0 for none
+	rpc_data *input;
+	rpc_data **batch;   // RPC_CALL_BATCH_FLAG payloads (input is NULL then), NULL otherwise
+	uint32_t batch_n;
+} rpc_job_t;
+
+/* answer owed by a rpc_async_handler, handed back through rpc_complete */
+struct rpc_token {
+	rpc_server *srv;
+	connection_t *conn; // referenced until the answer is sent
+	uint16_t fid;
+	int has_request_id;
+	uint32_t request_id;
+	uint32_t seq;
+	uint64_t start_ns;
+	uint64_t bytes_in;
+};
 
-	char port_str[5];
+/* call to a rpc_register_stream function, its handler runs on a thread of its own */
+struct rpc_stream_writer {
+	rpc_server *srv;
+	connection_t *conn; // referenced until the stream has ended
+	uint16_t fid;
+	uint32_t request_id;
+	rpc_stream_handler handler;
+	rpc_data *input;
+	uint64_t start_ns;
+	uint64_t bytes_in;
+	uint64_t bytes_out;
+	// guarded by conn->lock, like the list of streams of conn
+	uint32_t credit;         // chunks the client is ready to take
+	int cancelled;           // the client closed the stream
+	pthread_cond_t cond;     // signalled when credit grows, the stream is cancelled or conn closed
+	rpc_stream_writer *next; // conn->streams
+};
+
+/* every message is written as a single frame, so Nagle coalescing has nothing to merge */
+/* & would only hold a small frame back until the previous one is acknowledged */
+static void socketSetLowLatency(int sockfd) {
+	int one = 1;
+	setsockopt(sockfd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+}
+
+/* create a non-blocking IPv6 TCP socket bound to port */
+/* SO_REUSEPORT lets every reactor bind its own listening socket on the same port */
+/* RETURNS: socket fd on success, -1 on error */
+/* code inspired from COMP30023 Workshop9 */
+static int serverBindSocket(int port) {
+	char port_str[6];
     int re, s, sockfd;
 	struct addrinfo hints, *res;
 
@@ -62,588 +208,3750 @@ rpc_server *rpc_init_server(int port) {
 	s = getaddrinfo(NULL, port_str, &hints, &res);
 	if (s != 0) {
 		fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(s));
-		return NULL;
+		return -1;
 	}
 
 	sockfd = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
 	if (sockfd < 0) {
 		perror("socket");
-		return NULL;
+		freeaddrinfo(res);
+		return -1;
 	}
 
 	re = 1;
-	if (setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &re, sizeof(int)) < 0) {
+	if (setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &re, sizeof(int)) < 0 ||
+	setsockopt(sockfd, SOL_SOCKET, SO_REUSEPORT, &re, sizeof(int)) < 0) {
 		perror("setsockopt");
-		return NULL;
+		close(sockfd);
+		freeaddrinfo(res);
+		return -1;
 	}
 
 	if (bind(sockfd, res->ai_addr, res->ai_addrlen) < 0) {
 		perror("bind");
-		return NULL;
+		close(sockfd);
+		freeaddrinfo(res);
+		return -1;
 	}
 	freeaddrinfo(res);
 
-    // initialise rpc_server for storing server information
-    rpc_server *server = malloc(sizeof(*server));
-    assert(server);
-    server->functionList = functionListCreate();
-	assert(server->functionList);
-    server->sockfd = sockfd;
-	
-    // initialise file descriptor set
-    FD_ZERO(&(server->masterfds));
-    FD_SET(server->sockfd, &(server->masterfds));
-    server->maxfd = sockfd;
-
-    return server;
-}
-
-/* Registers a function (mapping from name to handler) */
-/* RETURNS: -1 on failure */
-int rpc_register(rpc_server *srv, char *name, rpc_handler handler) {
-	int fname_len = strlen(name);
-    
-	if (srv == NULL || name == NULL || handler == NULL || 
-	fname_len > MAX_FNAME_LEN || fname_len < MIN_FNAME_LEN) {
-        return -1;
-    }
-
-    for (int i = 0; i < fname_len; i++) {
-        if (name[i] < MIN_FNAME_ASCII || name[i] > MAX_FNAME_ASCII) {
-            return -1;
-        }
-    }
-
-    // initalise function object to store function info. and add into functionList in rpc_server
-    function_t *function = functionCreate(fname_len);
-	assignNameToFunction(function, name);
-    assignRPCHandlerToFunction(function, handler);
-    functionRegister(srv->functionList, function);
-    
-    return getFidFunction(function);
-}
-
-/* Start serving requests */
-/* packet serialization inspired from beej's guide (https://beej.us/guide/bgnet/html/#htonsman) */
-/* and https://robinmoussu.gitlab.io/blog/post/binary_serialisation_of_enum/ */
-/* code inspired from COMP30023 Workshop10 */
-void rpc_serve_all(rpc_server *srv) {
-	if (srv == NULL) {
-		return;
+	// listening socket must be non-blocking, so all pending connections can be drained on each edge
+	if (fcntl(sockfd, F_SETFL, fcntl(sockfd, F_GETFL, 0) | O_NONBLOCK) < 0) {
+		perror("fcntl");
+		close(sockfd);
+		return -1;
 	}
+	return sockfd;
+}
 
-	if (listen(srv->sockfd, 10) < 0) {
-		perror("listen");
-		return;
+/* fill sun with the Unix socket address of addr: "unix:/path" names a file, */
+/* "shm:name" lives in the abstract namespace (nothing on disk to clean up) */
+/* RETURNS: length of the address, -1 if addr has neither scheme or is too long */
+static int unixAddress(char *addr, struct sockaddr_un *sun) {
+	memset(sun, 0, sizeof(*sun));
+	sun->sun_family = AF_UNIX;
+	if (strncmp(addr, UNIX_SCHEME, strlen(UNIX_SCHEME)) == 0) {
+		char *path = addr + strlen(UNIX_SCHEME);
+		if (path[0] == '\0' || strlen(path) >= sizeof(sun->sun_path)) {
+			return -1;
+		}
+		strcpy(sun->sun_path, path);
+		return offsetof(struct sockaddr_un, sun_path) + strlen(path) + 1;
 	}
-
-    while (1) {
-        // monitor file descriptors
-	    fd_set readfds = srv->masterfds;
-		if (select(FD_SETSIZE, &readfds, NULL, NULL, NULL) < 0) {
-			perror("select");
-			return;
+	if (strncmp(addr, SHM_SCHEME, strlen(SHM_SCHEME)) == 0) {
+		// sun_path[0] stays '\0' for the abstract namespace
+		int len = snprintf(sun->sun_path + 1, sizeof(sun->sun_path) - 1, "rpc-%s", addr);
+		if (len < 0 || (size_t)len >= sizeof(sun->sun_path) - 1) {
+			return -1;
 		}
+		return offsetof(struct sockaddr_un, sun_path) + 1 + len;
+	}
+	return -1;
+}
 
-		// loop all possible descriptor
-		for (int i = 0; i <= srv->maxfd; ++i) {
-			// determine if the current file descriptor is active
-			if (!FD_ISSET(i, &readfds)) {
-				continue;
-			}
-
-			// create new socket if there is new incoming connection request to listening interface
-			if (i == srv->sockfd) {
-				struct sockaddr_in6 cliaddr;
-				socklen_t clilen = sizeof(cliaddr);
-				int newsockfd = accept(srv->sockfd, (struct sockaddr*)&cliaddr, &clilen);
-				if (newsockfd < 0)
-					perror("accept");
-				else {
-					// add the socket to the file descriptor set
-					FD_SET(newsockfd, &(srv->masterfds));
-					// update the maximum tracker
-					if (newsockfd > srv->maxfd)
-						srv->maxfd = newsockfd;
-					// print out the IP and the socket number
-					char ip[INET6_ADDRSTRLEN];
-					fprintf(stderr, "new connection from %s on socket %d\n",
-						   // convert to human readable string
-						   inet_ntop(cliaddr.sin6_family, &cliaddr.sin6_addr, ip,
-									 INET6_ADDRSTRLEN),
-						   newsockfd);
-				}
-			}
-			// client called rpc_find() / rpc_called()
-			else {
-				// read header_buffer from client
-				char header_buffer[HEADER_BUFFER_SIZE];
-				char *ptr = header_buffer;
-				int n = read(i, header_buffer, HEADER_BUFFER_SIZE);
-				if (n <= 0) {
-					if (n < 0)
-						perror("read");
-					continue;
-				}
+/* watch a rpc_listen socket from epollfd; every reactor watches it, but only one of them
+ * is woken up per connection */
+/* RETURNS: 0 on success, -1 on error */
+static int serverWatchListener(int epollfd, listener_t *listener) {
+	struct epoll_event ev;
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN | EPOLLET | EPOLLEXCLUSIVE;
+	ev.data.ptr = listener;
+	if (epoll_ctl(epollfd, EPOLL_CTL_ADD, listener->sockfd, &ev) < 0) {
+		perror("epoll_ctl");
+		return -1;
+	}
+	return 0;
+}
 
-				// extract function_flag from buffer
-				uint16_t flag_network, flag;
-				memcpy(&flag_network, ptr, sizeof(flag_network));
-				flag = ntohs(flag_network);
-				ptr += sizeof(flag_network);
-
-				// rpc_find()
-				if (flag == 1) {
-					// extract fname_len from header_buffer
-					uint16_t fname_len_network, fname_len;
-					memcpy(&fname_len_network, ptr, sizeof(fname_len_network));
-					fname_len = ntohs(fname_len_network);
-
-					// read fname from client & search for matching function
-					char fname_buffer[fname_len];
-					n = read(i, fname_buffer, fname_len);
-					if (n <= 0) {
-						if (n < 0)
-							perror("read");
-						continue;
-					}
-					fname_buffer[fname_len] = '\0';
-					uint16_t fid = searchFunction(srv->functionList, fname_buffer);
-
-					// sending response (fid) to client
-					char res_buffer[UINT16_SIZE];
-					uint16_t fid_network = htons(fid);
-					memcpy(res_buffer, &fid_network, sizeof(fid_network));
-					n = write(i, res_buffer, UINT16_SIZE);
-					if (n < 0) {
-						perror("write");
-						continue;
-					}
-				} 
-				// rpc_call()
-				else if (flag == 2) {
-					// extract fid from header buffer
-					uint16_t fid_network, fid;
-					memcpy(&fid_network, ptr, sizeof(fid_network));
-					fid = ntohs(fid_network);
-
-					// read rpc_data_len from client
-					char rpc_data_len_buffer[UINT32_SIZE];
-					ptr = rpc_data_len_buffer;
-					n = read(i, rpc_data_len_buffer, UINT32_SIZE);
-					if (n <= 0) {
-						if (n < 0)
-							perror("read");
-						continue;
-					}
-					uint32_t rpc_data_len_network, rpc_data_len;
-					memcpy(&rpc_data_len_network, ptr, sizeof(rpc_data_len_network));
-					rpc_data_len = ntohl(rpc_data_len_network);
-					
-					// read rpc_data from client & extract to input_rpc_data
-					rpc_data *input_rpc_data = malloc(sizeof(*input_rpc_data));
-					char in_rpc_data_buffer[rpc_data_len];
-					ptr = in_rpc_data_buffer;
-					n = read(i, in_rpc_data_buffer, rpc_data_len);
-					if (n <= 0) {
-						if (n < 0)
-							perror("read");
-						continue;
-					}
-					extractRPCDataFromBuffer(input_rpc_data, ptr, rpc_data_len);
-
-					// process function
-					rpc_handler called_function = getHandlerFunctionList(srv->functionList, fid);
-					rpc_data *res_rpc_data = called_function(input_rpc_data);
-					free(input_rpc_data);
-
-					// determine total_res_size & sending total_res_size to client
-					uint32_t total_res_size;
-					if (res_rpc_data == NULL || ((res_rpc_data->data2_len > 0) & (res_rpc_data->data2 == NULL)) || 
-					((res_rpc_data->data2_len == 0) & (res_rpc_data->data2 != NULL))) {
-						total_res_size = 0;
-					} else if (res_rpc_data->data2_len == 0) {
-						total_res_size = UINT64_SIZE;
-					} else {
-						total_res_size = UINT64_SIZE + UINT32_SIZE + res_rpc_data->data2_len;
-					}
-					
-					char res_data_size_buffer[UINT32_SIZE];
-					ptr = res_data_size_buffer;
-					uint32_t total_res_size_network = htonl(total_res_size);
-					memcpy(ptr, &total_res_size_network, sizeof(total_res_size_network));
-					n = write(i, res_data_size_buffer, UINT32_SIZE);
-					if (n < 0) {
-						perror("write");
-						continue;
-					} else if (total_res_size == 0) {
-						// if the total_res_size == 0, mean return_rpc_data is invalid
-						// Thus, the system continue to the next process
-						fprintf(stderr, "invalid return for return_rpc_data, move to the next process");
-						continue;
-					}
-
-					// send res_data back to client
-					char res_data_buffer[total_res_size];
-					ptr = res_data_buffer;
-					loadRPCDataToBuffer(res_rpc_data, ptr);
-					n = write(i, res_data_buffer, total_res_size);
-					if (n < 0) {
-						perror("write");
-						continue;
-					}
-				} 
-				// rpc_close_client()
-				else {
-					fprintf(stderr, "socket %d closed the connection\n", i);
-					close(i);
-					FD_CLR(i, &(srv->masterfds));
-				}
-			}
+/* the rpc_listen socket an epoll event refers to */
+/* RETURNS: listener_t* or NULL if ptr is a connection */
+static listener_t *serverFindListener(rpc_server *srv, void *ptr) {
+	for (int i = 0; i < srv->n_listeners; i++) {
+		if (ptr == &srv->listeners[i]) {
+			return &srv->listeners[i];
 		}
-    }
-
+	}
+	return NULL;
 }
 
-struct rpc_client {
-	int sockfd;
-};
-
-struct rpc_handle {
-	int fid;
-};
+/* create an epoll instance watching the listening socket */
+/* RETURNS: epoll fd on success, -1 on error */
+static int serverCreateEpoll(int sockfd) {
+	int epollfd = epoll_create1(0);
+	if (epollfd < 0) {
+		perror("epoll_create1");
+		return -1;
+	}
+	struct epoll_event ev;
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN | EPOLLET;
+	ev.data.ptr = NULL; // client sockets carry their connection_t instead
+	if (epoll_ctl(epollfd, EPOLL_CTL_ADD, sockfd, &ev) < 0) {
+		perror("epoll_ctl");
+		close(epollfd);
+		return -1;
+	}
+	return epollfd;
+}
 
 /* Initialises server state */
 /* RETURNS: rpc_server* on success, NULL on error */
-/* code inspired from COMP30023 Workshop9 */
-rpc_client *rpc_init_client(char *addr, int port) {
+rpc_server *rpc_init_server(int port) {
 	if (port < MIN_PORT_VALUE || port > MAX_PORT_VALUE) {
 		return NULL;
 	}
+	traceInit();
 
-	char port_str[5];
-	int sockfd, s;
-	struct addrinfo hints, *servinfo, *rp;
+	int sockfd = serverBindSocket(port);
+	if (sockfd < 0) {
+		return NULL;
+	}
 
-	sprintf(port_str, "%d", port);
-	memset(&hints, 0, sizeof hints);
-	hints.ai_family = AF_INET6; // IPv6
-	hints.ai_socktype = SOCK_STREAM; // Connection-mode byte streams (TCP)
+	// raise the open file limit, so the server is not capped at the default 1024 sockets
+	struct rlimit rl;
+	if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+		rl.rlim_cur = rl.rlim_max;
+		setrlimit(RLIMIT_NOFILE, &rl);
+	}
 
-	s = getaddrinfo(addr, port_str, &hints, &servinfo);
-	if (s != 0) {
-		fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(s));
+	// initialise epoll instance & watch the listening socket
+	int epollfd = serverCreateEpoll(sockfd);
+	if (epollfd < 0) {
+		close(sockfd);
 		return NULL;
 	}
 
-	for (rp = servinfo; rp != NULL; rp = rp->ai_next) {
-		sockfd = socket(rp->ai_family, rp->ai_socktype, rp->ai_protocol);
-		if (sockfd == -1)
-			continue;
-		if (connect(sockfd, rp->ai_addr, rp->ai_addrlen) != -1)
-			break; // success
-		close(sockfd);
+    // initialise rpc_server for storing server information
+    rpc_server *server = malloc(sizeof(*server));
+    assert(server);
+    server->functionList = functionListCreate();
+	assert(server->functionList);
+    server->port = port;
+    server->sockfd = sockfd;
+    server->epollfd = epollfd;
+    server->jobs = NULL;
+    server->n_listeners = 0;
+    server->max_per_connection = 0;
+    server->max_queued = 0;
+    server->uring = (ioBackend() == RPC_IO_URING);
+    server->cache = NULL;
+    server->cache_size = RPC_CACHE_DEFAULT_SIZE;
+
+    // built-in functions have no rpc_handler, serveRunHandlers recognises them by fid
+    function_t *stats = functionCreate(strlen(RPC_STATS_FUNCTION));
+    assignNameToFunction(stats, RPC_STATS_FUNCTION);
+    server->stats_fid = functionRegister(server->functionList, stats);
+
+    return server;
+}
+
+/* Accepts connections on addr as well, see rpc_ext.h */
+/* RETURNS: 0 on success, -1 on error */
+int rpc_listen(rpc_server *srv, char *addr) {
+	if (srv == NULL || addr == NULL || srv->n_listeners == MAX_LISTENERS) {
+		return -1;
 	}
-	if (rp == NULL) {
-		fprintf(stderr, "client: failed to connect\n");
-		return NULL;
+	struct sockaddr_un sun;
+	int addrlen = unixAddress(addr, &sun);
+	if (addrlen < 0) {
+		return -1;
 	}
-	freeaddrinfo(servinfo);
 
-	// initialise rpc_client for storing client information
-    rpc_client *client = malloc(sizeof(*client));
-    assert(client);
-	client->sockfd = sockfd;
-	
-    return client;
+	int sockfd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0);
+	if (sockfd < 0) {
+		perror("socket");
+		return -1;
+	}
+	// a socket file left behind by an earlier server would make bind fail
+	struct stat st;
+	if (sun.sun_path[0] != '\0' && stat(sun.sun_path, &st) == 0 && S_ISSOCK(st.st_mode)) {
+		unlink(sun.sun_path);
+	}
+	if (bind(sockfd, (struct sockaddr *)&sun, addrlen) < 0 || listen(sockfd, SOMAXCONN) < 0) {
+		perror("bind");
+		close(sockfd);
+		return -1;
+	}
+
+	listener_t *listener = &srv->listeners[srv->n_listeners];
+	listener->sockfd = sockfd;
+	listener->shm = (strncmp(addr, SHM_SCHEME, strlen(SHM_SCHEME)) == 0);
+	if (serverWatchListener(srv->epollfd, listener) < 0) {
+		close(sockfd);
+		return -1;
+	}
+	srv->n_listeners++;
+	return 0;
 }
 
-/* Finds a remote function by name */
-/* RETURNS: rpc_handle* on success, NULL on error */
-/* rpc_handle* will be freed with a single call to free(3) */
-/* packet serialization inspired from beej's guide (https://beej.us/guide/bgnet/html/#htonsman) */
-/* and https://robinmoussu.gitlab.io/blog/post/binary_serialisation_of_enum/ */
-rpc_handle *rpc_find(rpc_client *cl, char *name) {
-	int fname_len = strlen(name);
+/* add name to the registry with its handlers (at least one of them is not NULL) */
+/* RETURNS: fid on success, -1 on failure */
+static int serverRegister(rpc_server *srv, char *name, rpc_handler handler, rpc_batch_handler batch_handler,
+rpc_async_handler async_handler, rpc_stream_handler stream_handler, int pure) {
+	if (srv == NULL || name == NULL ||
+	(handler == NULL && batch_handler == NULL && async_handler == NULL && stream_handler == NULL)) {
+		return -1;
+	}
 
-	if (cl == NULL || name == NULL || fname_len > MAX_FNAME_LEN || 
-	fname_len < MIN_FNAME_LEN) {
-        return NULL;
+	int fname_len = strlen(name);
+	if (fname_len > MAX_FNAME_LEN || fname_len < MIN_FNAME_LEN) {
+        return -1;
     }
 
     for (int i = 0; i < fname_len; i++) {
         if (name[i] < MIN_FNAME_ASCII || name[i] > MAX_FNAME_ASCII) {
-            return NULL;
+            return -1;
         }
     }
-	
-	// rpc_find() will sent 3 data
-	// 1.(uint16_t *) function_flag: to indicate which function is called
-	// 2.(uint16_t *) fname_len: to indicate the length of searched function name
-	// 3.fname (fname_len byte): actual searched function name
-
-	// serialize header_buffer which contains function_flag & fname_len
-	char header_buffer[HEADER_BUFFER_SIZE];
-	char *ptr = header_buffer;
-	uint16_t function_flag_network = htons(RPC_FIND_FLAG);
-	memcpy(ptr, &function_flag_network, sizeof(function_flag_network));
-	ptr += sizeof(function_flag_network);
+    if (strncmp(name, RESERVED_FNAME_PREFIX, strlen(RESERVED_FNAME_PREFIX)) == 0) {
+        return -1;
+    }
 
-	uint16_t fname_len_network = htons(fname_len);
-	memcpy(ptr, &fname_len_network, sizeof(fname_len_network));
+    // initalise function object to store function info. and add into functionList in rpc_server
+    function_t *function = functionCreate(fname_len);
+	assignNameToFunction(function, name);
+    assignRPCHandlerToFunction(function, handler);
+    assignBatchHandlerToFunction(function, batch_handler);
+    assignAsyncHandlerToFunction(function, async_handler);
+    assignStreamHandlerToFunction(function, stream_handler);
+    assignPureToFunction(function, pure);
+    // an existing name keeps its fid, the new function object is freed
+    return functionRegister(srv->functionList, function);
+}
 
-	// send header_buffer to server
-	int n = write(cl->sockfd, header_buffer, HEADER_BUFFER_SIZE);
-	if (n < 0) {
-		perror("socket");
-		return NULL;
+/* Registers a function (mapping from name to handler) */
+/* RETURNS: -1 on failure */
+int rpc_register(rpc_server *srv, char *name, rpc_handler handler) {
+	if (handler == NULL) {
+		return -1;
 	}
+	return serverRegister(srv, name, handler, NULL, NULL, NULL, 0);
+}
 
-	// send fname to server
-	n = write(cl->sockfd, name, fname_len);
-	if (n < 0) {
-		perror("socket");
-		return NULL;
+/* Registers a function that can also process a whole batch at once, see rpc_ext.h */
+/* RETURNS: -1 on failure */
+int rpc_register_batch(rpc_server *srv, char *name, rpc_handler handler, rpc_batch_handler batch_handler) {
+	return serverRegister(srv, name, handler, batch_handler, NULL, NULL, 0);
+}
+
+/* Registers a function whose handler answers through rpc_complete, see rpc_ext.h */
+/* RETURNS: -1 on failure */
+int rpc_register_async(rpc_server *srv, char *name, rpc_async_handler handler) {
+	if (handler == NULL) {
+		return -1;
 	}
-	
-	// read respond (fid) from server
-	char res_buffer[UINT16_SIZE];
-	n = read(cl->sockfd, res_buffer, UINT16_SIZE);
-	if (n < 0) {
-		perror("read");
-		return NULL;
+	return serverRegister(srv, name, NULL, NULL, handler, NULL, 0);
+}
+
+/* Registers a function that answers with a stream of chunks, see rpc_ext.h */
+/* RETURNS: -1 on failure */
+int rpc_register_stream(rpc_server *srv, char *name, rpc_stream_handler handler) {
+	if (handler == NULL) {
+		return -1;
 	}
-	ptr = res_buffer;
-	uint16_t fid_network;
-	memcpy(&fid_network, ptr, sizeof(fid_network));
-	uint16_t fid = ntohs(fid_network);
+	return serverRegister(srv, name, NULL, NULL, NULL, handler, 0);
+}
 
-	if (fid == 0) {
-		return NULL;
+/* Registers a function whose results are cached, see rpc_ext.h */
+/* RETURNS: -1 on failure */
+int rpc_register_pure(rpc_server *srv, char *name, rpc_handler handler) {
+	if (srv == NULL || handler == NULL) {
+		return -1;
+	}
+	if (srv->cache == NULL) {
+		srv->cache = resultCacheCreate(srv->cache_size);
 	}
+	return serverRegister(srv, name, handler, NULL, NULL, NULL, 1);
+}
 
-	// stored fid in rpc_handle
-	rpc_handle *res = malloc(sizeof(*res));
-	res->fid = fid;
+/* Sets the memory the result cache may use, see rpc_ext.h */
+void rpc_set_cache_size(rpc_server *srv, size_t max_bytes) {
+	if (srv == NULL) {
+		return;
+	}
+	srv->cache_size = max_bytes;
+	if (srv->cache != NULL) {
+		resultCacheSetLimit(srv->cache, max_bytes);
+	}
+}
 
-	return res;
+/* Bounds the calls admitted per connection & the jobs queued for the workers, see rpc_ext.h */
+void rpc_set_admission(rpc_server *srv, unsigned max_per_connection, unsigned max_queued) {
+	if (srv == NULL) {
+		return;
+	}
+	srv->max_per_connection = max_per_connection;
+	srv->max_queued = max_queued;
 }
 
-/* Calls remote function using handle */
-/* RETURNS: rpc_data* on success, NULL on error */
-/* packet serialization inspired from beej's guide (https://beej.us/guide/bgnet/html/#htonsman) */
-/* and https://robinmoussu.gitlab.io/blog/post/binary_serialisation_of_enum/ */
-rpc_data *rpc_call(rpc_client *cl, rpc_handle *h, rpc_data *payload) {
-	if (cl == NULL || h == NULL || payload == NULL || ((payload->data2_len > 0) & (payload->data2 == NULL))
-	|| ((payload->data2_len == 0) & (payload->data2 != NULL))) {
-		return NULL;
+/* Bounds the calls to name that may be in progress at once, see rpc_ext.h */
+/* RETURNS: -1 on failure */
+int rpc_set_concurrency(rpc_server *srv, char *name, unsigned max_active) {
+	if (srv == NULL || name == NULL) {
+		return -1;
 	}
+	int fid = searchFunction(srv->functionList, name);
+	if (fid <= 0 || fid == srv->stats_fid) {
+		return -1;
+	}
+	setMaxActiveFunctionList(srv->functionList, fid, max_active);
+	return 0;
+}
 
-	// rpc_call() will sent 4 data
-	// 1.(uint16_t *) function_flag: to indicate which function is called
-	// 2.(uint16_t *) fid: function_id that we will execute
-	// 3.(uint32_t *) rpc_data_len: length of rpc_data that we will sent
-	// 4.rpc_data (XXX byte): actual rpc_data
+/* Builds a perfect hash over the registered names, see rpc_ext.h */
+/* RETURNS: -1 on failure */
+int rpc_freeze(rpc_server *srv) {
+	if (srv == NULL) {
+		return -1;
+	}
+	return functionListFreeze(srv->functionList);
+}
 
-	// header_buffer: contain function_flag & fname_len
-	char header_buffer[HEADER_BUFFER_SIZE];
-	char *ptr = header_buffer;
-	uint16_t function_flag_network = htons(RPC_CALL_FLAG);
-	memcpy(ptr, &function_flag_network, sizeof(function_flag_network));
-	ptr += sizeof(function_flag_network);
+static void serveUringWatch(reactor_t *reactor, connection_t *conn);
+static void serveWakeStreams(connection_t *conn);
 
-	uint16_t fid_network = htons(h->fid);
-	memcpy(ptr, &fid_network, sizeof(fid_network));
+/* set up the connection of a socket reactor accepted & start watching it */
+/* shm: the client hands over shared-memory rings first, the connection then uses them */
+static void serveAddConnection(reactor_t *reactor, int newsockfd, int shm, struct sockaddr_storage *cliaddr) {
+	if (!shm && cliaddr->ss_family == AF_INET6) {
+		socketSetLowLatency(newsockfd);
+	}
+	connection_t *conn = connectionCreate(newsockfd, NULL, reactor);
+	// the client sends its rings right after connecting: they are mapped once the socket
+	// turns readable, so a slow client never holds up the reactor
+	conn->awaiting_shm = shm;
 
-	// rpc_data_len_buffer (include case that payload->data2_len = 0)
-	uint32_t total_size;
-	if (payload->data2_len == 0) {
-		total_size = UINT64_SIZE;
+	if (reactor->uring != NULL) {
+		serveUringWatch(reactor, conn);
 	} else {
-		total_size = UINT64_SIZE + UINT32_SIZE + payload->data2_len;
+		// add the socket to the epoll interest list
+		// EPOLLOUT is edge-triggered too, so it only fires when a full socket buffer drains
+		struct epoll_event ev;
+		memset(&ev, 0, sizeof(ev));
+		ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+		ev.data.ptr = conn;
+		if (epoll_ctl(reactor->epollfd, EPOLL_CTL_ADD, newsockfd, &ev) < 0) {
+			perror("epoll_ctl");
+			connectionRelease(conn);
+			return;
+		}
 	}
-	char rpc_data_len_buffer[UINT32_SIZE];
-	ptr = rpc_data_len_buffer;
-	uint32_t rpc_data_len_network = htonl(total_size);
-	memcpy(ptr, &rpc_data_len_network, UINT32_SIZE);
 
-	// rpc_data_buffer (need to serialize into a single buffer)
-	char rpc_data_buffer[total_size];
-	ptr = rpc_data_buffer;
-	loadRPCDataToBuffer(payload, ptr);
+	// trace the socket number & the low half of the IP (the whole address for IPv4 peers)
+	uint64_t peer_network = 0;
+	if (cliaddr->ss_family == AF_INET6) {
+		memcpy(&peer_network, ((struct sockaddr_in6 *)cliaddr)->sin6_addr.s6_addr + 8, sizeof(peer_network));
+	}
+	TRACE(RPC_TRACE_INFO, TRACE_ACCEPT, newsockfd, n64bittoh(peer_network));
+}
 
-	// send header_buffer to server
-	int n = write(cl->sockfd, header_buffer, HEADER_BUFFER_SIZE);
-	if (n < 0) {
-		perror("socket");
-		return NULL;
+/* accept every pending connection on listenfd (edge-triggered, so drain until EAGAIN) */
+static void serveAcceptConnections(reactor_t *reactor, int listenfd, int shm) {
+	while (1) {
+		struct sockaddr_storage cliaddr;
+		socklen_t clilen = sizeof(cliaddr);
+		int newsockfd = accept(listenfd, (struct sockaddr*)&cliaddr, &clilen);
+		if (newsockfd < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno != EAGAIN && errno != EWOULDBLOCK)
+				perror("accept");
+			return;
+		}
+		serveAddConnection(reactor, newsockfd, shm, &cliaddr);
 	}
+}
 
-	// send rpc_data_len_buffer to server
-	n = write(cl->sockfd, rpc_data_len_buffer, UINT32_SIZE);
-	if (n < 0) {
-		perror("socket");
-		return NULL;
+/* stop watching connection, pending replies are dropped & the socket closes with the last reference */
+static void serveCloseConnection(connection_t *conn) {
+	reactor_t *reactor = conn->owner;
+	if (reactor->uring != NULL && conn->closed) {
+		// completions already queued for the connection may report the same failure again
+		return;
+	}
+	TRACE(RPC_TRACE_INFO, TRACE_CLOSE, conn->sockfd, 0);
+	connectionMarkClosed(conn);
+	serveWakeStreams(conn);
+	if (reactor->uring != NULL) {
+		// every request still armed on the socket completes with -ECANCELED & drops its reference
+		struct io_uring_sqe *sqe = uringGetSqe(reactor->uring);
+		if (sqe != NULL) {
+			sqe->opcode = IORING_OP_ASYNC_CANCEL;
+			sqe->fd = conn->sockfd;
+			sqe->cancel_flags = IORING_ASYNC_CANCEL_FD | IORING_ASYNC_CANCEL_ALL;
+			sqe->user_data = URING_ACCEPT;
+		} else {
+			shutdown(conn->sockfd, SHUT_RDWR);
+		}
+	} else {
+		epoll_ctl(reactor->epollfd, EPOLL_CTL_DEL, conn->sockfd, NULL);
 	}
+	connectionRelease(conn);
+}
 
-	// send rpc_data_buffer
-	n = write(cl->sockfd, rpc_data_buffer, total_size);
-	if (n < 0) {
-		perror("socket");
-		return NULL;
+/* built-in RPC_STATS_FUNCTION: one text line per function (or only fid in->data1 if not 0) */
+/* "fid name calls errors bytes_in bytes_out p50_ns p90_ns p99_ns p999_ns max_ns expired rejected hits misses" */
+/* the counters are read with relaxed atomic loads, so a scrape never blocks the handlers */
+/* RETURNS: rpc_data* with data1 = number of lines & the report (not NUL-terminated) in data2 */
+static rpc_data *serveStats(rpc_server *srv, rpc_data *in) {
+	int n = functionListSize(srv->functionList);
+	int first = 1, last = n;
+	if (in->data1 != 0) {
+		if (in->data1 < 1 || in->data1 > n) {
+			return NULL;
+		}
+		first = last = in->data1;
 	}
 
-	// read return_rpc_data_len from server
-	// server return invalid rpc_data, if the return_rpc_data_len == 0
-	char return_data_len_buffer[UINT32_SIZE];
-	ptr = return_data_len_buffer;
-	n = read(cl->sockfd, return_data_len_buffer, UINT32_SIZE);
-	if (n <= 0) {
-		perror("read");
-		return NULL;
+	char *report = poolAlloc((last - first + 2) * STATS_LINE_MAX);
+	int len = sprintf(report, "fid name calls errors bytes_in bytes_out p50_ns p90_ns p99_ns p999_ns max_ns expired "
+	"rejected hits misses\n");
+	functionStats_t *snapshot = poolAlloc(sizeof(*snapshot));
+	for (int fid = first; fid <= last; fid++) {
+		statsSnapshot(getStatsFunctionList(srv->functionList, fid), snapshot);
+		len += sprintf(report + len, "%d %s %" PRIu64 " %" PRIu64 " %" PRIu64 " %" PRIu64 " %" PRIu64
+		" %" PRIu64 " %" PRIu64 " %" PRIu64 " %" PRIu64 " %" PRIu64 " %" PRIu64 " %" PRIu64 " %" PRIu64 "\n",
+		fid, getNameFunctionList(srv->functionList, fid), snapshot->calls, snapshot->errors, snapshot->bytes_in,
+		snapshot->bytes_out, statsPercentile(snapshot, 0.5), statsPercentile(snapshot, 0.9),
+		statsPercentile(snapshot, 0.99), statsPercentile(snapshot, 0.999), snapshot->max_ns, snapshot->expired,
+		snapshot->rejected, snapshot->hits, snapshot->misses);
 	}
-	uint32_t return_data_len_network, return_data_len;
-	memcpy(&return_data_len_network, ptr, UINT32_SIZE);
-	return_data_len = ntohl(return_data_len_network);
+	poolFree(snapshot);
 
-	if (return_data_len == 0) {
+	rpc_data *out = rpc_data_alloc(len);
+	out->data1 = last - first + 1;
+	memcpy(out->data2, report, len);
+	poolFree(report);
+	return out;
+}
+
+/* key of fid in the result cache: a function registered again gets new keys, so results */
+/* of the handler it had before are never served (they age out of the cache instead) */
+static uint64_t serveCacheTag(rpc_server *srv, uint16_t fid) {
+	return (uint64_t)functionListGeneration(srv->functionList) << 16 | fid;
+}
+
+/* result of a call to fid already in the result cache, counted as a hit */
+/* RETURNS: rpc_data* (the caller owns it), NULL if fid is not pure or in is not cached */
+static rpc_data *serveCachedResult(rpc_server *srv, uint16_t fid, rpc_data *in) {
+	if (srv->cache == NULL || !isPureFunctionList(srv->functionList, fid)) {
 		return NULL;
 	}
-
-	// read return_rpc_data from server
-	rpc_data *return_data = malloc(sizeof(*return_data));
-	char return_buffer[return_data_len];
-	ptr = return_buffer;
-	n = read(cl->sockfd, return_buffer, return_data_len);
-	if (n <= 0) {
-		perror("read");
+	uint64_t start_ns = statsNow();
+	uint64_t tag = serveCacheTag(srv, fid);
+	rpc_data *out = resultCacheGet(srv->cache, resultCacheHash(tag, in), tag, in);
+	if (out == NULL) {
 		return NULL;
 	}
-	extractRPCDataFromBuffer(return_data, ptr, return_data_len);
-
-    return return_data;
+	functionStats_t *stats = getStatsFunctionList(srv->functionList, fid);
+	statsRecord(stats, statsNow() - start_ns, 1, 0, getRPCDataLen(in), getRPCDataLen(out));
+	statsCached(stats, 1, 0);
+	return out;
 }
 
-/* Cleans up client state and closes client */
-void rpc_close_client(rpc_client *cl) {
-	// sent flag = 0, to indicate closing socket signal
-	char header_buffer[HEADER_BUFFER_SIZE];
+/* run the pure handler of fid on in, through the result cache (looked up first if lookup) */
+/* RETURNS: result of the handler, NULL on error */
+static rpc_data *serveRunPure(rpc_server *srv, uint16_t fid, rpc_handler handler, rpc_data *in, int lookup,
+uint64_t *hits) {
+	uint64_t tag = serveCacheTag(srv, fid);
+	uint64_t hash = resultCacheHash(tag, in);
+	rpc_data *out = lookup ? resultCacheGet(srv->cache, hash, tag, in) : NULL;
+	if (out != NULL) {
+		(*hits)++;
+		return out;
+	}
+	// a pure handler leaves its payload as it found it, so in still is the key
+	out = handler(in);
+	if (isRPCDataValid(out)) {
+		resultCachePut(srv->cache, hash, tag, in, out);
+	}
+	return out;
+}
+
+/* run fid on the n payloads of in, out[i] receives the result for in[i] (NULL on error) */
+/* a function registered with a rpc_batch_handler gets them all in one invocation */
+/* the results of a rpc_register_pure function go through the result cache, where the */
+/* payloads are looked up first if lookup (serveCachedResult has missed them otherwise) */
+/* calls, errors, bytes & latency are added to the counters of fid */
+/* every in[i] is freed, except a data2 the handler handed back in out[i] */
+static void serveRunHandlers(rpc_server *srv, uint16_t fid, rpc_data *in[], size_t n, rpc_data *out[],
+int lookup) {
+	// an unknown fid gets error results instead of a crash
+	rpc_handler called_function = getHandlerFunctionList(srv->functionList, fid);
+	rpc_batch_handler batch_function = getBatchHandlerFunctionList(srv->functionList, fid);
+	int pure = srv->cache != NULL && isPureFunctionList(srv->functionList, fid);
+	uint64_t hits = 0;
+	uint64_t bytes_in = 0;
+	for (size_t i = 0; i < n; i++) {
+		out[i] = NULL;
+		bytes_in += getRPCDataLen(in[i]);
+	}
+	TRACE(RPC_TRACE_DEBUG, TRACE_HANDLER_START, fid, n);
+	uint64_t start_ns = statsNow();
+	if (fid == srv->stats_fid) {
+		for (size_t i = 0; i < n; i++) {
+			out[i] = serveStats(srv, in[i]);
+		}
+	} else if (batch_function != NULL && (n > 1 || called_function == NULL)) {
+		batch_function(in, n, out);
+	} else if (pure) {
+		for (size_t i = 0; i < n; i++) {
+			out[i] = serveRunPure(srv, fid, called_function, in[i], lookup, &hits);
+		}
+	} else if (called_function != NULL) {
+		for (size_t i = 0; i < n; i++) {
+			out[i] = called_function(in[i]);
+		}
+	}
+	uint64_t latency_ns = statsNow() - start_ns;
+
+	// input data2 is released too, unless the handler handed it back as its result
+	uint64_t errors = 0, bytes_out = 0;
+	for (size_t i = 0; i < n; i++) {
+		if (isRPCDataValid(out[i])) {
+			bytes_out += getRPCDataLen(out[i]);
+		} else {
+			errors++;
+		}
+		if (out[i] == NULL || out[i]->data2 != in[i]->data2) {
+			poolFree(in[i]->data2);
+		}
+		poolFree(in[i]);
+	}
+	TRACE(RPC_TRACE_DEBUG, TRACE_HANDLER_END, fid, errors);
+
+	functionStats_t *stats = getStatsFunctionList(srv->functionList, fid);
+	if (stats != NULL) {
+		statsRecord(stats, latency_ns, n, errors, bytes_in, bytes_out);
+		if (pure) {
+			statsCached(stats, hits, n - hits);
+		}
+	}
+}
+
+/* a call admitted by serveAdmitCall has been answered (or dropped) */
+static void serveFinishCall(rpc_server *srv, connection_t *conn, uint16_t fid) {
+	if (srv->max_per_connection > 0) {
+		__atomic_sub_fetch(&conn->active, 1, __ATOMIC_RELAXED);
+	}
+	releaseFunctionList(srv->functionList, fid);
+}
+
+/* run a RPC_CALL_BATCH_FLAG job & send every result back in a single reply */
+/* layout: request_id, batch_len, then the batch (see loadRPCDataBatchToBuffer), or for */
+/* v2 the header & the batch (see loadRPCDataBatchV2ToBuffer) */
+/* RETURNS: 0 if the connection stays open, -1 if it should be closed */
+static int serveExecuteBatch(rpc_server *srv, connection_t *conn, rpc_job_t *job) {
+	rpc_data **results = poolAlloc(job->batch_n * sizeof(*results));
+	serveRunHandlers(srv, job->fid, job->batch, job->batch_n, results, 1);
+	poolFree(job->batch);
+
+	// a batch_len of 0 means the results do not fit in a single frame
+	int v2 = (conn->version == 2);
+	size_t header_len = v2 ? RPC_V2_HEADER_SIZE : 2 * UINT32_SIZE;
+	uint64_t batch_len = v2 ? getRPCDataBatchLenV2(results, job->batch_n) : getRPCDataBatchLen(results, job->batch_n);
+	if (batch_len > UINT32_MAX - header_len) {
+		fprintf(stderr, "batch results too large for a single frame\n");
+		batch_len = 0;
+	}
+
+	// the reply is serialized into the data2 of a wrapper rpc_data, so that the
+	// connection can queue it by reference & free it once sent
+	rpc_data *reply = poolAlloc(sizeof(*reply));
+	reply->data1 = 0;
+	reply->data2_len = header_len + batch_len;
+	reply->data2 = poolAlloc(reply->data2_len);
+	char *ptr = reply->data2;
+	if (v2) {
+		ptr += loadFrameHeaderV2(ptr, RPC_OP_REPLY, 0, batch_len > 0 ? RPC_STATUS_OK : RPC_STATUS_ERROR,
+		job->request_id, batch_len);
+		if (batch_len > 0) {
+			loadRPCDataBatchV2ToBuffer(results, job->batch_n, ptr);
+		}
+	} else {
+		uint32_t request_id_network = htonl(job->request_id);
+		memcpy(ptr, &request_id_network, sizeof(request_id_network));
+		ptr += sizeof(request_id_network);
+		uint32_t batch_len_network = htonl(batch_len);
+		memcpy(ptr, &batch_len_network, sizeof(batch_len_network));
+		ptr += sizeof(batch_len_network);
+		if (batch_len > 0) {
+			loadRPCDataBatchToBuffer(results, job->batch_n, ptr);
+		}
+	}
+	for (uint32_t i = 0; i < job->batch_n; i++) {
+		rpc_data_free(results[i]);
+	}
+	poolFree(results);
+
+	struct iovec iov = {.iov_base = reply->data2, .iov_len = reply->data2_len};
+	return connectionSend(conn, 0, 0, &iov, 1, reply);
+}
+
+/* send res_rpc_data (NULL or invalid for an error, freed) as the reply to a call */
+/* replies to RPC_CALL_ID_FLAG calls are prefixed with the request id they answer, */
+/* the others are sent in request order (seq); every v2 reply carries its request id */
+/* RETURNS: 0 if the connection stays open, -1 if it should be closed */
+static int serveSendResult(connection_t *conn, int has_request_id, uint32_t request_id, uint32_t seq,
+rpc_data *res_rpc_data) {
+	// determine total_res_size, if the total_res_size == 0, mean return_rpc_data is invalid
+	uint32_t total_res_size = 0;
+	int compressed = 0;
+	if (isRPCDataValid(res_rpc_data)) {
+		uint32_t compressed_len;
+		char *data2 = conn->compress ? compressRPCData2(res_rpc_data, compressionMinSize(), &compressed_len) : NULL;
+		if (data2 != NULL) {
+			// the compressed bytes take the place of data2 & are released with the result
+			poolFree(res_rpc_data->data2);
+			res_rpc_data->data2 = data2;
+			compressed = 1;
+			total_res_size = RPC_DATA_HEADER_SIZE + compressed_len;
+		} else {
+			total_res_size = getRPCDataLen(res_rpc_data);
+		}
+	} else {
+		rpc_data_free(res_rpc_data);
+		res_rpc_data = NULL;
+	}
+
+	// the whole reply goes out as a single frame, data2 straight from the result
+	uint32_t data2_wire_len = compressed ? total_res_size - RPC_DATA_HEADER_SIZE :
+	total_res_size > 0 ? res_rpc_data->data2_len : 0;
+	char header_buffer[FRAME_MAX_HEADER_SIZE];
+	char *ptr = header_buffer;
+	if (conn->version == 2) {
+		// header (RPC_STATUS_ERROR & no body for an error) [data1 data2_len]
+		ptr += RPC_V2_HEADER_SIZE;
+		if (total_res_size > 0) {
+			ptr += loadRPCDataHeaderV2ToBuffer(res_rpc_data, ptr);
+		}
+		loadFrameHeaderV2(header_buffer, RPC_OP_REPLY, compressed ? RPC_V2_FLAG_COMPRESSED : 0,
+		total_res_size > 0 ? RPC_STATUS_OK : RPC_STATUS_ERROR, request_id,
+		ptr - header_buffer - RPC_V2_HEADER_SIZE + data2_wire_len);
+	} else {
+		// [request_id] total_res_size [data1 [data2_len]]
+		if (has_request_id) {
+			uint32_t request_id_network = htonl(request_id);
+			memcpy(ptr, &request_id_network, sizeof(request_id_network));
+			ptr += sizeof(request_id_network);
+		}
+		uint32_t total_res_size_network = htonl(total_res_size);
+		memcpy(ptr, &total_res_size_network, sizeof(total_res_size_network));
+		ptr += sizeof(total_res_size_network);
+		if (compressed) {
+			ptr += loadCompressedRPCDataHeaderToBuffer(res_rpc_data, ptr);
+		} else if (total_res_size > 0) {
+			ptr += loadRPCDataHeaderToBuffer(res_rpc_data, ptr);
+		}
+	}
+
+	struct iovec iov[2];
+	int iovcnt = 1;
+	iov[0].iov_base = header_buffer;
+	iov[0].iov_len = ptr - header_buffer;
+	if (data2_wire_len > 0) {
+		iov[1].iov_base = res_rpc_data->data2;
+		iov[1].iov_len = data2_wire_len;
+		iovcnt = 2;
+	}
+
+	// the connection frees res_rpc_data once sent, data2 is queued by reference meanwhile
+	return connectionSend(conn, !has_request_id, seq, iov, iovcnt, total_res_size > 0 ? res_rpc_data : NULL);
+}
+
+/* hand the call of job to the rpc_async_handler of its function, which answers through */
+/* rpc_complete whenever it is done while this thread moves on to other requests */
+static void serveStartAsync(rpc_server *srv, connection_t *conn, rpc_job_t *job, rpc_async_handler handler) {
+	rpc_token *token = poolAlloc(sizeof(*token));
+	token->srv = srv;
+	token->conn = conn;
+	token->fid = job->fid;
+	token->has_request_id = job->has_request_id;
+	token->request_id = job->request_id;
+	token->seq = job->seq;
+	token->bytes_in = getRPCDataLen(job->input);
+	connectionRetain(conn);
+
+	TRACE(RPC_TRACE_DEBUG, TRACE_HANDLER_START, job->fid, 1);
+	token->start_ns = statsNow();
+	handler(job->input, token);
+}
+
+/* Sends the answer of a call to a rpc_register_async function, see rpc_ext.h */
+void rpc_complete(rpc_token *token, rpc_data *result) {
+	if (token == NULL) {
+		rpc_data_free(result);
+		return;
+	}
+	uint64_t latency_ns = statsNow() - token->start_ns;
+	int valid = isRPCDataValid(result);
+	TRACE(RPC_TRACE_DEBUG, TRACE_HANDLER_END, token->fid, !valid);
+	functionStats_t *stats = getStatsFunctionList(token->srv->functionList, token->fid);
+	if (stats != NULL) {
+		statsRecord(stats, latency_ns, 1, !valid, token->bytes_in, valid ? getRPCDataLen(result) : 0);
+	}
+
+	connection_t *conn = token->conn;
+	serveFinishCall(token->srv, conn, token->fid);
+	if (serveSendResult(conn, token->has_request_id, token->request_id, token->seq, result) < 0) {
+		// wake the reactor up, it notices the broken socket & closes the connection
+		shutdown(conn->sockfd, SHUT_RDWR);
+	}
+	connectionRelease(conn);
+	poolFree(token);
+}
+
+/* answer a call with nothing but a status: status in v2, a v1 rpc_data_len of len */
+/* RETURNS: 0 if the connection stays open, -1 if it should be closed */
+static int serveSendStatus(connection_t *conn, int has_request_id, uint32_t request_id, uint32_t seq,
+uint8_t status, uint32_t len) {
+	// [request_id] len, or a v2 header with status
+	char res_buffer[RPC_V2_HEADER_SIZE];
+	char *ptr = res_buffer;
+	if (conn->version == 2) {
+		ptr += loadFrameHeaderV2(ptr, RPC_OP_REPLY, 0, status, request_id, 0);
+		struct iovec iov = {.iov_base = res_buffer, .iov_len = ptr - res_buffer};
+		return connectionSend(conn, 0, 0, &iov, 1, NULL);
+	}
+	if (has_request_id) {
+		uint32_t request_id_network = htonl(request_id);
+		memcpy(ptr, &request_id_network, sizeof(request_id_network));
+		ptr += sizeof(request_id_network);
+	}
+	uint32_t len_network = htonl(len);
+	memcpy(ptr, &len_network, sizeof(len_network));
+	ptr += sizeof(len_network);
+	struct iovec iov = {.iov_base = res_buffer, .iov_len = ptr - res_buffer};
+	return connectionSend(conn, !has_request_id, seq, &iov, 1, NULL);
+}
+
+/* run the rpc_handler for fid & send its result back to the client */
+/* RETURNS: 0 if the connection stays open, -1 if it should be closed */
+static int serveExecuteCall(rpc_server *srv, connection_t *conn, rpc_job_t *job) {
+	if (job->batch != NULL) {
+		int status = serveExecuteBatch(srv, conn, job);
+		serveFinishCall(srv, conn, job->fid);
+		return status;
+	}
+	if (job->deadline_ns != 0 && statsNow() >= job->deadline_ns) {
+		// the caller has given up already: shed the call instead of running it for nobody,
+		// deadline calls carry a request id so the short reply holds no other reply back
+		functionStats_t *stats = getStatsFunctionList(srv->functionList, job->fid);
+		if (stats != NULL) {
+			statsExpired(stats, 1);
+		}
+		TRACE(RPC_TRACE_DEBUG, TRACE_EXPIRED, job->fid, job->request_id);
+		rpc_data_free(job->input);
+		serveFinishCall(srv, conn, job->fid);
+		// still answered, so the client can let go of the request it gave up on
+		return serveSendStatus(conn, job->has_request_id, job->request_id, job->seq, RPC_STATUS_EXPIRED,
+		RPC_EXPIRED_LEN);
+	}
+	rpc_async_handler async_handler = getAsyncHandlerFunctionList(srv->functionList, job->fid);
+	if (async_handler != NULL) {
+		serveStartAsync(srv, conn, job, async_handler);
+		return 0;
+	}
+
+	// process function
+	rpc_data *res_rpc_data;
+	serveRunHandlers(srv, job->fid, &job->input, 1, &res_rpc_data, 0);
+	serveFinishCall(srv, conn, job->fid);
+	return serveSendResult(conn, job->has_request_id, job->request_id, job->seq, res_rpc_data);
+}
+
+/* check the call to fid arriving on conn against the limits of rpc_set_admission & */
+/* rpc_set_concurrency, RPC_STATS_FUNCTION is always let through so overload stays visible */
+/* RETURNS: 0 if admitted (serveFinishCall once answered), -1 if the call must be turned away */
+static int serveAdmitCall(rpc_server *srv, connection_t *conn, uint16_t fid) {
+	if (fid == srv->stats_fid) {
+		return 0;
+	}
+	if (srv->max_per_connection > 0 &&
+	__atomic_add_fetch(&conn->active, 1, __ATOMIC_RELAXED) > srv->max_per_connection) {
+		__atomic_sub_fetch(&conn->active, 1, __ATOMIC_RELAXED);
+		return -1;
+	}
+	if (admitFunctionList(srv->functionList, fid) < 0) {
+		if (srv->max_per_connection > 0) {
+			__atomic_sub_fetch(&conn->active, 1, __ATOMIC_RELAXED);
+		}
+		return -1;
+	}
+	return 0;
+}
+
+/* turn a call to fid away: the client gets RPC_OVERLOADED_LEN in place of the result */
+/* length right away, without the call having been run */
+/* RETURNS: 0 if the connection stays open, -1 if it should be closed */
+static int serveRejectCall(rpc_server *srv, connection_t *conn, uint16_t fid, int has_request_id,
+uint32_t request_id, uint32_t seq) {
+	functionStats_t *stats = getStatsFunctionList(srv->functionList, fid);
+	if (stats != NULL) {
+		statsRejected(stats, 1);
+	}
+	TRACE(RPC_TRACE_DEBUG, TRACE_REJECTED, fid, request_id);
+	return serveSendStatus(conn, has_request_id, request_id, seq, RPC_STATUS_OVERLOADED, RPC_OVERLOADED_LEN);
+}
+
+/* turn the call of job away with serveRejectCall & free job along with its payloads */
+/* RETURNS: 0 if the connection stays open, -1 if it should be closed */
+static int serveRejectJob(rpc_server *srv, connection_t *conn, rpc_job_t *job) {
+	if (job->batch != NULL) {
+		for (uint32_t i = 0; i < job->batch_n; i++) {
+			rpc_data_free(job->batch[i]);
+		}
+		poolFree(job->batch);
+	}
+	rpc_data_free(job->input);
+	int status = serveRejectCall(srv, conn, job->fid, job->has_request_id, job->request_id, job->seq);
+	poolFree(job);
+	return status;
+}
+
+/* remove out from the streams of its connection, a credit arriving later finds nothing */
+static void serveUnlinkStream(rpc_stream_writer *out) {
+	connection_t *conn = out->conn;
+	pthread_mutex_lock(&conn->lock);
+	rpc_stream_writer **link = (rpc_stream_writer **)&conn->streams;
+	while (*link != out) {
+		link = &(*link)->next;
+	}
+	*link = out->next;
+	pthread_mutex_unlock(&conn->lock);
+}
+
+/* send the reply ending the stream request_id: RPC_STREAM_END_LEN, or 0 if it failed */
+/* RETURNS: 0 if the connection stays open, -1 if it should be closed */
+static int serveSendStreamEnd(connection_t *conn, uint32_t request_id, int failed) {
+	return serveSendStatus(conn, 1, request_id, 0, failed ? RPC_STATUS_ERROR : RPC_STATUS_STREAM_END,
+	failed ? 0 : RPC_STREAM_END_LEN);
+}
+
+/* thread of a streaming call: run the handler, then end the stream & release out */
+static void *serveStreamThread(void *arg) {
+	rpc_stream_writer *out = arg;
+	rpc_server *srv = out->srv;
+	connection_t *conn = out->conn;
+	TRACE(RPC_TRACE_DEBUG, TRACE_HANDLER_START, out->fid, 1);
+	int status = out->handler(out->input, out);
+	rpc_data_free(out->input);
+	uint64_t latency_ns = statsNow() - out->start_ns;
+	TRACE(RPC_TRACE_DEBUG, TRACE_HANDLER_END, out->fid, status < 0);
+	functionStats_t *stats = getStatsFunctionList(srv->functionList, out->fid);
+	if (stats != NULL) {
+		statsRecord(stats, latency_ns, 1, status < 0, out->bytes_in, out->bytes_out);
+	}
+
+	// every chunk is queued already, so the end goes out after the last of them
+	serveUnlinkStream(out);
+	serveFinishCall(srv, conn, out->fid);
+	if (serveSendStreamEnd(conn, out->request_id, status < 0) < 0) {
+		// wake the reactor up, it notices the broken socket & closes the connection
+		shutdown(conn->sockfd, SHUT_RDWR);
+	}
+	connectionRelease(conn);
+	pthread_cond_destroy(&out->cond);
+	poolFree(out);
+	return NULL;
+}
+
+/* start the RPC_CALL_STREAM_FLAG call of job (admitted by serveAdmitCall) on a thread */
+/* of its own, window chunks may go out before the client grants more; job is freed */
+/* RETURNS: 0 if the connection stays open, -1 if it should be closed */
+static int serveStartStream(rpc_server *srv, connection_t *conn, rpc_job_t *job, uint32_t window) {
+	rpc_stream_handler handler = getStreamHandlerFunctionList(srv->functionList, job->fid);
+	if (handler == NULL) {
+		// not a streaming function: the stream ends with an error right away
+		serveFinishCall(srv, conn, job->fid);
+		rpc_data_free(job->input);
+		int status = serveSendStreamEnd(conn, job->request_id, 1);
+		poolFree(job);
+		return status;
+	}
+
+	rpc_stream_writer *out = poolAlloc(sizeof(*out));
+	out->srv = srv;
+	out->conn = conn;
+	out->fid = job->fid;
+	out->request_id = job->request_id;
+	out->handler = handler;
+	out->input = job->input;
+	out->start_ns = statsNow();
+	out->bytes_in = getRPCDataLen(job->input);
+	out->bytes_out = 0;
+	out->credit = window;
+	out->cancelled = 0;
+	pthread_cond_init(&out->cond, NULL);
+	connectionRetain(conn);
+	// linked before the thread starts, so that no credit can miss the stream
+	pthread_mutex_lock(&conn->lock);
+	out->next = conn->streams;
+	conn->streams = out;
+	pthread_mutex_unlock(&conn->lock);
+
+	pthread_attr_t attr;
+	pthread_t thread;
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	int err = pthread_create(&thread, &attr, serveStreamThread, out);
+	pthread_attr_destroy(&attr);
+	if (err != 0) {
+		// out of threads: turn the call away like any other overload
+		serveUnlinkStream(out);
+		connectionRelease(conn);
+		pthread_cond_destroy(&out->cond);
+		poolFree(out);
+		serveFinishCall(srv, conn, job->fid);
+		return serveRejectJob(srv, conn, job);
+	}
+	poolFree(job);
+	return 0;
+}
+
+/* Sends the next chunk of a streaming call, see rpc_ext.h */
+/* RETURNS: 0 on success, -1 if the stream is closed */
+int rpc_stream_write(rpc_stream_writer *out, rpc_data *chunk) {
+	if (out == NULL || !isRPCDataValid(chunk)) {
+		rpc_data_free(chunk);
+		return -1;
+	}
+	connection_t *conn = out->conn;
+	pthread_mutex_lock(&conn->lock);
+	while (out->credit == 0 && !out->cancelled && !conn->closed) {
+		pthread_cond_wait(&out->cond, &conn->lock);
+	}
+	int open = !out->cancelled && !conn->closed;
+	if (open) {
+		out->credit--;
+	}
+	pthread_mutex_unlock(&conn->lock);
+	if (!open) {
+		rpc_data_free(chunk);
+		return -1;
+	}
+
+	out->bytes_out += getRPCDataLen(chunk);
+	if (serveSendResult(conn, 1, out->request_id, 0, chunk) < 0) {
+		shutdown(conn->sockfd, SHUT_RDWR);
+		return -1;
+	}
+	return 0;
+}
+
+/* RPC_STREAM_CREDIT_FLAG: the client of stream request_id takes credit more chunks, */
+/* a credit of 0 cancels the stream */
+static void serveStreamCredit(connection_t *conn, uint32_t request_id, uint32_t credit) {
+	pthread_mutex_lock(&conn->lock);
+	rpc_stream_writer *out = conn->streams;
+	while (out != NULL && out->request_id != request_id) {
+		out = out->next;
+	}
+	// the stream may have ended before the credit arrived
+	if (out != NULL) {
+		if (credit == 0) {
+			out->cancelled = 1;
+		} else {
+			out->credit = out->credit > UINT32_MAX - credit ? UINT32_MAX : out->credit + credit;
+		}
+		pthread_cond_signal(&out->cond);
+	}
+	pthread_mutex_unlock(&conn->lock);
+}
+
+/* wake every stream handler waiting for credit on conn, which has just been closed */
+static void serveWakeStreams(connection_t *conn) {
+	pthread_mutex_lock(&conn->lock);
+	for (rpc_stream_writer *out = conn->streams; out != NULL; out = out->next) {
+		pthread_cond_signal(&out->cond);
+	}
+	pthread_mutex_unlock(&conn->lock);
+}
+
+/* look up fname (fname_len bytes, not NUL-terminated) in the registry */
+/* RETURNS: fid, 0 if not found */
+static uint16_t serveFindName(rpc_server *srv, const char *fname, uint16_t fname_len) {
+	if (fname_len < MIN_FNAME_LEN || fname_len > MAX_FNAME_LEN) {
+		return 0;
+	}
+	char fname_buffer[MAX_FNAME_LEN + 1];
+	memcpy(fname_buffer, fname, fname_len);
+	fname_buffer[fname_len] = '\0';
+	return searchFunction(srv->functionList, fname_buffer);
+}
+
+/* answer the v2 RPC_OP_FIND of header, whose body holds count varint fname_len & fname */
+/* reply body: (varint) registry generation, then one (varint) fid per name */
+/* RETURNS: 0 if the connection stays open, -1 if it should be closed */
+static int serveFindManyV2(rpc_server *srv, connection_t *conn, frameHeader_t *header, char *body) {
+	uint16_t count = header->arg;
+	size_t res_len = RPC_V2_HEADER_SIZE + VARINT_MAX_SIZE + count * VARINT_MAX_SIZE;
+	char *res_buffer = malloc(res_len);
+	assert(res_buffer);
+	char *res_ptr = res_buffer + RPC_V2_HEADER_SIZE;
+	res_ptr += putVarint(res_ptr, functionListGeneration(srv->functionList));
+
+	// every name must fit in the body & the body must hold nothing else
+	char *ptr = body, *end = body + header->body_len;
+	for (uint16_t i = 0; i < count; i++) {
+		uint32_t fname_len;
+		int n = getVarint(ptr, end - ptr, &fname_len);
+		if (n <= 0 || (uint32_t)(end - ptr - n) < fname_len) {
+			ptr = NULL;
+			break;
+		}
+		ptr += n;
+		res_ptr += putVarint(res_ptr, fname_len <= MAX_FNAME_LEN ? serveFindName(srv, ptr, fname_len) : 0);
+		ptr += fname_len;
+	}
+	if (ptr != end) {
+		fprintf(stderr, "socket %d sent a malformed rpc_find_many\n", conn->sockfd);
+		free(res_buffer);
+		return -1;
+	}
+
+	loadFrameHeaderV2(res_buffer, RPC_OP_REPLY, 0, RPC_STATUS_OK, header->request_id,
+	res_ptr - res_buffer - RPC_V2_HEADER_SIZE);
+	struct iovec iov = {.iov_base = res_buffer, .iov_len = res_ptr - res_buffer};
+	int status = connectionSend(conn, 0, 0, &iov, 1, NULL);
+	free(res_buffer);
+	return status;
+}
+
+/* serve one complete rpc_find() / rpc_call() / rpc_close_client() request */
+/* rpc_call() is handed to the worker pool when the server runs with rpc_serve_all_threads */
+/* a large data2 arrives already received in place & is handed to the rpc_handler as is */
+/* the deadline of a RPC_CALL_DEADLINE_FLAG call runs from received_ns, when its last bytes arrived */
+/* RETURNS: 0 if the connection stays open, -1 if it should be closed */
+static int serveClientRequest(reactor_t *reactor, connection_t *conn, frameHeader_t *header, char *body,
+char *data2, uint64_t received_ns) {
+	rpc_server *srv = reactor->srv;
+
+	// rpc_find()
+	if (header->flag == RPC_FIND_FLAG) {
+		// search for matching function
+		uint16_t fid = serveFindName(srv, body, header->arg);
+
+		// sending response (fid) to client, after any earlier in-order reply
+		char res_buffer[UINT16_SIZE];
+		uint16_t fid_network = htons(fid);
+		memcpy(res_buffer, &fid_network, sizeof(fid_network));
+		struct iovec iov = {.iov_base = res_buffer, .iov_len = UINT16_SIZE};
+		return connectionSend(conn, 1, connectionNextOrdered(conn), &iov, 1, NULL);
+	}
+	// features offered by a client as it connects
+	else if (header->flag == RPC_HELLO_FLAG) {
+		// the server always decodes compressed calls, its replies are compressed only
+		// when rpc_set_compression is on here as well
+		uint16_t features = header->arg & RPC_FEATURE_COMPRESS;
+		conn->compress = (features & RPC_FEATURE_COMPRESS) != 0;
+		if (header->version == 2) {
+			// v2 from now on, answered in v2 whatever later version the client offered
+			conn->version = 2;
+			char res_buffer[RPC_V2_HEADER_SIZE + VARINT_MAX_SIZE];
+			size_t features_len = putVarint(res_buffer + RPC_V2_HEADER_SIZE, features);
+			loadFrameHeaderV2(res_buffer, RPC_OP_REPLY, 0, RPC_STATUS_OK, header->request_id, features_len);
+			struct iovec iov = {.iov_base = res_buffer, .iov_len = RPC_V2_HEADER_SIZE + features_len};
+			return connectionSend(conn, 0, 0, &iov, 1, NULL);
+		}
+
+		char res_buffer[UINT16_SIZE];
+		uint16_t features_network = htons(features);
+		memcpy(res_buffer, &features_network, sizeof(features_network));
+		struct iovec iov = {.iov_base = res_buffer, .iov_len = UINT16_SIZE};
+		return connectionSend(conn, 1, connectionNextOrdered(conn), &iov, 1, NULL);
+	}
+	// rpc_find_many()
+	else if (header->flag == RPC_FIND_MANY_FLAG) {
+		if (header->version == 2) {
+			return serveFindManyV2(srv, conn, header, body);
+		}
+		// response: (uint32_t) registry generation, then one (uint16_t) fid per name
+		uint16_t count = header->arg;
+		size_t res_len = UINT32_SIZE + count * UINT16_SIZE;
+		char *res_buffer = malloc(res_len);
+		assert(res_buffer);
+		uint32_t generation_network = htonl(functionListGeneration(srv->functionList));
+		memcpy(res_buffer, &generation_network, sizeof(generation_network));
+
+		// every name must fit in the body & the body must hold nothing else
+		char *ptr = body, *end = body + header->body_len;
+		int malformed = 0;
+		for (uint16_t i = 0; i < count && !malformed; i++) {
+			uint16_t fname_len_network;
+			memcpy(&fname_len_network, ptr, sizeof(fname_len_network));
+			uint16_t fname_len = ntohs(fname_len_network);
+			ptr += UINT16_SIZE;
+			if (end - ptr < fname_len + (count - i - 1) * UINT16_SIZE) {
+				malformed = 1;
+				break;
+			}
+			uint16_t fid_network = htons(serveFindName(srv, ptr, fname_len));
+			memcpy(res_buffer + UINT32_SIZE + i * UINT16_SIZE, &fid_network, sizeof(fid_network));
+			ptr += fname_len;
+		}
+		if (malformed || ptr != end) {
+			fprintf(stderr, "socket %d sent a malformed rpc_find_many\n", conn->sockfd);
+			free(res_buffer);
+			return -1;
+		}
+
+		struct iovec iov = {.iov_base = res_buffer, .iov_len = res_len};
+		int status = connectionSend(conn, 1, connectionNextOrdered(conn), &iov, 1, NULL);
+		free(res_buffer);
+		return status;
+	}
+	// flow control of rpc_call_stream()
+	else if (header->flag == RPC_STREAM_CREDIT_FLAG) {
+		serveStreamCredit(conn, header->request_id, header->credit);
+		return 0;
+	}
+	// rpc_call() / rpc_call_async() / rpc_call_stream()
+	else if (header->flag == RPC_CALL_FLAG || header->flag == RPC_CALL_ID_FLAG ||
+	header->flag == RPC_CALL_DEADLINE_FLAG || header->flag == RPC_CALL_BATCH_FLAG ||
+	header->flag == RPC_CALL_STREAM_FLAG) {
+		uint32_t batch_n = 0;
+		int is_batch = (header->flag == RPC_CALL_BATCH_FLAG);
+		int v2 = (header->version == 2);
+		int malformed;
+		if (is_batch) {
+			malformed = (v2 ? checkRPCDataBatchV2(body, header->body_len, 0, &batch_n) :
+			checkRPCDataBatch(body, header->body_len, 0, &batch_n)) < 0;
+		} else {
+			// data2 received in place was checked as it arrived
+			malformed = data2 == NULL && (v2 ? checkRPCDataV2(header, body) :
+			checkRPCDataBuffer(body, header->body_len)) < 0;
+		}
+		if (malformed) {
+			fprintf(stderr, "socket %d sent a malformed rpc_data\n", conn->sockfd);
+			return -1;
+		}
+
+		rpc_job_t *job = poolAlloc(sizeof(*job));
+		job->conn = conn;
+		job->fid = header->arg;
+		job->has_request_id = (header->flag != RPC_CALL_FLAG);
+		job->request_id = header->request_id;
+		job->seq = job->has_request_id ? 0 : connectionNextOrdered(conn);
+		// the budget left to the caller starts running once the call is here
+		job->deadline_ns = header->timeout_us > 0 ? received_ns + (uint64_t)header->timeout_us * 1000 : 0;
+		job->input = NULL;
+		job->batch = NULL;
+		job->batch_n = batch_n;
+
+		// extract body to input_rpc_data (one per payload for a batch)
+		if (is_batch) {
+			job->batch = poolAlloc((batch_n > 0 ? batch_n : 1) * sizeof(*(job->batch)));
+			if (v2) {
+				extractRPCDataBatchV2(body, header->body_len, batch_n, job->batch);
+			} else {
+				extractRPCDataBatch(body, batch_n, job->batch);
+			}
+		} else {
+			job->input = poolAlloc(sizeof(*(job->input)));
+			if (v2) {
+				extractRPCDataV2(job->input, header, data2 != NULL ? data2 : body, data2 != NULL);
+			} else if (data2 != NULL) {
+				extractRPCDataWithData2(job->input, body, data2);
+			} else {
+				extractRPCDataFromBuffer(job->input, body, header->body_len);
+			}
+		}
+
+		// a result of a pure function the cache already holds is sent right away,
+		// without taking an admission slot or a trip through the worker pool
+		int is_stream = (header->flag == RPC_CALL_STREAM_FLAG);
+		rpc_data *cached = job->input != NULL && !is_stream ? serveCachedResult(srv, job->fid, job->input) : NULL;
+		if (cached != NULL) {
+			rpc_data_free(job->input);
+			int status = serveSendResult(conn, job->has_request_id, job->request_id, job->seq, cached);
+			poolFree(job);
+			return status;
+		}
+
+		// past a limit the call is answered at once instead of queueing up behind the others
+		if (serveAdmitCall(srv, conn, job->fid) < 0) {
+			return serveRejectJob(srv, conn, job);
+		}
+
+		// a stream holds its thread as long as the client reads, so it never takes a worker
+		if (is_stream) {
+			return serveStartStream(srv, conn, job, header->credit);
+		}
+
+		if (srv->jobs == NULL) {
+			int status = serveExecuteCall(srv, conn, job);
+			poolFree(job);
+			return status;
+		}
+
+		// hand the call over to the worker pool, the reactor keeps parsing the next requests
+		connectionRetain(conn);
+		if (workQueueTryPush(srv->jobs, job, srv->max_queued) < 0) {
+			// every worker is busy & the queue is full: shed the call rather than grow the queue
+			connectionRelease(conn);
+			serveFinishCall(srv, conn, job->fid);
+			return serveRejectJob(srv, conn, job);
+		}
+		return 0;
+	}
+	// rpc_close_client()
+	return -1;
+}
+
+/* serve every complete request buffered on conn, their deadlines run from received_ns */
+/* RETURNS: 0 if the connection stays open, -1 if it should be closed */
+static int serveConnectionFrames(reactor_t *reactor, connection_t *conn, uint64_t received_ns) {
+	frameHeader_t *header;
+	char *body, *data2;
+	int ready;
+	while ((ready = connectionNextFrame(conn, &header, &body, &data2)) > 0) {
+		TRACE(RPC_TRACE_DEBUG, TRACE_FRAME, conn->sockfd, (uint64_t)header->flag << 32 | header->body_len);
+		int status = serveClientRequest(reactor, conn, header, body, data2, received_ns);
+		connectionConsumeFrame(conn);
+		if (status < 0) {
+			return -1;
+		}
+	}
+	if (ready < 0) {
+		fprintf(stderr, "socket %d sent a malformed request\n", conn->sockfd);
+		return -1;
+	}
+	return 0;
+}
+
+/* read everything available on conn & serve every complete request it contains */
+/* RETURNS: 0 if the connection stays open, -1 if it should be closed */
+static int serveReadConnection(reactor_t *reactor, connection_t *conn) {
+	while (1) {
+		int received = connectionReceive(conn);
+		if (received < 0) {
+			return -1;
+		}
+		// deadlines of the requests completed by these bytes run from now
+		// & a single recv may hold several requests, or only part of one
+		if (serveConnectionFrames(reactor, conn, statsNow()) < 0) {
+			return -1;
+		}
+
+		// edge-triggered: stop only once the socket is drained
+		if (received == 0) {
+			return 0;
+		}
+	}
+}
+
+/* map the rings the client of conn sent, if they arrived */
+/* RETURNS: 0 once they are set up or while they are on their way, -1 on error */
+static int serveAcceptRings(connection_t *conn) {
+	conn->shm = shmChannelAccept(conn->sockfd);
+	if (conn->shm == NULL) {
+		if (errno == EAGAIN || errno == EWOULDBLOCK) {
+			return 0;
+		}
+		fprintf(stderr, "socket %d did not set up its shared-memory rings\n", conn->sockfd);
+		return -1;
+	}
+	conn->awaiting_shm = 0;
+	return 0;
+}
+
+/* serve the readiness events (EPOLLIN, EPOLLOUT, ...) reported for conn */
+static void serveConnectionEvents(reactor_t *reactor, connection_t *conn, uint32_t events) {
+	if (conn->awaiting_shm) {
+		if (serveAcceptRings(conn) < 0 || (conn->awaiting_shm && (events & (EPOLLERR | EPOLLHUP | EPOLLRDHUP)))) {
+			serveCloseConnection(conn);
+			return;
+		}
+		if (conn->awaiting_shm) {
+			return;
+		}
+		// doorbells may have followed the rings, so serve the events as usual
+	}
+
+	// rings have no EPOLLOUT: the client rings the socket once it made room
+	int status = 0;
+	if ((events & EPOLLOUT) || conn->shm != NULL) {
+		status = connectionFlush(conn);
+	}
+	if (status == 0 && (events & (EPOLLIN | EPOLLRDHUP))) {
+		status = serveReadConnection(reactor, conn);
+	}
+	if (status < 0 || (events & (EPOLLERR | EPOLLHUP))) {
+		serveCloseConnection(conn);
+	}
+}
+
+/* wait for ready sockets & serve them until an error occurs */
+/* readiness is reported by an edge-triggered epoll instance, so the cost of each wakeup */
+/* depends on the number of ready sockets rather than the number of open connections */
+static void serveEpollLoop(reactor_t *reactor) {
+	struct epoll_event events[MAX_EPOLL_EVENTS];
+	while (1) {
+		// wait for ready file descriptors
+		int nready = epoll_wait(reactor->epollfd, events, MAX_EPOLL_EVENTS, -1);
+		if (nready < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("epoll_wait");
+			return;
+		}
+
+		// loop only the ready descriptors
+		for (int i = 0; i < nready; ++i) {
+			connection_t *conn = events[i].data.ptr;
+
+			// create new socket if there is new incoming connection request to listening interface
+			if (conn == NULL) {
+				serveAcceptConnections(reactor, reactor->sockfd, 0);
+				continue;
+			}
+			listener_t *listener = serverFindListener(reactor->srv, conn);
+			if (listener != NULL) {
+				serveAcceptConnections(reactor, listener->sockfd, listener->shm);
+				continue;
+			}
+
+			// client called rpc_find() / rpc_called()
+			serveConnectionEvents(reactor, conn, events[i].events);
+		}
+	}
+}
+
+/* next submission slot of the reactor's ring, tagged for ptr & kind */
+/* RETURNS: io_uring_sqe* or NULL if the ring is stuck */
+static struct io_uring_sqe *serveUringSqe(reactor_t *reactor, void *ptr, int kind) {
+	struct io_uring_sqe *sqe = uringGetSqe(reactor->uring);
+	if (sqe == NULL) {
+		perror("io_uring_enter");
+		return NULL;
+	}
+	sqe->user_data = (uintptr_t)ptr | kind;
+	return sqe;
+}
+
+/* accept connections on listenfd until the request is cancelled, each one completes */
+/* separately; ptr is the reactor for its TCP port or the listener_t */
+static void serveUringAccept(reactor_t *reactor, int listenfd, void *ptr) {
+	struct io_uring_sqe *sqe = serveUringSqe(reactor, ptr, URING_ACCEPT);
+	if (sqe != NULL) {
+		sqe->opcode = IORING_OP_ACCEPT;
+		sqe->fd = listenfd;
+		sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+	}
+}
+
+/* receive on conn until it fails, every completion carries one provided buffer */
+/* RETURNS: 0 on success, -1 if the request could not be queued */
+static int serveUringRecv(reactor_t *reactor, connection_t *conn) {
+	struct io_uring_sqe *sqe = serveUringSqe(reactor, conn, URING_RECV);
+	if (sqe == NULL) {
+		return -1;
+	}
+	sqe->opcode = IORING_OP_RECV;
+	sqe->fd = conn->sockfd;
+	sqe->ioprio = IORING_RECV_MULTISHOT;
+	sqe->flags = IOSQE_BUFFER_SELECT;
+	sqe->buf_group = 0;
+	connectionRetain(conn);
+	return 0;
+}
+
+/* report the (edge-triggered) readiness events of conn until it fails */
+/* RETURNS: 0 on success, -1 if the request could not be queued */
+static int serveUringPoll(reactor_t *reactor, connection_t *conn, uint32_t events) {
+	struct io_uring_sqe *sqe = serveUringSqe(reactor, conn, URING_POLL);
+	if (sqe == NULL) {
+		return -1;
+	}
+	sqe->opcode = IORING_OP_POLL_ADD;
+	sqe->fd = conn->sockfd;
+	sqe->len = IORING_POLL_ADD_MULTI;
+	sqe->poll32_events = events;
+	connectionRetain(conn);
+	return 0;
+}
+
+/* start sending the replies queued on conn, unless a send is in flight already */
+/* RETURNS: 0 on success, -1 if the connection should be closed */
+static int serveUringSend(reactor_t *reactor, connection_t *conn) {
+	struct msghdr *msg = connectionStartSend(conn);
+	if (msg == NULL) {
+		return 0;
+	}
+	struct io_uring_sqe *sqe = serveUringSqe(reactor, conn, URING_SEND);
+	if (sqe == NULL) {
+		connectionSendDone(conn, -1);
+		return -1;
+	}
+	sqe->opcode = IORING_OP_SENDMSG;
+	sqe->fd = conn->sockfd;
+	sqe->addr = (uintptr_t)msg;
+	sqe->len = 1;
+	sqe->msg_flags = MSG_NOSIGNAL;
+	connectionRetain(conn);
+	return 0;
+}
+
+/* start watching a connection the io_uring reactor accepted */
+/* sockets are received from straight into provided buffers & only polled for EPOLLOUT, */
+/* which replies written by worker threads may wait for; rings keep their doorbell socket */
+/* polled, which also reports the arrival of the rings */
+static void serveUringWatch(reactor_t *reactor, connection_t *conn) {
+	int status;
+	if (conn->shm != NULL || conn->awaiting_shm) {
+		status = serveUringPoll(reactor, conn, EPOLLIN | EPOLLOUT | EPOLLRDHUP);
+	} else {
+		status = serveUringRecv(reactor, conn);
+		if (status == 0) {
+			status = serveUringPoll(reactor, conn, EPOLLOUT);
+		}
+	}
+	if (status < 0) {
+		serveCloseConnection(conn);
+	}
+}
+
+/* serve the bytes a recv completion brought for conn */
+/* replies are corked until every completion of the batch is served, then they go out */
+/* with a single sendmsg per connection, submitted together with the next wait */
+/* RETURNS: 0 if the connection stays open, -1 if it should be closed */
+static int serveUringReceived(reactor_t *reactor, connection_t *conn, const char *data, size_t len) {
+	TRACE(RPC_TRACE_DEBUG, TRACE_READ, conn->sockfd, len);
+	if (!conn->corked) {
+		if (reactor->n_corked == reactor->corked_cap) {
+			reactor->corked_cap = reactor->corked_cap > 0 ? 2 * reactor->corked_cap : 64;
+			reactor->corked = realloc(reactor->corked, reactor->corked_cap * sizeof(*(reactor->corked)));
+			assert(reactor->corked);
+		}
+		connectionCork(conn);
+		connectionRetain(conn);
+		reactor->corked[reactor->n_corked++] = conn;
+	}
+
+	// deadlines of the requests completed by these bytes run from now
+	uint64_t received_ns = statsNow();
+	while (len > 0) {
+		size_t taken = connectionReceiveBytes(conn, data, len);
+		data += taken;
+		len -= taken;
+		if (serveConnectionFrames(reactor, conn, received_ns) < 0) {
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/* serve one completion of the reactor's ring */
+static void serveUringCompletion(reactor_t *reactor, uint64_t user_data, int res, uint32_t flags) {
+	void *ptr = (void *)(uintptr_t)(user_data & ~(uint64_t)URING_KIND_MASK);
+	int kind = user_data & URING_KIND_MASK;
+	int more = (flags & IORING_CQE_F_MORE) != 0;
+
+	if (kind == URING_ACCEPT) {
+		if (ptr == NULL) {
+			// cancel request of serveCloseConnection
+			return;
+		}
+		listener_t *listener = serverFindListener(reactor->srv, ptr);
+		int listenfd = listener != NULL ? listener->sockfd : reactor->sockfd;
+		if (res >= 0) {
+			struct sockaddr_storage cliaddr;
+			socklen_t clilen = sizeof(cliaddr);
+			if (getpeername(res, (struct sockaddr *)&cliaddr, &clilen) < 0) {
+				cliaddr.ss_family = AF_UNSPEC;
+			}
+			serveAddConnection(reactor, res, listener != NULL && listener->shm, &cliaddr);
+		} else if (res != -ECANCELED) {
+			fprintf(stderr, "accept: %s\n", strerror(-res));
+		}
+		if (!more && res != -ECANCELED) {
+			serveUringAccept(reactor, listenfd, ptr);
+		}
+		return;
+	}
+
+	connection_t *conn = ptr;
+	int status = 0;
+	if (kind == URING_RECV) {
+		if (flags & IORING_CQE_F_BUFFER) {
+			unsigned bid = flags >> IORING_CQE_BUFFER_SHIFT;
+			if (res > 0 && !conn->closed) {
+				status = serveUringReceived(reactor, conn, uringBuffer(reactor->uring, bid), res);
+			}
+			uringRecycleBuffer(reactor->uring, bid);
+		}
+		if (res == 0 || (res < 0 && res != -ENOBUFS && res != -ECANCELED)) {
+			// end of file or error
+			status = -1;
+		} else if (status == 0 && !more && res != -ECANCELED && !conn->closed) {
+			// the kernel ended the receive, e.g. once every provided buffer was taken:
+			// the ones just served are back, so arm it again
+			status = serveUringRecv(reactor, conn);
+		}
+	} else if (kind == URING_POLL) {
+		if (res > 0 && !conn->closed) {
+			if (conn->shm != NULL || conn->awaiting_shm) {
+				serveConnectionEvents(reactor, conn, res);
+			} else if (connectionFlush(conn) < 0) {
+				status = -1;
+			}
+		}
+		if (!more && res != -ECANCELED && !conn->closed &&
+		serveUringPoll(reactor, conn, conn->shm != NULL || conn->awaiting_shm ? EPOLLIN | EPOLLOUT | EPOLLRDHUP : EPOLLOUT) < 0) {
+			status = -1;
+		}
+	} else if (kind == URING_SEND) {
+		if (connectionSendDone(conn, res) < 0 && res != -ECANCELED) {
+			fprintf(stderr, "sendmsg: %s\n", strerror(-res));
+			status = -1;
+		} else if (!conn->closed) {
+			// a partial send leaves the rest queued, & replies may have lined up meanwhile
+			status = serveUringSend(reactor, conn);
+		}
+		more = 0;
+	}
+
+	if (status < 0) {
+		serveCloseConnection(conn);
+	}
+	// the reference of this request, unless it stays armed
+	if (!more) {
+		connectionRelease(conn);
+	}
+}
+
+/* serve requests with io_uring: multishot accepts & receives into provided buffers report */
+/* whole batches of completions per wait, & the replies of a batch are submitted together */
+/* with the next wait, so a loaded reactor needs about one system call per batch */
+static void serveUringLoop(reactor_t *reactor) {
+	serveUringAccept(reactor, reactor->sockfd, reactor);
+	for (int i = 0; i < reactor->srv->n_listeners; i++) {
+		serveUringAccept(reactor, reactor->srv->listeners[i].sockfd, &reactor->srv->listeners[i]);
+	}
+
+	while (1) {
+		if (uringSubmit(reactor->uring, 1) < 0 && errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+			perror("io_uring_enter");
+			return;
+		}
+
+		struct io_uring_cqe *cqe;
+		while ((cqe = uringPeekCqe(reactor->uring)) != NULL) {
+			uint64_t user_data = cqe->user_data;
+			int res = cqe->res;
+			uint32_t flags = cqe->flags;
+			uringSeenCqe(reactor->uring);
+			serveUringCompletion(reactor, user_data, res, flags);
+		}
+
+		// the batch is served: release the corked replies
+		for (int i = 0; i < reactor->n_corked; i++) {
+			connection_t *conn = reactor->corked[i];
+			connectionUncork(conn);
+			if (serveUringSend(reactor, conn) < 0) {
+				serveCloseConnection(conn);
+			}
+			connectionRelease(conn);
+		}
+		reactor->n_corked = 0;
+	}
+}
+
+/* run the event loop of reactor, on io_uring if the server asked for it & the kernel */
+/* provides it, on epoll otherwise */
+static void serveReactorLoop(reactor_t *reactor) {
+	if (reactor->srv->uring) {
+		// created by the thread that submits to it, so the kernel may defer its work until then
+		reactor->uring = uringCreate(URING_ENTRIES, URING_CQ_ENTRIES,
+		IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN);
+		if (reactor->uring != NULL && uringSetupBuffers(reactor->uring, URING_BUFFERS, URING_BUFFER_SIZE) < 0) {
+			uringFree(reactor->uring);
+			reactor->uring = NULL;
+		}
+		if (reactor->uring != NULL) {
+			serveUringLoop(reactor);
+			return;
+		}
+	}
+	serveEpollLoop(reactor);
+}
+
+/* Start serving requests */
+/* packet serialization inspired from beej's guide (https://beej.us/guide/bgnet/html/#htonsman) */
+/* and https://robinmoussu.gitlab.io/blog/post/binary_serialisation_of_enum/ */
+/* code inspired from COMP30023 Workshop10 */
+void rpc_serve_all(rpc_server *srv) {
+	if (srv == NULL) {
+		return;
+	}
+
+	if (listen(srv->sockfd, SOMAXCONN) < 0) {
+		perror("listen");
+		return;
+	}
+
+	reactor_t reactor = {.srv = srv, .sockfd = srv->sockfd, .epollfd = srv->epollfd};
+	serveReactorLoop(&reactor);
+}
+
+/* worker thread: run queued rpc_call() jobs */
+static void *serveWorkerThread(void *arg) {
+	rpc_server *srv = arg;
+	rpc_job_t *job;
+	while ((job = workQueuePop(srv->jobs)) != NULL) {
+		connection_t *conn = job->conn;
+		if (serveExecuteCall(srv, conn, job) < 0) {
+			// wake the reactor up, it notices the broken socket & closes the connection
+			shutdown(conn->sockfd, SHUT_RDWR);
+		}
+		connectionRelease(conn);
+		poolFree(job);
+	}
+	return NULL;
+}
+
+/* reactor thread entry point */
+static void *serveReactorThread(void *arg) {
+	serveReactorLoop(arg);
+	return NULL;
+}
+
+/* Start serving requests on n_reactors event loops, each accepting on its own
+ * SO_REUSEPORT listening socket, while rpc_handler calls run on a pool of
+ * n_workers threads */
+void rpc_serve_all_threads(rpc_server *srv, int n_reactors, int n_workers) {
+	if (srv == NULL || n_reactors < 1 || n_workers < 0) {
+		return;
+	}
+
+	// reactor 0 reuses the socket & epoll instance created by rpc_init_server
+	reactor_t *reactors = malloc(n_reactors * sizeof(*reactors));
+	assert(reactors);
+	for (int i = 0; i < n_reactors; i++) {
+		reactors[i].srv = srv;
+		reactors[i].uring = NULL;
+		reactors[i].corked = NULL;
+		reactors[i].n_corked = 0;
+		reactors[i].corked_cap = 0;
+		if (i == 0) {
+			reactors[i].sockfd = srv->sockfd;
+			reactors[i].epollfd = srv->epollfd;
+		} else {
+			reactors[i].sockfd = serverBindSocket(srv->port);
+			reactors[i].epollfd = reactors[i].sockfd < 0 ? -1 : serverCreateEpoll(reactors[i].sockfd);
+			if (reactors[i].epollfd < 0) {
+				fprintf(stderr, "failed to create reactor %d\n", i);
+				return;
+			}
+			for (int j = 0; j < srv->n_listeners; j++) {
+				if (serverWatchListener(reactors[i].epollfd, &srv->listeners[j]) < 0) {
+					return;
+				}
+			}
+		}
+		if (listen(reactors[i].sockfd, SOMAXCONN) < 0) {
+			perror("listen");
+			return;
+		}
+	}
+
+	// without workers, every reactor runs its handlers inline
+	if (n_workers > 0) {
+		srv->jobs = workQueueCreate();
+		for (int i = 0; i < n_workers; i++) {
+			pthread_t worker;
+			if (pthread_create(&worker, NULL, serveWorkerThread, srv) != 0) {
+				perror("pthread_create");
+				return;
+			}
+			pthread_detach(worker);
+		}
+	}
+
+	for (int i = 1; i < n_reactors; i++) {
+		if (pthread_create(&reactors[i].thread, NULL, serveReactorThread, &reactors[i]) != 0) {
+			perror("pthread_create");
+			return;
+		}
+	}
+	serveReactorLoop(&reactors[0]);
+}
+
+/* in-flight rpc_call_async() request */
+struct rpc_pending {
+	uint32_t request_id;
+	int done;
+	rpc_data *result;
+	// rpc_call_batch: results go straight to the caller's array
+	rpc_data **batch_out; // NULL for a single call
+	uint32_t batch_n;
+	int batch_failed;     // the server answered the batch (or ended the stream) with an error
+	int overloaded;       // the server turned the call away without running it
+	int expired;          // the server dropped the call unrun once its deadline passed
+	rpc_stream *stream;   // rpc_call_stream: done once the stream has ended, NULL for a call
+	int raw;              // v2 rpc_find_many: data2 of the result is the body of the reply as is
+};
+
+/* rpc_call_stream() call, its chunks wait for rpc_stream_next in a ring */
+struct rpc_stream {
+	rpc_pending *p; // stays in the pending table until the reply ending the stream arrives
+	rpc_data *chunks[RPC_STREAM_WINDOW];
+	uint32_t head;
+	uint32_t n;
+	uint32_t taken; // chunks taken since credit was last sent back
+	int closed;     // rpc_stream_close cancelled it, the chunks still on their way are dropped
+};
+
+struct rpc_client {
+	int sockfd;
+	shmChannel_t *shm; // requests & responses travel through shared-memory rings, NULL for a plain socket
+	int broken; // set once the connection failed, every later call fails fast
+	int compress; // the server agreed on RPC_FEATURE_COMPRESS
+	int version;  // wire protocol spoken: 1, or 2 once the server answered RPC_OP_HELLO
+	uring_t *uring; // rpc_call sends & starts receiving with one io_uring_enter, NULL for plain system calls
+	// bytes received from server but not consumed yet
+	buffer_t *rbuf;
+	// large response being received in place, into data2 of direct_result
+	rpc_pending *direct_pending; // NULL when nobody waits for it
+	rpc_data *direct_result;
+	uint32_t direct_filled;
+	// in-flight requests, slot index is the low 16 bits of the request id
+	rpc_pending **pending;
+	uint32_t pending_cap;
+	uint32_t n_pending;   // slots in use
+	uint32_t n_inflight;  // requests still waiting for their response
+	uint32_t next_slot;
+	uint32_t next_seq;
+	uint32_t n_abandoned; // requests given up by rpc_call_timeout whose response may still come
+	uint32_t n_streams;   // rpc_call_stream streams not ended or closed, the server may send on them
+	// fids already resolved by rpc_find / rpc_find_many
+	nameCache_t *names;
+};
+
+struct rpc_handle {
+	int fid;
+};
+
+/* connection of a rpc_client_pool, cl is only used with lock held */
+typedef struct clientPoolConn {
+	rpc_client *cl;
+	pthread_mutex_t lock;
+	pthread_cond_t progress; // broadcast whenever responses may have been delivered
+	int reading;             // a caller waits for the socket to become readable, without lock
+	int wakefd;              // eventfd the reading caller also waits on, see clientPoolWake
+	int users;               // callers between picking this connection & releasing it
+} clientPoolConn_t;
+
+struct rpc_client_pool {
+	char *addr;
+	int port;
+	int n_conns;
+	clientPoolConn_t *conns;
+	unsigned next; // where the search for an idle connection starts
+};
+
+/* server of a rpc_client_multi */
+typedef struct multiEndpoint {
+	char *addr;
+	int port;
+	rpc_client *cl;      // NULL while the endpoint is down
+	uint32_t epoch;      // bumped by every connection, fids resolved on an earlier one are stale
+	uint64_t retry_ns;   // statsNow() from which an endpoint that is down is reconnected
+	uint64_t ewma_ns;    // smoothed latency of the calls it answered, see multiLatency
+	uint64_t updated_ns; // statsNow() of the last latency smoothed into ewma_ns
+} multiEndpoint_t;
+
+struct rpc_client_multi {
+	multiEndpoint_t *endpoints;
+	int n;
+	uint64_t rng; // xorshift state of the random picks
+};
+
+/* fid of a rpc_multi_handle on one endpoint */
+typedef struct multiFid {
+	uint32_t epoch; // connection of the endpoint it was resolved on, 0 if never
+	int fid;        // 0 if that server has no such function
+} multiFid_t;
+
+struct rpc_multi_handle {
+	char name[MAX_FNAME_LEN + 1];
+	int hedge;              // set by rpc_set_hedging
+	uint64_t hedge_ns;      // delay before a call is duplicated, 0 until enough latencies are known
+	functionStats_t window; // latencies of the calls answered since the last full window
+	functionStats_t last;   // latencies of the last full window
+	int n;
+	multiFid_t fids[];      // one per endpoint
+};
+
+/* request of a rpc_call_multi sent to one endpoint */
+typedef struct multiCall {
+	int endpoint;
+	rpc_pending *p; // NULL once settled
+	uint64_t start_ns;
+} multiCall_t;
+
+/* initialise rpc_client for storing client information, it owns sockfd & shm */
+static rpc_client *clientCreate(int sockfd, shmChannel_t *shm) {
+    rpc_client *client = malloc(sizeof(*client));
+    assert(client);
+	client->sockfd = sockfd;
+	client->shm = shm;
+	client->broken = 0;
+	client->compress = 0;
+	client->version = 1;
+	client->uring = (shm == NULL && ioBackend() == RPC_IO_URING) ? uringCreate(CLIENT_URING_ENTRIES, 0, 0) : NULL;
+	client->rbuf = bufferCreate();
+	client->direct_pending = NULL;
+	client->direct_result = NULL;
+	client->direct_filled = 0;
+	client->pending_cap = CLIENT_PENDING_INIT_SIZE;
+	client->pending = calloc(client->pending_cap, sizeof(*(client->pending)));
+	assert(client->pending);
+	client->n_pending = 0;
+	client->n_inflight = 0;
+	client->next_slot = 0;
+	client->next_seq = 0;
+	client->n_abandoned = 0;
+	client->n_streams = 0;
+	client->names = nameCacheCreate();
+	
+    return client;
+}
+
+static int clientReadExact(rpc_client *cl, char *buffer, size_t len);
+
+/* tell the server this client decodes compressed replies & wait for the features it agrees on */
+/* RETURNS: 0 on success, -1 on error */
+static int clientHello(rpc_client *cl) {
+	char buffer[HEADER_BUFFER_SIZE];
+	uint16_t flag_network = htons(RPC_HELLO_FLAG);
+	uint16_t features_network = htons(RPC_FEATURE_COMPRESS);
+	memcpy(buffer, &flag_network, sizeof(flag_network));
+	memcpy(buffer + UINT16_SIZE, &features_network, sizeof(features_network));
+	struct iovec iov = {.iov_base = buffer, .iov_len = HEADER_BUFFER_SIZE};
+	if (sendFrame(cl->sockfd, cl->shm, &iov, 1) < 0 ||
+	clientReadExact(cl, (char *)&features_network, UINT16_SIZE) < 0) {
+		return -1;
+	}
+	cl->compress = (ntohs(features_network) & RPC_FEATURE_COMPRESS) != 0;
+	return 0;
+}
+
+/* offer features in a v2 hello & switch the client to v2 once the server answers it */
+/* RETURNS: 0 on success, -1 if the server did not answer in v2 (the client is broken then) */
+static int clientHelloV2(rpc_client *cl, uint16_t features) {
+	char buffer[RPC_V2_HEADER_SIZE + VARINT_MAX_SIZE];
+	size_t features_len = putVarint(buffer + RPC_V2_HEADER_SIZE, features);
+	loadFrameHeaderV2(buffer, RPC_OP_HELLO, 0, RPC_STATUS_OK, 0, features_len);
+	struct iovec iov = {.iov_base = buffer, .iov_len = RPC_V2_HEADER_SIZE + features_len};
+	if (sendFrame(cl->sockfd, cl->shm, &iov, 1) < 0 || clientReadExact(cl, buffer, RPC_V2_HEADER_SIZE) < 0) {
+		cl->broken = 1;
+		return -1;
+	}
+
+	// reply: (varint) the features the server agrees to use
+	uint8_t opcode, flags, status;
+	uint32_t request_id, body_len, agreed;
+	if (parseFrameHeaderV2(buffer, &opcode, &flags, &status, &request_id, &body_len) != 2 ||
+	opcode != RPC_OP_REPLY || status != RPC_STATUS_OK || body_len == 0 || body_len > VARINT_MAX_SIZE ||
+	clientReadExact(cl, buffer, body_len) < 0 || getVarint(buffer, body_len, &agreed) != (int)body_len) {
+		cl->broken = 1;
+		return -1;
+	}
+	cl->version = 2;
+	cl->compress = (agreed & RPC_FEATURE_COMPRESS) != 0;
+	return 0;
+}
+
+/* open a connection to addr (port for TCP) without any handshake, *tcp tells whether */
+/* it goes through the network */
+/* RETURNS: rpc_client* on success, NULL on error */
+/* code inspired from COMP30023 Workshop9 */
+static rpc_client *clientConnect(char *addr, int port, int *tcp) {
+	// "unix:" & "shm:" addresses reach a server on the same host, port is not used
+	struct sockaddr_un sun;
+	int sunlen = unixAddress(addr, &sun);
+	*tcp = (sunlen < 0);
+	if (sunlen >= 0) {
+		int sockfd = socket(AF_UNIX, SOCK_STREAM, 0);
+		if (sockfd < 0 || connect(sockfd, (struct sockaddr *)&sun, sunlen) < 0) {
+			fprintf(stderr, "client: failed to connect\n");
+			if (sockfd >= 0) {
+				close(sockfd);
+			}
+			return NULL;
+		}
+		shmChannel_t *shm = NULL;
+		if (strncmp(addr, SHM_SCHEME, strlen(SHM_SCHEME)) == 0 && (shm = shmChannelConnect(sockfd)) == NULL) {
+			close(sockfd);
+			return NULL;
+		}
+		return clientCreate(sockfd, shm);
+	}
+
+	if (port < MIN_PORT_VALUE || port > MAX_PORT_VALUE) {
+		return NULL;
+	}
+	char port_str[6];
+	int sockfd, s;
+	struct addrinfo hints, *servinfo, *rp;
+
+	sprintf(port_str, "%d", port);
+	memset(&hints, 0, sizeof hints);
+	hints.ai_family = AF_INET6; // IPv6
+	hints.ai_socktype = SOCK_STREAM; // Connection-mode byte streams (TCP)
+
+	s = getaddrinfo(addr, port_str, &hints, &servinfo);
+	if (s != 0) {
+		fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(s));
+		return NULL;
+	}
+
+	for (rp = servinfo; rp != NULL; rp = rp->ai_next) {
+		sockfd = socket(rp->ai_family, rp->ai_socktype, rp->ai_protocol);
+		if (sockfd == -1)
+			continue;
+		if (connect(sockfd, rp->ai_addr, rp->ai_addrlen) != -1)
+			break; // success
+		close(sockfd);
+	}
+	if (rp == NULL) {
+		fprintf(stderr, "client: failed to connect\n");
+		return NULL;
+	}
+	freeaddrinfo(servinfo);
+	socketSetLowLatency(sockfd);
+	return clientCreate(sockfd, NULL);
+}
+
+/* Initialises client state */
+/* RETURNS: rpc_client* on success, NULL on error */
+rpc_client *rpc_init_client(char *addr, int port) {
+	if (addr == NULL) {
+		return NULL;
+	}
+	traceInit();
+
+	int tcp;
+	rpc_client *cl = clientConnect(addr, port, &tcp);
+	if (cl == NULL) {
+		return NULL;
+	}
+	// compression only pays off across the network
+	int compress = tcp && compressionMinSize() > 0;
+	if (wireVersion() == RPC_WIRE_V2) {
+		if (clientHelloV2(cl, compress ? RPC_FEATURE_COMPRESS : 0) == 0) {
+			return cl;
+		}
+		// a server older than v2 drops the connection on the hello: speak v1 on a new one
+		rpc_close_client(cl);
+		cl = clientConnect(addr, port, &tcp);
+		if (cl == NULL) {
+			return NULL;
+		}
+	}
+	if (compress && clientHello(cl) < 0) {
+		rpc_close_client(cl);
+		return NULL;
+	}
+	return cl;
+}
+
+
+static rpc_pending *clientAddPending(rpc_client *cl);
+static void clientRemovePending(rpc_client *cl, rpc_pending *p);
+static void clientWaitPending(rpc_client *cl, rpc_pending *p);
+
+/* free the chunks stream holds */
+static void clientStreamDropChunks(rpc_stream *stream) {
+	while (stream->n > 0) {
+		rpc_data_free(stream->chunks[stream->head]);
+		stream->head = (stream->head + 1) % RPC_STREAM_WINDOW;
+		stream->n--;
+	}
+}
+
+/* release stream along with the slot of its request */
+static void clientStreamFree(rpc_client *cl, rpc_stream *stream) {
+	clientStreamDropChunks(stream);
+	clientRemovePending(cl, stream->p);
+	poolFree(stream);
+}
+
+/* hand a response to p: result (NULL for an error) completes a call, while a stream */
+/* queues it as its next chunk & is only completed by the reply ending it (end) */
+static void clientDeliver(rpc_client *cl, rpc_pending *p, rpc_data *result, int end) {
+	rpc_stream *stream = p->stream;
+	if (stream == NULL) {
+		p->result = result;
+		p->done = 1;
+		cl->n_inflight--;
+		return;
+	}
+	if (result != NULL) {
+		if (stream->closed) {
+			rpc_data_free(result);
+		} else if (stream->n == RPC_STREAM_WINDOW) {
+			// the server sent more chunks than it was given credit for
+			fprintf(stderr, "client: stream %" PRIu32 " overran its window\n", p->request_id);
+			rpc_data_free(result);
+			cl->broken = 1;
+		} else {
+			stream->chunks[(stream->head + stream->n) % RPC_STREAM_WINDOW] = result;
+			stream->n++;
+		}
+		return;
+	}
+	p->batch_failed = !end;
+	p->done = 1;
+	if (stream->closed) {
+		cl->n_inflight--;
+		clientStreamFree(cl, stream);
+	} else {
+		cl->n_streams--;
+	}
+}
+
+/* hand a large response received in place over to its rpc_pending */
+static void clientFinishDirect(rpc_client *cl) {
+	rpc_pending *p = cl->direct_pending;
+	if (p != NULL) {
+		clientDeliver(cl, p, cl->direct_result, 0);
+	} else {
+		// nobody waits for it anymore
+		rpc_data_free(cl->direct_result);
+	}
+	cl->direct_pending = NULL;
+	cl->direct_result = NULL;
+	cl->direct_filled = 0;
+}
+
+/* start receiving data2 of a large response (for p, NULL if nobody waits for it) */
+/* straight into result, beginning with the part the receive buffer already holds */
+static void clientStartDirect(rpc_client *cl, rpc_pending *p, rpc_data *result) {
+	size_t buffered = bufferLen(cl->rbuf);
+	cl->direct_filled = buffered < result->data2_len ? buffered : result->data2_len;
+	memcpy(result->data2, bufferHead(cl->rbuf), cl->direct_filled);
+	bufferConsume(cl->rbuf, cl->direct_filled);
+	cl->direct_pending = p;
+	cl->direct_result = result;
+	if (cl->direct_filled == result->data2_len) {
+		clientFinishDirect(cl);
+	}
+}
+
+/* read whatever the server has sent so far into cl->rbuf */
+/* (or straight into data2 of the large response being received) */
+/* RETURNS: number of bytes read, 0 if nothing is available yet (non-blocking only), -1 on error */
+static int clientReceive(rpc_client *cl, int blocking) {
+	if (cl->broken) {
+		return -1;
+	}
+
+	ssize_t n;
+	int flags = blocking ? 0 : MSG_DONTWAIT;
+	if (cl->direct_result != NULL) {
+		char *dest = (char *)cl->direct_result->data2 + cl->direct_filled;
+		size_t len = cl->direct_result->data2_len - cl->direct_filled;
+		if (cl->shm != NULL) {
+			n = shmChannelRecv(cl->shm, dest, len, flags);
+		} else {
+			do {
+				n = recv(cl->sockfd, dest, len, flags);
+			} while (n < 0 && errno == EINTR);
+		}
+	} else if (cl->shm != NULL) {
+		n = shmChannelRecv(cl->shm, bufferReserve(cl->rbuf, CLIENT_READ_SIZE), CLIENT_READ_SIZE, flags);
+		if (n > 0) {
+			bufferCommit(cl->rbuf, n);
+		}
+	} else {
+		n = bufferReadFrom(cl->rbuf, cl->sockfd, CLIENT_READ_SIZE, flags);
+	}
+	if (n < 0 && !blocking && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+		return 0;
+	}
+	if (n <= 0) {
+		if (n < 0)
+			perror("read");
+		cl->broken = 1;
+		return -1;
+	}
+
+	TRACE(RPC_TRACE_DEBUG, TRACE_READ, cl->sockfd, n);
+	if (cl->direct_result != NULL) {
+		cl->direct_filled += n;
+		if (cl->direct_filled == cl->direct_result->data2_len) {
+			clientFinishDirect(cl);
+		}
+	}
+	return n;
+}
+
+/* copy exactly len bytes of the server stream into buffer, blocking until they arrive */
+/* RETURNS: 0 on success, -1 on error */
+static int clientReadExact(rpc_client *cl, char *buffer, size_t len) {
+	while (bufferLen(cl->rbuf) < len) {
+		if (clientReceive(cl, 1) < 0) {
+			return -1;
+		}
+	}
+	memcpy(buffer, bufferHead(cl->rbuf), len);
+	bufferConsume(cl->rbuf, len);
+	return 0;
+}
+
+/* the request still waiting for the response to request_id, NULL if none does */
+static rpc_pending *clientFindPending(rpc_client *cl, uint32_t request_id) {
+	rpc_pending *p = cl->pending[request_id & CLIENT_SLOT_MASK];
+	if (p != NULL && (p->request_id != request_id || p->done)) {
+		return NULL;
+	}
+	return p;
+}
+
+/* a response for request_id found nobody waiting: most likely the late answer to a */
+/* call rpc_call_timeout gave up on */
+static void clientUnexpected(rpc_client *cl, uint32_t request_id) {
+	if (cl->n_abandoned > 0) {
+		cl->n_abandoned--;
+	} else {
+		fprintf(stderr, "client: unexpected response for request %" PRIu32 "\n", request_id);
+	}
+}
+
+/* deliver every complete v2 reply in cl->rbuf to its rpc_pending */
+/* reply layout: v2 header, then a body if its status is RPC_STATUS_OK */
+/* a stream gets any number of them, up to the one with RPC_STATUS_STREAM_END */
+/* large responses switch the client to receiving data2 in place & stop here */
+static void clientConsumeResponsesV2(rpc_client *cl) {
+	while (cl->direct_result == NULL && bufferLen(cl->rbuf) >= RPC_V2_HEADER_SIZE) {
+		char *ptr = bufferHead(cl->rbuf);
+		uint8_t opcode, flags, status;
+		uint32_t request_id, body_len;
+		if (parseFrameHeaderV2(ptr, &opcode, &flags, &status, &request_id, &body_len) != 2 ||
+		opcode != RPC_OP_REPLY || status > RPC_STATUS_EXPIRED || (status != RPC_STATUS_OK && body_len > 0)) {
+			fprintf(stderr, "client: malformed reply\n");
+			cl->broken = 1;
+			return;
+		}
+		rpc_pending *p = clientFindPending(cl, request_id);
+
+		// batches & lookups are always buffered whole, a large rpc_data only up to data2
+		int whole = (p != NULL && (p->batch_out != NULL || p->raw));
+		int large = !whole && status == RPC_STATUS_OK && !(flags & RPC_V2_FLAG_COMPRESSED) &&
+		body_len >= LARGE_PAYLOAD_SIZE;
+		size_t needed = RPC_V2_HEADER_SIZE + (large ? RPC_V2_DATA_HEADER_MAX_SIZE : body_len);
+		if (bufferLen(cl->rbuf) < needed) {
+			// make room for the rest of the response at once
+			bufferReserve(cl->rbuf, needed - bufferLen(cl->rbuf));
+			return;
+		}
+		ptr += RPC_V2_HEADER_SIZE;
+		if (p == NULL) {
+			clientUnexpected(cl, request_id);
+		}
+
+		int malformed = 0;
+		rpc_data *result = NULL;
+		if (status != RPC_STATUS_OK) {
+			// nothing but the status: an error, an overload, an expiry or the end of a stream
+			if (p != NULL) {
+				p->overloaded = (status == RPC_STATUS_OVERLOADED);
+				p->expired = (status == RPC_STATUS_EXPIRED);
+				p->batch_failed = 1;
+			}
+		} else if (whole && p->batch_out != NULL) {
+			uint32_t count;
+			if (checkRPCDataBatchV2(ptr, body_len, 1, &count) < 0 || count != p->batch_n) {
+				malformed = 1;
+			} else {
+				extractRPCDataBatchV2(ptr, body_len, count, p->batch_out);
+				bufferConsume(cl->rbuf, needed);
+				p->done = 1;
+				cl->n_inflight--;
+				continue;
+			}
+		} else if (whole) {
+			result = rpc_data_alloc(body_len);
+			if (body_len > 0) {
+				memcpy(result->data2, ptr, body_len);
+			}
+		} else if (large) {
+			// receive data2 straight into its final buffer
+			int data1;
+			uint32_t data2_len;
+			int n = parseRPCDataHeaderV2(ptr, RPC_V2_DATA_HEADER_MAX_SIZE, &data1, &data2_len);
+			if (n <= 0 || body_len - n != data2_len) {
+				malformed = 1;
+			} else {
+				result = rpc_data_alloc(data2_len);
+				result->data1 = data1;
+				bufferConsume(cl->rbuf, RPC_V2_HEADER_SIZE + n);
+				clientStartDirect(cl, p, result);
+				continue;
+			}
+		} else if (checkRPCDataBufferV2(ptr, body_len, flags) < 0) {
+			malformed = 1;
+		} else if (p != NULL) {
+			result = poolAlloc(sizeof(*result));
+			extractRPCDataFromBufferV2(result, ptr, body_len, flags);
+		}
+		if (malformed) {
+			fprintf(stderr, "client: malformed response for request %" PRIu32 "\n", request_id);
+			cl->broken = 1;
+			return;
+		}
+		bufferConsume(cl->rbuf, needed);
+		if (p != NULL) {
+			clientDeliver(cl, p, result, status == RPC_STATUS_STREAM_END);
+		}
+	}
+}
+
+/* deliver every complete call response in cl->rbuf to its rpc_pending */
+/* response layout: (uint32_t) request_id, (uint32_t) rpc_data_len, rpc_data */
+/* a stream gets any number of them, up to the one whose rpc_data_len is RPC_STREAM_END_LEN */
+/* large responses switch the client to receiving data2 in place & stop here */
+static void clientConsumeResponses(rpc_client *cl) {
+	if (cl->version == 2) {
+		clientConsumeResponsesV2(cl);
+		return;
+	}
+	while (cl->direct_result == NULL && bufferLen(cl->rbuf) >= 2 * UINT32_SIZE) {
+		char *ptr = bufferHead(cl->rbuf);
+		uint32_t request_id_network, return_data_len_network;
+		memcpy(&request_id_network, ptr, UINT32_SIZE);
+		memcpy(&return_data_len_network, ptr + UINT32_SIZE, UINT32_SIZE);
+		uint32_t request_id = ntohl(request_id_network);
+		uint32_t return_data_len = ntohl(return_data_len_network);
+		rpc_pending *p = clientFindPending(cl, request_id);
+
+		// a batch response is always buffered whole, an overloaded or expired one is only its lengths
+		int batch = (p != NULL && p->batch_out != NULL);
+		int overloaded = (return_data_len == RPC_OVERLOADED_LEN);
+		int expired = (return_data_len == RPC_EXPIRED_LEN);
+		int ended = (return_data_len == RPC_STREAM_END_LEN);
+		int bare = overloaded || expired || ended;
+		int large = !batch && !bare && return_data_len >= LARGE_PAYLOAD_SIZE;
+		size_t needed = 2 * UINT32_SIZE + (bare ? 0 : large ? RPC_DATA_HEADER_SIZE : return_data_len);
+		if (large && bufferLen(cl->rbuf) >= needed && isRPCDataCompressed(ptr + 2 * UINT32_SIZE)) {
+			// a compressed data2 is inflated out of the receive buffer instead
+			large = 0;
+			needed = 2 * UINT32_SIZE + return_data_len;
+		}
+		if (bufferLen(cl->rbuf) < needed) {
+			// make room for the rest of the response at once
+			bufferReserve(cl->rbuf, needed - bufferLen(cl->rbuf));
+			return;
+		}
+		ptr += 2 * UINT32_SIZE;
+		if (p == NULL) {
+			clientUnexpected(cl, request_id);
+		}
+		if (overloaded || expired) {
+			// no result follows, the call was never run
+			bufferConsume(cl->rbuf, needed);
+			if (p != NULL) {
+				p->overloaded = overloaded;
+				p->expired = expired;
+				p->batch_failed = 1;
+				clientDeliver(cl, p, NULL, 0);
+			}
+			continue;
+		}
+		if (ended) {
+			bufferConsume(cl->rbuf, needed);
+			if (p != NULL) {
+				clientDeliver(cl, p, NULL, 1);
+			}
+			continue;
+		}
+		if (batch) {
+			// response layout: (uint32_t) request_id, (uint32_t) batch_len, batch
+			uint32_t count;
+			if (return_data_len > 0 && (checkRPCDataBatch(ptr, return_data_len, 1, &count) < 0 ||
+			count != p->batch_n)) {
+				fprintf(stderr, "client: malformed response for request %" PRIu32 "\n", request_id);
+				cl->broken = 1;
+				return;
+			}
+			if (return_data_len > 0) {
+				extractRPCDataBatch(ptr, count, p->batch_out);
+			} else {
+				p->batch_failed = 1;
+			}
+			bufferConsume(cl->rbuf, needed);
+			p->done = 1;
+			cl->n_inflight--;
+			continue;
+		}
+		if (return_data_len > 0 && checkRPCDataBuffer(ptr, return_data_len) < 0) {
+			fprintf(stderr, "client: malformed response for request %" PRIu32 "\n", request_id);
+			cl->broken = 1;
+			return;
+		}
+
+		rpc_data *result = NULL;
+		if (large) {
+			// receive data2 straight into its final buffer
+			result = poolAlloc(sizeof(*result));
+			uint32_t data2_len = return_data_len - RPC_DATA_HEADER_SIZE;
+			extractRPCDataWithData2(result, ptr, poolAlloc(data2_len));
+			bufferConsume(cl->rbuf, needed);
+			clientStartDirect(cl, p, result);
+			continue;
+		}
+
+		// server return invalid rpc_data, if the return_rpc_data_len == 0
+		if (return_data_len > 0 && p != NULL) {
+			result = poolAlloc(sizeof(*result));
+			extractRPCDataFromBuffer(result, ptr, return_data_len);
+		}
+		bufferConsume(cl->rbuf, needed);
+		if (p != NULL) {
+			clientDeliver(cl, p, result, 0);
+		}
+	}
+}
+
+/* block until every in-flight rpc_call_async() request has its response */
+/* RETURNS: 0 on success, -1 on error */
+static int clientDrainPending(rpc_client *cl) {
+	clientConsumeResponses(cl);
+	while (cl->n_inflight > 0) {
+		if (clientReceive(cl, 1) < 0) {
+			return -1;
+		}
+		clientConsumeResponses(cl);
+	}
+	return 0;
+}
+
+/* take in the late answers to abandoned requests that have arrived, without blocking */
+static void clientCollectAbandoned(rpc_client *cl) {
+	while (cl->n_abandoned > 0 && clientReceive(cl, 0) > 0) {
+		clientConsumeResponses(cl);
+	}
+}
+
+/* check that name is a valid function name */
+/* RETURNS: its length, -1 if invalid */
+static int clientCheckName(char *name) {
+	if (name == NULL) {
+		return -1;
+	}
+	int fname_len = strlen(name);
+	if (fname_len > MAX_FNAME_LEN || fname_len < MIN_FNAME_LEN) {
+		return -1;
+	}
+	for (int i = 0; i < fname_len; i++) {
+		if (name[i] < MIN_FNAME_ASCII || name[i] > MAX_FNAME_ASCII) {
+			return -1;
+		}
+	}
+	return fname_len;
+}
+
+/* clientFindMany in v2: the lookup waits for its reply like a call, so calls & streams */
+/* in flight carry on meanwhile */
+/* RETURNS: 0 on success, -1 on error */
+static int clientFindManyV2(rpc_client *cl, char *names[], size_t *pick, size_t n, uint16_t *fids) {
+	rpc_pending *p = clientAddPending(cl);
+	if (p == NULL) {
+		return -1;
+	}
+	p->raw = 1;
+
+	// v2 header, (varint) count, then every name as (varint) fname_len & fname
+	size_t frame_len = RPC_V2_HEADER_SIZE + VARINT_MAX_SIZE;
+	for (size_t i = 0; i < n; i++) {
+		frame_len += VARINT_MAX_SIZE + strlen(names[pick[i]]);
+	}
+	char *frame_buffer = malloc(frame_len);
+	assert(frame_buffer);
+	char *ptr = frame_buffer + RPC_V2_HEADER_SIZE;
+	ptr += putVarint(ptr, n);
+	for (size_t i = 0; i < n; i++) {
+		size_t fname_len = strlen(names[pick[i]]);
+		ptr += putVarint(ptr, fname_len);
+		memcpy(ptr, names[pick[i]], fname_len);
+		ptr += fname_len;
+	}
+	loadFrameHeaderV2(frame_buffer, RPC_OP_FIND, 0, RPC_STATUS_OK, p->request_id,
+	ptr - frame_buffer - RPC_V2_HEADER_SIZE);
+	struct iovec iov = {.iov_base = frame_buffer, .iov_len = ptr - frame_buffer};
+	int status = sendFrame(cl->sockfd, cl->shm, &iov, 1);
+	free(frame_buffer);
+	if (status < 0) {
+		cl->broken = 1;
+		clientRemovePending(cl, p);
+		return -1;
+	}
+
+	clientWaitPending(cl, p);
+	rpc_data *reply = p->result;
+	clientRemovePending(cl, p);
+	if (reply == NULL) {
+		return -1;
+	}
+
+	// reply: (varint) registry generation, then one (varint) fid per name
+	char *end = (char *)reply->data2 + reply->data2_len;
+	uint32_t generation, fid;
+	int len = getVarint(reply->data2, reply->data2_len, &generation);
+	ptr = (char *)reply->data2 + (len > 0 ? len : 0);
+	for (size_t i = 0; len > 0 && i < n; i++) {
+		len = getVarint(ptr, end - ptr, &fid);
+		fids[i] = fid;
+		ptr += len > 0 && fid <= UINT16_MAX ? len : 0;
+	}
+	rpc_data_free(reply);
+	if (len <= 0 || ptr != end) {
+		fprintf(stderr, "client: malformed rpc_find_many reply\n");
+		cl->broken = 1;
+		return -1;
+	}
+
+	// fids cached before the registry changed may be stale
+	nameCacheSetGeneration(cl->names, generation);
+	for (size_t i = 0; i < n; i++) {
+		nameCacheInsert(cl->names, names[pick[i]], fids[i]);
+	}
+	return 0;
+}
+
+/* resolve names[pick[0 .. n)] (n <= CLIENT_FIND_MANY_MAX) with a single request, */
+/* every fid is stored in fids & in the name cache */
+/* RETURNS: 0 on success, -1 on error */
+static int clientFindMany(rpc_client *cl, char *names[], size_t *pick, size_t n, uint16_t *fids) {
+	if (cl->version == 2) {
+		return clientFindManyV2(cl, names, pick, n, fids);
+	}
+	// rpc_find_many() will sent 4 data
+	// 1.(uint16_t *) function_flag: to indicate which function is called
+	// 2.(uint16_t *) count: number of searched function names
+	// 3.(uint32_t *) body_len: length of the names that follow
+	// 4.count times (uint16_t) fname_len & fname: actual searched function names
+	uint32_t body_len = 0;
+	for (size_t i = 0; i < n; i++) {
+		body_len += UINT16_SIZE + strlen(names[pick[i]]);
+	}
+	size_t frame_len = HEADER_BUFFER_SIZE + UINT32_SIZE + body_len;
+	char *frame_buffer = malloc(frame_len);
+	assert(frame_buffer);
+	char *ptr = frame_buffer;
+	uint16_t function_flag_network = htons(RPC_FIND_MANY_FLAG);
+	memcpy(ptr, &function_flag_network, sizeof(function_flag_network));
+	ptr += sizeof(function_flag_network);
+
+	uint16_t count_network = htons(n);
+	memcpy(ptr, &count_network, sizeof(count_network));
+	ptr += sizeof(count_network);
+
+	uint32_t body_len_network = htonl(body_len);
+	memcpy(ptr, &body_len_network, sizeof(body_len_network));
+	ptr += sizeof(body_len_network);
+
+	for (size_t i = 0; i < n; i++) {
+		uint16_t fname_len = strlen(names[pick[i]]);
+		uint16_t fname_len_network = htons(fname_len);
+		memcpy(ptr, &fname_len_network, sizeof(fname_len_network));
+		ptr += sizeof(fname_len_network);
+		memcpy(ptr, names[pick[i]], fname_len);
+		ptr += fname_len;
+	}
+
+	struct iovec iov = {.iov_base = frame_buffer, .iov_len = frame_len};
+	int status = sendFrame(cl->sockfd, cl->shm, &iov, 1);
+	free(frame_buffer);
+	if (status < 0) {
+		cl->broken = 1;
+		return -1;
+	}
+
+	// read respond from server: (uint32_t) registry generation, then one (uint16_t) fid per name
+	uint32_t generation_network;
+	if (clientReadExact(cl, (char *)&generation_network, UINT32_SIZE) < 0 ||
+	clientReadExact(cl, (char *)fids, n * UINT16_SIZE) < 0) {
+		return -1;
+	}
+
+	// fids cached before the registry changed may be stale
+	nameCacheSetGeneration(cl->names, ntohl(generation_network));
+	for (size_t i = 0; i < n; i++) {
+		fids[i] = ntohs(fids[i]);
+		nameCacheInsert(cl->names, names[pick[i]], fids[i]);
+	}
+	return 0;
+}
+
+/* Finds several remote functions by name with a single round trip */
+/* names already resolved by this client are answered from its cache without one */
+/* packet serialization inspired from beej's guide (https://beej.us/guide/bgnet/html/#htonsman) */
+/* and https://robinmoussu.gitlab.io/blog/post/binary_serialisation_of_enum/ */
+int rpc_find_many(rpc_client *cl, char *names[], size_t n, rpc_handle *handles[]) {
+	if (cl == NULL || (n > 0 && (names == NULL || handles == NULL))) {
+		return -1;
+	}
+
+	// answer what the cache knows, collect the rest
+	uint16_t *fids = calloc(n > 0 ? n : 1, sizeof(*fids));
+	size_t *pick = malloc((n > 0 ? n : 1) * sizeof(*pick));
+	assert(fids && pick);
+	size_t n_pick = 0;
+	for (size_t i = 0; i < n; i++) {
+		handles[i] = NULL;
+		if (clientCheckName(names[i]) < 0) {
+			continue;
+		}
+		fids[i] = nameCacheLookup(cl->names, names[i]);
+		if (fids[i] == 0) {
+			pick[n_pick++] = i;
+		}
+	}
+
+	// the v1 fid response carries no request id, so collect outstanding call responses first;
+	// an open stream may send a chunk at any time, & so may a call rpc_call_timeout gave
+	// up on (until the server answers it), so no name is looked up meanwhile
+	int status = 0;
+	if (n_pick > 0 && cl->version == 1) {
+		clientCollectAbandoned(cl);
+	}
+	if (n_pick > 0 && cl->version == 1 && (cl->n_streams > 0 || cl->n_abandoned > 0)) {
+		errno = EBUSY;
+		status = -1;
+	} else if (n_pick > 0 && cl->version == 1 && clientDrainPending(cl) < 0) {
+		status = -1;
+	}
+	uint16_t *picked_fids = malloc((n_pick > 0 ? n_pick : 1) * sizeof(*picked_fids));
+	assert(picked_fids);
+	for (size_t done = 0; status == 0 && done < n_pick; done += CLIENT_FIND_MANY_MAX) {
+		size_t chunk = n_pick - done < CLIENT_FIND_MANY_MAX ? n_pick - done : CLIENT_FIND_MANY_MAX;
+		status = clientFindMany(cl, names, pick + done, chunk, picked_fids + done);
+	}
+	for (size_t i = 0; status == 0 && i < n_pick; i++) {
+		fids[pick[i]] = picked_fids[i];
+	}
+	free(picked_fids);
+	free(pick);
+
+	// stored fid in rpc_handle
+	int found = 0;
+	for (size_t i = 0; status == 0 && i < n; i++) {
+		if (fids[i] != 0) {
+			handles[i] = malloc(sizeof(*(handles[i])));
+			assert(handles[i]);
+			handles[i]->fid = fids[i];
+			found++;
+		}
+	}
+	free(fids);
+	return status < 0 ? -1 : found;
+}
+
+/* Finds a remote function by name */
+/* RETURNS: rpc_handle* on success, NULL on error */
+/* rpc_handle* will be freed with a single call to free(3) */
+rpc_handle *rpc_find(rpc_client *cl, char *name) {
+	if (cl == NULL || clientCheckName(name) < 0) {
+		return NULL;
+	}
+
+	// a cached name costs no round trip, a new one is resolved as a batch of one
+	rpc_handle *res = NULL;
+	if (rpc_find_many(cl, &name, 1, &res) < 0) {
+		return NULL;
+	}
+	return res;
+}
+
+/* reserve a slot for a new in-flight request */
+/* RETURNS: rpc_pending* on success, NULL if too many requests are in flight */
+static rpc_pending *clientAddPending(rpc_client *cl) {
+	if (cl->n_pending == cl->pending_cap) {
+		if (cl->pending_cap > CLIENT_SLOT_MASK) {
+			return NULL;
+		}
+		cl->pending = realloc(cl->pending, 2 * cl->pending_cap * sizeof(*(cl->pending)));
+		assert(cl->pending);
+		memset(cl->pending + cl->pending_cap, 0, cl->pending_cap * sizeof(*(cl->pending)));
+		cl->pending_cap *= 2;
+	}
+
+	// look for a free slot, starting after the last one handed out
+	uint32_t slot = cl->next_slot;
+	while (cl->pending[slot] != NULL) {
+		slot = (slot + 1) % cl->pending_cap;
+	}
+	cl->next_slot = (slot + 1) % cl->pending_cap;
+
+	rpc_pending *p = poolAlloc(sizeof(*p));
+	// the upper bits tell a late response apart from the next request reusing the slot
+	p->request_id = (cl->next_seq++ << 16) | slot;
+	p->done = 0;
+	p->result = NULL;
+	p->batch_out = NULL;
+	p->batch_n = 0;
+	p->batch_failed = 0;
+	p->overloaded = 0;
+	p->expired = 0;
+	p->stream = NULL;
+	p->raw = 0;
+	cl->pending[slot] = p;
+	cl->n_pending++;
+	cl->n_inflight++;
+	return p;
+}
+
+/* release the slot held by p */
+static void clientRemovePending(rpc_client *cl, rpc_pending *p) {
+	cl->pending[p->request_id & CLIENT_SLOT_MASK] = NULL;
+	if (cl->direct_pending == p) {
+		cl->direct_pending = NULL;
+	}
+	cl->n_pending--;
+	if (!p->done && p->stream != NULL && !p->stream->closed) {
+		cl->n_streams--;
+	} else if (!p->done) {
+		cl->n_inflight--;
+	}
+	poolFree(p);
+}
+
+/* send a whole frame & receive what the server answers first with a single io_uring_enter: */
+/* the recv is linked to the sendmsg, so it only starts once every byte of the frame is out */
+/* RETURNS: 0 on success, -1 on error */
+static int clientSendReceive(rpc_client *cl, struct iovec *iov, int iovcnt) {
+	if (cl->direct_result != NULL) {
+		// a large response is being received in place, it goes on with plain recv
+		return sendFrame(cl->sockfd, cl->shm, iov, iovcnt);
+	}
+	size_t len = 0;
+	for (int i = 0; i < iovcnt; i++) {
+		len += iov[i].iov_len;
+	}
+	struct msghdr msg;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = iov;
+	msg.msg_iovlen = iovcnt;
+
+	// the ring is idle between calls, so both slots are free
+	struct io_uring_sqe *send_sqe = uringGetSqe(cl->uring);
+	struct io_uring_sqe *recv_sqe = uringGetSqe(cl->uring);
+	assert(send_sqe && recv_sqe);
+	send_sqe->opcode = IORING_OP_SENDMSG;
+	send_sqe->fd = cl->sockfd;
+	send_sqe->addr = (uintptr_t)&msg;
+	send_sqe->len = 1;
+	send_sqe->msg_flags = MSG_NOSIGNAL | MSG_WAITALL;
+	send_sqe->flags = IOSQE_IO_LINK;
+	send_sqe->user_data = 0;
+	recv_sqe->opcode = IORING_OP_RECV;
+	recv_sqe->fd = cl->sockfd;
+	recv_sqe->addr = (uintptr_t)bufferReserve(cl->rbuf, CLIENT_READ_SIZE);
+	recv_sqe->len = CLIENT_READ_SIZE;
+	recv_sqe->user_data = 1;
+
+	int sent = -1, received = -ECANCELED, completed = 0;
+	while (completed < 2) {
+		struct io_uring_cqe *cqe = uringPeekCqe(cl->uring);
+		if (cqe == NULL) {
+			if (uringSubmit(cl->uring, 1) < 0 && errno != EINTR) {
+				// both requests may still be in flight: the ring goes away with them
+				perror("io_uring_enter");
+				uringFree(cl->uring);
+				cl->uring = NULL;
+				return -1;
+			}
+			continue;
+		}
+		if (cqe->user_data == 0) {
+			sent = cqe->res;
+		} else {
+			received = cqe->res;
+		}
+		uringSeenCqe(cl->uring);
+		completed++;
+	}
+
+	if (sent < 0) {
+		fprintf(stderr, "sendmsg: %s\n", strerror(-sent));
+		return -1;
+	}
+	TRACE(RPC_TRACE_DEBUG, TRACE_WRITE, cl->sockfd, sent);
+	if ((size_t)sent < len) {
+		// a short send broke the link & cancelled the recv: send the rest the plain way
+		while (iovcnt > 0 && (size_t)sent >= iov->iov_len) {
+			sent -= iov->iov_len;
+			iov++;
+			iovcnt--;
+		}
+		iov->iov_base = (char *)iov->iov_base + sent;
+		iov->iov_len -= sent;
+		return sendFrame(cl->sockfd, cl->shm, iov, iovcnt);
+	}
+	if (received > 0) {
+		TRACE(RPC_TRACE_DEBUG, TRACE_READ, cl->sockfd, received);
+		bufferCommit(cl->rbuf, received);
+	} else if (received != -ECANCELED) {
+		if (received < 0) {
+			fprintf(stderr, "read: %s\n", strerror(-received));
+		}
+		cl->broken = 1;
+	}
+	return 0;
+}
+
+/* send a call without waiting for its response, timeout_us > 0 tells the server how */
+/* long the caller waits for it & window > 0 makes it a stream of up to window chunks */
+/* at first; then_receive: the caller waits for the response right away, so with */
+/* io_uring the first receive goes out along with the request */
+/* packet serialization inspired from beej's guide (https://beej.us/guide/bgnet/html/#htonsman) */
+/* and https://robinmoussu.gitlab.io/blog/post/binary_serialisation_of_enum/ */
+/* RETURNS: rpc_pending* on success, NULL on error */
+static rpc_pending *clientSendCall(rpc_client *cl, rpc_handle *h, rpc_data *payload, uint32_t timeout_us,
+uint32_t window, int then_receive) {
+	if (cl == NULL || h == NULL || !isRPCDataValid(payload) || cl->broken) {
+		return NULL;
+	}
+
+	rpc_pending *p = clientAddPending(cl);
+	if (p == NULL) {
+		return NULL;
+	}
+
+	// a large data2 goes out compressed if the server agreed to it & it shrinks enough
+	uint32_t compressed_len = 0;
+	char *compressed = cl->compress ? compressRPCData2(payload, compressionMinSize(), &compressed_len) : NULL;
+	uint32_t data2_wire_len = compressed != NULL ? compressed_len : payload->data2_len;
+
+	// the whole request goes out as a single frame: the other fields are serialized
+	// into header_buffer & data2 is sent straight from the caller's buffer
+	char header_buffer[FRAME_MAX_HEADER_SIZE];
 	char *ptr = header_buffer;
-	uint16_t close_flag_network = htons(RPC_CLOSE_CLIENT_FLAG);
-	memcpy(ptr, &close_flag_network, sizeof(close_flag_network));
-	ptr += sizeof(close_flag_network);
+	if (cl->version == 2) {
+		// v2 header, (varint) fid, [(varint) timeout_us | window], data1 & data2_len
+		ptr += RPC_V2_HEADER_SIZE;
+		ptr += putVarint(ptr, h->fid);
+		if (window > 0 || timeout_us > 0) {
+			ptr += putVarint(ptr, window > 0 ? window : timeout_us);
+		}
+		ptr += loadRPCDataHeaderV2ToBuffer(payload, ptr);
+		uint8_t flags = (window == 0 && timeout_us > 0 ? RPC_V2_FLAG_DEADLINE : 0) |
+		(compressed != NULL ? RPC_V2_FLAG_COMPRESSED : 0);
+		loadFrameHeaderV2(header_buffer, window > 0 ? RPC_OP_CALL_STREAM : RPC_OP_CALL, flags, RPC_STATUS_OK,
+		p->request_id, ptr - header_buffer - RPC_V2_HEADER_SIZE + data2_wire_len);
+	} else {
+		// 1.(uint16_t *) function_flag: to indicate which function is called
+		// 2.(uint16_t *) fid: function_id that we will execute
+		// 3.(uint32_t *) request_id: echoed back by the server with the response
+		// (uint32_t *) timeout_us: RPC_CALL_DEADLINE_FLAG only, window for RPC_CALL_STREAM_FLAG
+		// 4.(uint32_t *) rpc_data_len: length of rpc_data that we will sent
+		// 5.rpc_data (XXX byte): actual rpc_data
+		uint16_t function_flag = window > 0 ? RPC_CALL_STREAM_FLAG : timeout_us > 0 ? RPC_CALL_DEADLINE_FLAG :
+		RPC_CALL_ID_FLAG;
+		uint16_t function_flag_network = htons(function_flag);
+		memcpy(ptr, &function_flag_network, sizeof(function_flag_network));
+		ptr += sizeof(function_flag_network);
+
+		uint16_t fid_network = htons(h->fid);
+		memcpy(ptr, &fid_network, sizeof(fid_network));
+		ptr += sizeof(fid_network);
+
+		uint32_t request_id_network = htonl(p->request_id);
+		memcpy(ptr, &request_id_network, sizeof(request_id_network));
+		ptr += sizeof(request_id_network);
+
+		if (function_flag != RPC_CALL_ID_FLAG) {
+			uint32_t timeout_network = htonl(window > 0 ? window : timeout_us);
+			memcpy(ptr, &timeout_network, sizeof(timeout_network));
+			ptr += sizeof(timeout_network);
+		}
 
-	// add dummy data to make buffer full
-	uint16_t dummy_network = htons(0);
-	memcpy(ptr, &dummy_network, sizeof(dummy_network));
+		// rpc_data_len (include case that payload->data2_len = 0)
+		uint32_t rpc_data_len = compressed != NULL ? RPC_DATA_HEADER_SIZE + compressed_len : getRPCDataLen(payload);
+		uint32_t rpc_data_len_network = htonl(rpc_data_len);
+		memcpy(ptr, &rpc_data_len_network, sizeof(rpc_data_len_network));
+		ptr += sizeof(rpc_data_len_network);
 
-	int n = write(cl->sockfd, header_buffer, HEADER_BUFFER_SIZE);
-	if (n < 0) {
-		perror("socket");
-		free(cl);
+		if (compressed != NULL) {
+			ptr += loadCompressedRPCDataHeaderToBuffer(payload, ptr);
+		} else {
+			ptr += loadRPCDataHeaderToBuffer(payload, ptr);
+		}
+	}
+
+	struct iovec iov[2];
+	iov[0].iov_base = header_buffer;
+	iov[0].iov_len = ptr - header_buffer;
+	iov[1].iov_base = compressed != NULL ? compressed : payload->data2;
+	iov[1].iov_len = data2_wire_len;
+	int iovcnt = payload->data2_len > 0 ? 2 : 1;
+	int status = then_receive && cl->uring != NULL ? clientSendReceive(cl, iov, iovcnt) :
+	sendFrame(cl->sockfd, cl->shm, iov, iovcnt);
+	poolFree(compressed);
+	if (status < 0) {
+		cl->broken = 1;
+		clientRemovePending(cl, p);
+		return NULL;
+	}
+
+	return p;
+}
+
+/* Sends a call to remote function without waiting for its response */
+rpc_pending *rpc_call_async(rpc_client *cl, rpc_handle *h, rpc_data *payload) {
+	return clientSendCall(cl, h, payload, 0, 0, 0);
+}
+
+/* Checks whether the response of an rpc_call_async() request has arrived, without blocking */
+/* RETURNS: 1 if rpc_wait will not block, 0 if still in flight, -1 on error */
+int rpc_poll(rpc_client *cl, rpc_pending *p) {
+	if (cl == NULL || p == NULL) {
+		return -1;
+	}
+	int n;
+	while (!p->done && (n = clientReceive(cl, 0)) > 0) {
+		clientConsumeResponses(cl);
+	}
+	if (p->done) {
+		return 1;
+	}
+	return cl->broken ? -1 : 0;
+}
+
+/* block until p has its response (or the connection fails), */
+/* responses to other in-flight requests are delivered meanwhile */
+static void clientWaitPending(rpc_client *cl, rpc_pending *p) {
+	clientConsumeResponses(cl);
+	while (!p->done) {
+		if (clientReceive(cl, 1) < 0) {
+			break;
+		}
+		clientConsumeResponses(cl);
+	}
+}
+
+/* Waits for the response of an rpc_call_async() request & releases p */
+/* RETURNS: rpc_data* on success, NULL on error */
+rpc_data *rpc_wait(rpc_client *cl, rpc_pending *p) {
+	if (cl == NULL || p == NULL) {
+		return NULL;
+	}
+	clientWaitPending(cl, p);
+	rpc_data *return_data = p->result;
+	if (p->overloaded) {
+		errno = EBUSY;
+	} else if (p->expired) {
+		errno = ETIMEDOUT;
+	}
+	clientRemovePending(cl, p);
+	return return_data;
+}
+
+/* Calls remote function using handle */
+/* RETURNS: rpc_data* on success, NULL on error */
+rpc_data *rpc_call(rpc_client *cl, rpc_handle *h, rpc_data *payload) {
+	rpc_pending *p = clientSendCall(cl, h, payload, 0, 0, 1);
+	if (p == NULL) {
+		return NULL;
+	}
+    return rpc_wait(cl, p);
+}
+
+/* block until p has its response, the connection fails or deadline_ns (statsNow) passes */
+/* RETURNS: 1 once p is done, 0 on timeout, -1 on error */
+static int clientWaitPendingUntil(rpc_client *cl, rpc_pending *p, uint64_t deadline_ns) {
+	clientConsumeResponses(cl);
+	while (!p->done) {
+		int n = clientReceive(cl, 0);
+		if (n > 0) {
+			clientConsumeResponses(cl);
+			continue;
+		}
+		if (n < 0) {
+			return -1;
+		}
+		uint64_t now = statsNow();
+		if (now >= deadline_ns) {
+			return 0;
+		}
+		// a shared-memory channel asks for a doorbell on the socket before reporting EAGAIN
+		struct pollfd pfd = {.fd = cl->sockfd, .events = POLLIN};
+		int timeout_ms = (deadline_ns - now + 999999) / 1000000;
+		if (poll(&pfd, 1, timeout_ms) < 0 && errno != EINTR) {
+			perror("poll");
+			cl->broken = 1;
+			return -1;
+		}
+	}
+	return 1;
+}
+
+/* Calls remote function like rpc_call, but gives up after timeout_ms, see rpc_ext.h */
+/* RETURNS: rpc_data* on success, NULL on error (errno ETIMEDOUT if the deadline passed) */
+rpc_data *rpc_call_timeout(rpc_client *cl, rpc_handle *h, rpc_data *payload, unsigned timeout_ms) {
+	if (timeout_ms == 0) {
+		errno = ETIMEDOUT;
+		return NULL;
+	}
+	// the wire carries a 32-bit microsecond budget (a bit over an hour)
+	uint64_t timeout_us = (uint64_t)timeout_ms * 1000;
+	if (timeout_us > UINT32_MAX) {
+		timeout_us = UINT32_MAX;
+	}
+	uint64_t deadline_ns = statsNow() + (uint64_t)timeout_ms * 1000000;
+	rpc_pending *p = clientSendCall(cl, h, payload, timeout_us, 0, 0);
+	if (p == NULL) {
+		return NULL;
+	}
+	if (clientWaitPendingUntil(cl, p, deadline_ns) == 0) {
+		// a response that still comes is dropped quietly, unless it is already being received
+		if (cl->direct_pending != p) {
+			cl->n_abandoned++;
+		}
+		clientRemovePending(cl, p);
+		errno = ETIMEDOUT;
+		return NULL;
+	}
+	return rpc_wait(cl, p);
+}
+
+/* Calls remote function once per payload, all n payloads go out in a single frame */
+/* & all n results come back in a single response */
+/* RETURNS: number of out[i] that are not NULL on success, -1 on error */
+int rpc_call_batch(rpc_client *cl, rpc_handle *h, rpc_data *in[], size_t n, rpc_data *out[]) {
+	if (cl == NULL || h == NULL || (n > 0 && (in == NULL || out == NULL)) || cl->broken) {
+		return -1;
+	}
+	for (size_t i = 0; i < n; i++) {
+		out[i] = NULL;
+	}
+	for (size_t i = 0; i < n; i++) {
+		if (!isRPCDataValid(in[i])) {
+			return -1;
+		}
+	}
+	if (n == 0) {
+		return 0;
+	}
+
+	// rpc_call_batch() will sent 5 data
+	// 1.(uint16_t *) function_flag: to indicate which function is called
+	// 2.(uint16_t *) fid: function_id that we will execute
+	// 3.(uint32_t *) request_id: echoed back by the server with the response
+	// 4.(uint32_t *) batch_len: length of the batch that we will sent
+	// 5.batch (XXX byte): count, then every rpc_data_len & rpc_data
+	// (v2: header, (varint) fid, then the batch, see loadRPCDataBatchV2ToBuffer)
+	int v2 = (cl->version == 2);
+	size_t header_len = v2 ? RPC_V2_HEADER_SIZE + VARINT_MAX_SIZE : HEADER_BUFFER_SIZE + 2 * UINT32_SIZE;
+	uint64_t batch_len = v2 ? getRPCDataBatchLenV2(in, n) : getRPCDataBatchLen(in, n);
+	if (n > UINT32_MAX || batch_len > UINT32_MAX - header_len) {
+		return -1;
+	}
+
+	rpc_pending *p = clientAddPending(cl);
+	if (p == NULL) {
+		return -1;
+	}
+	p->batch_out = out;
+	p->batch_n = n;
+
+	// small payloads are the point of a batch, so they are copied into one buffer
+	char *frame_buffer = poolAlloc(header_len + batch_len);
+	char *ptr = frame_buffer;
+	if (v2) {
+		ptr += RPC_V2_HEADER_SIZE;
+		ptr += putVarint(ptr, h->fid);
+		ptr += loadRPCDataBatchV2ToBuffer(in, n, ptr);
+		loadFrameHeaderV2(frame_buffer, RPC_OP_CALL_BATCH, 0, RPC_STATUS_OK, p->request_id,
+		ptr - frame_buffer - RPC_V2_HEADER_SIZE);
+	} else {
+		uint16_t function_flag_network = htons(RPC_CALL_BATCH_FLAG);
+		memcpy(ptr, &function_flag_network, sizeof(function_flag_network));
+		ptr += sizeof(function_flag_network);
+
+		uint16_t fid_network = htons(h->fid);
+		memcpy(ptr, &fid_network, sizeof(fid_network));
+		ptr += sizeof(fid_network);
+
+		uint32_t request_id_network = htonl(p->request_id);
+		memcpy(ptr, &request_id_network, sizeof(request_id_network));
+		ptr += sizeof(request_id_network);
+
+		uint32_t batch_len_network = htonl(batch_len);
+		memcpy(ptr, &batch_len_network, sizeof(batch_len_network));
+		ptr += sizeof(batch_len_network);
+
+		ptr += loadRPCDataBatchToBuffer(in, n, ptr);
+	}
+
+	struct iovec iov = {.iov_base = frame_buffer, .iov_len = ptr - frame_buffer};
+	int status = sendFrame(cl->sockfd, cl->shm, &iov, 1);
+	poolFree(frame_buffer);
+	if (status < 0) {
+		cl->broken = 1;
+		clientRemovePending(cl, p);
+		return -1;
+	}
+
+	clientWaitPending(cl, p);
+	int found = -1;
+	if (p->done && !p->batch_failed) {
+		found = 0;
+		for (size_t i = 0; i < n; i++) {
+			found += (out[i] != NULL);
+		}
+	}
+	if (p->overloaded) {
+		errno = EBUSY;
+	}
+	clientRemovePending(cl, p);
+	return found;
+}
+
+/* send RPC_STREAM_CREDIT_FLAG: the stream request_id may send credit more chunks, */
+/* 0 cancels it */
+/* RETURNS: 0 on success, -1 on error */
+static int clientSendCredit(rpc_client *cl, uint32_t request_id, uint32_t credit) {
+	// (uint16_t) flag, (uint16_t) 0, (uint32_t) request_id, (uint32_t) credit,
+	// or v2 header & (varint) credit
+	char buffer[RPC_V2_HEADER_SIZE + VARINT_MAX_SIZE];
+	char *ptr = buffer;
+	if (cl->version == 2) {
+		size_t credit_len = putVarint(buffer + RPC_V2_HEADER_SIZE, credit);
+		ptr += loadFrameHeaderV2(buffer, RPC_OP_STREAM_CREDIT, 0, RPC_STATUS_OK, request_id, credit_len) + credit_len;
+		struct iovec iov = {.iov_base = buffer, .iov_len = ptr - buffer};
+		if (sendFrame(cl->sockfd, cl->shm, &iov, 1) < 0) {
+			cl->broken = 1;
+			return -1;
+		}
+		return 0;
+	}
+	uint16_t flag_network = htons(RPC_STREAM_CREDIT_FLAG);
+	memcpy(ptr, &flag_network, sizeof(flag_network));
+	ptr += sizeof(flag_network);
+	uint16_t arg_network = htons(0);
+	memcpy(ptr, &arg_network, sizeof(arg_network));
+	ptr += sizeof(arg_network);
+	uint32_t request_id_network = htonl(request_id);
+	memcpy(ptr, &request_id_network, sizeof(request_id_network));
+	ptr += sizeof(request_id_network);
+	uint32_t credit_network = htonl(credit);
+	memcpy(ptr, &credit_network, sizeof(credit_network));
+	ptr += sizeof(credit_network);
+
+	struct iovec iov = {.iov_base = buffer, .iov_len = ptr - buffer};
+	if (sendFrame(cl->sockfd, cl->shm, &iov, 1) < 0) {
+		cl->broken = 1;
+		return -1;
+	}
+	return 0;
+}
+
+/* Calls a function that answers with a stream of chunks, see rpc_ext.h */
+/* RETURNS: rpc_stream* on success, NULL on error */
+rpc_stream *rpc_call_stream(rpc_client *cl, rpc_handle *h, rpc_data *payload) {
+	rpc_pending *p = clientSendCall(cl, h, payload, 0, RPC_STREAM_WINDOW, 0);
+	if (p == NULL) {
+		return NULL;
+	}
+	rpc_stream *stream = poolAlloc(sizeof(*stream));
+	stream->p = p;
+	stream->head = 0;
+	stream->n = 0;
+	stream->taken = 0;
+	stream->closed = 0;
+	p->stream = stream;
+	// counted apart from the calls, which clientDrainPending waits for
+	cl->n_inflight--;
+	cl->n_streams++;
+	return stream;
+}
+
+/* Takes the next chunk of a stream, see rpc_ext.h */
+/* RETURNS: 1 with *chunk set, 0 once the stream has ended, -1 on error */
+int rpc_stream_next(rpc_client *cl, rpc_stream *stream, rpc_data **chunk) {
+	if (cl == NULL || stream == NULL || chunk == NULL) {
+		return -1;
+	}
+	*chunk = NULL;
+	rpc_pending *p = stream->p;
+	clientConsumeResponses(cl);
+	while (stream->n == 0 && !p->done) {
+		if (clientReceive(cl, 1) < 0) {
+			break;
+		}
+		clientConsumeResponses(cl);
+	}
+
+	if (stream->n > 0) {
+		*chunk = stream->chunks[stream->head];
+		stream->head = (stream->head + 1) % RPC_STREAM_WINDOW;
+		stream->n--;
+		// credit goes back half a window at a time, rather than one frame per chunk
+		if (!p->done && ++stream->taken >= RPC_STREAM_WINDOW / 2) {
+			clientSendCredit(cl, p->request_id, stream->taken);
+			stream->taken = 0;
+		}
+		return 1;
+	}
+	if (p->done && !p->batch_failed) {
+		return 0;
+	}
+	if (p->overloaded) {
+		errno = EBUSY;
+	}
+	return -1;
+}
+
+/* Releases a stream, cancelling it if it has not ended, see rpc_ext.h */
+void rpc_stream_close(rpc_client *cl, rpc_stream *stream) {
+	if (cl == NULL || stream == NULL) {
 		return;
 	}
+	if (stream->p->done || cl->broken || clientSendCredit(cl, stream->p->request_id, 0) < 0) {
+		clientStreamFree(cl, stream);
+		return;
+	}
+	// the slot waits for the reply ending the stream like any call in flight, the
+	// chunks sent before the server saw the cancel are dropped as they arrive
+	clientStreamDropChunks(stream);
+	stream->closed = 1;
+	cl->n_streams--;
+	cl->n_inflight++;
+}
+
+/* Cleans up client state and closes client */
+void rpc_close_client(rpc_client *cl) {
+	// sent flag = 0, to indicate closing socket signal (RPC_OP_CLOSE in v2)
+	char header_buffer[RPC_V2_HEADER_SIZE];
+	size_t header_len = HEADER_BUFFER_SIZE;
+	if (cl->version == 2) {
+		header_len = loadFrameHeaderV2(header_buffer, RPC_OP_CLOSE, 0, RPC_STATUS_OK, 0, 0);
+	} else {
+		char *ptr = header_buffer;
+		uint16_t close_flag_network = htons(RPC_CLOSE_CLIENT_FLAG);
+		memcpy(ptr, &close_flag_network, sizeof(close_flag_network));
+		ptr += sizeof(close_flag_network);
+
+		// add dummy data to make buffer full
+		uint16_t dummy_network = htons(0);
+		memcpy(ptr, &dummy_network, sizeof(dummy_network));
+	}
 
+	if (!cl->broken) {
+		struct iovec iov = {.iov_base = header_buffer, .iov_len = header_len};
+		sendFrame(cl->sockfd, cl->shm, &iov, 1);
+	}
+
+	// release requests that were never waited for
+	for (uint32_t i = 0; i < cl->pending_cap; i++) {
+		if (cl->pending[i] != NULL) {
+			if (cl->pending[i]->stream != NULL) {
+				clientStreamDropChunks(cl->pending[i]->stream);
+				poolFree(cl->pending[i]->stream);
+			}
+			rpc_data_free(cl->pending[i]->result);
+			poolFree(cl->pending[i]);
+		}
+	}
+	free(cl->pending);
+	rpc_data_free(cl->direct_result);
+	bufferFree(cl->rbuf);
+	nameCacheFree(cl->names);
+	shmChannelFree(cl->shm);
+	uringFree(cl->uring);
 	close(cl->sockfd);
 	free(cl);
 }
 
-/* load rpc_data into buffer*/
-void loadRPCDataToBuffer(rpc_data *payload, char *buffer_pointer) {
-	uint64_t data1_network = hton64bit(payload->data1);
-	fprintf(stderr, "[client] rpc_data->data1_network: %" PRIu64 "\n", data1_network);
-	memcpy(buffer_pointer, &data1_network, sizeof(data1_network));
-	buffer_pointer += sizeof(data1_network);
+/* Creates n_conns connections to the same server that any thread may call through */
+/* RETURNS: rpc_client_pool* on success, NULL on error */
+rpc_client_pool *rpc_client_pool_create(char *addr, int port, int n_conns) {
+	if (addr == NULL || n_conns < 1) {
+		return NULL;
+	}
+	rpc_client_pool *pool = malloc(sizeof(*pool));
+	assert(pool);
+	pool->addr = strdup(addr);
+	pool->port = port;
+	pool->n_conns = 0;
+	pool->next = 0;
+	pool->conns = calloc(n_conns, sizeof(*(pool->conns)));
+	assert(pool->conns);
+	for (int i = 0; i < n_conns; i++) {
+		clientPoolConn_t *conn = &pool->conns[i];
+		conn->cl = rpc_init_client(addr, port);
+		if (conn->cl == NULL) {
+			rpc_client_pool_close(pool);
+			return NULL;
+		}
+		conn->wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+		if (conn->wakefd < 0) {
+			rpc_close_client(conn->cl);
+			rpc_client_pool_close(pool);
+			return NULL;
+		}
+		pthread_mutex_init(&conn->lock, NULL);
+		pthread_cond_init(&conn->progress, NULL);
+		pool->n_conns++;
+	}
+	return pool;
+}
 
-	if (payload->data2_len != 0) {
-		uint32_t data2_len_network = htonl(payload->data2_len);
-		memcpy(buffer_pointer, &data2_len_network, sizeof(data2_len_network));
-		buffer_pointer += sizeof(data2_len_network);
+/* pick an idle connection, or the one with the fewest callers if none is idle, */
+/* & lock it; a broken connection nobody else uses is reconnected first */
+static clientPoolConn_t *clientPoolAcquire(rpc_client_pool *pool) {
+	unsigned start = __atomic_fetch_add(&pool->next, 1, __ATOMIC_RELAXED);
+	clientPoolConn_t *best = NULL;
+	int best_users = 0;
+	for (int i = 0; i < pool->n_conns; i++) {
+		clientPoolConn_t *conn = &pool->conns[(start + i) % pool->n_conns];
+		int users = __atomic_load_n(&conn->users, __ATOMIC_RELAXED);
+		if (best == NULL || users < best_users) {
+			best = conn;
+			best_users = users;
+		}
+		if (users == 0) {
+			break;
+		}
+	}
 
-		memcpy(buffer_pointer, payload->data2, payload->data2_len);
+	pthread_mutex_lock(&best->lock);
+	__atomic_add_fetch(&best->users, 1, __ATOMIC_RELAXED);
+	if (best->cl->broken && best->users == 1) {
+		rpc_client *cl = rpc_init_client(pool->addr, pool->port);
+		if (cl != NULL) {
+			rpc_close_client(best->cl);
+			best->cl = cl;
+		}
 	}
+	return best;
 }
 
-/* extract buffer to rpc_data*/
-void extractRPCDataFromBuffer(rpc_data *payload, char *buffer_pointer, uint32_t payload_len) {
-	uint64_t data1_network, data1;
-	memcpy(&data1_network, buffer_pointer, sizeof(data1_network));
-	data1 = n64bittoh(data1_network);
-	payload->data1 = data1;
-	buffer_pointer += sizeof(data1_network);
+/* wake the caller waiting for the socket (lock held): responses it waits for may have */
+/* been taken off the socket by someone else, after which the socket stays quiet */
+static void clientPoolWake(clientPoolConn_t *conn) {
+	if (conn->reading) {
+		uint64_t one = 1;
+		ssize_t n = write(conn->wakefd, &one, sizeof(one));
+		(void)n; // EAGAIN: the counter is non-zero, so the reader wakes up anyway
+	}
+}
 
-	fprintf(stderr, "payload->data1: %d\n", payload->data1);
-	
-	if (payload_len == RPC_DATA_NULL_DATA2_SIZE) {
-		// implement NULL data2 incase no data2 in return_buffer
-		payload->data2_len = 0;
-		payload->data2 = NULL;
-	} else {
-		// extract data2_len & data2 if available in return_buffer
-		uint32_t data2_len_network, data2_len;
-		memcpy(&data2_len_network, buffer_pointer, sizeof(data2_len_network));
-		data2_len = ntohl(data2_len_network);
-		payload->data2_len = data2_len;
-		buffer_pointer += sizeof(data2_len_network);
-
-		payload->data2 = malloc(payload->data2_len);
-		if (payload->data2 == NULL) {
-			perror("Memory allocation failed");
-		}
-		memcpy(payload->data2, buffer_pointer, payload->data2_len);
-	}
-	fprintf(stderr, "payload->data2_len: %ld\n", payload->data2_len);
-	fprintf(stderr, "payload->data2: %p\n", payload->data2);
-}
-
-/* convert 64-bit data to network byte order format */
-/* inspired from https://codereview.stackexchange.com/questions/151049/endianness-conversion-in-c */
-uint64_t hton64bit(uint64_t data) {
-    // Check the host's byte order
-    static const int32_t num = 1;
-    static const uint8_t* const is_little_endian_pointer = (const uint8_t*)&num;
-    if (*is_little_endian_pointer == 1) {
-        return ((data & 0x00000000000000FFULL) << 56) |
-               ((data & 0x000000000000FF00ULL) << 40) |
-               ((data & 0x0000000000FF0000ULL) << 24) |
-               ((data & 0x00000000FF000000ULL) << 8) |
-               ((data & 0x000000FF00000000ULL) >> 8) |
-               ((data & 0x0000FF0000000000ULL) >> 24) |
-               ((data & 0x00FF000000000000ULL) >> 40) |
-               ((data & 0xFF00000000000000ULL) >> 56);
-    } else {
-        return data;
-    }
+/* unlock a connection taken with clientPoolAcquire */
+static void clientPoolRelease(clientPoolConn_t *conn) {
+	__atomic_sub_fetch(&conn->users, 1, __ATOMIC_RELAXED);
+	// whatever this caller received may complete the calls of others
+	pthread_cond_broadcast(&conn->progress);
+	clientPoolWake(conn);
+	pthread_mutex_unlock(&conn->lock);
 }
 
-/* convert 64-bit data from network byte order format to host format*/
-/* inspired from https://codereview.stackexchange.com/questions/151049/endianness-conversion-in-c */
-uint64_t n64bittoh(uint64_t data) {
-    // Check the format of this host
-	int num = 1;
-	if (*(char*)&num == 0) {
-		// if it's a big endian system
-		return data;
-	} else {
-		// if it's a little endian system
-		return ((data & 0xFFULL) << 56) |
-               ((data & 0xFF00ULL) << 40) |
-               ((data & 0xFF0000ULL) << 24) |
-               ((data & 0xFF000000ULL) << 8) |
-               ((data & 0xFF00000000ULL) >> 8) |
-               ((data & 0xFF0000000000ULL) >> 24) |
-               ((data & 0xFF000000000000ULL) >> 40) |
-               ((data & 0xFF00000000000000ULL) >> 56);
+/* Finds a remote function by name through any connection of the pool */
+/* RETURNS: rpc_handle* on success, NULL on error */
+rpc_handle *rpc_client_pool_find(rpc_client_pool *pool, char *name) {
+	if (pool == NULL) {
+		return NULL;
+	}
+	clientPoolConn_t *conn = clientPoolAcquire(pool);
+	rpc_handle *h = rpc_find(conn->cl, name);
+	clientPoolRelease(conn);
+	return h;
+}
+
+/* Calls remote function through the least loaded connection of the pool, */
+/* several callers share a connection by pipelining their requests on it */
+/* RETURNS: rpc_data* on success, NULL on error */
+rpc_data *rpc_client_pool_call(rpc_client_pool *pool, rpc_handle *h, rpc_data *payload) {
+	if (pool == NULL) {
+		return NULL;
+	}
+	clientPoolConn_t *conn = clientPoolAcquire(pool);
+	rpc_client *cl = conn->cl;
+	rpc_pending *p = rpc_call_async(cl, h, payload);
+	if (p == NULL) {
+		clientPoolRelease(conn);
+		return NULL;
+	}
+
+	// one caller at a time waits for the socket without the lock, so others can send
+	// meanwhile; everyone else waits for it to report progress
+	while (1) {
+		clientConsumeResponses(cl);
+		if (p->done || cl->broken) {
+			break;
+		}
+		int n = clientReceive(cl, 0);
+		if (n > 0) {
+			clientConsumeResponses(cl);
+			pthread_cond_broadcast(&conn->progress);
+			clientPoolWake(conn);
+			continue;
+		}
+		if (n < 0) {
+			break;
+		}
+		if (conn->reading) {
+			pthread_cond_wait(&conn->progress, &conn->lock);
+			continue;
+		}
+		conn->reading = 1;
+		pthread_mutex_unlock(&conn->lock);
+		struct pollfd pfd[2] = {{.fd = cl->sockfd, .events = POLLIN}, {.fd = conn->wakefd, .events = POLLIN}};
+		while (poll(pfd, 2, -1) < 0 && errno == EINTR) {
+		}
+		pthread_mutex_lock(&conn->lock);
+		conn->reading = 0;
+		uint64_t wakeups;
+		if (read(conn->wakefd, &wakeups, sizeof(wakeups)) < 0) {
+			// EAGAIN: nobody woke this caller, the socket did
+		}
+		pthread_cond_broadcast(&conn->progress);
+	}
+
+	rpc_data *result = rpc_wait(cl, p);
+	clientPoolRelease(conn);
+	return result;
+}
+
+/* Closes every connection of the pool, no call may be in progress */
+void rpc_client_pool_close(rpc_client_pool *pool) {
+	if (pool == NULL) {
+		return;
+	}
+	for (int i = 0; i < pool->n_conns; i++) {
+		rpc_close_client(pool->conns[i].cl);
+		close(pool->conns[i].wakefd);
+		pthread_mutex_destroy(&pool->conns[i].lock);
+		pthread_cond_destroy(&pool->conns[i].progress);
+	}
+	free(pool->conns);
+	free(pool->addr);
+	free(pool);
+}
+
+/* Connects to every one of the n servers addrs[i]:ports[i], see rpc_ext.h */
+/* RETURNS: rpc_client_multi* on success, NULL if no server could be reached */
+rpc_client_multi *rpc_init_client_multi(char *addrs[], int ports[], int n) {
+	if (addrs == NULL || ports == NULL || n < 1) {
+		return NULL;
+	}
+	rpc_client_multi *mc = malloc(sizeof(*mc));
+	assert(mc);
+	mc->n = n;
+	mc->rng = statsNow() | 1;
+	mc->endpoints = calloc(n, sizeof(*(mc->endpoints)));
+	assert(mc->endpoints);
+	int connected = 0;
+	for (int i = 0; i < n; i++) {
+		multiEndpoint_t *e = &mc->endpoints[i];
+		e->addr = strdup(addrs[i]);
+		assert(e->addr);
+		e->port = ports[i];
+		e->cl = rpc_init_client(addrs[i], ports[i]);
+		if (e->cl != NULL) {
+			e->epoch = 1;
+			connected++;
+		} else {
+			e->retry_ns = statsNow() + MULTI_RETRY_NS;
+		}
+	}
+	if (connected == 0) {
+		rpc_close_client_multi(mc);
+		return NULL;
+	}
+	return mc;
+}
+
+/* next pseudo-random number of mc (xorshift64*) */
+static uint64_t multiRandom(rpc_client_multi *mc) {
+	mc->rng ^= mc->rng >> 12;
+	mc->rng ^= mc->rng << 25;
+	mc->rng ^= mc->rng >> 27;
+	return mc->rng * 0x2545F4914F6CDD1Dull;
+}
+
+/* drop the connection of e if it broke & reconnect e if it is down & due for a retry */
+/* RETURNS: 0 if e is connected, -1 if it is down */
+static int multiConnect(multiEndpoint_t *e) {
+	if (e->cl != NULL && e->cl->broken) {
+		rpc_close_client(e->cl);
+		e->cl = NULL;
+		e->retry_ns = statsNow() + MULTI_RETRY_NS;
+	}
+	if (e->cl == NULL) {
+		uint64_t now = statsNow();
+		if (now < e->retry_ns) {
+			return -1;
+		}
+		e->cl = rpc_init_client(e->addr, e->port);
+		if (e->cl == NULL) {
+			e->retry_ns = now + MULTI_RETRY_NS;
+			return -1;
+		}
+		// a restarted server may number its functions differently
+		e->epoch++;
+		e->ewma_ns = 0;
+		e->updated_ns = now;
+	}
+	return 0;
+}
+
+/* fid of h on endpoint i, resolved again on every new connection to it */
+/* RETURNS: fid, 0 if the endpoint is down or has no such function */
+static int multiFid(rpc_client_multi *mc, rpc_multi_handle *h, int i) {
+	multiEndpoint_t *e = &mc->endpoints[i];
+	if (multiConnect(e) < 0) {
+		return 0;
+	}
+	multiFid_t *f = &h->fids[i];
+	if (f->epoch != e->epoch) {
+		// only a server that answered is settled: a lookup that failed, e.g. with EBUSY
+		// while a v1 connection still owes a call abandoned by a lost hedge, is retried
+		char *name = h->name;
+		rpc_handle *found = NULL;
+		if (rpc_find_many(e->cl, &name, 1, &found) < 0) {
+			return 0;
+		}
+		f->fid = found != NULL ? found->fid : 0;
+		f->epoch = e->epoch;
+		free(found);
+	}
+	return f->fid;
+}
+
+/* Finds a remote function by name on every server of mc, see rpc_ext.h */
+/* RETURNS: rpc_multi_handle* on success, NULL if no server has it */
+rpc_multi_handle *rpc_find_multi(rpc_client_multi *mc, char *name) {
+	if (mc == NULL || clientCheckName(name) < 0) {
+		return NULL;
+	}
+	rpc_multi_handle *h = calloc(1, sizeof(*h) + mc->n * sizeof(h->fids[0]));
+	assert(h);
+	strcpy(h->name, name);
+	h->n = mc->n;
+	int found = 0;
+	for (int i = 0; i < mc->n; i++) {
+		found += (multiFid(mc, h, i) > 0);
+	}
+	if (found == 0) {
+		free(h);
+		return NULL;
+	}
+	return h;
+}
+
+/* Lets the calls through h be duplicated on a second server, see rpc_ext.h */
+void rpc_set_hedging(rpc_multi_handle *h, int enable) {
+	if (h != NULL) {
+		h->hedge = (enable != 0);
+	}
+}
+
+/* smoothed latency of e at now, halved for every MULTI_DECAY_NS without a new sample */
+static uint64_t multiLatency(multiEndpoint_t *e, uint64_t now) {
+	uint64_t halvings = (now - e->updated_ns) / MULTI_DECAY_NS;
+	return halvings >= 64 ? 0 : e->ewma_ns >> halvings;
+}
+
+/* requests e has not answered yet: waited for, or left behind by a hedge that lost */
+/* (late answers to the latter are collected first, without blocking) */
+static uint32_t multiOutstanding(multiEndpoint_t *e) {
+	rpc_client *cl = e->cl;
+	clientCollectAbandoned(cl);
+	return cl->n_inflight + cl->n_abandoned;
+}
+
+/* power of two choices: among the endpoints serving h that are not in skip, pick two */
+/* at random & keep the one with the lower smoothed latency x (outstanding requests + 1) */
+/* RETURNS: endpoint index, -1 if none is available */
+static int multiPick(rpc_client_multi *mc, rpc_multi_handle *h, int skip[], int n_skip) {
+	int first = -1, second = -1, n_ready = 0;
+	for (int i = 0; i < mc->n; i++) {
+		int skipped = 0;
+		for (int k = 0; k < n_skip; k++) {
+			skipped |= (skip[k] == i);
+		}
+		if (skipped || multiFid(mc, h, i) == 0) {
+			continue;
+		}
+		// reservoir sampling: every pair of ready endpoints is equally likely
+		n_ready++;
+		uint64_t r = n_ready <= 2 ? n_ready - 1 : multiRandom(mc) % n_ready;
+		if (r == 0) {
+			first = i;
+		} else if (r == 1) {
+			second = i;
+		}
 	}
+	if (second < 0) {
+		return first;
+	}
+	multiEndpoint_t *a = &mc->endpoints[first], *b = &mc->endpoints[second];
+	uint64_t now = statsNow();
+	uint64_t score_a = (multiLatency(a, now) + 1) * (multiOutstanding(a) + 1);
+	uint64_t score_b = (multiLatency(b, now) + 1) * (multiOutstanding(b) + 1);
+	return score_a <= score_b ? first : second;
+}
+
+/* send payload for h to endpoint i, then_receive as for clientSendCall */
+/* RETURNS: 0 on success, -1 if the request could not be sent */
+static int multiSend(rpc_client_multi *mc, rpc_multi_handle *h, int i, rpc_data *payload, int then_receive,
+multiCall_t *call) {
+	rpc_handle handle = {.fid = h->fids[i].fid};
+	call->endpoint = i;
+	call->start_ns = statsNow();
+	call->p = clientSendCall(mc->endpoints[i].cl, &handle, payload, 0, 0, then_receive);
+	return call->p != NULL ? 0 : -1;
+}
+
+/* smooth latency_ns into the latency of e */
+static void multiUpdateLatency(multiEndpoint_t *e, uint64_t latency_ns) {
+	uint64_t now = statsNow();
+	uint64_t ewma_ns = multiLatency(e, now);
+	e->ewma_ns = ewma_ns - (ewma_ns >> MULTI_EWMA_SHIFT) + (latency_ns >> MULTI_EWMA_SHIFT);
+	e->updated_ns = now;
+}
+
+/* add a latency to the windows h takes its hedging delay from */
+static void multiRecordLatency(rpc_multi_handle *h, uint64_t latency_ns) {
+	statsRecord(&h->window, latency_ns, 1, 0, 0, 0);
+	if (h->window.calls >= HEDGE_WINDOW) {
+		h->last = h->window;
+		memset(&h->window, 0, sizeof(h->window));
+	}
+	// the quantile is worked out again now & then, not on every call
+	functionStats_t *from = h->last.calls > 0 ? &h->last : &h->window;
+	if (h->window.calls % HEDGE_MIN_SAMPLES == 0 && from->calls >= HEDGE_MIN_SAMPLES) {
+		h->hedge_ns = statsPercentile(from, HEDGE_QUANTILE);
+	}
+}
+
+/* release the request of a settled call, whose response arrived or whose connection broke; */
+/* the latency of an answer feeds the smoothed latency of its endpoint & the hedging delay */
+/* RETURNS: 1 if the server answered (*result set, NULL for an error result), */
+/* 0 if it did not (*overloaded set if it turned the call away) */
+static int multiSettle(rpc_client_multi *mc, rpc_multi_handle *h, multiCall_t *call, rpc_data **result,
+int *overloaded) {
+	multiEndpoint_t *e = &mc->endpoints[call->endpoint];
+	rpc_pending *p = call->p;
+	call->p = NULL;
+	int answered = p->done && !p->overloaded;
+	if (answered) {
+		uint64_t latency_ns = statsNow() - call->start_ns;
+		multiUpdateLatency(e, latency_ns);
+		if (h->hedge) {
+			multiRecordLatency(h, latency_ns);
+		}
+		*result = p->result;
+	} else if (p->overloaded) {
+		// a server turning calls away answers fast, which must not attract more of them
+		multiUpdateLatency(e, (multiLatency(e, statsNow()) + 1) * MULTI_OVERLOAD_PENALTY);
+		*overloaded = 1;
+	}
+	clientRemovePending(e->cl, p);
+	return answered;
+}
+
+/* give up on the calls still waiting, their responses are dropped as they arrive */
+static void multiAbandon(rpc_client_multi *mc, multiCall_t calls[], int n) {
+	uint64_t now = statsNow();
+	for (int k = 0; k < n; k++) {
+		rpc_pending *p = calls[k].p;
+		if (p == NULL) {
+			continue;
+		}
+		multiEndpoint_t *e = &mc->endpoints[calls[k].endpoint];
+		rpc_client *cl = e->cl;
+		// the server that lost the race is at least this slow
+		multiUpdateLatency(e, now - calls[k].start_ns);
+		if (p->done) {
+			rpc_data_free(p->result);
+		} else if (cl->direct_pending != p) {
+			cl->n_abandoned++;
+		}
+		clientRemovePending(cl, p);
+		calls[k].p = NULL;
+	}
+}
+
+/* wait for the first of the n calls to be answered, the others are abandoned */
+/* RETURNS: 1 once a call was answered (*result set), 0 if none was (*overloaded as for multiSettle) */
+static int multiRace(rpc_client_multi *mc, rpc_multi_handle *h, multiCall_t calls[], int n, rpc_data **result,
+int *overloaded) {
+	struct pollfd pfds[2];
+	while (1) {
+		int n_waiting = 0;
+		for (int k = 0; k < n; k++) {
+			if (calls[k].p == NULL) {
+				continue;
+			}
+			rpc_client *cl = mc->endpoints[calls[k].endpoint].cl;
+			clientConsumeResponses(cl);
+			while (!calls[k].p->done && clientReceive(cl, 0) > 0) {
+				clientConsumeResponses(cl);
+			}
+			if (!calls[k].p->done && !cl->broken) {
+				// a shared-memory channel asks for a doorbell on the socket before reporting EAGAIN
+				pfds[n_waiting].fd = cl->sockfd;
+				pfds[n_waiting].events = POLLIN;
+				n_waiting++;
+			} else if (multiSettle(mc, h, &calls[k], result, overloaded)) {
+				multiAbandon(mc, calls, n);
+				return 1;
+			}
+		}
+		if (n_waiting == 0) {
+			return 0;
+		}
+		if (poll(pfds, n_waiting, -1) < 0 && errno != EINTR) {
+			perror("poll");
+			multiAbandon(mc, calls, n);
+			return 0;
+		}
+	}
+}
+
+/* Calls remote function on one of the servers of mc, see rpc_ext.h */
+/* RETURNS: rpc_data* on success, NULL on error */
+rpc_data *rpc_call_multi(rpc_client_multi *mc, rpc_multi_handle *h, rpc_data *payload) {
+	if (mc == NULL || h == NULL || h->n != mc->n || !isRPCDataValid(payload)) {
+		return NULL;
+	}
+	int tried[2 * MULTI_MAX_ATTEMPTS];
+	int n_tried = 0, overloaded = 0;
+	for (int attempt = 0; attempt < MULTI_MAX_ATTEMPTS; attempt++) {
+		int i = multiPick(mc, h, tried, n_tried);
+		if (i < 0) {
+			break;
+		}
+		tried[n_tried++] = i;
+		multiCall_t calls[2];
+		int n_calls = 1;
+		if (multiSend(mc, h, i, payload, !h->hedge, &calls[0]) < 0) {
+			// nothing reached the server, so another one may safely take the call
+			continue;
+		}
+		rpc_client *cl = mc->endpoints[i].cl;
+		if (h->hedge && h->hedge_ns > 0 &&
+		clientWaitPendingUntil(cl, calls[0].p, calls[0].start_ns + h->hedge_ns) == 0) {
+			// slower than HEDGE_QUANTILE of the recent calls: a second server gets a copy
+			int j = multiPick(mc, h, tried, n_tried);
+			if (j >= 0) {
+				tried[n_tried++] = j;
+				n_calls += (multiSend(mc, h, j, payload, 0, &calls[1]) == 0);
+			}
+		}
+		if (n_calls == 1) {
+			clientWaitPending(cl, calls[0].p);
+		}
+
+		rpc_data *result = NULL;
+		if (multiRace(mc, h, calls, n_calls, &result, &overloaded)) {
+			return result;
+		}
+		// a call that reached a server which then went away may have run there: only
+		// functions declared safe to run twice (hedged) are sent again
+		if (!overloaded && !h->hedge) {
+			break;
+		}
+	}
+	if (overloaded) {
+		errno = EBUSY;
+	}
+	return NULL;
+}
+
+/* Closes the connection to every server of mc & frees it */
+void rpc_close_client_multi(rpc_client_multi *mc) {
+	if (mc == NULL) {
+		return;
+	}
+	for (int i = 0; i < mc->n; i++) {
+		if (mc->endpoints[i].cl != NULL) {
+			rpc_close_client(mc->endpoints[i].cl);
+		}
+		free(mc->endpoints[i].addr);
+	}
+	free(mc->endpoints);
+	free(mc);
 }
 
 /* Frees a rpc_data struct */
+/* both buffers go back to the calling thread's pool, whether they came from it or from malloc(3) */
 void rpc_data_free(rpc_data *data) {
     if (data == NULL) {
         return;
     }
     if (data->data2 != NULL) {
-        free(data->data2);
+        poolFree(data->data2);
     }
-    free(data);
-}
\ No newline at end of file
+    poolFree(data);
+}
+
+/* Allocates a rpc_data with room for data2_len bytes of data2 from the calling thread's pool */
+/* RETURNS: rpc_data* with data1 = 0 (data2 is NULL when data2_len is 0) */
+rpc_data *rpc_data_alloc(size_t data2_len) {
+	rpc_data *data = poolAlloc(sizeof(*data));
+	data->data1 = 0;
+	data->data2_len = data2_len;
+	data->data2 = data2_len > 0 ? poolAlloc(data2_len) : NULL;
+	return data;
+}
+
+/* Sets the data2 size from which calls & replies are sent compressed, see rpc_ext.h */
+void rpc_set_compression(size_t min_size) {
+	__atomic_store_n(&compress_min_size, min_size, __ATOMIC_RELAXED);
+}
+
+/* Selects the I/O backend of the servers & clients initialised afterwards, see rpc_ext.h */
+/* RETURNS: the backend in use from now on */
+int rpc_set_io_backend(int backend) {
+	if (backend == RPC_IO_URING) {
+		// a kernel without io_uring, or with io_uring disabled, keeps epoll
+		uring_t *probe = uringCreate(CLIENT_URING_ENTRIES, 0, 0);
+		if (probe == NULL) {
+			backend = RPC_IO_EPOLL;
+		}
+		uringFree(probe);
+	} else {
+		backend = RPC_IO_EPOLL;
+	}
+	__atomic_store_n(&io_backend, backend, __ATOMIC_RELAXED);
+	return backend;
+}
+
+/* Selects the wire protocol of the clients initialised afterwards, see rpc_ext.h */
+/* RETURNS: 0 on success, -1 on error */
+int rpc_set_wire_version(int version) {
+	if (version != RPC_WIRE_V1 && version != RPC_WIRE_V2) {
+		return -1;
+	}
+	__atomic_store_n(&wire_version, version, __ATOMIC_RELAXED);
+	return 0;
+}
@@ -0,0 +1,394 @@
+/* Load generator & latency benchmark for the RPC system
+ * usage: rpc_bench [options], see usage() below
+ * Every connection is driven by its own thread with up to depth calls in flight:
+ * - closed loop (default): a new call is sent as soon as a slot frees up
+ * - open loop (-r): calls are due at a fixed rate whether or not earlier ones returned
+ * Latency is measured from the time a call was due (open loop) or is corrected for
+ * coordinated omission with the mean latency as expected interval (closed loop)
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include "rpc.h"
+#include "rpc_ext.h"
+#include "stats.h"
+
+#define BENCH_MAX_DEPTH 4096
+// open loop: sleep when the next call is due later than this, spin otherwise
+#define BENCH_SPIN_NS 50000
+// open loop: nap between polls for responses while the next call is not due
+#define BENCH_POLL_NS 10000
+
+typedef struct benchConfig {
+    char *addr;
+    int port;
+    char *function;
+    int connections;
+    int depth;
+    size_t min_size; // data2_len of each call, uniform in [min_size, max_size]
+    size_t max_size;
+    double rate;     // calls per second over all connections, 0 for closed loop
+    double duration; // seconds measured
+    double warmup;   // seconds run before measuring
+    int json;
+} benchConfig_t;
+
+typedef struct benchThread {
+    benchConfig_t *config;
+    pthread_t thread;
+    uint64_t start_ns;    // measuring starts here, after warm-up
+    uint64_t end_ns;      // no call is sent from here on
+    uint64_t offset_ns;   // open loop: stagger of this connection's schedule
+    int failed;           // connection could not be set up
+    functionStats_t raw;  // latency from send to response
+    functionStats_t sched; // latency from the time the call was due to response
+} benchThread_t;
+
+/* in-flight call */
+typedef struct benchSlot {
+    rpc_pending *pending;
+    uint64_t due_ns;
+    uint64_t sent_ns;
+    size_t size;
+} benchSlot_t;
+
+/* ---------------------- */
+/* in-process test server */
+/* ---------------------- */
+
+/* returns data1 & data2 unchanged, without copying data2 */
+static rpc_data *benchEcho(rpc_data *in) {
+    rpc_data *out = rpc_data_alloc(0);
+    out->data1 = in->data1;
+    out->data2_len = in->data2_len;
+    out->data2 = in->data2;
+    return out;
+}
+
+/* returns data1 only, so responses stay small whatever the request size */
+static rpc_data *benchSink(rpc_data *in) {
+    rpc_data *out = rpc_data_alloc(0);
+    out->data1 = in->data1;
+    return out;
+}
+
+typedef struct benchServer {
+    rpc_server *srv;
+    int reactors;
+    int workers;
+} benchServer_t;
+
+static void *benchServeThread(void *arg) {
+    benchServer_t *server = arg;
+    rpc_serve_all_threads(server->srv, server->reactors, server->workers);
+    return NULL;
+}
+
+/* start a server with "echo" & "sink" on port (& on addr for a "unix:" or "shm:" addr),
+ * serving from background threads */
+/* RETURNS: 0 on success, -1 on error */
+static int benchStartServer(char *addr, int port, int reactors, int workers) {
+    static benchServer_t server;
+    server.srv = rpc_init_server(port);
+    if (server.srv == NULL || rpc_register(server.srv, "echo", benchEcho) < 0 ||
+        rpc_register(server.srv, "sink", benchSink) < 0) {
+        return -1;
+    }
+    if ((strncmp(addr, "unix:", 5) == 0 || strncmp(addr, "shm:", 4) == 0) && rpc_listen(server.srv, addr) < 0) {
+        return -1;
+    }
+    rpc_freeze(server.srv);
+    server.reactors = reactors;
+    server.workers = workers;
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, benchServeThread, &server) != 0) {
+        return -1;
+    }
+    pthread_detach(thread);
+    return 0;
+}
+
+/* ------------- */
+/* load generator */
+/* ------------- */
+
+/* xorshift64, good enough to spread payload sizes */
+static uint64_t benchRandom(uint64_t *state) {
+    *state ^= *state << 13;
+    *state ^= *state >> 7;
+    *state ^= *state << 17;
+    return *state;
+}
+
+/* sleep until about BENCH_SPIN_NS before when_ns, at most max_ns */
+static void benchSleepUntil(uint64_t when_ns, uint64_t max_ns) {
+    uint64_t now = statsNow();
+    if (when_ns > now + BENCH_SPIN_NS) {
+        uint64_t wait = when_ns - now - BENCH_SPIN_NS;
+        if (wait > max_ns) {
+            wait = max_ns;
+        }
+        struct timespec ts = {wait / 1000000000, wait % 1000000000};
+        nanosleep(&ts, NULL);
+    }
+}
+
+/* wait for the response of slot & account for it */
+static void benchComplete(benchThread_t *bench, rpc_client *cl, benchSlot_t *slot) {
+    rpc_data *result = rpc_wait(cl, slot->pending);
+    uint64_t now = statsNow();
+    if (slot->due_ns < bench->start_ns) {
+        rpc_data_free(result);
+        return;
+    }
+    uint64_t errors = (result == NULL);
+    uint64_t bytes_out = result == NULL ? 0 : result->data2_len;
+    statsRecord(&bench->raw, now - slot->sent_ns, 1, errors, slot->size, bytes_out);
+    statsRecord(&bench->sched, now - slot->due_ns, 1, errors, slot->size, bytes_out);
+    rpc_data_free(result);
+}
+
+static void *benchConnectionThread(void *arg) {
+    benchThread_t *bench = arg;
+    benchConfig_t *config = bench->config;
+    rpc_client *cl = rpc_init_client(config->addr, config->port);
+    rpc_handle *h = cl == NULL ? NULL : rpc_find(cl, config->function);
+    if (h == NULL) {
+        bench->failed = 1;
+        if (cl != NULL) {
+            rpc_close_client(cl);
+        }
+        return NULL;
+    }
+
+    char *payload = calloc(config->max_size > 0 ? config->max_size : 1, 1);
+    benchSlot_t *slots = calloc(config->depth, sizeof(*slots));
+    uint64_t seed = (uint64_t)(uintptr_t)bench | 1;
+    uint64_t interval_ns = config->rate > 0 ? config->connections * 1e9 / config->rate : 0;
+    uint64_t next_due = bench->start_ns - (uint64_t)(config->warmup * 1e9) + bench->offset_ns;
+    int head = 0, inflight = 0;
+    int64_t sent = 0;
+
+    while (1) {
+        uint64_t now = statsNow();
+        if (interval_ns == 0) {
+            next_due = now;
+        }
+        if (next_due >= bench->end_ns) {
+            break;
+        }
+        // a full window stalls the sender: this is the omission open loop accounts for
+        if (inflight == config->depth) {
+            benchComplete(bench, cl, &slots[head]);
+            head = (head + 1) % config->depth;
+            inflight--;
+            continue;
+        }
+        if (now < next_due) {
+            if (inflight > 0 && rpc_poll(cl, slots[head].pending) != 0) {
+                benchComplete(bench, cl, &slots[head]);
+                head = (head + 1) % config->depth;
+                inflight--;
+            } else {
+                benchSleepUntil(next_due, inflight > 0 ? BENCH_POLL_NS : UINT64_MAX);
+            }
+            continue;
+        }
+
+        benchSlot_t *slot = &slots[(head + inflight) % config->depth];
+        slot->size = config->min_size;
+        if (config->max_size > config->min_size) {
+            slot->size += benchRandom(&seed) % (config->max_size - config->min_size + 1);
+        }
+        rpc_data request = {.data1 = sent++, .data2_len = slot->size, .data2 = slot->size ? payload : NULL};
+        slot->due_ns = next_due;
+        slot->sent_ns = statsNow();
+        slot->pending = rpc_call_async(cl, h, &request);
+        if (slot->pending == NULL) {
+            if (slot->due_ns >= bench->start_ns) {
+                statsRecord(&bench->raw, 0, 1, 1, slot->size, 0);
+                statsRecord(&bench->sched, 0, 1, 1, slot->size, 0);
+            }
+            break;
+        }
+        inflight++;
+        next_due += interval_ns;
+    }
+    while (inflight > 0) {
+        benchComplete(bench, cl, &slots[head]);
+        head = (head + 1) % config->depth;
+        inflight--;
+    }
+
+    free(slots);
+    free(payload);
+    free(h);
+    rpc_close_client(cl);
+    return NULL;
+}
+
+/* print a latency summary of snapshot, as "name": {...} in JSON or as a table row */
+static void benchPrintLatency(benchConfig_t *config, const char *name, functionStats_t *snapshot, int last) {
+    uint64_t p50 = statsPercentile(snapshot, 0.5), p90 = statsPercentile(snapshot, 0.9);
+    uint64_t p99 = statsPercentile(snapshot, 0.99), p999 = statsPercentile(snapshot, 0.999);
+    if (config->json) {
+        printf("\"%s\":{\"p50_ns\":%" PRIu64 ",\"p90_ns\":%" PRIu64 ",\"p99_ns\":%" PRIu64
+               ",\"p999_ns\":%" PRIu64 ",\"max_ns\":%" PRIu64 "}%s",
+               name, p50, p90, p99, p999, snapshot->max_ns, last ? "" : ",");
+    } else {
+        printf("%-10s %10.1f %10.1f %10.1f %10.1f %10.1f\n", name, p50 / 1e3, p90 / 1e3, p99 / 1e3,
+               p999 / 1e3, snapshot->max_ns / 1e3);
+    }
+}
+
+/* parse "N" or "MIN-MAX" into [min, max] */
+/* RETURNS: 0 on success, -1 on error */
+static int benchParseSize(char *arg, size_t *min, size_t *max) {
+    char *end;
+    *min = strtoull(arg, &end, 10);
+    *max = *min;
+    if (*end == '-') {
+        *max = strtoull(end + 1, &end, 10);
+    }
+    return (*end != '\0' || *max < *min) ? -1 : 0;
+}
+
+static void usage(char *name) {
+    fprintf(stderr,
+            "usage: %s [options]\n"
+            "  -a ADDR      server address, unix:/path & shm:name for same-host transports (default ::1)\n"
+            "  -p PORT      server port (default 3000)\n"
+            "  -f NAME      function to call with payloads of data2_len bytes (default echo)\n"
+            "  -c N         connections, one thread each (default 1)\n"
+            "  -d N         calls in flight per connection (default 1)\n"
+            "  -z N|MIN-MAX data2_len of each call, uniform over MIN-MAX (default 0)\n"
+            "  -r RATE      open loop at RATE calls/s over all connections (default closed loop)\n"
+            "  -t SECONDS   measured duration (default 5)\n"
+            "  -w SECONDS   warm-up before measuring (default 1)\n"
+            "  -C N         compress data2 of N bytes & more over TCP, e.g. %d (default off, payloads are zeros)\n"
+            "  -V 1|2       wire protocol version clients speak (default 2, falling back to 1)\n"
+            "  -S R:W       serve \"echo\" & \"sink\" in-process on PORT with R reactors & W workers\n"
+            "  -j           print a single JSON object instead of a table\n",
+            name, RPC_COMPRESS_MIN_SIZE);
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[]) {
+    benchConfig_t config = {.addr = "::1", .port = 3000, .function = "echo", .connections = 1,
+                            .depth = 1, .duration = 5, .warmup = 1};
+    int reactors = 0, workers = 0;
+    int opt;
+    while ((opt = getopt(argc, argv, "a:p:f:c:d:z:r:t:w:C:V:S:j")) != -1) {
+        switch (opt) {
+        case 'a': config.addr = optarg; break;
+        case 'p': config.port = atoi(optarg); break;
+        case 'f': config.function = optarg; break;
+        case 'c': config.connections = atoi(optarg); break;
+        case 'd': config.depth = atoi(optarg); break;
+        case 'z':
+            if (benchParseSize(optarg, &config.min_size, &config.max_size) < 0) {
+                usage(argv[0]);
+            }
+            break;
+        case 'r': config.rate = atof(optarg); break;
+        case 't': config.duration = atof(optarg); break;
+        case 'w': config.warmup = atof(optarg); break;
+        case 'C': rpc_set_compression(strtoul(optarg, NULL, 10)); break;
+        case 'V':
+            if (rpc_set_wire_version(atoi(optarg)) < 0) {
+                usage(argv[0]);
+            }
+            break;
+        case 'S':
+            if (sscanf(optarg, "%d:%d", &reactors, &workers) != 2 || reactors < 1 || workers < 0) {
+                usage(argv[0]);
+            }
+            break;
+        case 'j': config.json = 1; break;
+        default: usage(argv[0]);
+        }
+    }
+    if (optind != argc || config.connections < 1 || config.depth < 1 || config.depth > BENCH_MAX_DEPTH ||
+        config.rate < 0 || config.duration <= 0 || config.warmup < 0) {
+        usage(argv[0]);
+    }
+
+    if (reactors > 0 && benchStartServer(config.addr, config.port, reactors, workers) < 0) {
+        fprintf(stderr, "failed to start the server on port %d\n", config.port);
+        exit(EXIT_FAILURE);
+    }
+
+    benchThread_t *threads = calloc(config.connections, sizeof(*threads));
+    uint64_t start_ns = statsNow() + (uint64_t)(config.warmup * 1e9);
+    uint64_t end_ns = start_ns + (uint64_t)(config.duration * 1e9);
+    for (int i = 0; i < config.connections; i++) {
+        threads[i].config = &config;
+        threads[i].start_ns = start_ns;
+        threads[i].end_ns = end_ns;
+        // spread the connections' schedules over one interval
+        threads[i].offset_ns = config.rate > 0 ? i * 1e9 / config.rate : 0;
+        if (pthread_create(&threads[i].thread, NULL, benchConnectionThread, &threads[i]) != 0) {
+            perror("pthread_create");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    functionStats_t *raw = calloc(1, sizeof(*raw));
+    functionStats_t *corrected = calloc(1, sizeof(*corrected));
+    int failed = 0;
+    for (int i = 0; i < config.connections; i++) {
+        pthread_join(threads[i].thread, NULL);
+        failed += threads[i].failed;
+        statsMerge(raw, &threads[i].raw);
+        statsMerge(corrected, config.rate > 0 ? &threads[i].sched : &threads[i].raw);
+    }
+    double elapsed = (statsNow() - start_ns) / 1e9;
+    if (elapsed < config.duration) {
+        elapsed = config.duration;
+    }
+    if (failed == config.connections) {
+        fprintf(stderr, "could not call %s on [%s]:%d\n", config.function, config.addr, config.port);
+        exit(EXIT_FAILURE);
+    }
+
+    // closed loop has no schedule, a call is expected every mean latency per slot
+    uint64_t calls = raw->calls;
+    if (config.rate == 0 && calls > 0) {
+        uint64_t slot_ns = (uint64_t)(elapsed * 1e9) * config.connections * config.depth;
+        statsCorrect(corrected, slot_ns / calls);
+    }
+
+    if (config.json) {
+        printf("{\"function\":\"%s\",\"mode\":\"%s\",\"connections\":%d,\"depth\":%d,\"min_size\":%zu,"
+               "\"max_size\":%zu,\"rate\":%.0f,\"duration_s\":%.3f,\"failed_connections\":%d,"
+               "\"calls\":%" PRIu64 ",\"errors\":%" PRIu64 ",\"throughput\":%.1f,"
+               "\"bytes_in\":%" PRIu64 ",\"bytes_out\":%" PRIu64 ",",
+               config.function, config.rate > 0 ? "open" : "closed", config.connections, config.depth,
+               config.min_size, config.max_size, config.rate, elapsed, failed, calls, raw->errors,
+               calls / elapsed, raw->bytes_in, raw->bytes_out);
+        benchPrintLatency(&config, "raw", raw, 0);
+        benchPrintLatency(&config, "corrected", corrected, 1);
+        printf("}\n");
+    } else {
+        printf("%s, %s loop, %d connections x %d in flight, data2_len %zu-%zu, %.3f s\n", config.function,
+               config.rate > 0 ? "open" : "closed", config.connections, config.depth, config.min_size,
+               config.max_size, elapsed);
+        printf("calls %" PRIu64 ", errors %" PRIu64 ", %.1f calls/s, %.1f MB/s in, %.1f MB/s out\n", calls,
+               raw->errors, calls / elapsed, raw->bytes_in / elapsed / 1e6, raw->bytes_out / elapsed / 1e6);
+        if (failed > 0) {
+            printf("%d connections failed\n", failed);
+        }
+        printf("%-10s %10s %10s %10s %10s %10s\n", "latency_us", "p50", "p90", "p99", "p99.9", "max");
+        benchPrintLatency(&config, "raw", raw, 0);
+        benchPrintLatency(&config, "corrected", corrected, 1);
+    }
+
+    free(raw);
+    free(corrected);
+    free(threads);
+    return 0;
+}
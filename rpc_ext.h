@@ -0,0 +1,336 @@
+/* Header for extensions to the RPC system */
+/* rpc.h stays untouched, everything added on top of it is declared here */
+
+#ifndef RPC_EXT_H
+#define RPC_EXT_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "rpc.h"
+
+/* Tracing levels, see rpc_trace_set_level */
+#define RPC_TRACE_OFF 0
+#define RPC_TRACE_INFO 1  // connections accepted & closed
+#define RPC_TRACE_DEBUG 2 // every read, frame, handler call & write
+
+/* Built-in function every server registers, rpc_find & rpc_call it like any other:
+ * data2 of the response is a text report, one line per function with
+ * "fid name calls errors bytes_in bytes_out p50_ns p90_ns p99_ns p999_ns max_ns expired rejected hits misses"
+ * after a header line (expired counts calls dropped past their deadline, see
+ * rpc_call_timeout, rejected the calls turned away by rpc_set_admission or
+ * rpc_set_concurrency, hits & misses the calls to a rpc_register_pure function answered
+ * from the result cache or computed); payload data1 = 0 reports every function, otherwise only that fid */
+/* It is exempt from admission control, so it still answers under overload */
+/* Names starting with "__" are reserved, rpc_register refuses them */
+#define RPC_STATS_FUNCTION "__stats"
+
+/* Suggested rpc_set_compression threshold for links slower than the codec */
+#define RPC_COMPRESS_MIN_SIZE (32 * 1024)
+
+/* Default memory budget of the result cache, see rpc_set_cache_size */
+#define RPC_CACHE_DEFAULT_SIZE (64 * 1024 * 1024)
+
+/* Chunks a stream may have on their way to the client or waiting for rpc_stream_next,
+ * the handler writing them blocks until the client has taken some */
+#define RPC_STREAM_WINDOW 16
+
+/* I/O backends, see rpc_set_io_backend */
+#define RPC_IO_EPOLL 0
+#define RPC_IO_URING 1
+
+/* Wire protocol versions, see rpc_set_wire_version */
+#define RPC_WIRE_V1 1
+#define RPC_WIRE_V2 2
+
+/* Set of connections to one server that any number of threads may call through */
+typedef struct rpc_client_pool rpc_client_pool;
+
+/* Client spreading its calls over several servers that offer the same functions */
+typedef struct rpc_client_multi rpc_client_multi;
+
+/* Remote function found through a rpc_client_multi, valid on each of its servers */
+typedef struct rpc_multi_handle rpc_multi_handle;
+
+/* Handle for a call sent with rpc_call_async & not waited for yet */
+typedef struct rpc_pending rpc_pending;
+
+/* Handler processing a whole rpc_call_batch in one invocation: out[i] must be set to
+ * the result of in[i] (NULL on error), the server frees in & out afterwards */
+typedef void (*rpc_batch_handler)(rpc_data *in[], size_t n, rpc_data *out[]);
+
+/* Reply still owed for a call to a rpc_register_async function, see rpc_complete */
+typedef struct rpc_token rpc_token;
+
+/* Handler that may answer after it returns: payload is its own (rpc_data_free it) &
+ * the call is answered by passing token to rpc_complete exactly once, from any thread */
+typedef void (*rpc_async_handler)(rpc_data *payload, rpc_token *token);
+
+/* Sending side of a call to a rpc_register_stream function, see rpc_stream_write */
+typedef struct rpc_stream_writer rpc_stream_writer;
+
+/* Handler answering with a sequence of chunks passed to rpc_stream_write: the stream
+ * ends when it returns, with an error if it returns -1; payload is freed afterwards */
+typedef int (*rpc_stream_handler)(rpc_data *payload, rpc_stream_writer *out);
+
+/* Receiving side of a call sent with rpc_call_stream, see rpc_stream_next */
+typedef struct rpc_stream rpc_stream;
+
+/* ---------------- */
+/* Server functions */
+/* ---------------- */
+
+/* Start serving requests on n_reactors event loops, each accepting on its own
+ * SO_REUSEPORT listening socket, while rpc_handler calls run on a pool of
+ * n_workers threads */
+/* The calling thread becomes one of the event loops, so this only returns on error */
+void rpc_serve_all_threads(rpc_server *srv, int n_reactors, int n_workers);
+
+/* Registers a function that can also process a whole batch of payloads at once,
+ * rpc_call_batch requests are handed to batch_handler in one invocation */
+/* handler may be NULL, single calls are then run as batches of one */
+/* RETURNS: -1 on failure */
+int rpc_register_batch(rpc_server *srv, char *name, rpc_handler handler, rpc_batch_handler batch_handler);
+
+/* Registers a function whose handler does not have to answer before returning, so a
+ * call waiting on disk or another service holds no event loop or worker thread; any
+ * number of such calls may be outstanding, each costs its token & the payload */
+/* rpc_call_batch requests for it fail */
+/* RETURNS: -1 on failure */
+int rpc_register_async(rpc_server *srv, char *name, rpc_async_handler handler);
+
+/* Sends result (NULL or invalid for an error) as the answer of the call token stands
+ * for & frees token; thread-safe, the server takes ownership of result */
+/* The answer is dropped if the client has disconnected meanwhile */
+void rpc_complete(rpc_token *token, rpc_data *result);
+
+/* Registers a function whose answer is a stream of chunks, so a large or incremental
+ * result goes out while it is produced & the client may start on the first chunks
+ * before the last are computed; each call runs handler on a thread of its own,
+ * which blocks in rpc_stream_write while RPC_STREAM_WINDOW chunks are in flight */
+/* rpc_call & rpc_call_batch requests for it fail, rpc_call_stream calls it */
+/* RETURNS: -1 on failure */
+int rpc_register_stream(rpc_server *srv, char *name, rpc_stream_handler handler);
+
+/* Sends chunk (valid, the server takes ownership) as the next part of the answer,
+ * waiting for the client to take earlier chunks if RPC_STREAM_WINDOW are in flight */
+/* RETURNS: 0 on success, -1 if the client closed the stream or went away (the handler
+ * should return then, every later chunk is dropped) */
+int rpc_stream_write(rpc_stream_writer *out, rpc_data *chunk);
+
+/* Registers a function whose result depends only on the data1 & data2 of its payload
+ * & that leaves the payload untouched, so its results may be cached: a call whose
+ * payload was answered before is served from a sharded in-memory cache (evicting with
+ * CLOCK), on the event loop & without running handler or passing admission control */
+/* Registering the name again, pure or not, stops serving the results cached so far */
+/* RETURNS: -1 on failure */
+int rpc_register_pure(rpc_server *srv, char *name, rpc_handler handler);
+
+/* Sets the memory the result cache of rpc_register_pure functions may use, counting
+ * payloads, results & bookkeeping (RPC_CACHE_DEFAULT_SIZE until set, 0 disables caching);
+ * a result taking more than a 256th of max_bytes is never cached */
+/* May be called at any time, shrinking the budget evicts at once */
+void rpc_set_cache_size(rpc_server *srv, size_t max_bytes);
+
+/* Bounds the work a server accepts, so a burst is answered with an immediate
+ * overload reply (rpc_call returns NULL with errno EBUSY) instead of queueing up
+ * until every caller times out: a connection may have at most max_per_connection
+ * calls admitted & not answered yet, & at most max_queued calls may wait for a
+ * worker of rpc_serve_all_threads; 0 means no limit (the default for both) */
+/* Call it before serving */
+void rpc_set_admission(rpc_server *srv, unsigned max_per_connection, unsigned max_queued);
+
+/* Bounds the calls to the registered function name that may be queued, running or
+ * (for rpc_register_async) waiting for rpc_complete at once, across every connection;
+ * calls past max_active get the overload reply of rpc_set_admission, 0 lifts the bound */
+/* Call it before serving */
+/* RETURNS: 0 on success, -1 if name is not registered */
+int rpc_set_concurrency(rpc_server *srv, char *name, unsigned max_active);
+
+/* Accepts connections on addr too, next to the TCP port of rpc_init_server, for
+ * clients on the same host (rpc_init_client with the same addr reaches it):
+ * - "unix:/path": Unix domain socket at /path (a stale socket file there is replaced)
+ * - "shm:name": each connection carries its bytes through a pair of shared-memory
+ *   rings (memfd) & only uses a Unix socket to set them up & to wake a sleeping side */
+/* Call it before serving; every reactor of rpc_serve_all_threads accepts on addr */
+/* RETURNS: 0 on success, -1 on error */
+int rpc_listen(rpc_server *srv, char *addr);
+
+/* Builds a perfect hash over the functions registered so far, so every rpc_find
+ * costs a single probe; call it once registration is finished */
+/* Registering a new name afterwards drops the perfect hash (an existing name does not) */
+/* RETURNS: 0 on success, -1 on failure (lookups keep using the regular hash table) */
+int rpc_freeze(rpc_server *srv);
+
+/* ---------------- */
+/* Client functions */
+/* ---------------- */
+
+/* Finds several remote functions by name with a single round trip, handles[i] is
+ * set to the rpc_handle of names[i] or to NULL if the server has no such function */
+/* Names this client has already resolved are answered from a local cache, which is
+ * dropped as soon as the server reports that its registry changed; rpc_find uses it too */
+/* RETURNS: number of names found on success, -1 on error (every handles[i] is NULL) */
+/* each rpc_handle* will be freed with a single call to free(3) */
+int rpc_find_many(rpc_client *cl, char *names[], size_t n, rpc_handle *handles[]);
+
+/* Calls remote function once per payload, with all n payloads sent in a single frame &
+ * all n results received in a single response; out[i] is the result for in[i] */
+/* RETURNS: number of out[i] that are not NULL on success, -1 on error (every out[i] is NULL,
+ * errno is EBUSY if the server was overloaded) */
+/* each out[i] will be freed with rpc_data_free */
+int rpc_call_batch(rpc_client *cl, rpc_handle *h, rpc_data *in[], size_t n, rpc_data *out[]);
+
+/* Sends a call to remote function without waiting for its response, many calls
+ * may be in flight on the same client & the server may answer them out of order */
+/* RETURNS: rpc_pending* on success, NULL on error */
+rpc_pending *rpc_call_async(rpc_client *cl, rpc_handle *h, rpc_data *payload);
+
+/* Waits for the response of an rpc_call_async request */
+/* RETURNS: rpc_data* on success, NULL on error (errno is EBUSY if the server turned
+ * the call away without running it, see rpc_set_admission, so it may be retried) */
+/* rpc_pending* is released by this call, even on error */
+rpc_data *rpc_wait(rpc_client *cl, rpc_pending *p);
+
+/* Checks whether the response of an rpc_call_async request has arrived, without blocking */
+/* RETURNS: 1 if rpc_wait will not block, 0 if still in flight, -1 on error */
+int rpc_poll(rpc_client *cl, rpc_pending *p);
+
+/* Calls remote function like rpc_call, but waits at most timeout_ms for the result;
+ * the remaining budget travels with the call & the server drops the call unanswered
+ * if it is still queued once the budget has run out, so overload sheds work that
+ * nobody waits for anymore (counted as expired by RPC_STATS_FUNCTION) */
+/* RETURNS: rpc_data* on success, NULL on error (errno is ETIMEDOUT on timeout) */
+/* rpc_data* will be freed with rpc_data_free */
+rpc_data *rpc_call_timeout(rpc_client *cl, rpc_handle *h, rpc_data *payload, unsigned timeout_ms);
+
+/* Connects n_conns times to the server at addr:port, rpc_client_pool_find &
+ * rpc_client_pool_call may then be used by any number of threads at once */
+/* RETURNS: rpc_client_pool* on success, NULL on error */
+rpc_client_pool *rpc_client_pool_create(char *addr, int port, int n_conns);
+
+/* Finds a remote function by name, the rpc_handle is valid on every connection
+ * of the pool & may be shared by all threads */
+/* RETURNS: rpc_handle* on success, NULL on error */
+/* rpc_handle* will be freed with a single call to free(3) */
+rpc_handle *rpc_client_pool_find(rpc_client_pool *pool, char *name);
+
+/* Thread-safe rpc_call: the call goes out on an idle connection of the pool or,
+ * if every connection is busy, is pipelined on the one with the fewest callers;
+ * a connection that failed is reopened once nobody uses it anymore */
+/* RETURNS: rpc_data* on success, NULL on error */
+/* rpc_data* will be freed with rpc_data_free */
+rpc_data *rpc_client_pool_call(rpc_client_pool *pool, rpc_handle *h, rpc_data *payload);
+
+/* Closes every connection of the pool & frees it, once no thread calls through it */
+void rpc_client_pool_close(rpc_client_pool *pool);
+
+/* Connects to the n servers addrs[i]:ports[i] (addresses as for rpc_init_client),
+ * which serve the same functions; a server that cannot be reached, or whose
+ * connection fails later, is tried again at most once a second */
+/* Like rpc_client, a rpc_client_multi is used by one thread at a time */
+/* RETURNS: rpc_client_multi* on success, NULL if no server could be reached */
+rpc_client_multi *rpc_init_client_multi(char *addrs[], int ports[], int n);
+
+/* Finds a remote function by name on every server of mc (each may number it
+ * differently, & it is looked up again on a server that was reconnected) */
+/* RETURNS: rpc_multi_handle* on success, NULL if no server has it */
+/* rpc_multi_handle* will be freed with a single call to free(3) */
+rpc_multi_handle *rpc_find_multi(rpc_client_multi *mc, char *name);
+
+/* Allows the calls through h to be hedged (enable = 1, off by default): a call that
+ * has not been answered after the 95th percentile latency of the recent calls through
+ * h is sent to a second server as well, & whichever answer arrives first is returned
+ * while the other is dropped; only enable it for functions that may safely run twice */
+void rpc_set_hedging(rpc_multi_handle *h, int enable);
+
+/* Calls remote function on one of the servers of mc: of two servers picked at random,
+ * the one with the lower smoothed latency x (requests not answered yet + 1) gets the call
+ * (power of two choices); a call that could not be sent or that a server turned away
+ * (see rpc_set_admission) is tried on up to two other servers, as is a call of a hedged
+ * handle whose server went away before answering */
+/* RETURNS: rpc_data* on success, NULL on error (errno is EBUSY if every server tried
+ * was overloaded) */
+/* rpc_data* will be freed with rpc_data_free */
+rpc_data *rpc_call_multi(rpc_client_multi *mc, rpc_multi_handle *h, rpc_data *payload);
+
+/* Closes the connection to every server of mc & frees it */
+void rpc_close_client_multi(rpc_client_multi *mc);
+
+/* Calls a rpc_register_stream function, whose chunks are then read with
+ * rpc_stream_next; other calls may be made on cl while the stream is open, but not
+ * rpc_find / rpc_find_many of a name cl has not resolved yet */
+/* RETURNS: rpc_stream* on success (release it with rpc_stream_close), NULL on error */
+rpc_stream *rpc_call_stream(rpc_client *cl, rpc_handle *h, rpc_data *payload);
+
+/* Takes the next chunk of stream, waiting for it to arrive; at most RPC_STREAM_WINDOW
+ * chunks are ever buffered on the client, the server holds the rest back meanwhile */
+/* RETURNS: 1 with *chunk set (the caller frees it), 0 once the stream has ended,
+ * -1 on error (the handler failed, the connection broke, or errno EBUSY if the server
+ * turned the call away under overload) */
+int rpc_stream_next(rpc_client *cl, rpc_stream *stream, rpc_data **chunk);
+
+/* Releases stream; a stream that has not ended yet is cancelled, the server stops its
+ * handler at the next rpc_stream_write & the chunks still on their way are dropped */
+void rpc_stream_close(rpc_client *cl, rpc_stream *stream);
+
+/* ---------------- */
+/* Shared functions */
+/* ---------------- */
+
+/* Allocates a rpc_data with room for data2_len bytes of data2 (data2 is NULL when
+ * data2_len is 0), both taken from the calling thread's pool of recycled buffers */
+/* Release it with rpc_data_free, which returns the buffers to the pool; rpc_handler
+ * results & rpc_call responses are pooled the same way, so a steady stream of calls
+ * stops calling malloc(3) once the pools are warm */
+/* RETURNS: rpc_data* with data1 = 0 */
+rpc_data *rpc_data_alloc(size_t data2_len);
+
+/* Sets the data2 size from which this process sends calls or replies compressed
+ * (0, the default, turns compression off; see RPC_COMPRESS_MIN_SIZE) */
+/* A TCP client opened while compression is on agrees on it with the server as it
+ * connects, Unix socket & shared-memory connections never compress; a data2 then goes
+ * out compressed only if its start looks compressible & the whole shrinks by 1/8 */
+void rpc_set_compression(size_t min_size);
+
+/* Selects the I/O backend of the servers & clients initialised afterwards:
+ * - RPC_IO_EPOLL (the default): edge-triggered epoll & one system call per read or write
+ * - RPC_IO_URING: each event loop accepts & receives through multishot io_uring requests
+ *   filling a ring of provided buffers, & the replies to a whole batch of completions go
+ *   out with the next wait, so a loaded server needs about one system call per batch;
+ *   rpc_call sends its request & starts receiving the response with a single one
+ * (Unix socket & TCP connections, shared-memory connections keep their rings) */
+/* An event loop that cannot set up its ring & provided buffers runs on epoll instead;
+ * multishot receives need Linux 6.0 or later */
+/* RETURNS: the backend in use from now on, RPC_IO_EPOLL if the kernel has no io_uring */
+int rpc_set_io_backend(int backend);
+
+/* Selects the wire protocol the clients initialised afterwards speak:
+ * - RPC_WIRE_V2 (the default): every frame is one fixed 12-byte header (magic & version,
+ *   opcode, flags, status, request id, body length) followed by varint fields, & every
+ *   reply carries its request id & an explicit status; the client opens with a hello
+ *   negotiating version & features, & reconnects in v1 if the server predates v2
+ * - RPC_WIRE_V1: the original frames, with a hello only for compression
+ * Servers speak both, each connection in the version its client opened with */
+/* RETURNS: 0 on success, -1 if version is not one of them */
+int rpc_set_wire_version(int version);
+
+/* ------- */
+/* Tracing */
+/* ------- */
+
+/* Sets the runtime tracing level (RPC_TRACE_OFF by default, or RPC_TRACE_LEVEL from
+ * the environment); events are fixed-size binary records kept in a lock-free ring per
+ * thread, so tracing costs a clock read & a few stores per event when enabled & a
+ * single branch when not */
+/* Levels above the TRACE_LEVEL the library was built with are compiled out */
+void rpc_trace_set_level(int level);
+
+/* Records an application event (RPC_TRACE_DEBUG level) carrying two numbers */
+void rpc_trace(uint64_t a, uint64_t b);
+
+/* Writes the events still held by every thread's ring to path, rpc_trace_decode
+ * prints them; setting RPC_TRACE_DUMP=path in the environment dumps on SIGUSR2 too */
+/* RETURNS: number of events written, -1 on error */
+int rpc_trace_dump(const char *path);
+
+#endif
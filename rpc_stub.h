@@ -0,0 +1,250 @@
+/* Typed stubs for the RPC system, generated by the preprocessor from an X-macro IDL */
+/* Header only: include it after rpc.h & rpc_ext.h wherever the stubs are used */
+
+#ifndef RPC_STUB_H
+#define RPC_STUB_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include "rpc.h"
+#include "rpc_ext.h"
+
+/* An IDL lists each function with the fields of its argument & result structs, every
+ * field a fixed-width integer (int8_t ... uint64_t), float or double (a function may
+ * have no arguments or no results, with an empty list):
+ *
+ *     #define ADD2_IN(F) F(int8_t, a) F(int8_t, b)
+ *     #define ADD2_OUT(F) F(int32_t, sum)
+ *     #define MATH_STUBS(S) S(add2, ADD2_IN, ADD2_OUT)
+ *
+ * RPC_STUB_TYPES(MATH_STUBS) then defines, for each function name:
+ * - the structs name_in & name_out, with the fields in the order listed
+ * - name_IN_SIZE & name_OUT_SIZE, their size on the wire (the fields packed, big-endian)
+ * - name_signature(), a hash of both layouts (a constant once inlined) that every call
+ *   & result carries in data1
+ * RPC_STUB_CLIENT(MATH_STUBS) defines, on top of them:
+ * - rpc_handle *name_find(rpc_client *cl)
+ * - int name_call(rpc_client *cl, rpc_handle *h, const name_in *in, name_out *out)
+ *   the arguments are encoded into a buffer on the stack, which rpc_call sends from
+ *   in place; RETURNS: 0 on success, -1 on error (errno EBADMSG if the server answered
+ *   with another layout, EBUSY if it was overloaded)
+ * RPC_STUB_SERVER(MATH_STUBS) declares int name_impl(const name_in *in, name_out *out),
+ * which the server implements (RETURNS: 0 on success, -1 for an error reply), & defines:
+ * - rpc_data *name_dispatch(rpc_data *payload), the rpc_handler checking & decoding
+ *   the payload for name_impl
+ * - int name_register(rpc_server *srv), which rpc_register()s it under "name"
+ * A program that is both client & server uses RPC_STUB_TYPES once, then
+ * RPC_STUB_CLIENT_FUNCTIONS & RPC_STUB_SERVER_FUNCTIONS
+ *
+ * A field of another type, or arguments / results larger than RPC_STUB_MAX_SIZE, fail
+ * to compile; a call whose layout differs from the server's gets an error reply (unless
+ * the 31-bit layout hashes collide)
+ */
+
+/* Largest argument or result struct on the wire, both are encoded on the stack */
+#define RPC_STUB_MAX_SIZE 4096
+
+// FNV-1a (32-bit) parameters of the layout signature
+#define RPC_STUB_FNV_OFFSET 2166136261u
+#define RPC_STUB_FNV_PRIME 16777619u
+
+/* ------------------- */
+/* field (de)encoding  */
+/* ------------------- */
+
+/* code of a field type in a layout signature, 0 for a type stubs cannot carry */
+#define RPC_STUB_TYPE_CODE(type) _Generic((type)0, int8_t: 1, uint8_t: 2, int16_t: 3, uint16_t: 4, \
+	int32_t: 5, uint32_t: 6, int64_t: 7, uint64_t: 8, float: 9, double: 10, default: 0)
+
+static inline unsigned char *rpcStubPut8(unsigned char *p, uint8_t v) {
+	p[0] = v;
+	return p + 1;
+}
+
+static inline unsigned char *rpcStubPut16(unsigned char *p, uint16_t v) {
+	p[0] = v >> 8;
+	p[1] = v;
+	return p + 2;
+}
+
+static inline unsigned char *rpcStubPut32(unsigned char *p, uint32_t v) {
+	p[0] = v >> 24;
+	p[1] = v >> 16;
+	p[2] = v >> 8;
+	p[3] = v;
+	return p + 4;
+}
+
+static inline unsigned char *rpcStubPut64(unsigned char *p, uint64_t v) {
+	return rpcStubPut32(rpcStubPut32(p, v >> 32), v);
+}
+
+static inline unsigned char *rpcStubPutFloat(unsigned char *p, float v) {
+	uint32_t bits;
+	memcpy(&bits, &v, sizeof(bits));
+	return rpcStubPut32(p, bits);
+}
+
+static inline unsigned char *rpcStubPutDouble(unsigned char *p, double v) {
+	uint64_t bits;
+	memcpy(&bits, &v, sizeof(bits));
+	return rpcStubPut64(p, bits);
+}
+
+/* the getters store through memcpy, so signed fields take the bits as they are */
+static inline const unsigned char *rpcStubGet8(const unsigned char *p, void *dst) {
+	memcpy(dst, p, 1);
+	return p + 1;
+}
+
+static inline const unsigned char *rpcStubGet16(const unsigned char *p, void *dst) {
+	uint16_t v = (uint16_t)(p[0] << 8 | p[1]);
+	memcpy(dst, &v, sizeof(v));
+	return p + 2;
+}
+
+static inline const unsigned char *rpcStubGet32(const unsigned char *p, void *dst) {
+	uint32_t v = (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3];
+	memcpy(dst, &v, sizeof(v));
+	return p + 4;
+}
+
+static inline const unsigned char *rpcStubGet64(const unsigned char *p, void *dst) {
+	uint32_t high, low;
+	rpcStubGet32(p, &high);
+	rpcStubGet32(p + 4, &low);
+	uint64_t v = (uint64_t)high << 32 | low;
+	memcpy(dst, &v, sizeof(v));
+	return p + 8;
+}
+
+/* append the value of a field at p, RETURNS: p past it */
+#define rpcStubPut(p, v) _Generic((v), int8_t: rpcStubPut8, uint8_t: rpcStubPut8, int16_t: rpcStubPut16, \
+	uint16_t: rpcStubPut16, int32_t: rpcStubPut32, uint32_t: rpcStubPut32, int64_t: rpcStubPut64, \
+	uint64_t: rpcStubPut64, float: rpcStubPutFloat, double: rpcStubPutDouble)(p, v)
+
+/* fold the four bytes of v into the FNV-1a hash h, RETURNS: the new hash */
+static inline uint32_t rpcStubSignMix(uint32_t h, uint32_t v) {
+	for (int i = 0; i < 4; i++) {
+		h = (h ^ (v & 0xFF)) * RPC_STUB_FNV_PRIME;
+		v >>= 8;
+	}
+	return h;
+}
+
+/* read the field *dst from p, RETURNS: p past it */
+#define rpcStubGet(p, dst) _Generic((dst), int8_t *: rpcStubGet8, uint8_t *: rpcStubGet8, \
+	int16_t *: rpcStubGet16, uint16_t *: rpcStubGet16, int32_t *: rpcStubGet32, uint32_t *: rpcStubGet32, \
+	int64_t *: rpcStubGet64, uint64_t *: rpcStubGet64, float *: rpcStubGet32, double *: rpcStubGet64)(p, dst)
+
+/* ------------------------------- */
+/* per-field expansions of the IDL */
+/* ------------------------------- */
+
+#define RPC_STUB_MEMBER(type, field) \
+	type field; \
+	_Static_assert(RPC_STUB_TYPE_CODE(type) != 0, "stub field " #field ": not a fixed-width scalar");
+#define RPC_STUB_WIRE_SIZE(type, field) + sizeof(type)
+#define RPC_STUB_PUT(type, field) p = rpcStubPut(p, (type)src->field);
+#define RPC_STUB_GET(type, field) q = rpcStubGet(q, &dst->field);
+
+#define RPC_STUB_COUNT(type, field) + 1
+
+/* layout signature: the type codes are hashed in wire order, so fields cannot trade places */
+#define RPC_STUB_SIGN(type, field) h = rpcStubSignMix(h, RPC_STUB_TYPE_CODE(type));
+
+/* --------------------------- */
+/* per-function expansions     */
+/* --------------------------- */
+
+#define RPC_STUB_DEFINE_TYPES(name, IN, OUT) \
+	typedef struct name##_in { IN(RPC_STUB_MEMBER) } name##_in; \
+	typedef struct name##_out { OUT(RPC_STUB_MEMBER) } name##_out; \
+	enum { \
+		name##_IN_SIZE = 0 IN(RPC_STUB_WIRE_SIZE), \
+		name##_OUT_SIZE = 0 OUT(RPC_STUB_WIRE_SIZE) \
+	}; \
+	_Static_assert(name##_IN_SIZE <= RPC_STUB_MAX_SIZE, "stub " #name ": arguments too large"); \
+	_Static_assert(name##_OUT_SIZE <= RPC_STUB_MAX_SIZE, "stub " #name ": results too large"); \
+	static inline int name##_signature(void) { \
+		uint32_t h = RPC_STUB_FNV_OFFSET; \
+		h = rpcStubSignMix(h, 0 IN(RPC_STUB_COUNT)); \
+		IN(RPC_STUB_SIGN) \
+		h = rpcStubSignMix(h, name##_IN_SIZE); \
+		h = rpcStubSignMix(h, 0 OUT(RPC_STUB_COUNT)); \
+		OUT(RPC_STUB_SIGN) \
+		h = rpcStubSignMix(h, name##_OUT_SIZE); \
+		return (int)(h & 0x7FFFFFFF); \
+	} \
+	static inline void name##_encode_in(const name##_in *src, unsigned char *p) { \
+		(void)src; (void)p; IN(RPC_STUB_PUT) \
+	} \
+	static inline void name##_decode_in(const unsigned char *q, name##_in *dst) { \
+		(void)q; (void)dst; IN(RPC_STUB_GET) \
+	} \
+	static inline void name##_encode_out(const name##_out *src, unsigned char *p) { \
+		(void)src; (void)p; OUT(RPC_STUB_PUT) \
+	} \
+	static inline void name##_decode_out(const unsigned char *q, name##_out *dst) { \
+		(void)q; (void)dst; OUT(RPC_STUB_GET) \
+	}
+
+#define RPC_STUB_DEFINE_CLIENT(name, IN, OUT) \
+	static inline rpc_handle *name##_find(rpc_client *cl) { \
+		return rpc_find(cl, #name); \
+	} \
+	static inline int name##_call(rpc_client *cl, rpc_handle *h, const name##_in *in, name##_out *out) { \
+		unsigned char buffer[name##_IN_SIZE > 0 ? name##_IN_SIZE : 1]; \
+		name##_encode_in(in, buffer); \
+		rpc_data payload = {.data1 = name##_signature(), .data2_len = name##_IN_SIZE, \
+		.data2 = name##_IN_SIZE > 0 ? buffer : NULL}; \
+		rpc_data *result = rpc_call(cl, h, &payload); \
+		if (result == NULL) { \
+			return -1; \
+		} \
+		int status = 0; \
+		if (result->data1 != payload.data1 || result->data2_len != name##_OUT_SIZE) { \
+			errno = EBADMSG; \
+			status = -1; \
+		} else { \
+			name##_decode_out(result->data2, out); \
+		} \
+		rpc_data_free(result); \
+		return status; \
+	}
+
+#define RPC_STUB_DEFINE_SERVER(name, IN, OUT) \
+	int name##_impl(const name##_in *in, name##_out *out); \
+	static inline rpc_data *name##_dispatch(rpc_data *payload) { \
+		if (payload->data1 != name##_signature() || payload->data2_len != name##_IN_SIZE) { \
+			return NULL; \
+		} \
+		name##_in in; \
+		name##_out out; \
+		memset(&out, 0, sizeof(out)); \
+		name##_decode_in(payload->data2, &in); \
+		if (name##_impl(&in, &out) < 0) { \
+			return NULL; \
+		} \
+		rpc_data *result = rpc_data_alloc(name##_OUT_SIZE); \
+		result->data1 = payload->data1; \
+		name##_encode_out(&out, result->data2); \
+		return result; \
+	} \
+	static inline int name##_register(rpc_server *srv) { \
+		return rpc_register(srv, #name, name##_dispatch); \
+	}
+
+/* --------------- */
+/* IDL entry points */
+/* --------------- */
+
+#define RPC_STUB_TYPES(STUBS) STUBS(RPC_STUB_DEFINE_TYPES)
+#define RPC_STUB_CLIENT_FUNCTIONS(STUBS) STUBS(RPC_STUB_DEFINE_CLIENT)
+#define RPC_STUB_SERVER_FUNCTIONS(STUBS) STUBS(RPC_STUB_DEFINE_SERVER)
+#define RPC_STUB_CLIENT(STUBS) RPC_STUB_TYPES(STUBS) RPC_STUB_CLIENT_FUNCTIONS(STUBS)
+#define RPC_STUB_SERVER(STUBS) RPC_STUB_TYPES(STUBS) RPC_STUB_SERVER_FUNCTIONS(STUBS)
+
+#endif
@@ -0,0 +1,94 @@
+/* Decodes a trace dump written by rpc_trace_dump (or SIGUSR2 with RPC_TRACE_DUMP set)
+ * into one line per event, sorted by time
+ * usage: rpc_trace_decode <dump file>
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include "trace.h"
+
+/* order events by timestamp */
+static int compareEvents(const void *left, const void *right) {
+	const traceEvent_t *a = left, *b = right;
+	return (a->time_ns > b->time_ns) - (a->time_ns < b->time_ns);
+}
+
+/* print the type-specific fields of event */
+static void printEvent(const traceEvent_t *event, uint64_t start_ns) {
+	printf("%12.6f %-7" PRIu32 " %-13s ", (event->time_ns - start_ns) / 1e9, event->thread,
+		   traceTypeName(event->type));
+	switch (event->type) {
+	case TRACE_ACCEPT:
+		printf("socket=%" PRIu64 " peer=...:%04x:%04x:%04x:%04x\n", event->a,
+			   (unsigned)(event->b >> 48) & 0xFFFF, (unsigned)(event->b >> 32) & 0xFFFF,
+			   (unsigned)(event->b >> 16) & 0xFFFF, (unsigned)event->b & 0xFFFF);
+		break;
+	case TRACE_CLOSE:
+		printf("socket=%" PRIu64 "\n", event->a);
+		break;
+	case TRACE_READ:
+	case TRACE_WRITE:
+		printf("socket=%" PRIu64 " bytes=%" PRIu64 "\n", event->a, event->b);
+		break;
+	case TRACE_FRAME:
+		printf("socket=%" PRIu64 " flag=%" PRIu64 " body_len=%" PRIu64 "\n", event->a, event->b >> 32,
+			   event->b & 0xFFFFFFFF);
+		break;
+	case TRACE_HANDLER_START:
+		printf("fid=%" PRIu64 " payloads=%" PRIu64 "\n", event->a, event->b);
+		break;
+	case TRACE_HANDLER_END:
+		printf("fid=%" PRIu64 " errors=%" PRIu64 "\n", event->a, event->b);
+		break;
+	case TRACE_EXPIRED:
+	case TRACE_REJECTED:
+		printf("fid=%" PRIu64 " request_id=%" PRIu64 "\n", event->a, event->b);
+		break;
+	default:
+		printf("a=%" PRIu64 " b=%" PRIu64 "\n", event->a, event->b);
+		break;
+	}
+}
+
+int main(int argc, char *argv[]) {
+	if (argc != 2) {
+		fprintf(stderr, "usage: %s <dump file>\n", argv[0]);
+		exit(EXIT_FAILURE);
+	}
+	FILE *file = fopen(argv[1], "rb");
+	if (file == NULL) {
+		perror("fopen");
+		exit(EXIT_FAILURE);
+	}
+
+	traceDumpHeader_t header;
+	if (fread(&header, sizeof(header), 1, file) != 1 ||
+	memcmp(header.magic, TRACE_DUMP_MAGIC, sizeof(header.magic)) != 0 ||
+	header.version != TRACE_DUMP_VERSION || header.event_size != sizeof(traceEvent_t)) {
+		fprintf(stderr, "%s is not a trace dump of this version\n", argv[1]);
+		exit(EXIT_FAILURE);
+	}
+
+	size_t n = 0, cap = TRACE_RING_SIZE;
+	traceEvent_t *events = malloc(cap * sizeof(*events));
+	while (events != NULL && fread(&events[n], sizeof(*events), 1, file) == 1) {
+		if (++n == cap) {
+			cap *= 2;
+			events = realloc(events, cap * sizeof(*events));
+		}
+	}
+	fclose(file);
+	if (events == NULL) {
+		perror("Memory allocation failed");
+		exit(EXIT_FAILURE);
+	}
+
+	qsort(events, n, sizeof(*events), compareEvents);
+	printf("%12s %-7s %-13s %s\n", "seconds", "thread", "event", "fields");
+	for (size_t i = 0; i < n; i++) {
+		printEvent(&events[i], events[0].time_ns);
+	}
+	free(events);
+	return 0;
+}
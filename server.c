@@ -78,7 +78,7 @@ rpc_data *minus2_i8(rpc_data *in) {
     char n2 = ((char *)in->data2)[0];
 
     /* Perform calculation */
-    printf("add2: arguments %d and %d\n", n1, n2);
+    printf("minus2: arguments %d and %d\n", n1, n2);
     int res = n1 - n2;
 
     /* Prepare response */
@@ -103,7 +103,7 @@ rpc_data *times2_i8(rpc_data *in) {
     char n2 = ((char *)in->data2)[0];
 
     /* Perform calculation */
-    printf("add2: arguments %d and %d\n", n1, n2);
+    printf("times2: arguments %d and %d\n", n1, n2);
     int res = n1 * n2;
 
     /* Prepare response */
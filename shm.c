@@ -0,0 +1,392 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include "shm.h"
+
+#define SHM_MAGIC 0x52504353 // "RPCS"
+#define SHM_CLIENT 0
+#define SHM_SERVER 1
+#define SHM_CACHE_LINE 64
+
+/* one direction of the stream, positions only ever grow & wrap around data */
+typedef struct shmRing {
+    _Alignas(SHM_CACHE_LINE) uint64_t head; // next byte to read, written by the consumer
+    _Alignas(SHM_CACHE_LINE) uint64_t tail; // next byte to write, written by the producer
+    _Alignas(SHM_CACHE_LINE) char data[SHM_RING_SIZE];
+} shmRing_t;
+
+/* a flag of its own cache line, so polling it does not slow the rings down */
+typedef struct shmFlag {
+    _Alignas(SHM_CACHE_LINE) int value;
+} shmFlag_t;
+
+/* layout of the memfd both processes map */
+typedef struct shmShared {
+    uint32_t magic;
+    uint32_t ring_size;
+    shmFlag_t waiting[2];  // side may be asleep on its socket & has to be woken up
+    shmRing_t rings[2];    // rings[side] is written by side
+} shmShared_t;
+
+struct shmChannel {
+    int sockfd;
+    int side;
+    shmShared_t *shared;
+    shmRing_t *in;
+    shmRing_t *out;
+};
+
+/* --------------------- */
+/* ring & wakeup helpers */
+/* --------------------- */
+
+static uint64_t shmNow() {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+static void shmPause() {
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_ia32_pause();
+#endif
+}
+
+/* copy up to len readable bytes out of ring */
+/* RETURNS: bytes read, -1 if the positions are corrupt (errno EPROTO) */
+static ssize_t shmRingRead(shmRing_t *ring, char *buf, size_t len) {
+	// the peer can write anything to the shared positions, so read each one once &
+	// never let them point past the ring
+	uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+	uint64_t tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+	if (tail - head > SHM_RING_SIZE) {
+		errno = EPROTO;
+		return -1;
+	}
+	size_t n = tail - head < len ? tail - head : len;
+	size_t offset = head & (SHM_RING_SIZE - 1);
+	size_t first = n < SHM_RING_SIZE - offset ? n : SHM_RING_SIZE - offset;
+	memcpy(buf, ring->data + offset, first);
+	memcpy(buf + first, ring->data, n - first);
+	__atomic_store_n(&ring->head, head + n, __ATOMIC_RELEASE);
+	return n;
+}
+
+/* copy as much of iov as fits into ring, skipping its first skip bytes */
+/* RETURNS: bytes written, -1 if the positions are corrupt (errno EPROTO) */
+static ssize_t shmRingWrite(shmRing_t *ring, struct iovec *iov, int iovcnt, size_t skip) {
+	uint64_t tail = __atomic_load_n(&ring->tail, __ATOMIC_RELAXED);
+	uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+	if (tail - head > SHM_RING_SIZE) {
+		errno = EPROTO;
+		return -1;
+	}
+	size_t room = SHM_RING_SIZE - (tail - head);
+	size_t written = 0;
+	for (int i = 0; i < iovcnt && written < room; i++) {
+		if (skip >= iov[i].iov_len) {
+			skip -= iov[i].iov_len;
+			continue;
+		}
+		char *src = (char *)iov[i].iov_base + skip;
+		size_t len = iov[i].iov_len - skip;
+		skip = 0;
+		if (len > room - written) {
+			len = room - written;
+		}
+		size_t offset = (tail + written) & (SHM_RING_SIZE - 1);
+		size_t first = len < SHM_RING_SIZE - offset ? len : SHM_RING_SIZE - offset;
+		memcpy(ring->data + offset, src, first);
+		memcpy(ring->data, src + first, len - first);
+		written += len;
+	}
+	__atomic_store_n(&ring->tail, tail + written, __ATOMIC_RELEASE);
+	return written;
+}
+
+/* is there something to read (for_space == 0) or room to write (for_space == 1) */
+/* corrupt positions count as ready, so the next read or write reports them */
+static int shmReady(shmChannel_t *ch, int for_space) {
+	if (for_space) {
+		return __atomic_load_n(&ch->out->tail, __ATOMIC_RELAXED) -
+		__atomic_load_n(&ch->out->head, __ATOMIC_ACQUIRE) != SHM_RING_SIZE;
+	}
+	return __atomic_load_n(&ch->in->tail, __ATOMIC_ACQUIRE) != __atomic_load_n(&ch->in->head, __ATOMIC_RELAXED);
+}
+
+/* after moving a ring position: ring the peer's doorbell if it went to sleep */
+static void shmWakePeer(shmChannel_t *ch) {
+	int *waiting = &ch->shared->waiting[ch->side ^ 1].value;
+	// pairs with the fence in shmWait: either the peer sees the new position or we see its flag
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (__atomic_load_n(waiting, __ATOMIC_RELAXED) && __atomic_exchange_n(waiting, 0, __ATOMIC_RELAXED)) {
+		char bell = 0;
+		send(ch->sockfd, &bell, 1, MSG_DONTWAIT | MSG_NOSIGNAL);
+	}
+}
+
+/* wait for the peer to make the ring readable (for_space == 0) or writable (for_space == 1)
+ * RETURNS: 1 to try again, 0 at end of stream, -1 on error (EAGAIN if not blocking)
+ */
+static int shmWait(shmChannel_t *ch, int for_space, int blocking) {
+	char bells[64];
+	ssize_t n;
+	// doorbells already queued mean the peer moved on since
+	do {
+		n = recv(ch->sockfd, bells, sizeof(bells), MSG_DONTWAIT);
+	} while (n < 0 && errno == EINTR);
+	if (n >= 0) {
+		return n > 0;
+	}
+	if (errno != EAGAIN && errno != EWOULDBLOCK) {
+		return -1;
+	}
+
+	int *waiting = &ch->shared->waiting[ch->side].value;
+	__atomic_store_n(waiting, 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (shmReady(ch, for_space)) {
+		__atomic_store_n(waiting, 0, __ATOMIC_RELAXED);
+		return 1;
+	}
+	if (!blocking) {
+		errno = EAGAIN;
+		return -1;
+	}
+	do {
+		n = recv(ch->sockfd, bells, sizeof(bells), 0);
+	} while (n < 0 && errno == EINTR);
+	return n > 0 ? 1 : n;
+}
+
+/* spin on the ring for up to SHM_SPIN_NS after *spin_start (set on the first call),
+ * unless there is a single CPU */
+/* RETURNS: 1 while still spinning */
+static int shmSpin(shmChannel_t *ch, int for_space, uint64_t *spin_start) {
+	// on a single CPU the peer cannot make progress while we spin
+	static int cpus = 0;
+	if (cpus == 0) {
+		cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	}
+	if (cpus < 2) {
+		return 0;
+	}
+	uint64_t now = shmNow();
+	if (*spin_start == 0) {
+		*spin_start = now;
+	}
+	if (now - *spin_start >= SHM_SPIN_NS) {
+		return 0;
+	}
+	for (int i = 0; i < 64 && !shmReady(ch, for_space); i++) {
+		shmPause();
+	}
+	return 1;
+}
+
+/* map the memfd of a channel */
+static shmChannel_t *shmChannelMap(int memfd, int sockfd, int side) {
+	shmShared_t *shared = mmap(NULL, sizeof(shmShared_t), PROT_READ | PROT_WRITE, MAP_SHARED, memfd, 0);
+	if (shared == MAP_FAILED) {
+		perror("mmap");
+		return NULL;
+	}
+	shmChannel_t *ch = malloc(sizeof(*ch));
+	if (ch == NULL) {
+		munmap(shared, sizeof(shmShared_t));
+		return NULL;
+	}
+	ch->sockfd = sockfd;
+	ch->side = side;
+	ch->shared = shared;
+	ch->in = &shared->rings[side ^ 1];
+	ch->out = &shared->rings[side];
+	return ch;
+}
+
+/* -------------------- */
+/* shmChannel procedure */
+/* -------------------- */
+
+/* client side: create the rings & hand them to the server over sockfd */
+shmChannel_t *shmChannelConnect(int sockfd) {
+	int memfd = memfd_create("rpc-shm", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+	if (memfd < 0) {
+		perror("memfd_create");
+		return NULL;
+	}
+	shmChannel_t *ch = NULL;
+	// the server only maps a memfd sealed at its size, so neither side can shrink it under the other
+	if (ftruncate(memfd, sizeof(shmShared_t)) < 0 ||
+	fcntl(memfd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL) < 0 ||
+	(ch = shmChannelMap(memfd, sockfd, SHM_CLIENT)) == NULL) {
+		close(memfd);
+		return NULL;
+	}
+	// a fresh memfd is zero-filled: both rings are empty, & the server only reads once
+	// its epoll reports the socket, so it starts out waiting for a doorbell
+	ch->shared->magic = SHM_MAGIC;
+	ch->shared->ring_size = SHM_RING_SIZE;
+	ch->shared->waiting[SHM_SERVER].value = 1;
+
+	// the fd travels as ancillary data of a single byte
+	char byte = 0;
+	struct iovec iov = {.iov_base = &byte, .iov_len = 1};
+	char control[CMSG_SPACE(sizeof(int))];
+	memset(control, 0, sizeof(control));
+	struct msghdr msg;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control;
+	msg.msg_controllen = sizeof(control);
+	struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+	memcpy(CMSG_DATA(cmsg), &memfd, sizeof(int));
+	ssize_t n;
+	do {
+		n = sendmsg(sockfd, &msg, MSG_NOSIGNAL);
+	} while (n < 0 && errno == EINTR);
+	close(memfd);
+	if (n != 1) {
+		perror("sendmsg");
+		shmChannelFree(ch);
+		return NULL;
+	}
+	return ch;
+}
+
+/* server side: map the rings the client sent over sockfd */
+shmChannel_t *shmChannelAccept(int sockfd) {
+	char byte;
+	struct iovec iov = {.iov_base = &byte, .iov_len = 1};
+	char control[CMSG_SPACE(sizeof(int))];
+	struct msghdr msg;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control;
+	msg.msg_controllen = sizeof(control);
+	ssize_t n;
+	do {
+		n = recvmsg(sockfd, &msg, MSG_DONTWAIT | MSG_CMSG_CLOEXEC);
+	} while (n < 0 && errno == EINTR);
+	if (n < 0) {
+		return NULL;
+	}
+
+	// the fd travels with the first byte, anything else is not a client of ours
+	struct cmsghdr *cmsg = n == 1 ? CMSG_FIRSTHDR(&msg) : NULL;
+	if (cmsg == NULL || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS ||
+	cmsg->cmsg_len != CMSG_LEN(sizeof(int))) {
+		errno = EPROTO;
+		return NULL;
+	}
+	int memfd;
+	memcpy(&memfd, CMSG_DATA(cmsg), sizeof(int));
+
+	// the client controls the memfd, so check it holds a whole channel before mapping it &
+	// that it can no longer shrink, or touching the mapping would raise SIGBUS (any other
+	// kind of file has no seals)
+	struct stat st;
+	shmChannel_t *ch = NULL;
+	int seals = fcntl(memfd, F_GET_SEALS);
+	if (seals >= 0 && (seals & F_SEAL_SHRINK) && fstat(memfd, &st) == 0 && st.st_size == sizeof(shmShared_t)) {
+		ch = shmChannelMap(memfd, sockfd, SHM_SERVER);
+	}
+	close(memfd);
+	if (ch != NULL && (ch->shared->magic != SHM_MAGIC || ch->shared->ring_size != SHM_RING_SIZE)) {
+		shmChannelFree(ch);
+		ch = NULL;
+	}
+	if (ch == NULL) {
+		errno = EPROTO;
+	}
+	return ch;
+}
+
+/* recv(2) on the stream */
+ssize_t shmChannelRecv(shmChannel_t *ch, void *buf, size_t len, int flags) {
+	int blocking = !(flags & MSG_DONTWAIT);
+	uint64_t spin_start = 0;
+	while (1) {
+		ssize_t n = shmRingRead(ch->in, buf, len);
+		if (n < 0) {
+			return -1;
+		}
+		if (n > 0 || len == 0) {
+			shmWakePeer(ch);
+			return n;
+		}
+		if (blocking && shmSpin(ch, 0, &spin_start)) {
+			continue;
+		}
+		int status = shmWait(ch, 0, blocking);
+		if (status == 0) {
+			// the peer may have written its last bytes right before closing
+			return shmRingRead(ch->in, buf, len);
+		}
+		if (status < 0) {
+			return -1;
+		}
+	}
+}
+
+/* sendmsg(2) on the stream */
+ssize_t shmChannelSend(shmChannel_t *ch, struct iovec *iov, int iovcnt, int flags) {
+	int blocking = !(flags & MSG_DONTWAIT);
+	size_t total = 0;
+	for (int i = 0; i < iovcnt; i++) {
+		total += iov[i].iov_len;
+	}
+
+	size_t sent = 0;
+	uint64_t spin_start = 0;
+	while (sent < total) {
+		ssize_t n = shmRingWrite(ch->out, iov, iovcnt, sent);
+		if (n < 0) {
+			return -1;
+		}
+		if (n > 0) {
+			sent += n;
+			spin_start = 0;
+			shmWakePeer(ch);
+			continue;
+		}
+		if (blocking && shmSpin(ch, 1, &spin_start)) {
+			continue;
+		}
+		int status = shmWait(ch, 1, blocking);
+		if (status < 0 && !blocking && errno == EAGAIN) {
+			break;
+		}
+		if (status <= 0) {
+			if (status == 0) {
+				errno = EPIPE;
+			}
+			return -1;
+		}
+	}
+	return sent;
+}
+
+/* unmap the rings & free ch */
+void shmChannelFree(shmChannel_t *ch) {
+	if (ch == NULL) {
+		return;
+	}
+	munmap(ch->shared, sizeof(shmShared_t));
+	free(ch);
+}
@@ -0,0 +1,52 @@
+#ifndef SHM_H
+#define SHM_H
+#include <stddef.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+// bytes of each direction's ring, a power of two
+#define SHM_RING_SIZE (1 << 20)
+// a blocking receive or send polls the ring this long before sleeping on the socket
+// (when there is more than one CPU)
+#define SHM_SPIN_NS 50000
+
+// data definitions
+typedef struct shmChannel shmChannel_t;
+
+/* -------------------- */
+/* shmChannel procedure */
+/* -------------------- */
+
+/* byte stream between a client & the server on the same host, carried by two
+ * single-producer single-consumer rings in a memfd mapped by both processes
+ * the connected Unix socket the channel was set up on stays open next to it: a side
+ * about to sleep raises a flag in shared memory & the other side then writes a single
+ * byte to the socket to wake it up, so the socket is what epoll & poll(2) wait on & its
+ * end of file is the end of the stream
+ */
+
+/* client side: create the rings & hand them to the server over sockfd (not owned)
+ * returns NULL on error
+ */
+shmChannel_t *shmChannelConnect(int sockfd);
+
+/* server side: map the rings the client sent over sockfd (not owned), without waiting
+ * returns NULL with errno EAGAIN if they have not arrived yet, NULL on other errors
+ */
+shmChannel_t *shmChannelAccept(int sockfd);
+
+/* recv(2) on the stream: up to len bytes, blocking unless flags has MSG_DONTWAIT
+ * returns bytes read, 0 at end of stream, -1 on error (errno set, EAGAIN included)
+ */
+ssize_t shmChannelRecv(shmChannel_t *ch, void *buf, size_t len, int flags);
+
+/* sendmsg(2) on the stream: blocks until every byte of iov is written unless flags
+ * has MSG_DONTWAIT, then writes what fits
+ * returns bytes written (0 if the ring is full), -1 on error
+ */
+ssize_t shmChannelSend(shmChannel_t *ch, struct iovec *iov, int iovcnt, int flags);
+
+/* unmap the rings & free ch, the socket is left open */
+void shmChannelFree(shmChannel_t *ch);
+
+#endif
@@ -0,0 +1,156 @@
+#include <string.h>
+#include <time.h>
+#include "stats.h"
+
+/* monotonic clock in nanoseconds */
+uint64_t statsNow() {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+/* histogram bucket of a latency */
+static int statsBucket(uint64_t value) {
+	if (value < STATS_SUB_BUCKETS) {
+		return value;
+	}
+	int exp = 63 - __builtin_clzll(value);
+	if (exp > STATS_MAX_EXP) {
+		return STATS_BUCKETS - 1;
+	}
+	int sub = (value >> (exp - STATS_SUB_BITS)) - STATS_SUB_BUCKETS;
+	return STATS_SUB_BUCKETS + (exp - STATS_SUB_BITS) * STATS_SUB_BUCKETS + sub;
+}
+
+/* highest latency that falls into bucket */
+static uint64_t statsBucketHighest(int bucket) {
+	if (bucket < STATS_SUB_BUCKETS) {
+		return bucket;
+	}
+	int exp = (bucket - STATS_SUB_BUCKETS) / STATS_SUB_BUCKETS + STATS_SUB_BITS;
+	uint64_t sub = (bucket - STATS_SUB_BUCKETS) % STATS_SUB_BUCKETS + STATS_SUB_BUCKETS;
+	return ((sub + 1) << (exp - STATS_SUB_BITS)) - 1;
+}
+
+/* account for one handler invocation that took latency_ns for count payloads */
+void statsRecord(functionStats_t *stats, uint64_t latency_ns, uint64_t count, uint64_t errors,
+uint64_t bytes_in, uint64_t bytes_out) {
+	if (count == 0) {
+		return;
+	}
+	__atomic_fetch_add(&stats->calls, count, __ATOMIC_RELAXED);
+	if (errors > 0) {
+		__atomic_fetch_add(&stats->errors, errors, __ATOMIC_RELAXED);
+	}
+	__atomic_fetch_add(&stats->bytes_in, bytes_in, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&stats->bytes_out, bytes_out, __ATOMIC_RELAXED);
+
+	uint64_t each = latency_ns / count;
+	__atomic_fetch_add(&stats->buckets[statsBucket(each)], count, __ATOMIC_RELAXED);
+	uint64_t max = __atomic_load_n(&stats->max_ns, __ATOMIC_RELAXED);
+	while (each > max &&
+	!__atomic_compare_exchange_n(&stats->max_ns, &max, each, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+	}
+}
+
+/* account for count calls dropped before their handler ran because they expired */
+void statsExpired(functionStats_t *stats, uint64_t count) {
+	__atomic_fetch_add(&stats->expired, count, __ATOMIC_RELAXED);
+}
+
+/* account for count calls turned away by admission control */
+void statsRejected(functionStats_t *stats, uint64_t count) {
+	__atomic_fetch_add(&stats->rejected, count, __ATOMIC_RELAXED);
+}
+
+/* account for hits calls answered from the result cache & misses that ran the handler */
+void statsCached(functionStats_t *stats, uint64_t hits, uint64_t misses) {
+	if (hits > 0) {
+		__atomic_fetch_add(&stats->hits, hits, __ATOMIC_RELAXED);
+	}
+	if (misses > 0) {
+		__atomic_fetch_add(&stats->misses, misses, __ATOMIC_RELAXED);
+	}
+}
+
+/* copy stats into snapshot without blocking concurrent statsRecord calls */
+void statsSnapshot(functionStats_t *stats, functionStats_t *snapshot) {
+	snapshot->calls = __atomic_load_n(&stats->calls, __ATOMIC_RELAXED);
+	snapshot->errors = __atomic_load_n(&stats->errors, __ATOMIC_RELAXED);
+	snapshot->bytes_in = __atomic_load_n(&stats->bytes_in, __ATOMIC_RELAXED);
+	snapshot->bytes_out = __atomic_load_n(&stats->bytes_out, __ATOMIC_RELAXED);
+	snapshot->expired = __atomic_load_n(&stats->expired, __ATOMIC_RELAXED);
+	snapshot->rejected = __atomic_load_n(&stats->rejected, __ATOMIC_RELAXED);
+	snapshot->hits = __atomic_load_n(&stats->hits, __ATOMIC_RELAXED);
+	snapshot->misses = __atomic_load_n(&stats->misses, __ATOMIC_RELAXED);
+	snapshot->max_ns = __atomic_load_n(&stats->max_ns, __ATOMIC_RELAXED);
+	for (int i = 0; i < STATS_BUCKETS; i++) {
+		snapshot->buckets[i] = __atomic_load_n(&stats->buckets[i], __ATOMIC_RELAXED);
+	}
+}
+
+/* add every counter of from into a snapshot */
+void statsMerge(functionStats_t *snapshot, functionStats_t *from) {
+	snapshot->calls += from->calls;
+	snapshot->errors += from->errors;
+	snapshot->bytes_in += from->bytes_in;
+	snapshot->bytes_out += from->bytes_out;
+	snapshot->expired += from->expired;
+	snapshot->rejected += from->rejected;
+	snapshot->hits += from->hits;
+	snapshot->misses += from->misses;
+	if (from->max_ns > snapshot->max_ns) {
+		snapshot->max_ns = from->max_ns;
+	}
+	for (int i = 0; i < STATS_BUCKETS; i++) {
+		snapshot->buckets[i] += from->buckets[i];
+	}
+}
+
+/* correct a snapshot for coordinated omission, assuming a sample was due every interval_ns */
+void statsCorrect(functionStats_t *snapshot, uint64_t interval_ns) {
+	if (interval_ns == 0) {
+		return;
+	}
+	// missed samples land in the bucket being walked or below it, so walking up from
+	// the bottom never corrects a synthesized sample again
+	for (int i = 0; i < STATS_BUCKETS; i++) {
+		uint64_t count = snapshot->buckets[i];
+		uint64_t value = statsBucketHighest(i);
+		if (value > snapshot->max_ns) {
+			value = snapshot->max_ns;
+		}
+		if (count == 0 || value <= interval_ns) {
+			continue;
+		}
+		for (uint64_t missed = value - interval_ns; missed >= interval_ns; missed -= interval_ns) {
+			snapshot->buckets[statsBucket(missed)] += count;
+			snapshot->calls += count;
+		}
+	}
+}
+
+/* latency at quantile q (0 to 1) of a snapshot */
+uint64_t statsPercentile(functionStats_t *snapshot, double q) {
+	// the buckets are the source of truth: calls may already count a sample still being added
+	uint64_t total = 0;
+	for (int i = 0; i < STATS_BUCKETS; i++) {
+		total += snapshot->buckets[i];
+	}
+	if (total == 0) {
+		return 0;
+	}
+	uint64_t rank = q * total;
+	if (rank >= total) {
+		rank = total - 1;
+	}
+	uint64_t seen = 0;
+	for (int i = 0; i < STATS_BUCKETS; i++) {
+		seen += snapshot->buckets[i];
+		if (seen > rank) {
+			uint64_t highest = statsBucketHighest(i);
+			return highest < snapshot->max_ns ? highest : snapshot->max_ns;
+		}
+	}
+	return snapshot->max_ns;
+}
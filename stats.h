@@ -0,0 +1,66 @@
+#ifndef STATS_H
+#define STATS_H
+#include <stdint.h>
+
+// HDR-style latency histogram: exact below 2^STATS_SUB_BITS ns, then every power of two
+// is split into 2^STATS_SUB_BITS linear buckets (about 6% relative precision)
+#define STATS_SUB_BITS 4
+#define STATS_SUB_BUCKETS (1 << STATS_SUB_BITS)
+// largest power of two tracked, longer latencies land in the last bucket (2^41 ns, ~36 minutes)
+#define STATS_MAX_EXP 40
+#define STATS_BUCKETS (STATS_SUB_BUCKETS + (STATS_MAX_EXP - STATS_SUB_BITS + 1) * STATS_SUB_BUCKETS)
+
+/* counters of one function, updated with relaxed atomics so readers never block writers */
+typedef struct functionStats {
+    uint64_t calls;     // payloads handled (a batch counts each payload)
+    uint64_t errors;    // payloads answered with an invalid rpc_data (total_res_size == 0)
+    uint64_t bytes_in;  // serialized rpc_data received
+    uint64_t bytes_out; // serialized rpc_data sent
+    uint64_t expired;   // calls dropped unanswered because their deadline had passed
+    uint64_t rejected;  // calls turned away by admission control
+    uint64_t hits;      // calls to a rpc_register_pure function answered from the result cache
+    uint64_t misses;    // calls to a rpc_register_pure function its handler had to compute
+    uint64_t max_ns;
+    uint64_t buckets[STATS_BUCKETS];
+} functionStats_t;
+
+/* --------------- */
+/* stats procedure */
+/* --------------- */
+
+/* monotonic clock in nanoseconds */
+uint64_t statsNow();
+
+/* account for one handler invocation that took latency_ns for count payloads,
+ * the histogram gets count samples of latency_ns / count
+ */
+void statsRecord(functionStats_t *stats, uint64_t latency_ns, uint64_t count, uint64_t errors,
+uint64_t bytes_in, uint64_t bytes_out);
+
+/* account for count calls dropped before their handler ran because they expired */
+void statsExpired(functionStats_t *stats, uint64_t count);
+
+/* account for count calls answered with RPC_OVERLOADED_LEN instead of being run */
+void statsRejected(functionStats_t *stats, uint64_t count);
+
+/* account for hits calls answered from the result cache & misses that ran the handler */
+void statsCached(functionStats_t *stats, uint64_t hits, uint64_t misses);
+
+/* copy stats into snapshot without blocking concurrent statsRecord calls */
+void statsSnapshot(functionStats_t *stats, functionStats_t *snapshot);
+
+/* add every counter of from into a snapshot */
+void statsMerge(functionStats_t *snapshot, functionStats_t *from);
+
+/* correct a snapshot for coordinated omission, assuming a sample was due every interval_ns:
+ * each recorded latency L also accounts for the samples that would have seen L - interval_ns,
+ * L - 2 * interval_ns, ... had the sender not been stalled (as HdrHistogram does)
+ */
+void statsCorrect(functionStats_t *snapshot, uint64_t interval_ns);
+
+/* latency at quantile q (0 to 1) of a snapshot, as the highest value of its bucket
+ * returns 0 when nothing was recorded
+ */
+uint64_t statsPercentile(functionStats_t *snapshot, double q);
+
+#endif
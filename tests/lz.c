@@ -0,0 +1,181 @@
+/* Regression test: the block codec of compressed payloads (lz.h)
+ * usage: lz [PORT] (no server is needed, the port is ignored)
+ * The decompressor runs on whatever a peer sends, so besides round trips through the
+ * compressor it is fed hand-made streams: valid ones with matches the compressor is
+ * unlikely to produce, & malformed ones it has to reject without touching memory past
+ * either buffer
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "lz.h"
+
+// no match starts in the last bytes of the input (LZ_MATCH_LIMIT of lz.c)
+#define TEST_MATCH_LIMIT 12
+#define TEST_MAX_LEN (256 * 1024)
+
+static int failures;
+static unsigned test_seed = 1;
+
+static void testExpect(int ok, const char *what) {
+    if (!ok) {
+        fprintf(stderr, "FAIL: %s\n", what);
+        failures++;
+    }
+}
+
+/* bytes that do not compress */
+static void testFillRandom(char *buf, size_t len) {
+    for (size_t i = 0; i < len; i++) {
+        test_seed = test_seed * 1103515245 + 12345;
+        buf[i] = (char)(test_seed >> 16);
+    }
+}
+
+/* compressor bound: incompressible input grows by a token & length bytes */
+static size_t testBound(size_t len) {
+    return len + len / 255 + 16;
+}
+
+/* compress & decompress src, which must come back as it was */
+static void testRoundTrip(const char *src, size_t len, const char *what) {
+    char *compressed = malloc(testBound(len));
+    char *out = malloc(len + 1);
+    size_t compressed_len = lzCompress(src, len, compressed, testBound(len));
+    testExpect(compressed_len > 0, what);
+    testExpect(lzDecompress(compressed, compressed_len, NULL, len) == 0, what);
+    testExpect(lzDecompress(compressed, compressed_len, out, len) == 0 && memcmp(out, src, len) == 0, what);
+    free(compressed);
+    free(out);
+}
+
+/* append the extra bytes of a length whose nibble is 15 */
+static char *testPutLength(char *op, size_t length) {
+    if (length < 15) {
+        return op;
+    }
+    for (length -= 15; length >= 255; length -= 255) {
+        *op++ = (char)255;
+    }
+    *op++ = (char)length;
+    return op;
+}
+
+/* append a sequence by hand: literals, then a match unless match_len is 0 */
+static char *testPutSequence(char *op, const char *literals, size_t literal_len, size_t offset, size_t match_len) {
+    size_t match_code = match_len > 0 ? match_len - LZ_MIN_MATCH : 0;
+    *op++ = (char)(((literal_len < 15 ? literal_len : 15) << 4) | (match_code < 15 ? match_code : 15));
+    op = testPutLength(op, literal_len);
+    memcpy(op, literals, literal_len);
+    op += literal_len;
+    if (match_len > 0) {
+        *op++ = (char)(offset & 0xFF);
+        *op++ = (char)(offset >> 8);
+        op = testPutLength(op, match_code);
+    }
+    return op;
+}
+
+static void testRoundTrips(void) {
+    char *src = malloc(TEST_MAX_LEN);
+    testRoundTrip(src, 0, "round trip of an empty input");
+
+    // around the tail that is always left as literals
+    size_t short_lens[] = {1, TEST_MATCH_LIMIT - 1, TEST_MATCH_LIMIT, TEST_MATCH_LIMIT + 1, TEST_MATCH_LIMIT + 8, 64};
+    for (size_t i = 0; i < sizeof(short_lens) / sizeof(short_lens[0]); i++) {
+        memset(src, 'a', short_lens[i]);
+        testRoundTrip(src, short_lens[i], "round trip of a short repetitive input");
+        testFillRandom(src, short_lens[i]);
+        testRoundTrip(src, short_lens[i], "round trip of a short random input");
+    }
+
+    // a run repeats its first byte: offset 1, far shorter than the match
+    memset(src, 'x', 100000);
+    testRoundTrip(src, 100000, "round trip of a run");
+    // a short period: offset 3 & matches made of thousands of bytes (255-extended)
+    for (size_t i = 0; i < 50000; i++) {
+        src[i] = "abc"[i % 3];
+    }
+    testRoundTrip(src, 50000, "round trip of a short period");
+
+    // long literal runs (255-extended) between matches
+    testFillRandom(src, TEST_MAX_LEN);
+    for (size_t i = 0; i + 2000 < TEST_MAX_LEN; i += 3000) {
+        memcpy(src + i + 1000, src + i, 1000);
+    }
+    testRoundTrip(src, TEST_MAX_LEN, "round trip of literals & matches");
+    testFillRandom(src, TEST_MAX_LEN);
+    testRoundTrip(src, TEST_MAX_LEN, "round trip of a random input");
+
+    // the compressor gives up once the output would pass cap
+    char small[64];
+    testExpect(lzCompress(src, 1000, small, sizeof(small)) == 0, "random input does not fit a small cap");
+    free(src);
+}
+
+static void testHandMadeStreams(void) {
+    char *expected = malloc(TEST_MAX_LEN);
+    char *stream = malloc(testBound(TEST_MAX_LEN));
+    char *out = malloc(TEST_MAX_LEN);
+
+    // the farthest offset, with a literal run & a match both longer than 255 + 15
+    size_t literal_len = LZ_MAX_OFFSET, match_len = 600;
+    testFillRandom(expected, literal_len);
+    memcpy(expected + literal_len, expected, match_len);
+    memcpy(expected + literal_len + match_len, "tail", 4);
+    size_t expected_len = literal_len + match_len + 4;
+    char *op = testPutSequence(stream, expected, literal_len, LZ_MAX_OFFSET, match_len);
+    op = testPutSequence(op, "tail", 4, 0, 0);
+    size_t stream_len = op - stream;
+    testExpect(lzDecompress(stream, stream_len, out, expected_len) == 0 &&
+    memcmp(out, expected, expected_len) == 0, "offset 65535 & extended lengths");
+
+    // every prefix of a valid stream is truncated
+    size_t truncated_failures = 0;
+    for (size_t len = 0; len < stream_len; len += (len < 300 ? 1 : 4099)) {
+        truncated_failures += lzDecompress(stream, len, out, expected_len) == 0;
+    }
+    for (size_t len = stream_len - 10; len < stream_len; len++) {
+        truncated_failures += lzDecompress(stream, len, out, expected_len) == 0;
+    }
+    testExpect(truncated_failures == 0, "truncated streams are rejected");
+
+    // more or fewer bytes than the caller expects
+    testExpect(lzDecompress(stream, stream_len, out, expected_len - 1) < 0, "a longer output is rejected");
+    testExpect(lzDecompress(stream, stream_len, NULL, expected_len - 1) < 0, "a longer output fails the check");
+    testExpect(lzDecompress(stream, stream_len, out, expected_len + 1) < 0, "a shorter output is rejected");
+    testExpect(lzDecompress(stream, 0, out, 1) < 0, "an empty stream for one byte is rejected");
+
+    // an overlapping match of offset 2 repeats the last two bytes
+    op = testPutSequence(stream, "ab", 2, 2, 9);
+    op = testPutSequence(op, "c", 1, 0, 0);
+    testExpect(lzDecompress(stream, op - stream, out, 12) == 0 && memcmp(out, "abababababac", 12) == 0,
+    "overlapping match");
+
+    // offsets that point at nothing
+    op = testPutSequence(stream, "abcd", 4, 0, 4);
+    op = testPutSequence(op, "e", 1, 0, 0);
+    testExpect(lzDecompress(stream, op - stream, out, 9) < 0, "offset 0 is rejected");
+    op = testPutSequence(stream, "abcd", 4, 5, 4);
+    op = testPutSequence(op, "e", 1, 0, 0);
+    testExpect(lzDecompress(stream, op - stream, out, 9) < 0, "an offset past the output is rejected");
+    testExpect(lzDecompress(stream, op - stream, NULL, 9) < 0, "an offset past the output fails the check");
+
+    // a length byte missing after a nibble of 15
+    stream[0] = (char)0xF0;
+    testExpect(lzDecompress(stream, 1, out, 15) < 0, "a missing length byte is rejected");
+    free(expected);
+    free(stream);
+    free(out);
+}
+
+int main(void) {
+    testRoundTrips();
+    testHandMadeStreams();
+    if (failures > 0) {
+        fprintf(stderr, "FAIL: %d checks went wrong\n", failures);
+        return EXIT_FAILURE;
+    }
+    printf("lz: OK\n");
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,132 @@
+/* Regression test: two threads calling through a single rpc_client_pool connection
+ * usage: pool_wakeup PORT
+ * While one caller waits for the socket without the lock, the other one may take its
+ * response off the socket along with its own; the waiting caller must still wake up
+ * although nothing more arrives. Both threads make one call per round & wait for each
+ * other in between, so the connection goes quiet after every round. A lost wakeup
+ * hangs a caller, which the alarm turns into a failure
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <signal.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <string.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include "rpc.h"
+#include "rpc_ext.h"
+
+#define TEST_ROUNDS 50000
+#define TEST_TIMEOUT_S 60
+// the server starts listening from its own thread: wait up to this many 10 ms steps
+#define TEST_LISTEN_TRIES 500
+
+static rpc_client_pool *pool;
+static rpc_handle *handle;
+static pthread_barrier_t round_barrier;
+static int failures;
+
+static rpc_data *testIncrement(rpc_data *in) {
+    rpc_data *out = rpc_data_alloc(0);
+    out->data1 = in->data1 + 1;
+    return out;
+}
+
+static void *testServeThread(void *arg) {
+    rpc_serve_all_threads(arg, 1, 2);
+    return NULL;
+}
+
+static void testTimeout(int sig) {
+    (void)sig;
+    static const char message[] = "FAIL: a pool caller never woke up\n";
+    ssize_t n = write(STDERR_FILENO, message, sizeof(message) - 1);
+    (void)n;
+    _exit(EXIT_FAILURE);
+}
+
+/* wait until the server accepts connections on port */
+/* RETURNS: 0 once it does, -1 if it never did */
+static int testWaitForServer(int port) {
+    struct sockaddr_in6 addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin6_family = AF_INET6;
+    addr.sin6_port = htons(port);
+    addr.sin6_addr = in6addr_loopback;
+    for (int i = 0; i < TEST_LISTEN_TRIES; i++) {
+        int fd = socket(AF_INET6, SOCK_STREAM, 0);
+        int status = connect(fd, (struct sockaddr *)&addr, sizeof(addr));
+        close(fd);
+        if (status == 0) {
+            return 0;
+        }
+        usleep(10000);
+    }
+    return -1;
+}
+
+/* one call through the pool per round, counting wrong or missing results */
+static void *testCallThread(void *arg) {
+    int data1 = *(int *)arg;
+    for (int i = 0; i < TEST_ROUNDS; i++) {
+        pthread_barrier_wait(&round_barrier);
+        rpc_data payload = {.data1 = data1, .data2_len = 0, .data2 = NULL};
+        rpc_data *result = rpc_client_pool_call(pool, handle, &payload);
+        if (result == NULL || result->data1 != data1 + 1) {
+            __atomic_add_fetch(&failures, 1, __ATOMIC_RELAXED);
+        }
+        rpc_data_free(result);
+    }
+    return NULL;
+}
+
+int main(int argc, char *argv[]) {
+    if (argc != 2) {
+        fprintf(stderr, "usage: %s PORT\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+    int port = atoi(argv[1]);
+    rpc_server *srv = rpc_init_server(port);
+    if (srv == NULL || rpc_register(srv, "increment", testIncrement) < 0) {
+        fprintf(stderr, "FAIL: cannot start the server\n");
+        return EXIT_FAILURE;
+    }
+    pthread_t server_thread;
+    if (pthread_create(&server_thread, NULL, testServeThread, srv) != 0) {
+        return EXIT_FAILURE;
+    }
+
+    // a single connection, so both threads pipeline on it
+    pool = testWaitForServer(port) < 0 ? NULL : rpc_client_pool_create("::1", port, 1);
+    if (pool == NULL) {
+        fprintf(stderr, "FAIL: cannot connect\n");
+        return EXIT_FAILURE;
+    }
+    handle = rpc_client_pool_find(pool, "increment");
+    if (handle == NULL) {
+        fprintf(stderr, "FAIL: cannot find the function\n");
+        return EXIT_FAILURE;
+    }
+
+    signal(SIGALRM, testTimeout);
+    alarm(TEST_TIMEOUT_S);
+    pthread_barrier_init(&round_barrier, NULL, 2);
+    int data1[2] = {1, 1000};
+    pthread_t caller;
+    if (pthread_create(&caller, NULL, testCallThread, &data1[1]) != 0) {
+        return EXIT_FAILURE;
+    }
+    testCallThread(&data1[0]);
+    pthread_join(caller, NULL);
+    alarm(0);
+
+    free(handle);
+    rpc_client_pool_close(pool);
+    if (failures > 0) {
+        fprintf(stderr, "FAIL: %d calls went wrong\n", failures);
+        return EXIT_FAILURE;
+    }
+    printf("pool_wakeup: OK\n");
+    return EXIT_SUCCESS;
+}
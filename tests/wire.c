@@ -0,0 +1,343 @@
+/* Regression test: the v2 wire protocol & its v1 fallback
+ * usage: wire PORT
+ * The request parser is fed partial & malformed v2 frames, which it has to wait on or
+ * reject. Then an in-process server is driven with hand-made v2 frames (hello, find,
+ * call & batch) on a raw socket, & with v2 & v1 clients of the library
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include "rpc.h"
+#include "rpc_ext.h"
+#include "frame.h"
+
+// the server starts listening from its own thread: wait up to this many 10 ms steps
+#define TEST_LISTEN_TRIES 500
+#define TEST_BATCH_N 5
+
+static int failures;
+
+static void testExpect(int ok, const char *what) {
+    if (!ok) {
+        fprintf(stderr, "FAIL: %s\n", what);
+        failures++;
+    }
+}
+
+static rpc_data *testIncrement(rpc_data *in) {
+    rpc_data *out = rpc_data_alloc(in->data2_len);
+    out->data1 = in->data1 + 1;
+    if (in->data2_len > 0) {
+        memcpy(out->data2, in->data2, in->data2_len);
+    }
+    return out;
+}
+
+static void *testServeThread(void *arg) {
+    rpc_serve_all_threads(arg, 1, 2);
+    return NULL;
+}
+
+/* connect a raw socket to the server on port, waiting until it listens */
+/* RETURNS: the socket, -1 if the server never listened */
+static int testConnect(int port) {
+    struct sockaddr_in6 addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin6_family = AF_INET6;
+    addr.sin6_port = htons(port);
+    addr.sin6_addr = in6addr_loopback;
+    for (int i = 0; i < TEST_LISTEN_TRIES; i++) {
+        int fd = socket(AF_INET6, SOCK_STREAM, 0);
+        if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0) {
+            return fd;
+        }
+        close(fd);
+        usleep(10000);
+    }
+    return -1;
+}
+
+/* ------------------ */
+/* parser of requests */
+/* ------------------ */
+
+static void testVarints(void) {
+    char buffer[VARINT_MAX_SIZE + 1];
+    uint32_t values[] = {0, 127, 128, 16383, 16384, UINT32_MAX};
+    for (size_t i = 0; i < sizeof(values) / sizeof(values[0]); i++) {
+        size_t n = putVarint(buffer, values[i]);
+        uint32_t v = 0;
+        testExpect(getVarint(buffer, n, &v) == (int)n && v == values[i], "varint round trip");
+        testExpect(getVarint(buffer, n - 1, &v) == 0, "a partial varint needs more bytes");
+    }
+
+    // 32 bits leave 4 for the fifth byte, & there is no sixth
+    uint32_t v;
+    memcpy(buffer, "\xFF\xFF\xFF\xFF\x10", 5);
+    testExpect(getVarint(buffer, 5, &v) < 0, "a varint past 32 bits is rejected");
+    memcpy(buffer, "\x80\x80\x80\x80\x80\x00", 6);
+    testExpect(getVarint(buffer, 6, &v) < 0, "a varint longer than 5 bytes is rejected");
+}
+
+/* a v2 call of fid with data1 & data2_len, its data2 is not part of the header */
+/* RETURNS: the size of the frame header & its varint fields */
+static size_t testCallHeader(char *buffer, uint32_t fid, int data1, uint32_t data2_len) {
+    rpc_data payload = {.data1 = data1, .data2_len = data2_len, .data2 = NULL};
+    char fields[FRAME_MAX_HEADER_SIZE];
+    size_t fields_len = putVarint(fields, fid);
+    fields_len += loadRPCDataHeaderV2ToBuffer(&payload, fields + fields_len);
+    loadFrameHeaderV2(buffer, RPC_OP_CALL, 0, RPC_STATUS_OK, 7, fields_len + data2_len);
+    memcpy(buffer + RPC_V2_HEADER_SIZE, fields, fields_len);
+    return RPC_V2_HEADER_SIZE + fields_len;
+}
+
+static void testRequestHeaders(void) {
+    char buffer[FRAME_MAX_HEADER_SIZE];
+    frameHeader_t header;
+    size_t len = testCallHeader(buffer, 300, -5, 1000);
+    testExpect(parseRequestHeader(buffer, len, &header) == (int)len && header.version == 2 &&
+    header.flag == RPC_CALL_ID_FLAG && header.request_id == 7 && header.arg == 300 && header.data1 == -5 &&
+    header.data2_len == 1000 && header.body_len == 1000, "a whole v2 call header is decoded");
+
+    // every prefix of the header & of its varint fields waits for more bytes
+    int partial_failures = 0;
+    for (size_t i = 0; i < len; i++) {
+        partial_failures += parseRequestHeader(buffer, i, &header) != 0;
+    }
+    testExpect(partial_failures == 0, "partial headers & varints need more bytes");
+
+    char bad[FRAME_MAX_HEADER_SIZE];
+    memcpy(bad, buffer, len);
+    bad[0] = (char)(RPC_V2_MAGIC | 3);
+    testExpect(parseRequestHeader(bad, len, &header) < 0, "a call of a later version is rejected");
+    bad[0] = (char)(RPC_V2_MAGIC | 1);
+    testExpect(parseRequestHeader(bad, len, &header) < 0, "a v2 magic with version 1 is rejected");
+    uint8_t opcode, flags, status;
+    uint32_t request_id, body_len;
+    bad[0] = (char)0x52;
+    testExpect(parseFrameHeaderV2(bad, &opcode, &flags, &status, &request_id, &body_len) < 0,
+    "a bad magic is rejected");
+
+    memcpy(bad, buffer, len);
+    bad[3] = RPC_STATUS_ERROR;
+    testExpect(parseRequestHeader(bad, len, &header) < 0, "a request with a status is rejected");
+    memcpy(bad, buffer, len);
+    bad[1] = 0x7F;
+    testExpect(parseRequestHeader(bad, len, &header) < 0, "an unknown opcode is rejected");
+
+    // the fid as a varint that never ends
+    loadFrameHeaderV2(bad, RPC_OP_CALL, 0, RPC_STATUS_OK, 7, 20);
+    memset(bad + RPC_V2_HEADER_SIZE, 0xFF, VARINT_MAX_SIZE + 1);
+    testExpect(parseRequestHeader(bad, RPC_V2_HEADER_SIZE + VARINT_MAX_SIZE + 1, &header) < 0,
+    "an over-long varint is rejected");
+
+    // a varint cut off by the end of the body, rather than by the bytes received so far
+    loadFrameHeaderV2(bad, RPC_OP_CALL, 0, RPC_STATUS_OK, 7, 1);
+    bad[RPC_V2_HEADER_SIZE] = (char)0x80;
+    bad[RPC_V2_HEADER_SIZE + 1] = 0x01;
+    testExpect(parseRequestHeader(bad, RPC_V2_HEADER_SIZE + 2, &header) < 0, "a varint past the body is rejected");
+}
+
+static void testBatches(void) {
+    char data2[3] = {1, 2, 3};
+    rpc_data payloads[TEST_BATCH_N];
+    rpc_data *in[TEST_BATCH_N];
+    for (int i = 0; i < TEST_BATCH_N; i++) {
+        payloads[i].data1 = i * 1000 - 2000;
+        payloads[i].data2_len = i % 2 == 0 ? sizeof(data2) : 0;
+        payloads[i].data2 = i % 2 == 0 ? data2 : NULL;
+        in[i] = &payloads[i];
+    }
+    size_t len = getRPCDataBatchLenV2(in, TEST_BATCH_N);
+    char *buffer = malloc(len + 1);
+    testExpect(loadRPCDataBatchV2ToBuffer(in, TEST_BATCH_N, buffer) == len, "a batch takes its computed length");
+    uint32_t count = 0;
+    testExpect(checkRPCDataBatchV2(buffer, len, 0, &count) == 0 && count == TEST_BATCH_N, "a batch is consistent");
+    testExpect(checkRPCDataBatchV2(buffer, len - 1, 0, &count) < 0, "a truncated batch is rejected");
+    buffer[len] = 0;
+    testExpect(checkRPCDataBatchV2(buffer, len + 1, 0, &count) < 0, "a batch with trailing bytes is rejected");
+    buffer[0] = TEST_BATCH_N + 1;
+    testExpect(checkRPCDataBatchV2(buffer, len, 0, &count) < 0, "a batch with a wrong count is rejected");
+    free(buffer);
+}
+
+/* ------------------------ */
+/* server over a raw socket */
+/* ------------------------ */
+
+/* send a whole v2 frame of body_len bytes */
+static void testSendFrame(int fd, uint8_t opcode, uint32_t request_id, const char *body, size_t body_len) {
+    char *frame = malloc(RPC_V2_HEADER_SIZE + body_len);
+    loadFrameHeaderV2(frame, opcode, 0, RPC_STATUS_OK, request_id, body_len);
+    memcpy(frame + RPC_V2_HEADER_SIZE, body, body_len);
+    testExpect(send(fd, frame, RPC_V2_HEADER_SIZE + body_len, MSG_NOSIGNAL) == (ssize_t)(RPC_V2_HEADER_SIZE + body_len),
+    "a request frame is sent");
+    free(frame);
+}
+
+static int testRecvAll(int fd, char *buffer, size_t len) {
+    for (size_t done = 0; done < len;) {
+        ssize_t n = recv(fd, buffer + done, len - done, 0);
+        if (n <= 0) {
+            return -1;
+        }
+        done += n;
+    }
+    return 0;
+}
+
+/* receive a whole v2 reply, which must be OK & answer request_id */
+/* RETURNS: its body (free(3)) & *body_len, NULL on error */
+static char *testRecvReply(int fd, uint32_t request_id, uint32_t *body_len) {
+    char header[RPC_V2_HEADER_SIZE];
+    uint8_t opcode, flags, status;
+    uint32_t reply_id;
+    if (testRecvAll(fd, header, sizeof(header)) < 0 ||
+    parseFrameHeaderV2(header, &opcode, &flags, &status, &reply_id, body_len) != 2 ||
+    opcode != RPC_OP_REPLY || status != RPC_STATUS_OK || reply_id != request_id) {
+        return NULL;
+    }
+    char *body = malloc(*body_len + 1);
+    if (testRecvAll(fd, body, *body_len) < 0) {
+        free(body);
+        return NULL;
+    }
+    return body;
+}
+
+static void testRawV2(int fd) {
+    char body[64];
+    uint32_t body_len;
+
+    // the hello settles v2 & offers no feature
+    size_t len = putVarint(body, 0);
+    testSendFrame(fd, RPC_OP_HELLO, 1, body, len);
+    char *reply = testRecvReply(fd, 1, &body_len);
+    testExpect(reply != NULL, "the hello is answered in v2");
+    free(reply);
+
+    // look up the function
+    len = putVarint(body, 1);
+    len += putVarint(body + len, strlen("increment"));
+    memcpy(body + len, "increment", strlen("increment"));
+    len += strlen("increment");
+    testSendFrame(fd, RPC_OP_FIND, 2, body, len);
+    reply = testRecvReply(fd, 2, &body_len);
+    // the registry generation, then the fid
+    uint32_t generation = 0, fid = 0;
+    int n = reply != NULL ? getVarint(reply, body_len, &generation) : -1;
+    testExpect(n > 0 && getVarint(reply + n, body_len - n, &fid) == (int)body_len - n && fid > 0,
+    "the function is found");
+    free(reply);
+
+    // a call with data2
+    len = putVarint(body, fid);
+    rpc_data payload = {.data1 = 41, .data2_len = 4, .data2 = "abcd"};
+    len += loadRPCDataHeaderV2ToBuffer(&payload, body + len);
+    memcpy(body + len, payload.data2, payload.data2_len);
+    len += payload.data2_len;
+    testSendFrame(fd, RPC_OP_CALL, 3, body, len);
+    reply = testRecvReply(fd, 3, &body_len);
+    int data1 = 0;
+    uint32_t data2_len = 0;
+    n = reply != NULL ? parseRPCDataHeaderV2(reply, body_len, &data1, &data2_len) : -1;
+    testExpect(n > 0 && data1 == 42 && data2_len == 4 && body_len == n + data2_len &&
+    memcmp(reply + n, "abcd", 4) == 0, "a v2 call is answered");
+    free(reply);
+
+    // a batch
+    rpc_data payloads[TEST_BATCH_N];
+    rpc_data *in[TEST_BATCH_N];
+    for (int i = 0; i < TEST_BATCH_N; i++) {
+        payloads[i] = (rpc_data){.data1 = i, .data2_len = 0, .data2 = NULL};
+        in[i] = &payloads[i];
+    }
+    len = putVarint(body, fid);
+    len += loadRPCDataBatchV2ToBuffer(in, TEST_BATCH_N, body + len);
+    testSendFrame(fd, RPC_OP_CALL_BATCH, 4, body, len);
+    reply = testRecvReply(fd, 4, &body_len);
+    uint32_t count = 0;
+    testExpect(reply != NULL && checkRPCDataBatchV2(reply, body_len, 1, &count) == 0 && count == TEST_BATCH_N,
+    "a v2 batch is answered");
+    free(reply);
+}
+
+/* ------------------------- */
+/* clients of either version */
+/* ------------------------- */
+
+static void testClient(int port, int version) {
+    const char *what = version == RPC_WIRE_V1 ? "a v1 client" : "a v2 client";
+    rpc_set_wire_version(version);
+    rpc_client *cl = rpc_init_client("::1", port);
+    rpc_handle *handle = cl != NULL ? rpc_find(cl, "increment") : NULL;
+    testExpect(handle != NULL, what);
+    if (handle == NULL) {
+        rpc_close_client(cl);
+        return;
+    }
+
+    rpc_data payload = {.data1 = 1, .data2_len = 3, .data2 = "xyz"};
+    rpc_data *result = rpc_call(cl, handle, &payload);
+    testExpect(result != NULL && result->data1 == 2 && result->data2_len == 3 &&
+    memcmp(result->data2, "xyz", 3) == 0, what);
+    rpc_data_free(result);
+
+    rpc_data payloads[TEST_BATCH_N];
+    rpc_data *in[TEST_BATCH_N], *out[TEST_BATCH_N];
+    for (int i = 0; i < TEST_BATCH_N; i++) {
+        payloads[i] = (rpc_data){.data1 = i, .data2_len = 0, .data2 = NULL};
+        in[i] = &payloads[i];
+    }
+    testExpect(rpc_call_batch(cl, handle, in, TEST_BATCH_N, out) == TEST_BATCH_N, what);
+    for (int i = 0; i < TEST_BATCH_N; i++) {
+        testExpect(out[i] != NULL && out[i]->data1 == i + 1, what);
+        rpc_data_free(out[i]);
+    }
+    free(handle);
+    rpc_close_client(cl);
+}
+
+int main(int argc, char *argv[]) {
+    if (argc != 2) {
+        fprintf(stderr, "usage: %s PORT\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+    testVarints();
+    testRequestHeaders();
+    testBatches();
+
+    int port = atoi(argv[1]);
+    rpc_server *srv = rpc_init_server(port);
+    if (srv == NULL || rpc_register(srv, "increment", testIncrement) < 0) {
+        fprintf(stderr, "FAIL: cannot start the server\n");
+        return EXIT_FAILURE;
+    }
+    pthread_t server_thread;
+    if (pthread_create(&server_thread, NULL, testServeThread, srv) != 0) {
+        return EXIT_FAILURE;
+    }
+    int fd = testConnect(port);
+    if (fd < 0) {
+        fprintf(stderr, "FAIL: cannot connect\n");
+        return EXIT_FAILURE;
+    }
+    testRawV2(fd);
+    close(fd);
+
+    // both versions against the same server
+    testClient(port, RPC_WIRE_V2);
+    testClient(port, RPC_WIRE_V1);
+
+    if (failures > 0) {
+        fprintf(stderr, "FAIL: %d checks went wrong\n", failures);
+        return EXIT_FAILURE;
+    }
+    printf("wire: OK\n");
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,203 @@
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/syscall.h>
+#include "trace.h"
+
+// events copied out of a ring at once while dumping
+#define TRACE_DUMP_CHUNK 256
+
+/* per-thread event ring, written by its thread only
+ * head counts every event ever recorded, event i lives in events[i % TRACE_RING_SIZE]
+ */
+typedef struct traceRing {
+    traceEvent_t events[TRACE_RING_SIZE];
+    uint64_t head;
+    uint32_t thread;
+    int in_use;             // 0 once its thread exited, the ring is then handed to the next new thread
+    struct traceRing *next; // rings are never freed, so dumps can walk the list without locking
+} traceRing_t;
+
+int traceLevel = RPC_TRACE_OFF;
+
+static traceRing_t *rings;
+static __thread traceRing_t *thread_ring;
+static pthread_key_t ring_key;
+static pthread_once_t trace_once = PTHREAD_ONCE_INIT;
+static char dump_path[4096];
+
+/* the ring outlives its thread: keep its events & let another thread reuse it */
+static void traceRingRelease(void *arg) {
+	traceRing_t *ring = arg;
+	__atomic_store_n(&ring->in_use, 0, __ATOMIC_RELEASE);
+}
+
+/* SIGUSR2 handler installed when RPC_TRACE_DUMP names a file */
+static void traceDumpSignal(int signum) {
+	traceDump(dump_path);
+}
+
+static void traceSetup() {
+	pthread_key_create(&ring_key, traceRingRelease);
+
+	char *level = getenv("RPC_TRACE_LEVEL");
+	if (level != NULL) {
+		__atomic_store_n(&traceLevel, atoi(level), __ATOMIC_RELAXED);
+	}
+	char *path = getenv("RPC_TRACE_DUMP");
+	if (path != NULL && strlen(path) < sizeof(dump_path)) {
+		strcpy(dump_path, path);
+		struct sigaction sa;
+		memset(&sa, 0, sizeof(sa));
+		sa.sa_handler = traceDumpSignal;
+		sa.sa_flags = SA_RESTART;
+		sigaction(SIGUSR2, &sa, NULL);
+	}
+}
+
+/* read RPC_TRACE_LEVEL & RPC_TRACE_DUMP from the environment (once) */
+void traceInit() {
+	pthread_once(&trace_once, traceSetup);
+}
+
+/* get the calling thread's ring: a ring left by an exited thread, or a new one */
+static traceRing_t *traceThreadRing() {
+	traceInit();
+	traceRing_t *ring;
+	for (ring = __atomic_load_n(&rings, __ATOMIC_ACQUIRE); ring != NULL; ring = ring->next) {
+		int free_ring = 0;
+		if (__atomic_compare_exchange_n(&ring->in_use, &free_ring, 1, 0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+			break;
+		}
+	}
+	if (ring == NULL) {
+		ring = calloc(1, sizeof(*ring));
+		assert(ring);
+		ring->in_use = 1;
+		ring->next = __atomic_load_n(&rings, __ATOMIC_RELAXED);
+		while (!__atomic_compare_exchange_n(&rings, &ring->next, ring, 0, __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+		}
+	}
+	ring->thread = syscall(SYS_gettid);
+	pthread_setspecific(ring_key, ring);
+	thread_ring = ring;
+	return ring;
+}
+
+/* append an event to the calling thread's ring, lock-free */
+void traceRecord(int level, int type, uint64_t a, uint64_t b) {
+	traceRing_t *ring = thread_ring != NULL ? thread_ring : traceThreadRing();
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	uint64_t head = ring->head;
+	traceEvent_t *event = &ring->events[head & (TRACE_RING_SIZE - 1)];
+	event->time_ns = (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+	event->thread = ring->thread;
+	event->type = type;
+	event->level = level;
+	event->a = a;
+	event->b = b;
+	// publish the event to dumps running on other threads
+	__atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+}
+
+/* write all of buffer to fd */
+static int traceWriteAll(int fd, const void *buffer, size_t len) {
+	const char *ptr = buffer;
+	while (len > 0) {
+		ssize_t n = write(fd, ptr, len);
+		if (n < 0) {
+			return -1;
+		}
+		ptr += n;
+		len -= n;
+	}
+	return 0;
+}
+
+/* write every event still held by the rings to path */
+int traceDump(const char *path) {
+	int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0) {
+		return -1;
+	}
+	traceDumpHeader_t header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, TRACE_DUMP_MAGIC, sizeof(header.magic));
+	header.version = TRACE_DUMP_VERSION;
+	header.event_size = sizeof(traceEvent_t);
+	int status = traceWriteAll(fd, &header, sizeof(header));
+
+	int written = 0;
+	traceEvent_t chunk[TRACE_DUMP_CHUNK];
+	for (traceRing_t *ring = __atomic_load_n(&rings, __ATOMIC_ACQUIRE); ring != NULL && status == 0;
+	ring = ring->next) {
+		uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+		uint64_t first = head > TRACE_RING_SIZE ? head - TRACE_RING_SIZE : 0;
+		while (first < head && status == 0) {
+			uint64_t count = head - first < TRACE_DUMP_CHUNK ? head - first : TRACE_DUMP_CHUNK;
+			for (uint64_t i = 0; i < count; i++) {
+				chunk[i] = ring->events[(first + i) & (TRACE_RING_SIZE - 1)];
+			}
+
+			// events the writer lapped while they were copied are torn, skip them
+			uint64_t now = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+			uint64_t skip = 0;
+			if (now >= TRACE_RING_SIZE && now - TRACE_RING_SIZE + 1 > first) {
+				skip = now - TRACE_RING_SIZE + 1 - first;
+			}
+			if (skip < count) {
+				status = traceWriteAll(fd, chunk + skip, (count - skip) * sizeof(traceEvent_t));
+				written += count - skip;
+			}
+			first += count;
+		}
+	}
+	close(fd);
+	return status < 0 ? -1 : written;
+}
+
+/* printable name of an event type */
+const char *traceTypeName(int type) {
+	static const char *names[TRACE_TYPES] = {
+		[TRACE_ACCEPT] = "accept",
+		[TRACE_CLOSE] = "close",
+		[TRACE_READ] = "read",
+		[TRACE_FRAME] = "frame",
+		[TRACE_HANDLER_START] = "handler_start",
+		[TRACE_HANDLER_END] = "handler_end",
+		[TRACE_WRITE] = "write",
+		[TRACE_USER] = "user",
+		[TRACE_EXPIRED] = "expired",
+		[TRACE_REJECTED] = "rejected",
+	};
+	if (type <= 0 || type >= TRACE_TYPES) {
+		return "unknown";
+	}
+	return names[type];
+}
+
+/* Sets the runtime tracing level */
+void rpc_trace_set_level(int level) {
+	traceInit();
+	__atomic_store_n(&traceLevel, level, __ATOMIC_RELAXED);
+}
+
+/* Writes the events held by every thread's trace ring to path */
+int rpc_trace_dump(const char *path) {
+	if (path == NULL) {
+		return -1;
+	}
+	return traceDump(path);
+}
+
+/* Records an application event */
+void rpc_trace(uint64_t a, uint64_t b) {
+	TRACE(RPC_TRACE_DEBUG, TRACE_USER, a, b);
+}
@@ -0,0 +1,77 @@
+#ifndef TRACE_H
+#define TRACE_H
+#include <stdint.h>
+#include "rpc_ext.h"
+
+// events above this level are compiled out (make TRACE_LEVEL=0 removes every event)
+#ifndef RPC_TRACE_MAX_LEVEL
+#define RPC_TRACE_MAX_LEVEL RPC_TRACE_DEBUG
+#endif
+
+// events kept per thread, the oldest ones are overwritten (power of two)
+#define TRACE_RING_SIZE 4096
+#define TRACE_DUMP_MAGIC "RPCTRACE"
+#define TRACE_DUMP_VERSION 1
+
+/* event types, a & b depend on the type */
+enum traceType {
+    TRACE_ACCEPT = 1,    // a: socket, b: low 64 bits of the peer IPv6 address
+    TRACE_CLOSE,         // a: socket
+    TRACE_READ,          // a: socket, b: bytes received
+    TRACE_FRAME,         // a: socket, b: request flag << 32 | body_len
+    TRACE_HANDLER_START, // a: fid, b: payloads
+    TRACE_HANDLER_END,   // a: fid, b: payloads answered with an error
+    TRACE_WRITE,         // a: socket, b: bytes sent
+    TRACE_USER,          // rpc_trace(a, b)
+    TRACE_EXPIRED,       // a: fid, b: request id of a call dropped past its deadline
+    TRACE_REJECTED,      // a: fid, b: request id of a call turned away by admission control
+    TRACE_TYPES
+};
+
+/* fixed-size binary event, also the record layout of a dump file (host byte order) */
+typedef struct traceEvent {
+    uint64_t time_ns; // CLOCK_MONOTONIC
+    uint32_t thread;  // kernel thread id
+    uint16_t type;
+    uint16_t level;
+    uint64_t a;
+    uint64_t b;
+} traceEvent_t;
+
+/* dump file header, followed by the events of every thread (not sorted) */
+typedef struct traceDumpHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t event_size;
+} traceDumpHeader_t;
+
+// current runtime level, read on every event site
+extern int traceLevel;
+
+/* record an event if level is enabled at compile time & at run time */
+#define TRACE(level, type, a, b) \
+    do { \
+        if ((level) <= RPC_TRACE_MAX_LEVEL && (level) <= __atomic_load_n(&traceLevel, __ATOMIC_RELAXED)) \
+            traceRecord((level), (type), (uint64_t)(a), (uint64_t)(b)); \
+    } while (0)
+
+/* --------------- */
+/* trace procedure */
+/* --------------- */
+
+/* read RPC_TRACE_LEVEL & RPC_TRACE_DUMP from the environment (once) */
+void traceInit();
+
+/* append an event to the calling thread's ring, lock-free */
+void traceRecord(int level, int type, uint64_t a, uint64_t b);
+
+/* write every event still held by the rings to path
+ * returns the number of events written, -1 on error
+ * only uses async-signal-safe calls, so a signal handler may call it
+ */
+int traceDump(const char *path);
+
+/* printable name of an event type */
+const char *traceTypeName(int type);
+
+#endif
@@ -0,0 +1,251 @@
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include "uring.h"
+
+struct uring {
+    int fd;
+    // submission queue, shared with the kernel
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned sq_mask;
+    unsigned sq_entries;
+    struct io_uring_sqe *sqes;
+    unsigned sqe_tail; // slots handed out by uringGetSqe, published by uringSubmit
+    // completion queue, shared with the kernel
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned cq_mask;
+    struct io_uring_cqe *cqes;
+    // mappings
+    void *sq_ptr;
+    size_t sq_size;
+    void *cq_ptr;
+    size_t cq_size;
+    size_t sqes_size;
+    // provided buffer group 0, NULL until uringSetupBuffers
+    struct io_uring_buf_ring *buf_ring;
+    size_t buf_ring_size;
+    char *buf_base;
+    unsigned buf_size;
+    unsigned buf_mask;
+    unsigned short buf_tail;
+};
+
+/* --------------------- */
+/* system call wrappers  */
+/* --------------------- */
+
+static int uringSetup(unsigned entries, struct io_uring_params *params) {
+	return syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int uringEnter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags) {
+	return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static int uringRegister(int fd, unsigned opcode, void *arg, unsigned nr_args) {
+	return syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+/* ---------------- */
+/* uring procedure  */
+/* ---------------- */
+
+/* creates & returns a ring, NULL if the kernel has no (usable) io_uring */
+uring_t *uringCreate(unsigned entries, unsigned cq_entries, unsigned flags) {
+	struct io_uring_params params;
+	int fd = -1;
+	// newer setup flags are dropped one attempt at a time on older kernels
+	unsigned attempts[] = {flags, flags & ~(IORING_SETUP_DEFER_TASKRUN | IORING_SETUP_SINGLE_ISSUER), 0};
+	for (size_t i = 0; i < sizeof(attempts) / sizeof(attempts[0]) && fd < 0; i++) {
+		memset(&params, 0, sizeof(params));
+		params.flags = attempts[i];
+		if (cq_entries > 0) {
+			params.flags |= IORING_SETUP_CQSIZE;
+			params.cq_entries = cq_entries;
+		}
+		fd = uringSetup(entries, &params);
+		if (fd < 0 && errno != EINVAL) {
+			return NULL;
+		}
+	}
+	if (fd < 0) {
+		return NULL;
+	}
+
+	uring_t *ring = calloc(1, sizeof(*ring));
+	if (ring == NULL) {
+		close(fd);
+		return NULL;
+	}
+	ring->fd = fd;
+
+	// map both queues, in a single mapping when the kernel allows it
+	ring->sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+	ring->cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+	if (params.features & IORING_FEAT_SINGLE_MMAP) {
+		if (ring->cq_size > ring->sq_size) {
+			ring->sq_size = ring->cq_size;
+		}
+		ring->cq_size = ring->sq_size;
+	}
+	ring->sq_ptr = mmap(NULL, ring->sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd,
+	IORING_OFF_SQ_RING);
+	if (ring->sq_ptr == MAP_FAILED) {
+		ring->sq_ptr = NULL;
+		uringFree(ring);
+		return NULL;
+	}
+	if (params.features & IORING_FEAT_SINGLE_MMAP) {
+		ring->cq_ptr = ring->sq_ptr;
+	} else {
+		ring->cq_ptr = mmap(NULL, ring->cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd,
+		IORING_OFF_CQ_RING);
+		if (ring->cq_ptr == MAP_FAILED) {
+			ring->cq_ptr = NULL;
+			uringFree(ring);
+			return NULL;
+		}
+	}
+	ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+	ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+	if (ring->sqes == MAP_FAILED) {
+		ring->sqes = NULL;
+		uringFree(ring);
+		return NULL;
+	}
+
+	char *sq = ring->sq_ptr, *cq = ring->cq_ptr;
+	ring->sq_head = (unsigned *)(sq + params.sq_off.head);
+	ring->sq_tail = (unsigned *)(sq + params.sq_off.tail);
+	ring->sq_mask = *(unsigned *)(sq + params.sq_off.ring_mask);
+	ring->sq_entries = params.sq_entries;
+	ring->sqe_tail = *ring->sq_tail;
+	ring->cq_head = (unsigned *)(cq + params.cq_off.head);
+	ring->cq_tail = (unsigned *)(cq + params.cq_off.tail);
+	ring->cq_mask = *(unsigned *)(cq + params.cq_off.ring_mask);
+	ring->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+
+	// slots are always used in order, so the indirection array is the identity
+	unsigned *array = (unsigned *)(sq + params.sq_off.array);
+	for (unsigned i = 0; i < ring->sq_entries; i++) {
+		array[i] = i;
+	}
+	return ring;
+}
+
+/* next free submission slot, zeroed */
+struct io_uring_sqe *uringGetSqe(uring_t *ring) {
+	if (ring->sqe_tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) >= ring->sq_entries) {
+		if (uringSubmit(ring, 0) < 0 ||
+		ring->sqe_tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) >= ring->sq_entries) {
+			return NULL;
+		}
+	}
+	struct io_uring_sqe *sqe = &ring->sqes[ring->sqe_tail & ring->sq_mask];
+	memset(sqe, 0, sizeof(*sqe));
+	ring->sqe_tail++;
+	return sqe;
+}
+
+/* hand every prepared request to the kernel & wait for wait_nr completions */
+int uringSubmit(uring_t *ring, unsigned wait_nr) {
+	__atomic_store_n(ring->sq_tail, ring->sqe_tail, __ATOMIC_RELEASE);
+	unsigned to_submit = ring->sqe_tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+	if (to_submit == 0 && wait_nr == 0) {
+		return 0;
+	}
+	return uringEnter(ring->fd, to_submit, wait_nr, wait_nr > 0 ? IORING_ENTER_GETEVENTS : 0) < 0 ? -1 : 0;
+}
+
+/* oldest completion not seen yet */
+struct io_uring_cqe *uringPeekCqe(uring_t *ring) {
+	unsigned head = *ring->cq_head;
+	if (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+		return NULL;
+	}
+	return &ring->cqes[head & ring->cq_mask];
+}
+
+/* release the completion returned by uringPeekCqe */
+void uringSeenCqe(uring_t *ring) {
+	__atomic_store_n(ring->cq_head, *ring->cq_head + 1, __ATOMIC_RELEASE);
+}
+
+/* register n buffers of size bytes each as provided buffer group 0 */
+int uringSetupBuffers(uring_t *ring, unsigned n, unsigned size) {
+	// the kernel wants the ring of buffer descriptors page aligned
+	ring->buf_ring_size = n * sizeof(struct io_uring_buf);
+	void *buf_ring = mmap(NULL, ring->buf_ring_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (buf_ring == MAP_FAILED) {
+		return -1;
+	}
+	ring->buf_base = malloc((size_t)n * size);
+	if (ring->buf_base == NULL) {
+		munmap(buf_ring, ring->buf_ring_size);
+		return -1;
+	}
+
+	struct io_uring_buf_reg reg;
+	memset(&reg, 0, sizeof(reg));
+	reg.ring_addr = (uintptr_t)buf_ring;
+	reg.ring_entries = n;
+	reg.bgid = 0;
+	if (uringRegister(ring->fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+		munmap(buf_ring, ring->buf_ring_size);
+		free(ring->buf_base);
+		ring->buf_base = NULL;
+		return -1;
+	}
+	ring->buf_ring = buf_ring;
+	ring->buf_size = size;
+	ring->buf_mask = n - 1;
+	ring->buf_tail = 0;
+	for (unsigned bid = 0; bid < n; bid++) {
+		uringRecycleBuffer(ring, bid);
+	}
+	return 0;
+}
+
+/* the provided buffer a completion with IORING_CQE_F_BUFFER filled */
+char *uringBuffer(uring_t *ring, unsigned bid) {
+	return ring->buf_base + (size_t)bid * ring->buf_size;
+}
+
+/* give a provided buffer back to the kernel */
+void uringRecycleBuffer(uring_t *ring, unsigned bid) {
+	// the tail overlays the reserved field of the first descriptor, which is never written
+	struct io_uring_buf *buf = &ring->buf_ring->bufs[ring->buf_tail & ring->buf_mask];
+	buf->addr = (uintptr_t)uringBuffer(ring, bid);
+	buf->len = ring->buf_size;
+	buf->bid = bid;
+	ring->buf_tail++;
+	__atomic_store_n(&ring->buf_ring->tail, ring->buf_tail, __ATOMIC_RELEASE);
+}
+
+/* unmap the queues, free the provided buffers & close the ring */
+void uringFree(uring_t *ring) {
+	if (ring == NULL) {
+		return;
+	}
+	close(ring->fd);
+	if (ring->sqes != NULL) {
+		munmap(ring->sqes, ring->sqes_size);
+	}
+	if (ring->cq_ptr != NULL && ring->cq_ptr != ring->sq_ptr) {
+		munmap(ring->cq_ptr, ring->cq_size);
+	}
+	if (ring->sq_ptr != NULL) {
+		munmap(ring->sq_ptr, ring->sq_size);
+	}
+	if (ring->buf_ring != NULL) {
+		munmap(ring->buf_ring, ring->buf_ring_size);
+	}
+	free(ring->buf_base);
+	free(ring);
+}
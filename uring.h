@@ -0,0 +1,60 @@
+#ifndef URING_H
+#define URING_H
+#include <stddef.h>
+#include <linux/io_uring.h>
+
+// data definitions
+typedef struct uring uring_t;
+
+/* ---------------- */
+/* uring procedure  */
+/* ---------------- */
+
+/* minimal io_uring wrapper on top of the raw system calls (no liburing): requests are
+ * prepared in the submission queue with uringGetSqe, handed to the kernel together by
+ * uringSubmit & their completions read back with uringPeekCqe / uringSeenCqe
+ * a ring is used by a single thread at a time
+ */
+
+/* creates & returns a ring of entries submission slots (a power of two) & cq_entries
+ * completion slots (0 for the kernel default), with the setup flags the kernel accepts
+ * among flags
+ * returns NULL if the kernel has no (usable) io_uring
+ */
+uring_t *uringCreate(unsigned entries, unsigned cq_entries, unsigned flags);
+
+/* next free submission slot, zeroed; the queue is submitted first if it is full
+ * returns NULL if no slot could be freed
+ */
+struct io_uring_sqe *uringGetSqe(uring_t *ring);
+
+/* hand every prepared request to the kernel & wait until at least wait_nr completions
+ * are available (0 to return at once)
+ * returns 0 on success, -1 on error (errno set, EINTR included)
+ */
+int uringSubmit(uring_t *ring, unsigned wait_nr);
+
+/* oldest completion not seen yet
+ * returns NULL if there is none
+ */
+struct io_uring_cqe *uringPeekCqe(uring_t *ring);
+
+/* release the completion returned by uringPeekCqe */
+void uringSeenCqe(uring_t *ring);
+
+/* register n buffers of size bytes each as provided buffer group 0, which
+ * IOSQE_BUFFER_SELECT requests pick their buffer from (n a power of two)
+ * returns 0 on success, -1 on error
+ */
+int uringSetupBuffers(uring_t *ring, unsigned n, unsigned size);
+
+/* the provided buffer a completion with IORING_CQE_F_BUFFER filled */
+char *uringBuffer(uring_t *ring, unsigned bid);
+
+/* give a provided buffer back to the kernel once its bytes have been consumed */
+void uringRecycleBuffer(uring_t *ring, unsigned bid);
+
+/* unmap the queues, free the provided buffers & close the ring */
+void uringFree(uring_t *ring);
+
+#endif
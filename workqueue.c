@@ -0,0 +1,79 @@
+#include <stdlib.h>
+#include <assert.h>
+#include <pthread.h>
+#include "workqueue.h"
+#include "pool.h"
+
+typedef struct workItem {
+    void *item;
+    struct workItem *next;
+} workItem_t;
+
+struct workQueue {
+    workItem_t *head;
+    workItem_t *tail;
+    size_t len;
+    pthread_mutex_t lock;
+    pthread_cond_t nonempty;
+};
+
+/* ------------------- */
+/* workQueue procedure */
+/* ------------------- */
+
+/* creates & returns an empty (unbounded) FIFO queue shared between threads */
+workQueue_t *workQueueCreate() {
+	workQueue_t *queue = malloc(sizeof(*queue));
+	assert(queue);
+	queue->head = NULL;
+	queue->tail = NULL;
+	queue->len = 0;
+	pthread_mutex_init(&queue->lock, NULL);
+	pthread_cond_init(&queue->nonempty, NULL);
+	return queue;
+}
+
+/* append item to the tail of the queue & wake up one waiting consumer, unless max_len
+ * items (0 for no limit) are already waiting
+ */
+int workQueueTryPush(workQueue_t *queue, void *item, size_t max_len) {
+	workItem_t *node = poolAlloc(sizeof(*node));
+	node->item = item;
+	node->next = NULL;
+
+	pthread_mutex_lock(&queue->lock);
+	if (max_len > 0 && queue->len >= max_len) {
+		pthread_mutex_unlock(&queue->lock);
+		poolFree(node);
+		return -1;
+	}
+	queue->len++;
+	if (queue->tail == NULL) {
+		queue->head = node;
+	} else {
+		queue->tail->next = node;
+	}
+	queue->tail = node;
+	pthread_cond_signal(&queue->nonempty);
+	pthread_mutex_unlock(&queue->lock);
+	return 0;
+}
+
+/* remove & return the item at the head of the queue, blocking while the queue is empty */
+void *workQueuePop(workQueue_t *queue) {
+	pthread_mutex_lock(&queue->lock);
+	while (queue->head == NULL) {
+		pthread_cond_wait(&queue->nonempty, &queue->lock);
+	}
+	workItem_t *node = queue->head;
+	queue->head = node->next;
+	queue->len--;
+	if (queue->head == NULL) {
+		queue->tail = NULL;
+	}
+	pthread_mutex_unlock(&queue->lock);
+
+	void *item = node->item;
+	poolFree(node);
+	return item;
+}
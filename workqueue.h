@@ -0,0 +1,24 @@
+#ifndef WORKQUEUE_H
+#define WORKQUEUE_H
+#include <stddef.h>
+
+// data definitions
+typedef struct workQueue workQueue_t;
+
+/* ------------------- */
+/* workQueue procedure */
+/* ------------------- */
+
+/* creates & returns an empty (unbounded) FIFO queue shared between threads */
+workQueue_t *workQueueCreate();
+
+/* append item to the tail of the queue & wake up one waiting consumer, unless max_len
+ * items (0 for no limit) are already waiting
+ * returns 0 if item was queued, -1 if the queue is full
+ */
+int workQueueTryPush(workQueue_t *queue, void *item, size_t max_len);
+
+/* remove & return the item at the head of the queue, blocking while the queue is empty */
+void *workQueuePop(workQueue_t *queue);
+
+#endif